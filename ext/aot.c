@@ -0,0 +1,55 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+
+#include "common.h"
+#include "aot.h"
+#include "bytecode_file.h"
+#include "vm.h"
+
+static bool aot_read_bool_env_var(const char* variable);
+static int aot_attach(ObjFunction* function, const AotFunction* functions, int function_count, int index);
+
+int Aot_main(const uint8_t* bytecode, size_t size, const AotFunction* functions, int function_count) {
+  bool debug_mode = aot_read_bool_env_var("LOXRB_DEBUG_MODE");
+
+  Vm vm;
+  Vm_init(&vm);
+  vm.memory_allocator.log_gc = aot_read_bool_env_var("LOXRB_LOG_GC") || debug_mode;
+  vm.memory_allocator.stress_gc = aot_read_bool_env_var("LOXRB_STRESS_GC") || debug_mode;
+  vm.memory_allocator.gc_enabled = true;
+
+  ObjFunction* function = BytecodeFile_load(&vm, bytecode, size);
+  if (function == NULL || aot_attach(function, functions, function_count, 0) != function_count) {
+    fprintf(stderr, "Could not load the compiled script.\n");
+    return 74;
+  }
+
+  InterpretResult result = Vm_interpret_compiled(&vm, function);
+  Vm_free(&vm);
+  return result == INTERPRET_RUNTIME_ERROR ? 70 : 0;
+}
+
+static bool aot_read_bool_env_var(const char* variable) {
+  const char* value = getenv(variable);
+  return value != NULL && value[0] != '\0' && strcmp(value, "0") != 0 && strcasecmp(value, "false") != 0;
+}
+
+// Returns the index of the compiled code for the function after the ones
+// in function's constants, or -1 if the code doesn't match the functions
+static int aot_attach(ObjFunction* function, const AotFunction* functions, int function_count, int index) {
+  if (index >= function_count || functions[index].code_length != function->chunk.count) {
+    return -1;
+  }
+  function->compiled = functions[index].function;
+  index++;
+
+  ValueArray* constants = &function->chunk.constants;
+  for (int i = 0; i < constants->count && index != -1; i++) {
+    if (Object_is_function(constants->values[i])) {
+      index = aot_attach(Object_as_function(constants->values[i]), functions, function_count, index);
+    }
+  }
+  return index;
+}
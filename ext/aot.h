@@ -0,0 +1,47 @@
+#ifndef clox_aot_h
+#define clox_aot_h
+
+#include "common.h"
+#include "object.h"
+#include "table.h"
+#include "value.h"
+#include "vm.h"
+
+// Support for scripts that lib/lox/bytecode/aot_compiler.rb has compiled
+// to C. A compiled program holds the script's bytecode file along with one
+// C function for each Lox function in it, in the order Aot_main walks the
+// functions in: each one comes before the ones in its constants.
+//
+// Compiled code handles the common cases of the simpler instructions
+// itself, such as arithmetic on numbers, locals and jumps, and hands every
+// other instruction to the interpreter with Aot_step. The interpreter is
+// also what reports runtime errors, so they read the same either way.
+
+typedef struct {
+  CompiledFn function;
+  int code_length; // Of the function it was compiled from, as a sanity check
+} AotFunction;
+
+// Loads the bytecode, gives its functions their compiled code and runs the
+// script. Returns the exit status for the program, the same one lox-native
+// would exit with.
+int Aot_main(const uint8_t* bytecode, size_t size, const AotFunction* functions, int function_count);
+
+// Runs the instruction at offset in frame's function in the interpreter.
+// Returns false if the compiled code has to return result to the VM, which
+// is when the instruction failed, or called a function or returned from
+// this one, or switched fibers. The VM calls the compiled code again to
+// pick up where it left off once it's this frame's turn again.
+inline bool Aot_step(Vm* vm, CallFrame* frame, int offset, InterpretResult* result) {
+  frame->ip = frame->closure->function->chunk.code + offset;
+  CallFrame* frames = vm->frames;
+  int frame_count = vm->frame_count;
+  *result = Vm_interpret_next_instruction(vm);
+  return *result == INTERPRET_INCOMPLETE && vm->frame_count == frame_count && vm->frames == frames;
+}
+
+inline bool Aot_is_falsey(Value value) {
+  return Value_is_nil(value) || (Value_is_boolean(value) && !Value_as_boolean(value));
+}
+
+#endif
@@ -0,0 +1,213 @@
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+#include "common.h"
+#include "batch.h"
+#include "vm.h"
+
+// What the scheduler keeps for each job, on top of what the job reports
+typedef struct {
+  FILE* output;
+  FILE* errors;
+  double queued_at; // When the job last went to the back of the queue
+} BatchSlot;
+
+// The jobs that are waiting for a thread, in the order they'll get one.
+// Every job is either in here or running, so the queue never holds more
+// than all of them.
+typedef struct {
+  BatchJob* jobs;
+  BatchSlot* slots;
+  int job_count;
+  int64_t budget;
+  double started_at;
+  pthread_mutex_t lock;
+  pthread_cond_t changed; // A job was queued, or the last one finished
+  int* queue;
+  int head;
+  int length;
+  int finished_count;
+} BatchQueue;
+
+static void* batch_work(void* argument);
+static bool batch_run_slice(BatchQueue* queue, int index);
+static bool batch_start_job(BatchJob* job, BatchSlot* slot);
+static void batch_finish_job(BatchJob* job, BatchSlot* slot);
+static double batch_now(void);
+
+void Batch_run(BatchJob* jobs, int job_count, int thread_count, int64_t budget) {
+  BatchQueue queue = {
+    .jobs = jobs,
+    .slots = malloc(sizeof(BatchSlot) * (job_count > 0 ? job_count : 1)),
+    .job_count = job_count,
+    .budget = budget,
+    .started_at = batch_now(),
+    .queue = malloc(sizeof(int) * (job_count > 0 ? job_count : 1)),
+    .head = 0,
+    .length = job_count,
+    .finished_count = 0
+  };
+  if (queue.slots == NULL || queue.queue == NULL) {
+    // Not a single job could be run, so none of them has anything to keep
+    for (int i = 0; i < job_count; i++) {
+      jobs[i] = (BatchJob){ .vm = jobs[i].vm, .function = jobs[i].function, .result = INTERPRET_RUNTIME_ERROR };
+    }
+    free(queue.slots);
+    free(queue.queue);
+    return;
+  }
+  pthread_mutex_init(&queue.lock, NULL);
+  pthread_cond_init(&queue.changed, NULL);
+  for (int i = 0; i < job_count; i++) {
+    jobs[i].slices = 0;
+    jobs[i].run_time = 0;
+    jobs[i].longest_wait = 0;
+    jobs[i].finish_time = 0;
+    queue.slots[i].queued_at = queue.started_at;
+    queue.queue[i] = i;
+  }
+
+  if (thread_count > job_count) {
+    thread_count = job_count;
+  }
+  pthread_t* threads = malloc(sizeof(pthread_t) * (thread_count > 1 ? thread_count - 1 : 1));
+  int started = 0;
+  // The calling thread works through the queue as well, so the jobs still
+  // all run if no threads could be started
+  while (threads != NULL && started < thread_count - 1 &&
+         pthread_create(&threads[started], NULL, batch_work, &queue) == 0) {
+    started++;
+  }
+  batch_work(&queue);
+
+  for (int i = 0; i < started; i++) {
+    pthread_join(threads[i], NULL);
+  }
+  free(threads);
+  pthread_cond_destroy(&queue.changed);
+  pthread_mutex_destroy(&queue.lock);
+  free(queue.slots);
+  free(queue.queue);
+}
+
+void BatchJob_free(BatchJob* job) {
+  free(job->output);
+  free(job->errors);
+  job->output = NULL;
+  job->output_length = 0;
+  job->errors = NULL;
+  job->errors_length = 0;
+}
+
+// Takes the job at the front of the queue, runs it for a slice, and puts it
+// at the back if it hasn't finished, until every job has. Threads wait
+// rather than leave while the queue is empty, since the jobs that are
+// running may still come back to it.
+static void* batch_work(void* argument) {
+  BatchQueue* queue = (BatchQueue*)argument;
+  pthread_mutex_lock(&queue->lock);
+  for (;;) {
+    while (queue->length == 0 && queue->finished_count < queue->job_count) {
+      pthread_cond_wait(&queue->changed, &queue->lock);
+    }
+    if (queue->length == 0) {
+      pthread_mutex_unlock(&queue->lock);
+      return NULL;
+    }
+    int index = queue->queue[queue->head];
+    queue->head = (queue->head + 1) % queue->job_count;
+    queue->length--;
+    pthread_mutex_unlock(&queue->lock);
+
+    bool finished = batch_run_slice(queue, index);
+
+    pthread_mutex_lock(&queue->lock);
+    if (finished) {
+      queue->finished_count++;
+      if (queue->finished_count == queue->job_count) {
+        pthread_cond_broadcast(&queue->changed);
+      }
+    } else {
+      queue->slots[index].queued_at = batch_now();
+      queue->queue[(queue->head + queue->length) % queue->job_count] = index;
+      queue->length++;
+      pthread_cond_signal(&queue->changed);
+    }
+  }
+}
+
+// Returns true once the job has finished
+static bool batch_run_slice(BatchQueue* queue, int index) {
+  BatchJob* job = &queue->jobs[index];
+  BatchSlot* slot = &queue->slots[index];
+  double started_at = batch_now();
+  double wait = started_at - slot->queued_at;
+  if (wait > job->longest_wait) {
+    job->longest_wait = wait;
+  }
+
+  bool first_slice = job->slices == 0;
+  if (first_slice && !batch_start_job(job, slot)) {
+    job->result = INTERPRET_RUNTIME_ERROR;
+    job->finish_time = batch_now() - queue->started_at;
+    return true;
+  }
+
+  Vm* vm = job->vm;
+  vm->budget = queue->budget > 0 ? queue->budget : BUDGET_UNLIMITED;
+  job->result = first_slice ? Vm_interpret(vm, job->function) : Vm_resume(vm);
+  job->slices++;
+  double stopped_at = batch_now();
+  job->run_time += stopped_at - started_at;
+  if (job->result == INTERPRET_YIELDED) {
+    return false;
+  }
+
+  batch_finish_job(job, slot);
+  job->finish_time = stopped_at - queue->started_at;
+  return true;
+}
+
+// Starts capturing what the job prints, which it goes on doing across all
+// of its slices
+static bool batch_start_job(BatchJob* job, BatchSlot* slot) {
+  job->output = NULL;
+  job->errors = NULL;
+  slot->output = open_memstream(&job->output, &job->output_length);
+  slot->errors = open_memstream(&job->errors, &job->errors_length);
+  if (slot->output == NULL || slot->errors == NULL) {
+    // Nothing has been written, so there's no output to keep
+    if (slot->output != NULL) {
+      fclose(slot->output);
+    }
+    if (slot->errors != NULL) {
+      fclose(slot->errors);
+    }
+    BatchJob_free(job);
+    return false;
+  }
+
+  job->vm->output = slot->output;
+  job->vm->errors = slot->errors;
+  return true;
+}
+
+static void batch_finish_job(BatchJob* job, BatchSlot* slot) {
+  Vm* vm = job->vm;
+  vm->output = stdout;
+  vm->errors = stderr;
+  vm->budget = BUDGET_UNLIMITED;
+
+  // The buffers and their lengths are only up to date once the streams are
+  // closed
+  fclose(slot->output);
+  fclose(slot->errors);
+}
+
+static double batch_now(void) {
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return now.tv_sec + now.tv_nsec / 1e9;
+}
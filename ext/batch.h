@@ -0,0 +1,47 @@
+#ifndef clox_batch_h
+#define clox_batch_h
+
+#include "common.h"
+#include "object.h"
+#include "vm.h"
+
+// Runs many scripts at once on a pool of threads. Nothing in a VM is shared
+// with any other VM, so scripts can run in parallel as long as each one has
+// a VM of its own. What a script prints, and the runtime errors it reports,
+// are captured while it runs, rather than written to stdout and stderr
+// where they'd be interleaved with the output of the others.
+//
+// Jobs can also be given a budget (see Vm_resume), in which case each job
+// only runs until it has used its budget up, and then goes to the back of
+// the queue to wait for its next turn. Threads are handed jobs round-robin,
+// so a script that loops forever only takes its share of the threads and
+// the others still finish. Each job reports how it was scheduled, so that
+// how fairly the threads were shared out can be measured.
+
+typedef struct {
+  Vm* vm;
+  ObjFunction* function;
+  // Filled in once the script has run. The output and errors belong to the
+  // job from then on, see BatchJob_free.
+  InterpretResult result;
+  char* output;
+  size_t output_length;
+  char* errors;
+  size_t errors_length;
+  int slices; // How many turns the job had
+  double run_time; // Seconds it spent running, over all of its turns
+  double longest_wait; // The most seconds it spent waiting for a turn
+  double finish_time; // Seconds from the start of the batch until it finished
+} BatchJob;
+
+// Runs every job, using up to thread_count threads including the calling
+// one, and returns once they've all finished. Each thread takes whichever
+// job has waited longest, so a long script only holds up the thread it
+// runs on. A budget of 0 runs each job to the end in one turn. Jobs can't
+// use anything that has to run on the calling thread, like a VM's
+// compile_function.
+void Batch_run(BatchJob* jobs, int job_count, int thread_count, int64_t budget);
+
+void BatchJob_free(BatchJob* job);
+
+#endif
@@ -0,0 +1,156 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "common.h"
+#include "binary_file.h"
+
+#define BINARY_FILE_BYTE_ORDER 0x01020304u
+
+static uint64_t binary_file_checksum(const uint8_t* bytes, size_t count);
+
+void BinaryWriter_init(BinaryWriter* writer, const char* magic, uint32_t version) {
+  writer->bytes = NULL;
+  writer->count = 0;
+  writer->capacity = 0;
+
+  // The size and the checksum are filled in by BinaryWriter_save
+  BinaryFileHeader header;
+  memset(&header, 0, sizeof(header));
+  memcpy(header.magic, magic, sizeof(header.magic));
+  header.version = version;
+  header.byte_order = BINARY_FILE_BYTE_ORDER;
+  BinaryWriter_write(writer, &header, sizeof(header));
+}
+
+void BinaryWriter_write(BinaryWriter* writer, const void* bytes, size_t count) {
+  if (writer->capacity < writer->count + count) {
+    size_t capacity = writer->capacity < 256 ? 256 : writer->capacity;
+    while (capacity < writer->count + count) {
+      capacity *= 2;
+    }
+    writer->bytes = (uint8_t*)realloc(writer->bytes, capacity);
+    writer->capacity = capacity;
+  }
+
+  memcpy(writer->bytes + writer->count, bytes, count);
+  writer->count += count;
+}
+
+void BinaryWriter_write_int(BinaryWriter* writer, int32_t value) {
+  BinaryWriter_write(writer, &value, sizeof(value));
+}
+
+// Pads the file with zeroes up to the next multiple of 4 bytes. The header
+// is a multiple of 4 bytes long, so the payload can be aligned on its own.
+void BinaryWriter_align(BinaryWriter* writer) {
+  static const uint8_t padding[3] = { 0, 0, 0 };
+  BinaryWriter_write(writer, padding, (4 - writer->count % 4) % 4);
+}
+
+bool BinaryWriter_save(BinaryWriter* writer, const char* path) {
+  BinaryFileHeader header;
+  memcpy(&header, writer->bytes, sizeof(header));
+  header.payload_size = writer->count - sizeof(header);
+  header.checksum = binary_file_checksum(writer->bytes + sizeof(header), header.payload_size);
+  memcpy(writer->bytes, &header, sizeof(header));
+
+  size_t temporary_path_length = strlen(path) + 32;
+  char* temporary_path = (char*)malloc(temporary_path_length);
+  snprintf(temporary_path, temporary_path_length, "%s.%ld.tmp", path, (long)getpid());
+
+  bool written = false;
+  FILE* file = fopen(temporary_path, "wb");
+  if (file != NULL) {
+    written = fwrite(writer->bytes, 1, writer->count, file) == writer->count;
+    written = fclose(file) == 0 && written;
+    written = written && rename(temporary_path, path) == 0;
+    if (!written) {
+      remove(temporary_path);
+    }
+  }
+
+  free(temporary_path);
+  return written;
+}
+
+void BinaryWriter_free(BinaryWriter* writer) {
+  free(writer->bytes);
+  writer->bytes = NULL;
+  writer->count = 0;
+  writer->capacity = 0;
+}
+
+bool BinaryReader_init(BinaryReader* reader, const uint8_t* bytes, size_t size, const char* magic, uint32_t version) {
+  BinaryFileHeader header;
+  if (size < sizeof(header)) {
+    return false;
+  }
+
+  memcpy(&header, bytes, sizeof(header));
+  size_t payload_size = size - sizeof(header);
+  const uint8_t* payload = bytes + sizeof(header);
+  if (memcmp(header.magic, magic, sizeof(header.magic)) != 0 ||
+      header.version != version ||
+      header.byte_order != BINARY_FILE_BYTE_ORDER ||
+      header.payload_size != payload_size ||
+      header.checksum != binary_file_checksum(payload, payload_size)) {
+    return false;
+  }
+
+  reader->bytes = payload;
+  reader->count = payload_size;
+  reader->position = 0;
+  reader->had_error = false;
+  return true;
+}
+
+const uint8_t* BinaryReader_read(BinaryReader* reader, size_t count) {
+  if (reader->had_error || reader->count - reader->position < count) {
+    reader->had_error = true;
+    return NULL;
+  }
+
+  const uint8_t* bytes = reader->bytes + reader->position;
+  reader->position += count;
+  return bytes;
+}
+
+int32_t BinaryReader_read_int(BinaryReader* reader) {
+  const uint8_t* bytes = BinaryReader_read(reader, sizeof(int32_t));
+  if (bytes == NULL) {
+    return 0;
+  }
+
+  int32_t value;
+  memcpy(&value, bytes, sizeof(value));
+  return value;
+}
+
+int32_t BinaryReader_read_count(BinaryReader* reader, size_t item_size) {
+  int32_t count = BinaryReader_read_int(reader);
+  if (count < 0 || (size_t)count * item_size > reader->count - reader->position) {
+    reader->had_error = true;
+    return 0;
+  }
+  return count;
+}
+
+void BinaryReader_align(BinaryReader* reader) {
+  BinaryReader_read(reader, (4 - reader->position % 4) % 4);
+}
+
+bool BinaryReader_is_at_end(BinaryReader* reader) {
+  return reader->position == reader->count;
+}
+
+// FNV-1a
+static uint64_t binary_file_checksum(const uint8_t* bytes, size_t count) {
+  uint64_t hash = 14695981039346656037u;
+  for (size_t i = 0; i < count; i++) {
+    hash ^= bytes[i];
+    hash *= 1099511628211u;
+  }
+  return hash;
+}
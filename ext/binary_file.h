@@ -0,0 +1,58 @@
+#ifndef clox_binary_file_h
+#define clox_binary_file_h
+
+#include "common.h"
+
+// The plumbing shared by the VM's binary file formats (see bytecode_file.h
+// and heap_snapshot.h). A file starts with a header that identifies the
+// format and its version and holds a checksum of the rest of the file, the
+// payload. Numbers are stored in native byte order, since the files are
+// only meant to be read on the machine that wrote them.
+
+typedef struct {
+  char magic[4];
+  uint32_t version;
+  uint32_t byte_order;
+  uint32_t unused;
+  uint64_t payload_size;
+  uint64_t checksum;
+} BinaryFileHeader;
+
+// Collects a whole file in memory before saving it
+typedef struct {
+  uint8_t* bytes;
+  size_t count;
+  size_t capacity;
+} BinaryWriter;
+
+// Reads a payload, checking that nothing is read past its end. After the
+// first failed read, had_error is set and every read fails.
+typedef struct {
+  const uint8_t* bytes;
+  size_t count;
+  size_t position;
+  bool had_error;
+} BinaryReader;
+
+void BinaryWriter_init(BinaryWriter* writer, const char* magic, uint32_t version);
+void BinaryWriter_write(BinaryWriter* writer, const void* bytes, size_t count);
+void BinaryWriter_write_int(BinaryWriter* writer, int32_t value);
+void BinaryWriter_align(BinaryWriter* writer);
+// Fills in the header and writes the file to a temporary file next to
+// path, which is then renamed, so that readers never see a half-written
+// file. Returns false if the file couldn't be written.
+bool BinaryWriter_save(BinaryWriter* writer, const char* path);
+void BinaryWriter_free(BinaryWriter* writer);
+
+// Returns false, without setting up the reader, if the header doesn't match
+// the format or the checksum doesn't match the payload
+bool BinaryReader_init(BinaryReader* reader, const uint8_t* bytes, size_t size, const char* magic, uint32_t version);
+const uint8_t* BinaryReader_read(BinaryReader* reader, size_t count);
+int32_t BinaryReader_read_int(BinaryReader* reader);
+// Reads the number of items that follow, making sure that there's room for
+// them in the file before anything gets allocated for them
+int32_t BinaryReader_read_count(BinaryReader* reader, size_t item_size);
+void BinaryReader_align(BinaryReader* reader);
+bool BinaryReader_is_at_end(BinaryReader* reader);
+
+#endif
@@ -0,0 +1,743 @@
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "common.h"
+#include "binary_file.h"
+#include "bytecode_file.h"
+#include "chunk.h"
+#include "object.h"
+#include "value.h"
+#include "vm.h"
+
+// The payload of a file (see binary_file.h) is the script's function. A
+// function is
+//
+//   int32 arity, int32 upvalue_count
+//   string name (a length of -1 for the script itself)
+//   int32 constant_count, then each constant as a tag and its contents
+//   int32 code_count, then the code, padded to a multiple of 4 bytes
+//   int32 line_run_count, then each run as int32 offset, int32 line
+//
+// where a string is an int32 length followed by its characters, and
+// function constants are nested functions. The padding keeps the line runs
+// aligned so that chunks can use them straight from the mapped file.
+
+#define BYTECODE_FILE_MAGIC "LOXC"
+#define BYTECODE_FILE_MAX_DEPTH 256
+#define BYTECODE_FILE_MAX_CONSTANTS 256
+// How deep a function can take the stack, which is what the VM sets aside
+// for each frame
+#define BYTECODE_FILE_MAX_STACK 256
+
+typedef enum {
+  CONSTANT_NUMBER,
+  CONSTANT_STRING,
+  CONSTANT_SELECTOR, // A string that is used as a method name
+  CONSTANT_FUNCTION
+} ConstantTag;
+
+typedef struct {
+  Vm* vm;
+  BinaryReader binary;
+  int depth;
+} BytecodeReader;
+
+
+static void bytecode_file_write_string(BinaryWriter* writer, ObjString* string);
+static bool bytecode_file_write_function(BinaryWriter* writer, ObjFunction* function);
+
+static ObjString* bytecode_reader_read_string(BytecodeReader* reader);
+static ObjString* bytecode_reader_read_name(BytecodeReader* reader);
+static ObjString* bytecode_reader_read_chars(BytecodeReader* reader, int32_t length);
+static ObjFunction* bytecode_reader_read_function(BytecodeReader* reader);
+static bool bytecode_reader_read_constants(BytecodeReader* reader, Chunk* chunk);
+static bool bytecode_reader_read_code(BytecodeReader* reader, Chunk* chunk);
+
+static int bytecode_file_operand_count(ObjFunction* function, int offset);
+static bool bytecode_file_is_jump(uint8_t instruction);
+static int bytecode_file_jump_target(Chunk* chunk, int offset, int next);
+static bool bytecode_file_validate_stack(ObjFunction* function);
+static bool bytecode_file_stack_effect(ObjFunction* function, int offset, int depth, int* pops, int* pushes);
+static bool bytecode_file_validate_upvalues(ObjFunction* function, const bool* by_value);
+static bool bytecode_file_is_constant_of_type(ObjFunction* function, int index, ObjType type);
+
+int BytecodeFile_version(void) {
+  return BYTECODE_FILE_VERSION;
+}
+
+bool BytecodeFile_write(ObjFunction* function, const char* path) {
+  BinaryWriter writer;
+  BinaryWriter_init(&writer, BYTECODE_FILE_MAGIC, BYTECODE_FILE_VERSION);
+  bool written = bytecode_file_write_function(&writer, function) && BinaryWriter_save(&writer, path);
+  BinaryWriter_free(&writer);
+  return written;
+}
+
+ObjFunction* BytecodeFile_map(Vm* vm, const char* path) {
+  int descriptor = open(path, O_RDONLY);
+  if (descriptor < 0) {
+    return NULL;
+  }
+
+  struct stat file_stat;
+  if (fstat(descriptor, &file_stat) != 0 || file_stat.st_size < (off_t)sizeof(BinaryFileHeader)) {
+    close(descriptor);
+    return NULL;
+  }
+
+  // Files are only ever replaced by renaming a new file over them, never
+  // written to in place, so the mapping can't change under the VM's feet
+  size_t size = file_stat.st_size;
+  void* address = mmap(NULL, size, PROT_READ, MAP_SHARED, descriptor, 0);
+  close(descriptor);
+  if (address == MAP_FAILED) {
+    return NULL;
+  }
+
+  // If loading fails halfway, the functions that were already loaded point
+  // into the mapping, but they're garbage and chunks never free code that
+  // they've borrowed
+  ObjFunction* function = BytecodeFile_load(vm, (const uint8_t*)address, size);
+  if (function == NULL) {
+    munmap(address, size);
+    return NULL;
+  }
+
+  BytecodeImage* image = (BytecodeImage*)malloc(sizeof(BytecodeImage));
+  image->address = address;
+  image->size = size;
+  image->next = vm->images;
+  vm->images = image;
+  return function;
+}
+
+void BytecodeFile_unmap_images(Vm* vm) {
+  BytecodeImage* image = vm->images;
+  while (image != NULL) {
+    BytecodeImage* next = image->next;
+    munmap(image->address, image->size);
+    free(image);
+    image = next;
+  }
+  vm->images = NULL;
+}
+
+ObjFunction* BytecodeFile_load(Vm* vm, const uint8_t* bytes, size_t size) {
+  BytecodeReader reader = { vm, { NULL, 0, 0, false }, 0 };
+  if (!BinaryReader_init(&reader.binary, bytes, size, BYTECODE_FILE_MAGIC, BYTECODE_FILE_VERSION)) {
+    return NULL;
+  }
+
+  // The reader creates objects that nothing refers to until the whole file
+  // has been read. Loading doesn't create any garbage, so rather than making
+  // each of them a root the way the compilers do, the GC is simply kept off.
+  bool gc_enabled = vm->memory_allocator.gc_enabled;
+  vm->memory_allocator.gc_enabled = false;
+
+  ObjFunction* function = bytecode_reader_read_function(&reader);
+  if (!BinaryReader_is_at_end(&reader.binary)) {
+    // Trailing garbage
+    function = NULL;
+  }
+  // Scripts are called without arguments and don't capture anything
+  if (function != NULL &&
+      (function->arity != 0 || function->upvalue_count != 0 || !bytecode_file_validate_upvalues(function, NULL))) {
+    function = NULL;
+  }
+
+  vm->memory_allocator.gc_enabled = gc_enabled;
+  return function;
+}
+
+static void bytecode_file_write_string(BinaryWriter* writer, ObjString* string) {
+  if (string == NULL) {
+    BinaryWriter_write_int(writer, -1);
+    return;
+  }
+
+  BinaryWriter_write_int(writer, string->length);
+  BinaryWriter_write(writer, string->chars, string->length);
+}
+
+static bool bytecode_file_write_function(BinaryWriter* writer, ObjFunction* function) {
+  Chunk* chunk = &function->chunk;
+
+  BinaryWriter_write_int(writer, function->arity);
+  BinaryWriter_write_int(writer, function->upvalue_count);
+  bytecode_file_write_string(writer, function->name);
+
+  BinaryWriter_write_int(writer, chunk->constants.count);
+  for (int i = 0; i < chunk->constants.count; i++) {
+    Value constant = chunk->constants.values[i];
+    uint8_t tag;
+    if (Value_is_number(constant)) {
+      tag = CONSTANT_NUMBER;
+      double number = Value_as_number(constant);
+      BinaryWriter_write(writer, &tag, sizeof(tag));
+      BinaryWriter_write(writer, &number, sizeof(number));
+    } else if (Object_is_string(constant)) {
+      ObjString* string = Object_as_string(constant);
+      tag = string->selector == -1 ? CONSTANT_STRING : CONSTANT_SELECTOR;
+      BinaryWriter_write(writer, &tag, sizeof(tag));
+      bytecode_file_write_string(writer, string);
+    } else if (Object_is_function(constant)) {
+      tag = CONSTANT_FUNCTION;
+      BinaryWriter_write(writer, &tag, sizeof(tag));
+      if (!bytecode_file_write_function(writer, Object_as_function(constant))) {
+        return false;
+      }
+    } else {
+      // The compilers never produce any other kind of constant
+      return false;
+    }
+  }
+
+  BinaryWriter_write_int(writer, chunk->count);
+  BinaryWriter_write(writer, chunk->code, chunk->count);
+  BinaryWriter_align(writer);
+
+  BinaryWriter_write_int(writer, chunk->line_run_count);
+  for (int i = 0; i < chunk->line_run_count; i++) {
+    BinaryWriter_write_int(writer, chunk->line_runs[i].offset);
+    BinaryWriter_write_int(writer, chunk->line_runs[i].line);
+  }
+
+  return true;
+}
+
+static ObjString* bytecode_reader_read_string(BytecodeReader* reader) {
+  int32_t length = BinaryReader_read_count(&reader->binary, sizeof(char));
+  return bytecode_reader_read_chars(reader, length);
+}
+
+// Like a string, except that the script's function has no name
+static ObjString* bytecode_reader_read_name(BytecodeReader* reader) {
+  int32_t length = BinaryReader_read_int(&reader->binary);
+  if (length == -1) {
+    return NULL;
+  }
+  if (length < 0) {
+    reader->binary.had_error = true;
+    return NULL;
+  }
+  return bytecode_reader_read_chars(reader, length);
+}
+
+static ObjString* bytecode_reader_read_chars(BytecodeReader* reader, int32_t length) {
+  const uint8_t* chars = BinaryReader_read(&reader->binary, length);
+  if (chars == NULL) {
+    return NULL;
+  }
+  return Vm_copy_string(reader->vm, (char*)chars, length);
+}
+
+static ObjFunction* bytecode_reader_read_function(BytecodeReader* reader) {
+  if (reader->depth == BYTECODE_FILE_MAX_DEPTH) {
+    reader->binary.had_error = true;
+    return NULL;
+  }
+  reader->depth++;
+
+  ObjFunction* function = Vm_new_function(reader->vm);
+  function->arity = BinaryReader_read_int(&reader->binary);
+  function->upvalue_count = BinaryReader_read_int(&reader->binary);
+  if (function->arity < 0 || function->arity > 255 || function->upvalue_count < 0 || function->upvalue_count > 256) {
+    reader->binary.had_error = true;
+  }
+
+  function->name = bytecode_reader_read_name(reader);
+
+  if (!bytecode_reader_read_constants(reader, &function->chunk) ||
+      !bytecode_reader_read_code(reader, &function->chunk) ||
+      !BytecodeFile_validate_function(function)) {
+    reader->binary.had_error = true;
+  } else {
+    Vm_finish_function(function);
+  }
+
+  reader->depth--;
+  return reader->binary.had_error ? NULL : function;
+}
+
+static bool bytecode_reader_read_constants(BytecodeReader* reader, Chunk* chunk) {
+  int32_t count = BinaryReader_read_count(&reader->binary, sizeof(uint8_t));
+  if (reader->binary.had_error || count > BYTECODE_FILE_MAX_CONSTANTS) {
+    return false;
+  }
+
+  for (int i = 0; i < count; i++) {
+    const uint8_t* tag = BinaryReader_read(&reader->binary, sizeof(uint8_t));
+    if (tag == NULL) {
+      return false;
+    }
+
+    switch (*tag) {
+      case CONSTANT_NUMBER: {
+        const uint8_t* bytes = BinaryReader_read(&reader->binary, sizeof(double));
+        if (bytes == NULL) {
+          return false;
+        }
+        double number;
+        memcpy(&number, bytes, sizeof(number));
+        Chunk_add_number(chunk, number);
+        break;
+      }
+      case CONSTANT_STRING:
+      case CONSTANT_SELECTOR: {
+        ObjString* string = bytecode_reader_read_string(reader);
+        if (string == NULL) {
+          return false;
+        }
+        // Keeps the selectors in the same order as when the script was
+        // compiled. Method names that aren't interned here would be
+        // interned by OP_METHOD anyway.
+        if (*tag == CONSTANT_SELECTOR) {
+          Vm_intern_selector(reader->vm, string);
+        }
+        Chunk_add_object(chunk, (Obj*)string);
+        break;
+      }
+      case CONSTANT_FUNCTION: {
+        ObjFunction* function = bytecode_reader_read_function(reader);
+        if (function == NULL) {
+          return false;
+        }
+        Chunk_add_object(chunk, (Obj*)function);
+        break;
+      }
+      default:
+        return false;
+    }
+  }
+
+  return true;
+}
+
+static bool bytecode_reader_read_code(BytecodeReader* reader, Chunk* chunk) {
+  int32_t count = BinaryReader_read_count(&reader->binary, sizeof(uint8_t));
+  const uint8_t* code = BinaryReader_read(&reader->binary, count);
+  BinaryReader_align(&reader->binary);
+  int32_t line_run_count = BinaryReader_read_count(&reader->binary, sizeof(LineRun));
+  const uint8_t* line_run_bytes = BinaryReader_read(&reader->binary, line_run_count * sizeof(LineRun));
+  if (reader->binary.had_error || count == 0 || line_run_count == 0) {
+    return false;
+  }
+
+  // Chunk_get_line relies on the runs being in order, starting with the
+  // first byte of code
+  LineRun* line_runs = (LineRun*)line_run_bytes;
+  for (int i = 0; i < line_run_count; i++) {
+    int offset = line_runs[i].offset;
+    if (i == 0 ? offset != 0 : (offset <= line_runs[i - 1].offset || offset >= count)) {
+      return false;
+    }
+  }
+
+  Chunk_borrow_code(chunk, (uint8_t*)code, count, line_runs, line_run_count);
+  return true;
+}
+
+// Makes sure that running the code can't go wrong in ways that the VM
+// doesn't check for at runtime: every instruction has to be complete, refer
+// to constants of the right type, and jump to the start of an instruction.
+// The last instruction has to be a return so that execution can't run off
+// the end of the code, and the stack has to be used the way compiled code
+// uses it (see bytecode_file_validate_stack).
+bool BytecodeFile_validate_function(ObjFunction* function) {
+  Chunk* chunk = &function->chunk;
+  if (chunk->count == 0) {
+    return false;
+  }
+
+  bool* starts_instruction = (bool*)calloc(chunk->count, sizeof(bool));
+  bool valid = true;
+  int last_instruction = 0;
+
+  for (int offset = 0; offset < chunk->count && valid; ) {
+    int operand_count = bytecode_file_operand_count(function, offset);
+    if (operand_count < 0 || offset + 1 + operand_count > chunk->count) {
+      valid = false;
+      break;
+    }
+    starts_instruction[offset] = true;
+    last_instruction = offset;
+    offset += 1 + operand_count;
+  }
+
+  valid = valid && chunk->code[last_instruction] == OP_RETURN;
+
+  for (int offset = 0; offset < chunk->count && valid; ) {
+    int next = offset + 1 + bytecode_file_operand_count(function, offset);
+    if (bytecode_file_is_jump(chunk->code[offset])) {
+      int target = bytecode_file_jump_target(chunk, offset, next);
+      valid = target >= 0 && target < chunk->count && starts_instruction[target];
+    }
+    offset = next;
+  }
+
+  free(starts_instruction);
+  return valid && bytecode_file_validate_stack(function);
+}
+
+// Returns the number of operand bytes of the instruction at offset, or -1
+// if it isn't a valid instruction
+static int bytecode_file_operand_count(ObjFunction* function, int offset) {
+  Chunk* chunk = &function->chunk;
+  uint8_t instruction = chunk->code[offset];
+  bool has_operand = offset + 1 < chunk->count;
+  uint8_t operand = has_operand ? chunk->code[offset + 1] : 0;
+
+  switch (instruction) {
+    case OP_NIL:
+    case OP_TRUE:
+    case OP_FALSE:
+    case OP_POP:
+    case OP_EQUAL:
+    case OP_GREATER:
+    case OP_LESS:
+    case OP_NOT_EQUAL:
+    case OP_NOT_GREATER:
+    case OP_NOT_LESS:
+    case OP_ADD:
+    case OP_SUBTRACT:
+    case OP_MULTIPLY:
+    case OP_DIVIDE:
+    case OP_ADD_NUMBERS:
+    case OP_SUBTRACT_NUMBERS:
+    case OP_MULTIPLY_NUMBERS:
+    case OP_DIVIDE_NUMBERS:
+    case OP_GREATER_NUMBERS:
+    case OP_LESS_NUMBERS:
+    case OP_NOT:
+    case OP_NEGATE:
+    case OP_PRINT:
+    case OP_CLOSE_UPVALUE:
+    case OP_RETURN:
+    case OP_INHERIT:
+    case OP_END_CLASS:
+      return 0;
+    case OP_GET_LOCAL:
+    case OP_SET_LOCAL:
+    case OP_STORE_LOCAL:
+    case OP_CALL:
+      return 1;
+    case OP_ADD_REGISTERS:
+    case OP_SUBTRACT_REGISTERS:
+    case OP_MULTIPLY_REGISTERS:
+    case OP_DIVIDE_REGISTERS:
+    case OP_GREATER_REGISTERS:
+    case OP_LESS_REGISTERS:
+      return 2;
+    case OP_ADD_REGISTER_CONSTANT:
+    case OP_SUBTRACT_REGISTER_CONSTANT:
+    case OP_MULTIPLY_REGISTER_CONSTANT:
+    case OP_DIVIDE_REGISTER_CONSTANT:
+    case OP_GREATER_REGISTER_CONSTANT:
+    case OP_LESS_REGISTER_CONSTANT:
+      return offset + 2 < chunk->count && chunk->code[offset + 2] < chunk->constants.count ? 2 : -1;
+    case OP_CONSTANT:
+      return has_operand && operand < chunk->constants.count ? 1 : -1;
+    case OP_GET_UPVALUE:
+    case OP_SET_UPVALUE:
+    case OP_GET_CAPTURED:
+      return has_operand && operand < function->upvalue_count ? 1 : -1;
+    case OP_GET_GLOBAL:
+    case OP_DEFINE_GLOBAL:
+    case OP_SET_GLOBAL:
+    case OP_GET_PROPERTY:
+    case OP_GET_METHOD:
+    case OP_SET_PROPERTY:
+    case OP_GET_SUPER:
+    case OP_CLASS:
+    case OP_METHOD:
+      return has_operand && bytecode_file_is_constant_of_type(function, operand, OBJ_STRING) ? 1 : -1;
+    case OP_INVOKE:
+    case OP_SUPER_INVOKE:
+    case OP_CALL_METHOD:
+      return has_operand && bytecode_file_is_constant_of_type(function, operand, OBJ_STRING) ? 2 : -1;
+    case OP_JUMP:
+    case OP_JUMP_IF_FALSE:
+    case OP_JUMP_IF_TRUE:
+    case OP_LOOP:
+      return 2;
+    case OP_CLOSURE: {
+      if (!has_operand || !bytecode_file_is_constant_of_type(function, operand, OBJ_FUNCTION)) {
+        return -1;
+      }
+
+      ObjFunction* closure_function = Object_as_function(chunk->constants.values[operand]);
+      int operand_count = 1 + closure_function->upvalue_count * 2;
+      if (offset + 1 + operand_count > chunk->count) {
+        return -1;
+      }
+      for (int i = 0; i < closure_function->upvalue_count; i++) {
+        uint8_t capture_type = chunk->code[offset + 2 + i * 2];
+        uint8_t index = chunk->code[offset + 3 + i * 2];
+        if (capture_type > CAPTURE_VALUE || (capture_type == CAPTURE_UPVALUE && index >= function->upvalue_count)) {
+          return -1;
+        }
+      }
+      return operand_count;
+    }
+    default:
+      return -1;
+  }
+}
+
+static bool bytecode_file_is_jump(uint8_t instruction) {
+  return instruction == OP_JUMP || instruction == OP_JUMP_IF_FALSE || instruction == OP_JUMP_IF_TRUE ||
+    instruction == OP_LOOP;
+}
+
+static int bytecode_file_jump_target(Chunk* chunk, int offset, int next) {
+  int jump = (chunk->code[offset + 1] << 8) | chunk->code[offset + 2];
+  return chunk->code[offset] == OP_LOOP ? next - jump : next + jump;
+}
+
+// The VM doesn't check the stack as it runs, so this works out how deep it
+// is before each instruction, starting with the callee and the arguments
+// in the frame's first slots. Every way of reaching an instruction has to
+// leave the stack equally deep, instructions can't pop anything below the
+// callee, locals have to be below the top, and the stack can't grow past
+// what the VM sets aside for a frame. The instructions are known to be
+// complete and to jump to the start of other instructions by now.
+static bool bytecode_file_validate_stack(ObjFunction* function) {
+  Chunk* chunk = &function->chunk;
+  int* depths = (int*)calloc(chunk->count, sizeof(int));
+  int* pending = (int*)calloc(chunk->count, sizeof(int));
+  for (int offset = 0; offset < chunk->count; offset++) {
+    depths[offset] = -1;
+  }
+
+  int pending_count = 0;
+  depths[0] = 1 + function->arity;
+  pending[pending_count++] = 0;
+  bool valid = true;
+  while (pending_count > 0 && valid) {
+    int offset = pending[--pending_count];
+    uint8_t instruction = chunk->code[offset];
+    int pops;
+    int pushes;
+    if (!bytecode_file_stack_effect(function, offset, depths[offset], &pops, &pushes) ||
+        pops > depths[offset] - 1) {
+      valid = false;
+      break;
+    }
+    int depth = depths[offset] - pops + pushes;
+    if (depth > BYTECODE_FILE_MAX_STACK) {
+      valid = false;
+      break;
+    }
+
+    // Each instruction goes on to at most two others, the next one and
+    // the one it jumps to
+    int next = offset + 1 + bytecode_file_operand_count(function, offset);
+    int successors[2];
+    int successor_count = 0;
+    if (instruction != OP_JUMP && instruction != OP_LOOP && instruction != OP_RETURN) {
+      successors[successor_count++] = next;
+    }
+    if (bytecode_file_is_jump(instruction)) {
+      successors[successor_count++] = bytecode_file_jump_target(chunk, offset, next);
+    }
+    for (int i = 0; i < successor_count && valid; i++) {
+      int successor = successors[i];
+      if (depths[successor] == -1) {
+        depths[successor] = depth;
+        pending[pending_count++] = successor;
+      } else {
+        valid = depths[successor] == depth;
+      }
+    }
+  }
+
+  free(depths);
+  free(pending);
+  return valid;
+}
+
+// Sets how many values the instruction at offset pops off the stack, and
+// how many it pushes after that. Instructions that only look at values
+// without popping them count as popping and pushing them back. Returns
+// false if the instruction refers to a local that isn't on the stack.
+static bool bytecode_file_stack_effect(ObjFunction* function, int offset, int depth, int* pops, int* pushes) {
+  Chunk* chunk = &function->chunk;
+  uint8_t operand = chunk->code[offset + 1];
+  *pops = 0;
+  *pushes = 0;
+
+  switch (chunk->code[offset]) {
+    case OP_CONSTANT:
+    case OP_NIL:
+    case OP_TRUE:
+    case OP_FALSE:
+    case OP_GET_GLOBAL:
+    case OP_GET_UPVALUE:
+    case OP_GET_CAPTURED:
+    case OP_CLASS:
+      *pushes = 1;
+      return true;
+    case OP_GET_LOCAL:
+      *pushes = 1;
+      return operand < depth;
+    case OP_ADD_REGISTERS:
+    case OP_SUBTRACT_REGISTERS:
+    case OP_MULTIPLY_REGISTERS:
+    case OP_DIVIDE_REGISTERS:
+    case OP_GREATER_REGISTERS:
+    case OP_LESS_REGISTERS:
+      *pushes = 1;
+      return operand < depth && chunk->code[offset + 2] < depth;
+    case OP_ADD_REGISTER_CONSTANT:
+    case OP_SUBTRACT_REGISTER_CONSTANT:
+    case OP_MULTIPLY_REGISTER_CONSTANT:
+    case OP_DIVIDE_REGISTER_CONSTANT:
+    case OP_GREATER_REGISTER_CONSTANT:
+    case OP_LESS_REGISTER_CONSTANT:
+      *pushes = 1;
+      return operand < depth;
+    case OP_SET_LOCAL:
+      *pops = 1;
+      *pushes = 1;
+      return operand < depth;
+    case OP_STORE_LOCAL:
+      *pops = 1;
+      return operand < depth - 1;
+    case OP_POP:
+    case OP_DEFINE_GLOBAL:
+    case OP_PRINT:
+    case OP_CLOSE_UPVALUE:
+    case OP_RETURN:
+    case OP_END_CLASS:
+      *pops = 1;
+      return true;
+    case OP_SET_GLOBAL:
+    case OP_SET_UPVALUE:
+    case OP_GET_PROPERTY:
+    case OP_GET_METHOD:
+    case OP_NOT:
+    case OP_NEGATE:
+    case OP_JUMP_IF_FALSE:
+    case OP_JUMP_IF_TRUE:
+      *pops = 1;
+      *pushes = 1;
+      return true;
+    case OP_SET_PROPERTY:
+    case OP_GET_SUPER:
+    case OP_EQUAL:
+    case OP_GREATER:
+    case OP_LESS:
+    case OP_NOT_EQUAL:
+    case OP_NOT_GREATER:
+    case OP_NOT_LESS:
+    case OP_ADD:
+    case OP_SUBTRACT:
+    case OP_MULTIPLY:
+    case OP_DIVIDE:
+    case OP_ADD_NUMBERS:
+    case OP_SUBTRACT_NUMBERS:
+    case OP_MULTIPLY_NUMBERS:
+    case OP_DIVIDE_NUMBERS:
+    case OP_GREATER_NUMBERS:
+    case OP_LESS_NUMBERS:
+      *pops = 2;
+      *pushes = 1;
+      return true;
+    case OP_INHERIT:
+    case OP_METHOD:
+      // The superclass, or the class, stays where it is
+      *pops = 2;
+      *pushes = 1;
+      return true;
+    case OP_JUMP:
+    case OP_LOOP:
+      return true;
+    case OP_CALL:
+      *pops = operand + 1;
+      *pushes = 1;
+      return true;
+    case OP_INVOKE:
+    case OP_CALL_METHOD:
+      *pops = chunk->code[offset + 2] + 1;
+      *pushes = 1;
+      return true;
+    case OP_SUPER_INVOKE:
+      *pops = chunk->code[offset + 2] + 2;
+      *pushes = 1;
+      return true;
+    case OP_CLOSURE: {
+      // A closure can capture itself, since it's pushed before it captures
+      // anything
+      *pushes = 1;
+      ObjFunction* closure_function = Object_as_function(chunk->constants.values[operand]);
+      for (int i = 0; i < closure_function->upvalue_count; i++) {
+        uint8_t capture_type = chunk->code[offset + 2 + i * 2];
+        uint8_t index = chunk->code[offset + 3 + i * 2];
+        if (capture_type != CAPTURE_UPVALUE && index > depth) {
+          return false;
+        }
+      }
+      return true;
+    }
+    default:
+      return false;
+  }
+}
+
+// Upvalues are either shared through an ObjUpvalue or copied by value (see
+// CaptureType), and OP_GET_UPVALUE and OP_SET_UPVALUE only work on shared
+// ones while OP_GET_CAPTURED only works on copied ones. Which kind each
+// upvalue is depends on the OP_CLOSURE instructions that create closures of
+// the function, so this is checked from the script down once every function
+// has been loaded. by_value tells which of the function's upvalues are
+// copies.
+static bool bytecode_file_validate_upvalues(ObjFunction* function, const bool* by_value) {
+  Chunk* chunk = &function->chunk;
+  // The kinds of the upvalues of each function in the constants, as the
+  // first OP_CLOSURE for it captures them. Any others have to agree.
+  bool** constant_kinds = (bool**)calloc(chunk->constants.count + 1, sizeof(bool*));
+  bool valid = true;
+
+  for (int offset = 0; offset < chunk->count && valid; ) {
+    uint8_t instruction = chunk->code[offset];
+    uint8_t operand = chunk->code[offset + 1];
+    if (instruction == OP_GET_UPVALUE || instruction == OP_SET_UPVALUE) {
+      valid = !by_value[operand];
+    } else if (instruction == OP_GET_CAPTURED) {
+      valid = by_value[operand];
+    } else if (instruction == OP_CLOSURE) {
+      ObjFunction* closure_function = Object_as_function(chunk->constants.values[operand]);
+      int upvalue_count = closure_function->upvalue_count;
+      bool* kinds = (bool*)malloc(upvalue_count + 1);
+      for (int i = 0; i < upvalue_count; i++) {
+        uint8_t capture_type = chunk->code[offset + 2 + i * 2];
+        uint8_t index = chunk->code[offset + 3 + i * 2];
+        kinds[i] = capture_type == CAPTURE_VALUE || (capture_type == CAPTURE_UPVALUE && by_value[index]);
+      }
+      if (constant_kinds[operand] == NULL) {
+        constant_kinds[operand] = kinds;
+      } else {
+        valid = memcmp(constant_kinds[operand], kinds, upvalue_count) == 0;
+        free(kinds);
+      }
+    }
+    offset += 1 + bytecode_file_operand_count(function, offset);
+  }
+
+  for (int i = 0; i < chunk->constants.count; i++) {
+    if (constant_kinds[i] != NULL) {
+      valid = valid && bytecode_file_validate_upvalues(Object_as_function(chunk->constants.values[i]), constant_kinds[i]);
+      free(constant_kinds[i]);
+    }
+  }
+  free(constant_kinds);
+  return valid;
+}
+
+static bool bytecode_file_is_constant_of_type(ObjFunction* function, int index, ObjType type) {
+  return index < function->chunk.constants.count && Object_is_type(function->chunk.constants.values[index], type);
+}
@@ -0,0 +1,60 @@
+#ifndef clox_bytecode_file_h
+#define clox_bytecode_file_h
+
+#include "common.h"
+#include "object.h"
+#include "vm.h"
+
+// Compiled scripts can be saved to .loxc files and loaded back without
+// going through a compiler again. A file holds the script's function and,
+// nested in its constants, every function declared inside it, with their
+// code, line runs and constants. Strings are stored as their characters
+// and are interned again when they're loaded.
+//
+// Files are mapped into memory rather than read, and the code and line runs
+// of their functions are used in place, so loading one doesn't copy any
+// code and processes that load the same file share its pages. Constants
+// still have to be created on the VM's heap, since strings are interned.
+//
+// The format is meant for caching on the machine that wrote it, so numbers
+// are stored in native byte order. A file written by a machine with a
+// different byte order, or by a different format version, is rejected.
+//
+// Bump the version whenever the format or the opcodes change.
+#define BYTECODE_FILE_VERSION 7
+
+// The VM keeps every file it has mapped until it's freed, since there's no
+// telling when the last function using one is collected
+typedef struct BytecodeImage {
+  void* address;
+  size_t size;
+  struct BytecodeImage* next;
+} BytecodeImage;
+
+int BytecodeFile_version(void);
+
+// Writes the file to a temporary file next to path first and then renames
+// it, so that readers never see a half-written file. Returns false if the
+// file couldn't be written.
+bool BytecodeFile_write(ObjFunction* function, const char* path);
+
+// Maps the file read-only into memory. Returns NULL if the file doesn't
+// exist or isn't valid. Files are checked thoroughly enough that a corrupt
+// file is rejected instead of being run: besides a checksum of the whole
+// file, every instruction must be a known opcode whose operands are in
+// bounds, and the code must use the stack and its upvalues the way compiled
+// code does. What the values on the stack are is still checked as the code
+// runs, as it is for any script.
+ObjFunction* BytecodeFile_map(Vm* vm, const char* path);
+void BytecodeFile_unmap_images(Vm* vm);
+
+// Loads a file that's already in memory, with the same checks as
+// BytecodeFile_map. The code of the functions points into bytes, so they
+// have to stay around for as long as the VM does.
+ObjFunction* BytecodeFile_load(Vm* vm, const uint8_t* bytes, size_t size);
+
+// The checks that BytecodeFile_map makes on the code of each function. The
+// function's constants have to be loaded already.
+bool BytecodeFile_validate_function(ObjFunction* function);
+
+#endif
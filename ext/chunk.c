@@ -1,4 +1,5 @@
 #include <stdlib.h>
+#include <string.h>
 
 #include "common.h"
 #include "chunk.h"
@@ -6,31 +7,66 @@
 #include "object_types.h"
 #include "value_array.h"
 
+static void chunk_grow_code(Chunk* chunk, int minimum_capacity);
+static void chunk_add_line(Chunk* chunk, int offset, int line);
+
 void Chunk_init(Chunk* chunk, MemoryAllocator* memory_allocator) {
   chunk->count = 0;
   chunk->capacity = 0;
   chunk->code = NULL;
-  chunk->lines = NULL;
+  chunk->line_run_capacity = 0;
+  chunk->line_run_count = 0;
+  chunk->line_runs = NULL;
   chunk->memory_allocator = memory_allocator;
+  chunk->owns_code = true;
   ValueArray_init(&chunk->constants, chunk->memory_allocator);
 }
 
 void Chunk_write(Chunk* chunk, uint8_t byte, int line) {
   if (chunk->capacity < chunk->count + 1) {
-    int old_capacity = chunk->capacity;
-    chunk->capacity = MemoryAllocator_get_increased_capacity(chunk->memory_allocator, old_capacity);
-    chunk->code = (uint8_t*) MemoryAllocator_grow_array(chunk->memory_allocator, chunk->code, sizeof(uint8_t), old_capacity, chunk->capacity);
-    chunk->lines = (int*) MemoryAllocator_grow_array(chunk->memory_allocator, chunk->lines, sizeof(int), old_capacity, chunk->capacity);
+    chunk_grow_code(chunk, chunk->count + 1);
   }
 
+  chunk_add_line(chunk, chunk->count, line);
   chunk->code[chunk->count] = byte;
-  chunk->lines[chunk->count] = line;
   chunk->count++;
 }
 
+// Appends count bytes in one go, which is how the Ruby compiler hands over
+// the code of a whole function. Their lines are given as line_run_count
+// pairs of a line and the number of consecutive bytes on that line.
+void Chunk_write_bytes(Chunk* chunk, uint8_t* bytes, int count, int* line_runs, int line_run_count) {
+  if (chunk->capacity < chunk->count + count) {
+    chunk_grow_code(chunk, chunk->count + count);
+  }
+
+  int offset = chunk->count;
+  for (int i = 0; i < line_run_count; i++) {
+    chunk_add_line(chunk, offset, line_runs[i * 2]);
+    offset += line_runs[i * 2 + 1];
+  }
+
+  memcpy(chunk->code + chunk->count, bytes, count);
+  chunk->count += count;
+}
+
+// Makes the chunk use code and line runs that it doesn't own, which is how
+// mapped bytecode files are run in place. Such a chunk can't be written to.
+void Chunk_borrow_code(Chunk* chunk, uint8_t* code, int count, LineRun* line_runs, int line_run_count) {
+  chunk->owns_code = false;
+  chunk->code = code;
+  chunk->count = count;
+  chunk->capacity = count;
+  chunk->line_runs = line_runs;
+  chunk->line_run_count = line_run_count;
+  chunk->line_run_capacity = line_run_count;
+}
+
 void Chunk_free(Chunk* chunk) {
-  MemoryAllocator_free_array(chunk->memory_allocator, chunk->code, sizeof(uint8_t), chunk->capacity);
-  MemoryAllocator_free_array(chunk->memory_allocator, chunk->lines, sizeof(int), chunk->capacity);
+  if (chunk->owns_code) {
+    MemoryAllocator_free_array(chunk->memory_allocator, chunk->code, sizeof(uint8_t), chunk->capacity);
+    MemoryAllocator_free_array(chunk->memory_allocator, chunk->line_runs, sizeof(LineRun), chunk->line_run_capacity);
+  }
   ValueArray_free(&chunk->constants);
   Chunk_init(chunk, chunk->memory_allocator);
 }
@@ -41,8 +77,49 @@ int Chunk_add_number(Chunk* chunk, double number) {
 }
 
 int Chunk_add_object(Chunk* chunk, Obj* object) {
-  chunk->memory_allocator->protected_object = object;
+  MemoryAllocator_push_root(chunk->memory_allocator, object);
   ValueArray_write(&chunk->constants, Value_make_obj(object));
-  chunk->memory_allocator->protected_object = NULL;
+  MemoryAllocator_pop_root(chunk->memory_allocator);
   return chunk->constants.count - 1;
 }
+
+int Chunk_get_line(Chunk* chunk, int offset) {
+  // Finds the last run that starts at or before the offset
+  int low = 0;
+  int high = chunk->line_run_count - 1;
+  while (low < high) {
+    int middle = low + (high - low + 1) / 2;
+    if (chunk->line_runs[middle].offset <= offset) {
+      low = middle;
+    } else {
+      high = middle - 1;
+    }
+  }
+  return chunk->line_runs[low].line;
+}
+
+static void chunk_grow_code(Chunk* chunk, int minimum_capacity) {
+  int old_capacity = chunk->capacity;
+  int new_capacity = MemoryAllocator_get_increased_capacity(chunk->memory_allocator, old_capacity);
+  while (new_capacity < minimum_capacity) {
+    new_capacity = MemoryAllocator_get_increased_capacity(chunk->memory_allocator, new_capacity);
+  }
+  chunk->capacity = new_capacity;
+  chunk->code = (uint8_t*) MemoryAllocator_grow_array(chunk->memory_allocator, chunk->code, sizeof(uint8_t), old_capacity, chunk->capacity);
+}
+
+static void chunk_add_line(Chunk* chunk, int offset, int line) {
+  if (chunk->line_run_count > 0 && chunk->line_runs[chunk->line_run_count - 1].line == line) {
+    return;
+  }
+
+  if (chunk->line_run_capacity < chunk->line_run_count + 1) {
+    int old_capacity = chunk->line_run_capacity;
+    chunk->line_run_capacity = MemoryAllocator_get_increased_capacity(chunk->memory_allocator, old_capacity);
+    chunk->line_runs = (LineRun*) MemoryAllocator_grow_array(chunk->memory_allocator, chunk->line_runs, sizeof(LineRun), old_capacity, chunk->line_run_capacity);
+  }
+
+  chunk->line_runs[chunk->line_run_count].offset = offset;
+  chunk->line_runs[chunk->line_run_count].line = line;
+  chunk->line_run_count++;
+}
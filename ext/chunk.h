@@ -14,50 +14,107 @@ typedef enum {
   OP_POP,
   OP_GET_LOCAL,
   OP_SET_LOCAL,
+  OP_STORE_LOCAL,
   OP_GET_GLOBAL,
   OP_DEFINE_GLOBAL,
   OP_SET_GLOBAL,
   OP_GET_UPVALUE,
   OP_SET_UPVALUE,
+  OP_GET_CAPTURED,
   OP_GET_PROPERTY,
+  OP_GET_METHOD,
   OP_SET_PROPERTY,
   OP_GET_SUPER,
   OP_EQUAL,
   OP_GREATER,
   OP_LESS,
+  OP_NOT_EQUAL,
+  OP_NOT_GREATER,
+  OP_NOT_LESS,
   OP_ADD,
   OP_SUBTRACT,
   OP_MULTIPLY,
   OP_DIVIDE,
+  OP_ADD_NUMBERS,
+  OP_SUBTRACT_NUMBERS,
+  OP_MULTIPLY_NUMBERS,
+  OP_DIVIDE_NUMBERS,
+  OP_GREATER_NUMBERS,
+  OP_LESS_NUMBERS,
+  // Superinstructions that each do the work of an OP_GET_LOCAL, an
+  // OP_GET_LOCAL or OP_CONSTANT, and the operation, by reading the operands
+  // straight out of the frame's slots, or out of the constants. The result
+  // is still pushed, so the VM stays a stack machine, and "register" only
+  // refers to the slots they read. Only SuperinstructionCompiler emits
+  // them.
+  OP_ADD_REGISTERS,
+  OP_SUBTRACT_REGISTERS,
+  OP_MULTIPLY_REGISTERS,
+  OP_DIVIDE_REGISTERS,
+  OP_GREATER_REGISTERS,
+  OP_LESS_REGISTERS,
+  OP_ADD_REGISTER_CONSTANT,
+  OP_SUBTRACT_REGISTER_CONSTANT,
+  OP_MULTIPLY_REGISTER_CONSTANT,
+  OP_DIVIDE_REGISTER_CONSTANT,
+  OP_GREATER_REGISTER_CONSTANT,
+  OP_LESS_REGISTER_CONSTANT,
   OP_NOT,
   OP_NEGATE,
   OP_PRINT,
   OP_JUMP,
   OP_JUMP_IF_FALSE,
+  OP_JUMP_IF_TRUE,
   OP_LOOP,
   OP_CALL,
   OP_INVOKE,
   OP_SUPER_INVOKE,
+  OP_CALL_METHOD,
   OP_CLOSURE,
   OP_CLOSE_UPVALUE,
   OP_RETURN,
   OP_CLASS,
   OP_INHERIT,
-  OP_METHOD
+  OP_METHOD,
+  OP_END_CLASS
 } OpCode;
 
+// How OP_CLOSURE captures each of the new closure's upvalues. Variables that
+// are never assigned once they're declared are copied into the closure, and
+// the rest are shared with the enclosing function through an ObjUpvalue.
+typedef enum {
+  CAPTURE_UPVALUE, // Copies one of the enclosing closure's upvalues
+  CAPTURE_LOCAL,   // Shares a local of the enclosing function
+  CAPTURE_VALUE    // Copies the value of a local of the enclosing function
+} CaptureType;
+
+// Lines are stored run-length encoded: each run covers the bytes from its
+// offset up to the offset of the next run, which are all on the same line.
+// They're only needed for runtime errors and the disassembler, so finding
+// the line of a byte is a binary search.
+typedef struct {
+  int offset;
+  int line;
+} LineRun;
+
 typedef struct {
   int capacity;
   int count;
   uint8_t* code;
-  int* lines;
+  int line_run_capacity;
+  int line_run_count;
+  LineRun* line_runs;
   ValueArray constants;
   MemoryAllocator* memory_allocator;
+  bool owns_code; // False if the code and line runs are in a mapped bytecode file
 } Chunk;
 
 void Chunk_init(Chunk* chunk, MemoryAllocator* memory_allocator);
 void Chunk_write(Chunk* chunk, uint8_t byte, int line);
+void Chunk_write_bytes(Chunk* chunk, uint8_t* bytes, int count, int* line_runs, int line_run_count);
+void Chunk_borrow_code(Chunk* chunk, uint8_t* code, int count, LineRun* line_runs, int line_run_count);
 void Chunk_free(Chunk* chunk);
+int Chunk_get_line(Chunk* chunk, int offset);
 int Chunk_add_number(Chunk* chunk, double number);
 int Chunk_add_object(Chunk* chunk, Obj* object);
 
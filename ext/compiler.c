@@ -0,0 +1,1232 @@
+#include <setjmp.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "common.h"
+#include "chunk.h"
+#include "compiler.h"
+#include "object.h"
+#include "peephole.h"
+#include "scanner.h"
+#include "value.h"
+#include "vm.h"
+
+#define MAX_LOCALS 256
+#define MAX_UPVALUES 256
+
+typedef enum {
+  PREC_NONE,
+  PREC_ASSIGNMENT, // =
+  PREC_OR,         // or
+  PREC_AND,        // and
+  PREC_EQUALITY,   // == !=
+  PREC_COMPARISON, // < > <= >=
+  PREC_TERM,       // + -
+  PREC_FACTOR,     // * /
+  PREC_UNARY,      // ! -
+  PREC_CALL,       // . ()
+  PREC_PRIMARY
+} Precedence;
+
+typedef enum {
+  TYPE_FUNCTION,
+  TYPE_INITIALIZER,
+  TYPE_METHOD,
+  TYPE_SCRIPT
+} FunctionType;
+
+typedef struct {
+  Token name;
+  int depth;
+  bool is_captured;
+} Local;
+
+typedef struct {
+  uint8_t index;
+  bool is_local;
+} Upvalue;
+
+typedef struct FunctionCompiler {
+  struct FunctionCompiler* enclosing;
+  ObjFunction* function;
+  FunctionType type;
+  Local locals[MAX_LOCALS];
+  int local_count;
+  Upvalue upvalues[MAX_UPVALUES];
+  int scope_depth;
+} FunctionCompiler;
+
+typedef struct ClassCompiler {
+  struct ClassCompiler* enclosing;
+  bool has_superclass;
+} ClassCompiler;
+
+typedef struct {
+  Vm* vm;
+  Scanner scanner;
+  Token current;
+  Token previous;
+  bool had_error;
+  // Where to go back to when a syntax error is raised, which is always the
+  // innermost declaration being compiled. This stands in for the exceptions
+  // the Ruby parser uses to recover from errors, so the same errors get
+  // reported.
+  jmp_buf* recovery;
+  // The line of the last simple statement that was compiled, which is what
+  // the Ruby compiler reports a loop that is too large on
+  int last_statement_line;
+  FunctionCompiler* function_compiler;
+  ClassCompiler* class_compiler;
+  // The Ruby frontend only compiles a program once it has parsed all of it
+  // without errors, so compile errors are held back until the end and are
+  // only reported if there weren't any syntax errors
+  char* compile_errors;
+  int compile_errors_length;
+  int compile_errors_capacity;
+} Compiler;
+
+// Everything needed to rewind the compiler to an earlier token
+typedef struct {
+  Scanner scanner;
+  Token current;
+  Token previous;
+} CompilerPosition;
+
+typedef void (*ParseFn)(Compiler* compiler, bool can_assign);
+
+typedef struct {
+  ParseFn prefix;
+  ParseFn infix;
+  Precedence precedence;
+} ParseRule;
+
+static void compiler_advance(Compiler* compiler);
+static void compiler_consume(Compiler* compiler, TokenType type, const char* message);
+static bool compiler_check(Compiler* compiler, TokenType type);
+static bool compiler_match(Compiler* compiler, TokenType type);
+static CompilerPosition compiler_save_position(Compiler* compiler);
+static void compiler_restore_position(Compiler* compiler, CompilerPosition position);
+static void compiler_report(Token* token, const char* message);
+static void compiler_error_at(Compiler* compiler, Token* token, const char* message);
+static void compiler_raise_error_at(Compiler* compiler, Token* token, const char* message);
+static void compiler_compile_error_at(Compiler* compiler, Token* token, const char* message);
+static void compiler_tokenless_compile_error(Compiler* compiler, int line, const char* message);
+static void compiler_defer_error(Compiler* compiler, const char* format, ...) __attribute__((format(printf, 2, 3)));
+static void compiler_synchronize(Compiler* compiler);
+
+static Chunk* compiler_current_chunk(Compiler* compiler);
+static void compiler_emit_byte(Compiler* compiler, uint8_t byte);
+static void compiler_emit_bytes(Compiler* compiler, uint8_t byte1, uint8_t byte2);
+static void compiler_emit_byte_on_line(Compiler* compiler, uint8_t byte, int line);
+static void compiler_emit_bytes_on_line(Compiler* compiler, uint8_t byte1, uint8_t byte2, int line);
+static int compiler_emit_jump(Compiler* compiler, uint8_t instruction);
+static void compiler_patch_jump(Compiler* compiler, int offset);
+static bool compiler_emit_loop(Compiler* compiler, int loop_start);
+static void compiler_emit_return(Compiler* compiler);
+static uint8_t compiler_check_constant(Compiler* compiler, Token* token, int constant);
+static uint8_t compiler_identifier_constant(Compiler* compiler, Token* name);
+static uint8_t compiler_selector_constant(Compiler* compiler, Token* name);
+
+static void compiler_begin_function(Compiler* compiler, FunctionCompiler* function_compiler, FunctionType type);
+static ObjFunction* compiler_end_function(Compiler* compiler);
+static void compiler_begin_scope(Compiler* compiler);
+static void compiler_end_scope(Compiler* compiler);
+static bool compiler_identifiers_equal(Token* a, Token* b);
+static Token compiler_synthetic_token(const char* text, int line);
+static void compiler_add_local(Compiler* compiler, Token name);
+static void compiler_declare_local(Compiler* compiler);
+static void compiler_mark_initialized(Compiler* compiler);
+static uint8_t compiler_parse_variable(Compiler* compiler, const char* message);
+static void compiler_define_variable(Compiler* compiler, uint8_t global);
+static int compiler_resolve_local(Compiler* compiler, FunctionCompiler* function_compiler, Token* name);
+static int compiler_add_upvalue(Compiler* compiler, FunctionCompiler* function_compiler, Token* name, uint8_t index, bool is_local);
+static int compiler_resolve_upvalue(Compiler* compiler, FunctionCompiler* function_compiler, Token* name);
+static void compiler_get_named_variable(Compiler* compiler, Token name);
+static void compiler_set_named_variable(Compiler* compiler, Token name);
+
+static void compiler_declaration(Compiler* compiler);
+static void compiler_class_declaration(Compiler* compiler);
+static void compiler_method(Compiler* compiler);
+static void compiler_fun_declaration(Compiler* compiler);
+static void compiler_function(Compiler* compiler, FunctionType type);
+static void compiler_var_declaration(Compiler* compiler);
+static void compiler_statement(Compiler* compiler);
+static void compiler_block(Compiler* compiler);
+static void compiler_expression_statement(Compiler* compiler);
+static void compiler_for_statement(Compiler* compiler);
+static void compiler_for_increment(Compiler* compiler);
+static void compiler_if_statement(Compiler* compiler);
+static void compiler_print_statement(Compiler* compiler);
+static void compiler_return_statement(Compiler* compiler);
+static void compiler_while_statement(Compiler* compiler);
+
+static void compiler_expression(Compiler* compiler);
+static void compiler_parse_precedence(Compiler* compiler, Precedence precedence);
+static ParseRule* compiler_get_rule(TokenType type);
+static uint8_t compiler_argument_list(Compiler* compiler);
+static void compiler_validate_super(Compiler* compiler, Token* keyword);
+static void compiler_and(Compiler* compiler, bool can_assign);
+static void compiler_binary(Compiler* compiler, bool can_assign);
+static void compiler_call(Compiler* compiler, bool can_assign);
+static void compiler_dot(Compiler* compiler, bool can_assign);
+static void compiler_grouping(Compiler* compiler, bool can_assign);
+static void compiler_literal(Compiler* compiler, bool can_assign);
+static void compiler_number(Compiler* compiler, bool can_assign);
+static void compiler_or(Compiler* compiler, bool can_assign);
+static void compiler_string(Compiler* compiler, bool can_assign);
+static void compiler_super(Compiler* compiler, bool can_assign);
+static void compiler_this(Compiler* compiler, bool can_assign);
+static void compiler_unary(Compiler* compiler, bool can_assign);
+static void compiler_variable(Compiler* compiler, bool can_assign);
+
+static ParseRule compiler_rules[] = {
+  [TOKEN_LEFT_PAREN]    = {compiler_grouping, compiler_call,   PREC_CALL},
+  [TOKEN_RIGHT_PAREN]   = {NULL,              NULL,            PREC_NONE},
+  [TOKEN_LEFT_BRACE]    = {NULL,              NULL,            PREC_NONE},
+  [TOKEN_RIGHT_BRACE]   = {NULL,              NULL,            PREC_NONE},
+  [TOKEN_COMMA]         = {NULL,              NULL,            PREC_NONE},
+  [TOKEN_DOT]           = {NULL,              compiler_dot,    PREC_CALL},
+  [TOKEN_MINUS]         = {compiler_unary,    compiler_binary, PREC_TERM},
+  [TOKEN_PLUS]          = {NULL,              compiler_binary, PREC_TERM},
+  [TOKEN_SEMICOLON]     = {NULL,              NULL,            PREC_NONE},
+  [TOKEN_SLASH]         = {NULL,              compiler_binary, PREC_FACTOR},
+  [TOKEN_STAR]          = {NULL,              compiler_binary, PREC_FACTOR},
+  [TOKEN_BANG]          = {compiler_unary,    NULL,            PREC_NONE},
+  [TOKEN_BANG_EQUAL]    = {NULL,              compiler_binary, PREC_EQUALITY},
+  [TOKEN_EQUAL]         = {NULL,              NULL,            PREC_NONE},
+  [TOKEN_EQUAL_EQUAL]   = {NULL,              compiler_binary, PREC_EQUALITY},
+  [TOKEN_GREATER]       = {NULL,              compiler_binary, PREC_COMPARISON},
+  [TOKEN_GREATER_EQUAL] = {NULL,              compiler_binary, PREC_COMPARISON},
+  [TOKEN_LESS]          = {NULL,              compiler_binary, PREC_COMPARISON},
+  [TOKEN_LESS_EQUAL]    = {NULL,              compiler_binary, PREC_COMPARISON},
+  [TOKEN_IDENTIFIER]    = {compiler_variable, NULL,            PREC_NONE},
+  [TOKEN_STRING]        = {compiler_string,   NULL,            PREC_NONE},
+  [TOKEN_NUMBER]        = {compiler_number,   NULL,            PREC_NONE},
+  [TOKEN_AND]           = {NULL,              compiler_and,    PREC_AND},
+  [TOKEN_CLASS]         = {NULL,              NULL,            PREC_NONE},
+  [TOKEN_ELSE]          = {NULL,              NULL,            PREC_NONE},
+  [TOKEN_FALSE]         = {compiler_literal,  NULL,            PREC_NONE},
+  [TOKEN_FOR]           = {NULL,              NULL,            PREC_NONE},
+  [TOKEN_FUN]           = {NULL,              NULL,            PREC_NONE},
+  [TOKEN_IF]            = {NULL,              NULL,            PREC_NONE},
+  [TOKEN_NIL]           = {compiler_literal,  NULL,            PREC_NONE},
+  [TOKEN_OR]            = {NULL,              compiler_or,     PREC_OR},
+  [TOKEN_PRINT]         = {NULL,              NULL,            PREC_NONE},
+  [TOKEN_RETURN]        = {NULL,              NULL,            PREC_NONE},
+  [TOKEN_SUPER]         = {compiler_super,    NULL,            PREC_NONE},
+  [TOKEN_THIS]          = {compiler_this,     NULL,            PREC_NONE},
+  [TOKEN_TRUE]          = {compiler_literal,  NULL,            PREC_NONE},
+  [TOKEN_VAR]           = {NULL,              NULL,            PREC_NONE},
+  [TOKEN_WHILE]         = {NULL,              NULL,            PREC_NONE},
+  [TOKEN_ERROR]         = {NULL,              NULL,            PREC_NONE},
+  [TOKEN_EOF]           = {NULL,              NULL,            PREC_NONE},
+};
+
+ObjFunction* Compiler_compile(Vm* vm, const char* source) {
+  Compiler compiler;
+  compiler.vm = vm;
+  Scanner_init(&compiler.scanner, source);
+  compiler.had_error = false;
+  compiler.recovery = NULL;
+  compiler.last_statement_line = 1;
+  compiler.function_compiler = NULL;
+  compiler.class_compiler = NULL;
+  compiler.compile_errors = NULL;
+  compiler.compile_errors_length = 0;
+  compiler.compile_errors_capacity = 0;
+
+  FunctionCompiler function_compiler;
+  compiler_begin_function(&compiler, &function_compiler, TYPE_SCRIPT);
+
+  compiler_advance(&compiler);
+  while (!compiler_match(&compiler, TOKEN_EOF)) {
+    compiler_declaration(&compiler);
+  }
+
+  ObjFunction* function = compiler_end_function(&compiler);
+
+  bool had_compile_error = compiler.compile_errors_length > 0;
+  if (had_compile_error && !compiler.had_error) {
+    fputs(compiler.compile_errors, stderr);
+  }
+  free(compiler.compile_errors);
+
+  return compiler.had_error || had_compile_error ? NULL : function;
+}
+
+// Parsing
+
+static void compiler_advance(Compiler* compiler) {
+  compiler->previous = compiler->current;
+
+  for (;;) {
+    compiler->current = Scanner_scan_token(&compiler->scanner);
+    if (compiler->current.type != TOKEN_ERROR) {
+      break;
+    }
+
+    // Scanning is a separate pass in the Ruby frontend, so scanning errors
+    // never interrupt parsing
+    compiler_report(&compiler->current, compiler->current.start);
+    compiler->had_error = true;
+  }
+}
+
+static void compiler_consume(Compiler* compiler, TokenType type, const char* message) {
+  if (compiler->current.type == type) {
+    compiler_advance(compiler);
+    return;
+  }
+
+  compiler_raise_error_at(compiler, &compiler->current, message);
+}
+
+static bool compiler_check(Compiler* compiler, TokenType type) {
+  return compiler->current.type == type;
+}
+
+static bool compiler_match(Compiler* compiler, TokenType type) {
+  if (!compiler_check(compiler, type)) {
+    return false;
+  }
+  compiler_advance(compiler);
+  return true;
+}
+
+static CompilerPosition compiler_save_position(Compiler* compiler) {
+  CompilerPosition position = {
+    .scanner = compiler->scanner,
+    .current = compiler->current,
+    .previous = compiler->previous
+  };
+  return position;
+}
+
+static void compiler_restore_position(Compiler* compiler, CompilerPosition position) {
+  compiler->scanner = position.scanner;
+  compiler->current = position.current;
+  compiler->previous = position.previous;
+}
+
+static void compiler_report(Token* token, const char* message) {
+  if (token->type == TOKEN_EOF) {
+    fprintf(stderr, "[line %d] Error at end: %s\n", token->line, message);
+  } else if (token->type == TOKEN_ERROR) {
+    fprintf(stderr, "[line %d] Error: %s\n", token->line, message);
+  } else {
+    fprintf(stderr, "[line %d] Error at '%.*s': %s\n", token->line, token->length, token->start, message);
+  }
+}
+
+static void compiler_error_at(Compiler* compiler, Token* token, const char* message) {
+  compiler_report(token, message);
+  compiler->had_error = true;
+}
+
+static void compiler_raise_error_at(Compiler* compiler, Token* token, const char* message) {
+  compiler_error_at(compiler, token, message);
+  longjmp(*compiler->recovery, 1);
+}
+
+static void compiler_compile_error_at(Compiler* compiler, Token* token, const char* message) {
+  if (token->type == TOKEN_EOF) {
+    compiler_defer_error(compiler, "[line %d] Error at end: %s\n", token->line, message);
+  } else {
+    compiler_defer_error(compiler, "[line %d] Error at '%.*s': %s\n", token->line, token->length, token->start, message);
+  }
+}
+
+static void compiler_tokenless_compile_error(Compiler* compiler, int line, const char* message) {
+  compiler_defer_error(compiler, "[line %d] Error: %s\n", line, message);
+}
+
+static void compiler_defer_error(Compiler* compiler, const char* format, ...) {
+  va_list args;
+  va_start(args, format);
+  int length = vsnprintf(NULL, 0, format, args);
+  va_end(args);
+
+  int required_capacity = compiler->compile_errors_length + length + 1;
+  if (compiler->compile_errors_capacity < required_capacity) {
+    compiler->compile_errors_capacity = required_capacity * 2;
+    compiler->compile_errors = realloc(compiler->compile_errors, compiler->compile_errors_capacity);
+    if (compiler->compile_errors == NULL) exit(1);
+  }
+
+  va_start(args, format);
+  vsnprintf(compiler->compile_errors + compiler->compile_errors_length, length + 1, format, args);
+  va_end(args);
+  compiler->compile_errors_length += length;
+}
+
+static void compiler_synchronize(Compiler* compiler) {
+  if (compiler->current.type != TOKEN_EOF) {
+    compiler_advance(compiler);
+  }
+
+  while (compiler->current.type != TOKEN_EOF) {
+    if (compiler->previous.type == TOKEN_SEMICOLON) {
+      return;
+    }
+
+    switch (compiler->current.type) {
+      case TOKEN_CLASS:
+      case TOKEN_FUN:
+      case TOKEN_VAR:
+      case TOKEN_FOR:
+      case TOKEN_IF:
+      case TOKEN_WHILE:
+      case TOKEN_PRINT:
+      case TOKEN_RETURN:
+        return;
+      default:
+        ; // Do nothing
+    }
+
+    compiler_advance(compiler);
+  }
+}
+
+// Emitting bytecode
+
+static Chunk* compiler_current_chunk(Compiler* compiler) {
+  return &compiler->function_compiler->function->chunk;
+}
+
+static void compiler_emit_byte(Compiler* compiler, uint8_t byte) {
+  compiler_emit_byte_on_line(compiler, byte, compiler->previous.line);
+}
+
+static void compiler_emit_bytes(Compiler* compiler, uint8_t byte1, uint8_t byte2) {
+  compiler_emit_byte(compiler, byte1);
+  compiler_emit_byte(compiler, byte2);
+}
+
+// Operators and names are emitted on their own line rather than the line
+// of the last token of their operands, like in the Ruby compiler
+static void compiler_emit_byte_on_line(Compiler* compiler, uint8_t byte, int line) {
+  Chunk_write(compiler_current_chunk(compiler), byte, line);
+}
+
+static void compiler_emit_bytes_on_line(Compiler* compiler, uint8_t byte1, uint8_t byte2, int line) {
+  compiler_emit_byte_on_line(compiler, byte1, line);
+  compiler_emit_byte_on_line(compiler, byte2, line);
+}
+
+static int compiler_emit_jump(Compiler* compiler, uint8_t instruction) {
+  compiler_emit_byte(compiler, instruction);
+  compiler_emit_byte(compiler, 0xff);
+  compiler_emit_byte(compiler, 0xff);
+  return compiler_current_chunk(compiler)->count - 2;
+}
+
+static void compiler_patch_jump(Compiler* compiler, int offset) {
+  Chunk* chunk = compiler_current_chunk(compiler);
+  // -2 to adjust for the bytecode for the jump offset itself.
+  int jump = chunk->count - offset - 2;
+
+  if (jump > 0xffff) {
+    compiler_tokenless_compile_error(compiler, compiler->previous.line, "Too much code to jump over.");
+  }
+
+  chunk->code[offset] = (jump >> 8) & 0xff;
+  chunk->code[offset + 1] = jump & 0xff;
+}
+
+// Returns false if the loop is too large, in which case the exit jump of
+// the loop shouldn't be patched, so that only one error is reported
+static bool compiler_emit_loop(Compiler* compiler, int loop_start) {
+  compiler_emit_byte(compiler, OP_LOOP);
+
+  int offset = compiler_current_chunk(compiler)->count - loop_start + 2;
+  if (offset > 0xffff) {
+    compiler_tokenless_compile_error(compiler, compiler->last_statement_line, "Loop body too large.");
+    return false;
+  }
+
+  compiler_emit_byte(compiler, (offset >> 8) & 0xff);
+  compiler_emit_byte(compiler, offset & 0xff);
+  return true;
+}
+
+static void compiler_emit_return(Compiler* compiler) {
+  if (compiler->function_compiler->type == TYPE_INITIALIZER) {
+    compiler_emit_bytes(compiler, OP_GET_LOCAL, 0);
+  } else {
+    compiler_emit_byte(compiler, OP_NIL);
+  }
+  compiler_emit_byte(compiler, OP_RETURN);
+}
+
+static uint8_t compiler_check_constant(Compiler* compiler, Token* token, int constant) {
+  if (constant > UINT8_MAX) {
+    compiler_compile_error_at(compiler, token, "Too many constants in one chunk.");
+    return 0;
+  }
+  return (uint8_t)constant;
+}
+
+static uint8_t compiler_identifier_constant(Compiler* compiler, Token* name) {
+  ObjString* string = Vm_copy_string(compiler->vm, (char*)name->start, name->length);
+  return compiler_check_constant(compiler, name, Chunk_add_object(compiler_current_chunk(compiler), (Obj*)string));
+}
+
+// Method names are given selectors as they are compiled, like in
+// Lox::Bytecode::Compiler#make_selector_constant
+static uint8_t compiler_selector_constant(Compiler* compiler, Token* name) {
+  ObjString* string = Vm_copy_string(compiler->vm, (char*)name->start, name->length);
+  Vm_intern_selector(compiler->vm, string);
+  return compiler_check_constant(compiler, name, Chunk_add_object(compiler_current_chunk(compiler), (Obj*)string));
+}
+
+// Scopes and variables
+
+static void compiler_begin_function(Compiler* compiler, FunctionCompiler* function_compiler, FunctionType type) {
+  function_compiler->enclosing = compiler->function_compiler;
+  // Functions aren't reachable from the VM until they're finished and added
+  // to the constants of the function around them, and the garbage collector
+  // can run at any point while compiling, so each one is a root until then
+  function_compiler->function = Vm_new_function(compiler->vm);
+  MemoryAllocator_push_root(&compiler->vm->memory_allocator, (Obj*)function_compiler->function);
+  function_compiler->type = type;
+  function_compiler->local_count = 0;
+  function_compiler->scope_depth = 0;
+  compiler->function_compiler = function_compiler;
+
+  if (type != TYPE_SCRIPT) {
+    function_compiler->function->name = Vm_copy_string(compiler->vm, (char*)compiler->previous.start, compiler->previous.length);
+  }
+
+  Local* local = &function_compiler->locals[function_compiler->local_count++];
+  local->depth = 0;
+  local->is_captured = false;
+  if (type == TYPE_FUNCTION || type == TYPE_SCRIPT) {
+    local->name = compiler_synthetic_token("", 0);
+  } else {
+    local->name = compiler_synthetic_token("this", 0);
+  }
+}
+
+static ObjFunction* compiler_end_function(Compiler* compiler) {
+  compiler_emit_return(compiler);
+  ObjFunction* function = compiler->function_compiler->function;
+  Peephole_optimize(&function->chunk);
+  Vm_finish_function(function);
+  compiler->function_compiler = compiler->function_compiler->enclosing;
+  MemoryAllocator_pop_root(&compiler->vm->memory_allocator);
+  return function;
+}
+
+static void compiler_begin_scope(Compiler* compiler) {
+  compiler->function_compiler->scope_depth++;
+}
+
+static void compiler_end_scope(Compiler* compiler) {
+  FunctionCompiler* function_compiler = compiler->function_compiler;
+  function_compiler->scope_depth--;
+
+  while (function_compiler->local_count > 0 &&
+         function_compiler->locals[function_compiler->local_count - 1].depth > function_compiler->scope_depth) {
+    if (function_compiler->locals[function_compiler->local_count - 1].is_captured) {
+      compiler_emit_byte(compiler, OP_CLOSE_UPVALUE);
+    } else {
+      compiler_emit_byte(compiler, OP_POP);
+    }
+    function_compiler->local_count--;
+  }
+}
+
+static bool compiler_identifiers_equal(Token* a, Token* b) {
+  if (a->length != b->length) {
+    return false;
+  }
+  return memcmp(a->start, b->start, a->length) == 0;
+}
+
+static Token compiler_synthetic_token(const char* text, int line) {
+  Token token;
+  token.type = TOKEN_IDENTIFIER;
+  token.start = text;
+  token.length = (int)strlen(text);
+  token.line = line;
+  return token;
+}
+
+static void compiler_add_local(Compiler* compiler, Token name) {
+  FunctionCompiler* function_compiler = compiler->function_compiler;
+  if (function_compiler->local_count == MAX_LOCALS) {
+    compiler_compile_error_at(compiler, &name, "Too many local variables in function.");
+    return;
+  }
+
+  Local* local = &function_compiler->locals[function_compiler->local_count++];
+  local->name = name;
+  local->depth = -1;
+  local->is_captured = false;
+}
+
+static void compiler_declare_local(Compiler* compiler) {
+  FunctionCompiler* function_compiler = compiler->function_compiler;
+  Token* name = &compiler->previous;
+  for (int i = function_compiler->local_count - 1; i >= 0; i--) {
+    Local* local = &function_compiler->locals[i];
+    if (local->depth != -1 && local->depth < function_compiler->scope_depth) {
+      break;
+    }
+
+    if (compiler_identifiers_equal(name, &local->name)) {
+      compiler_compile_error_at(compiler, name, "Already a variable with this name in this scope.");
+    }
+  }
+
+  compiler_add_local(compiler, *name);
+}
+
+static void compiler_mark_initialized(Compiler* compiler) {
+  FunctionCompiler* function_compiler = compiler->function_compiler;
+  if (function_compiler->scope_depth == 0) {
+    return;
+  }
+  function_compiler->locals[function_compiler->local_count - 1].depth = function_compiler->scope_depth;
+}
+
+static uint8_t compiler_parse_variable(Compiler* compiler, const char* message) {
+  compiler_consume(compiler, TOKEN_IDENTIFIER, message);
+
+  if (compiler->function_compiler->scope_depth > 0) {
+    compiler_declare_local(compiler);
+    return 0;
+  }
+
+  return compiler_identifier_constant(compiler, &compiler->previous);
+}
+
+static void compiler_define_variable(Compiler* compiler, uint8_t global) {
+  if (compiler->function_compiler->scope_depth > 0) {
+    compiler_mark_initialized(compiler);
+    return;
+  }
+
+  compiler_emit_bytes(compiler, OP_DEFINE_GLOBAL, global);
+}
+
+static int compiler_resolve_local(Compiler* compiler, FunctionCompiler* function_compiler, Token* name) {
+  for (int i = function_compiler->local_count - 1; i >= 0; i--) {
+    Local* local = &function_compiler->locals[i];
+    if (compiler_identifiers_equal(name, &local->name)) {
+      if (local->depth == -1) {
+        compiler_compile_error_at(compiler, name, "Can't read local variable in its own initializer.");
+      }
+      return i;
+    }
+  }
+
+  return -1;
+}
+
+static int compiler_add_upvalue(Compiler* compiler, FunctionCompiler* function_compiler, Token* name, uint8_t index, bool is_local) {
+  int upvalue_count = function_compiler->function->upvalue_count;
+
+  for (int i = 0; i < upvalue_count; i++) {
+    Upvalue* upvalue = &function_compiler->upvalues[i];
+    if (upvalue->index == index && upvalue->is_local == is_local) {
+      return i;
+    }
+  }
+
+  if (upvalue_count == MAX_UPVALUES) {
+    compiler_compile_error_at(compiler, name, "Too many closure variables in function.");
+    return 0;
+  }
+
+  function_compiler->upvalues[upvalue_count].is_local = is_local;
+  function_compiler->upvalues[upvalue_count].index = index;
+  return function_compiler->function->upvalue_count++;
+}
+
+static int compiler_resolve_upvalue(Compiler* compiler, FunctionCompiler* function_compiler, Token* name) {
+  if (function_compiler->enclosing == NULL) {
+    return -1;
+  }
+
+  int local = compiler_resolve_local(compiler, function_compiler->enclosing, name);
+  if (local != -1) {
+    function_compiler->enclosing->locals[local].is_captured = true;
+    return compiler_add_upvalue(compiler, function_compiler, name, (uint8_t)local, true);
+  }
+
+  int upvalue = compiler_resolve_upvalue(compiler, function_compiler->enclosing, name);
+  if (upvalue != -1) {
+    return compiler_add_upvalue(compiler, function_compiler, name, (uint8_t)upvalue, false);
+  }
+
+  return -1;
+}
+
+static void compiler_get_named_variable(Compiler* compiler, Token name) {
+  int arg = compiler_resolve_local(compiler, compiler->function_compiler, &name);
+  if (arg != -1) {
+    compiler_emit_bytes(compiler, OP_GET_LOCAL, (uint8_t)arg);
+  } else if ((arg = compiler_resolve_upvalue(compiler, compiler->function_compiler, &name)) != -1) {
+    compiler_emit_bytes(compiler, OP_GET_UPVALUE, (uint8_t)arg);
+  } else {
+    compiler_emit_bytes(compiler, OP_GET_GLOBAL, compiler_identifier_constant(compiler, &name));
+  }
+}
+
+// Unlike in clox, the variable is resolved after its new value has been
+// compiled, which is the order the Ruby compiler hands out constants and
+// upvalues in.
+static void compiler_set_named_variable(Compiler* compiler, Token name) {
+  int arg = compiler_resolve_local(compiler, compiler->function_compiler, &name);
+  if (arg != -1) {
+    compiler_emit_bytes_on_line(compiler, OP_SET_LOCAL, (uint8_t)arg, name.line);
+  } else if ((arg = compiler_resolve_upvalue(compiler, compiler->function_compiler, &name)) != -1) {
+    compiler_emit_bytes_on_line(compiler, OP_SET_UPVALUE, (uint8_t)arg, name.line);
+  } else {
+    compiler_emit_bytes_on_line(compiler, OP_SET_GLOBAL, compiler_identifier_constant(compiler, &name), name.line);
+  }
+}
+
+// Declarations and statements
+
+static void compiler_declaration(Compiler* compiler) {
+  // The code emitted for a program with syntax errors is thrown away, so
+  // recovering only needs to put the compiler back into a state where it
+  // can keep parsing
+  jmp_buf recovery;
+  jmp_buf* enclosing_recovery = compiler->recovery;
+  FunctionCompiler* function_compiler = compiler->function_compiler;
+  ClassCompiler* class_compiler = compiler->class_compiler;
+  int scope_depth = function_compiler->scope_depth;
+  int local_count = function_compiler->local_count;
+  int root_count = compiler->vm->memory_allocator.root_count;
+  compiler->recovery = &recovery;
+
+  if (setjmp(recovery) == 0) {
+    if (compiler_match(compiler, TOKEN_CLASS)) {
+      compiler_class_declaration(compiler);
+    } else if (compiler_match(compiler, TOKEN_FUN)) {
+      compiler_fun_declaration(compiler);
+    } else if (compiler_match(compiler, TOKEN_VAR)) {
+      compiler_var_declaration(compiler);
+    } else {
+      compiler_statement(compiler);
+    }
+  } else {
+    compiler->function_compiler = function_compiler;
+    compiler->class_compiler = class_compiler;
+    function_compiler->scope_depth = scope_depth;
+    function_compiler->local_count = local_count;
+    // The functions that were being compiled when the error was raised are
+    // abandoned without being ended
+    compiler->vm->memory_allocator.root_count = root_count;
+    compiler_synchronize(compiler);
+  }
+
+  compiler->recovery = enclosing_recovery;
+}
+
+static void compiler_class_declaration(Compiler* compiler) {
+  compiler_consume(compiler, TOKEN_IDENTIFIER, "Expect class name.");
+  Token class_name = compiler->previous;
+  uint8_t name_constant = compiler_identifier_constant(compiler, &compiler->previous);
+  if (compiler->function_compiler->scope_depth > 0) {
+    compiler_declare_local(compiler);
+  }
+
+  compiler_emit_bytes(compiler, OP_CLASS, name_constant);
+  compiler_define_variable(compiler, name_constant);
+
+  ClassCompiler class_compiler;
+  class_compiler.has_superclass = false;
+  class_compiler.enclosing = compiler->class_compiler;
+  compiler->class_compiler = &class_compiler;
+
+  if (compiler_match(compiler, TOKEN_LESS)) {
+    compiler_consume(compiler, TOKEN_IDENTIFIER, "Expect superclass name.");
+    Token superclass_name = compiler->previous;
+    if (compiler_identifiers_equal(&class_name, &superclass_name)) {
+      compiler_compile_error_at(compiler, &superclass_name, "A class can't inherit from itself.");
+    }
+    compiler_get_named_variable(compiler, superclass_name);
+
+    compiler_begin_scope(compiler);
+    compiler_add_local(compiler, compiler_synthetic_token("super", superclass_name.line));
+    compiler_define_variable(compiler, 0);
+
+    compiler_get_named_variable(compiler, class_name);
+    compiler_emit_byte(compiler, OP_INHERIT);
+    class_compiler.has_superclass = true;
+  }
+
+  // Put the class back on the stack
+  compiler_get_named_variable(compiler, class_name);
+  compiler_consume(compiler, TOKEN_LEFT_BRACE, "Expect '{' before class body.");
+  while (!compiler_check(compiler, TOKEN_RIGHT_BRACE) && !compiler_check(compiler, TOKEN_EOF)) {
+    compiler_method(compiler);
+  }
+  compiler_consume(compiler, TOKEN_RIGHT_BRACE, "Expect '}' after class body.");
+
+  // Compacts the dispatch row of the class now that all of its methods are
+  // defined, and pops it
+  compiler_emit_byte(compiler, OP_END_CLASS);
+
+  if (class_compiler.has_superclass) {
+    compiler_end_scope(compiler);
+  }
+
+  compiler->class_compiler = compiler->class_compiler->enclosing;
+}
+
+static void compiler_method(Compiler* compiler) {
+  compiler_consume(compiler, TOKEN_IDENTIFIER, "Expect method name.");
+  uint8_t constant = compiler_selector_constant(compiler, &compiler->previous);
+
+  FunctionType type = TYPE_METHOD;
+  if (compiler->previous.length == 4 && memcmp(compiler->previous.start, "init", 4) == 0) {
+    type = TYPE_INITIALIZER;
+  }
+
+  compiler_function(compiler, type);
+  compiler_emit_bytes(compiler, OP_METHOD, constant);
+}
+
+static void compiler_fun_declaration(Compiler* compiler) {
+  uint8_t global = compiler_parse_variable(compiler, "Expect function name.");
+  // Mark functions as initialized immediately
+  compiler_mark_initialized(compiler);
+  compiler_function(compiler, TYPE_FUNCTION);
+  compiler_define_variable(compiler, global);
+  compiler->last_statement_line = compiler->previous.line;
+}
+
+static void compiler_function(Compiler* compiler, FunctionType type) {
+  const char* kind = type == TYPE_FUNCTION ? "function" : "method";
+  char message[64];
+  Token name = compiler->previous;
+
+  FunctionCompiler function_compiler;
+  compiler_begin_function(compiler, &function_compiler, type);
+  compiler_begin_scope(compiler);
+
+  snprintf(message, sizeof(message), "Expect '(' after %s name.", kind);
+  compiler_consume(compiler, TOKEN_LEFT_PAREN, message);
+  if (!compiler_check(compiler, TOKEN_RIGHT_PAREN)) {
+    do {
+      function_compiler.function->arity++;
+      if (function_compiler.function->arity > 255) {
+        compiler_error_at(compiler, &compiler->current, "Can't have more than 255 parameters.");
+      }
+      uint8_t constant = compiler_parse_variable(compiler, "Expect parameter name.");
+      compiler_define_variable(compiler, constant);
+    } while (compiler_match(compiler, TOKEN_COMMA));
+  }
+  compiler_consume(compiler, TOKEN_RIGHT_PAREN, "Expect ')' after parameters.");
+
+  snprintf(message, sizeof(message), "Expect '{' before %s body.", kind);
+  compiler_consume(compiler, TOKEN_LEFT_BRACE, message);
+  compiler_block(compiler);
+
+  ObjFunction* function = compiler_end_function(compiler);
+  uint8_t constant = compiler_check_constant(compiler, &name, Chunk_add_object(compiler_current_chunk(compiler), (Obj*)function));
+  compiler_emit_bytes_on_line(compiler, OP_CLOSURE, constant, name.line);
+
+  for (int i = 0; i < function->upvalue_count; i++) {
+    compiler_emit_byte_on_line(compiler, function_compiler.upvalues[i].is_local ? CAPTURE_LOCAL : CAPTURE_UPVALUE, name.line);
+    compiler_emit_byte_on_line(compiler, function_compiler.upvalues[i].index, name.line);
+  }
+}
+
+static void compiler_var_declaration(Compiler* compiler) {
+  uint8_t global = compiler_parse_variable(compiler, "Expect variable name.");
+
+  if (compiler_match(compiler, TOKEN_EQUAL)) {
+    compiler_expression(compiler);
+  } else {
+    compiler_emit_byte(compiler, OP_NIL);
+  }
+  compiler_consume(compiler, TOKEN_SEMICOLON, "Expect ';' after variable declaration.");
+
+  compiler_define_variable(compiler, global);
+  compiler->last_statement_line = compiler->previous.line;
+}
+
+static void compiler_statement(Compiler* compiler) {
+  if (compiler_match(compiler, TOKEN_PRINT)) {
+    compiler_print_statement(compiler);
+  } else if (compiler_match(compiler, TOKEN_FOR)) {
+    compiler_for_statement(compiler);
+  } else if (compiler_match(compiler, TOKEN_IF)) {
+    compiler_if_statement(compiler);
+  } else if (compiler_match(compiler, TOKEN_RETURN)) {
+    compiler_return_statement(compiler);
+  } else if (compiler_match(compiler, TOKEN_WHILE)) {
+    compiler_while_statement(compiler);
+  } else if (compiler_match(compiler, TOKEN_LEFT_BRACE)) {
+    compiler_begin_scope(compiler);
+    compiler_block(compiler);
+    compiler_end_scope(compiler);
+  } else {
+    compiler_expression_statement(compiler);
+  }
+}
+
+static void compiler_block(Compiler* compiler) {
+  while (!compiler_check(compiler, TOKEN_RIGHT_BRACE) && !compiler_check(compiler, TOKEN_EOF)) {
+    compiler_declaration(compiler);
+  }
+
+  compiler_consume(compiler, TOKEN_RIGHT_BRACE, "Expect '}' after block.");
+}
+
+static void compiler_expression_statement(Compiler* compiler) {
+  compiler_expression(compiler);
+  compiler_consume(compiler, TOKEN_SEMICOLON, "Expect ';' after expression.");
+  compiler_emit_byte(compiler, OP_POP);
+  compiler->last_statement_line = compiler->previous.line;
+}
+
+// The Ruby parser desugars for loops into while loops whose bodies end with
+// the increment clause, so the increment is skipped over at first and is
+// compiled after the body by rewinding to it.
+static void compiler_for_statement(Compiler* compiler) {
+  compiler_begin_scope(compiler);
+  compiler_consume(compiler, TOKEN_LEFT_PAREN, "Expect '(' after 'for'.");
+  if (compiler_match(compiler, TOKEN_SEMICOLON)) {
+    // No initializer.
+  } else if (compiler_match(compiler, TOKEN_VAR)) {
+    compiler_var_declaration(compiler);
+  } else {
+    compiler_expression_statement(compiler);
+  }
+
+  int loop_start = compiler_current_chunk(compiler)->count;
+  if (compiler_check(compiler, TOKEN_SEMICOLON)) {
+    compiler_emit_byte(compiler, OP_TRUE);
+  } else {
+    compiler_expression(compiler);
+  }
+  compiler_consume(compiler, TOKEN_SEMICOLON, "Expect ';' after loop condition.");
+
+  int exit_jump = compiler_emit_jump(compiler, OP_JUMP_IF_FALSE);
+  compiler_emit_byte(compiler, OP_POP);
+
+  bool has_increment = !compiler_check(compiler, TOKEN_RIGHT_PAREN);
+  CompilerPosition increment = compiler_save_position(compiler);
+  int depth = 0;
+  while (!compiler_check(compiler, TOKEN_EOF) && (depth > 0 || !compiler_check(compiler, TOKEN_RIGHT_PAREN))) {
+    if (compiler_check(compiler, TOKEN_LEFT_PAREN)) {
+      depth++;
+    } else if (compiler_check(compiler, TOKEN_RIGHT_PAREN)) {
+      depth--;
+    }
+    // Scanning errors are reported when the increment is compiled
+    compiler->current = Scanner_scan_token(&compiler->scanner);
+  }
+  compiler_consume(compiler, TOKEN_RIGHT_PAREN, "Expect ')' after for clauses.");
+
+  compiler_begin_scope(compiler);
+  compiler_statement(compiler);
+  if (has_increment) {
+    CompilerPosition after_body = compiler_save_position(compiler);
+    compiler_restore_position(compiler, increment);
+    compiler_for_increment(compiler);
+    compiler_restore_position(compiler, after_body);
+  }
+  compiler_end_scope(compiler);
+
+  if (compiler_emit_loop(compiler, loop_start)) {
+    compiler_patch_jump(compiler, exit_jump);
+  }
+  compiler_emit_byte(compiler, OP_POP);
+  compiler_end_scope(compiler);
+}
+
+// A syntax error in the increment has nothing to recover from once it has
+// been reported, since the rest of the loop has already been parsed
+static void compiler_for_increment(Compiler* compiler) {
+  jmp_buf recovery;
+  jmp_buf* enclosing_recovery = compiler->recovery;
+  compiler->recovery = &recovery;
+
+  if (setjmp(recovery) == 0) {
+    compiler_expression(compiler);
+    compiler_emit_byte(compiler, OP_POP);
+    if (!compiler_check(compiler, TOKEN_RIGHT_PAREN)) {
+      compiler_raise_error_at(compiler, &compiler->current, "Expect ')' after for clauses.");
+    }
+  }
+
+  compiler->recovery = enclosing_recovery;
+}
+
+static void compiler_if_statement(Compiler* compiler) {
+  compiler_consume(compiler, TOKEN_LEFT_PAREN, "Expect '(' after 'if'.");
+  compiler_expression(compiler);
+  compiler_consume(compiler, TOKEN_RIGHT_PAREN, "Expect ')' after if condition.");
+
+  int then_jump = compiler_emit_jump(compiler, OP_JUMP_IF_FALSE);
+  compiler_emit_byte(compiler, OP_POP);
+  compiler_statement(compiler);
+
+  int else_jump = compiler_emit_jump(compiler, OP_JUMP);
+  compiler_patch_jump(compiler, then_jump);
+  compiler_emit_byte(compiler, OP_POP);
+
+  if (compiler_match(compiler, TOKEN_ELSE)) {
+    compiler_statement(compiler);
+  }
+  compiler_patch_jump(compiler, else_jump);
+}
+
+static void compiler_print_statement(Compiler* compiler) {
+  compiler_expression(compiler);
+  compiler_consume(compiler, TOKEN_SEMICOLON, "Expect ';' after value.");
+  compiler_emit_byte(compiler, OP_PRINT);
+  compiler->last_statement_line = compiler->previous.line;
+}
+
+static void compiler_return_statement(Compiler* compiler) {
+  Token keyword = compiler->previous;
+  if (compiler->function_compiler->type == TYPE_SCRIPT) {
+    compiler_compile_error_at(compiler, &keyword, "Can't return from top-level code.");
+  }
+
+  if (compiler_match(compiler, TOKEN_SEMICOLON)) {
+    compiler_emit_return(compiler);
+  } else {
+    if (compiler->function_compiler->type == TYPE_INITIALIZER) {
+      compiler_compile_error_at(compiler, &keyword, "Can't return a value from an initializer.");
+    }
+
+    compiler_expression(compiler);
+    compiler_consume(compiler, TOKEN_SEMICOLON, "Expect ';' after return value.");
+    compiler_emit_byte(compiler, OP_RETURN);
+  }
+  compiler->last_statement_line = compiler->previous.line;
+}
+
+static void compiler_while_statement(Compiler* compiler) {
+  int loop_start = compiler_current_chunk(compiler)->count;
+  compiler_consume(compiler, TOKEN_LEFT_PAREN, "Expect '(' after 'while'.");
+  compiler_expression(compiler);
+  compiler_consume(compiler, TOKEN_RIGHT_PAREN, "Expect ')' after condition.");
+
+  int exit_jump = compiler_emit_jump(compiler, OP_JUMP_IF_FALSE);
+  compiler_emit_byte(compiler, OP_POP);
+  compiler_statement(compiler);
+  if (compiler_emit_loop(compiler, loop_start)) {
+    compiler_patch_jump(compiler, exit_jump);
+  }
+  compiler_emit_byte(compiler, OP_POP);
+}
+
+// Expressions
+
+static void compiler_expression(Compiler* compiler) {
+  compiler_parse_precedence(compiler, PREC_ASSIGNMENT);
+}
+
+static void compiler_parse_precedence(Compiler* compiler, Precedence precedence) {
+  ParseFn prefix_rule = compiler_get_rule(compiler->current.type)->prefix;
+  if (prefix_rule == NULL) {
+    compiler_raise_error_at(compiler, &compiler->current, "Expect expression.");
+  }
+  compiler_advance(compiler);
+
+  bool can_assign = precedence <= PREC_ASSIGNMENT;
+  prefix_rule(compiler, can_assign);
+
+  while (precedence <= compiler_get_rule(compiler->current.type)->precedence) {
+    compiler_advance(compiler);
+    ParseFn infix_rule = compiler_get_rule(compiler->previous.type)->infix;
+    infix_rule(compiler, can_assign);
+  }
+
+  if (can_assign && compiler_match(compiler, TOKEN_EQUAL)) {
+    // Like in the Ruby parser, this doesn't stop the value from being parsed
+    compiler_error_at(compiler, &compiler->previous, "Invalid assignment target.");
+    compiler_expression(compiler);
+  }
+}
+
+static ParseRule* compiler_get_rule(TokenType type) {
+  return &compiler_rules[type];
+}
+
+static uint8_t compiler_argument_list(Compiler* compiler) {
+  uint8_t arg_count = 0;
+  if (!compiler_check(compiler, TOKEN_RIGHT_PAREN)) {
+    do {
+      if (arg_count == 255) {
+        compiler_error_at(compiler, &compiler->current, "Can't have more than 255 arguments.");
+      }
+      compiler_expression(compiler);
+      arg_count++;
+    } while (compiler_match(compiler, TOKEN_COMMA));
+  }
+  compiler_consume(compiler, TOKEN_RIGHT_PAREN, "Expect ')' after arguments.");
+  return arg_count;
+}
+
+static void compiler_validate_super(Compiler* compiler, Token* keyword) {
+  if (compiler->class_compiler == NULL) {
+    compiler_compile_error_at(compiler, keyword, "Can't use 'super' outside of a class.");
+  } else if (!compiler->class_compiler->has_superclass) {
+    compiler_compile_error_at(compiler, keyword, "Can't use 'super' in a class with no superclass.");
+  }
+}
+
+static void compiler_and(Compiler* compiler, bool can_assign) {
+  int end_jump = compiler_emit_jump(compiler, OP_JUMP_IF_FALSE);
+  compiler_emit_byte(compiler, OP_POP);
+  // Left-associative, like the Ruby parser, rather than right-associative
+  // as in clox
+  compiler_parse_precedence(compiler, PREC_AND + 1);
+  compiler_patch_jump(compiler, end_jump);
+}
+
+static void compiler_binary(Compiler* compiler, bool can_assign) {
+  TokenType operator_type = compiler->previous.type;
+  int line = compiler->previous.line;
+  ParseRule* rule = compiler_get_rule(operator_type);
+  compiler_parse_precedence(compiler, (Precedence)(rule->precedence + 1));
+
+  switch (operator_type) {
+    case TOKEN_BANG_EQUAL:
+      compiler_emit_bytes_on_line(compiler, OP_EQUAL, OP_NOT, line);
+      break;
+    case TOKEN_EQUAL_EQUAL:   compiler_emit_byte_on_line(compiler, OP_EQUAL, line); break;
+    case TOKEN_GREATER:       compiler_emit_byte_on_line(compiler, OP_GREATER, line); break;
+    case TOKEN_GREATER_EQUAL:
+      compiler_emit_bytes_on_line(compiler, OP_LESS, OP_NOT, line);
+      break;
+    case TOKEN_LESS:          compiler_emit_byte_on_line(compiler, OP_LESS, line); break;
+    case TOKEN_LESS_EQUAL:
+      compiler_emit_bytes_on_line(compiler, OP_GREATER, OP_NOT, line);
+      break;
+    case TOKEN_PLUS:          compiler_emit_byte_on_line(compiler, OP_ADD, line); break;
+    case TOKEN_MINUS:         compiler_emit_byte_on_line(compiler, OP_SUBTRACT, line); break;
+    case TOKEN_STAR:          compiler_emit_byte_on_line(compiler, OP_MULTIPLY, line); break;
+    case TOKEN_SLASH:         compiler_emit_byte_on_line(compiler, OP_DIVIDE, line); break;
+    default: return; // Unreachable.
+  }
+}
+
+static void compiler_call(Compiler* compiler, bool can_assign) {
+  uint8_t arg_count = compiler_argument_list(compiler);
+  compiler_emit_bytes(compiler, OP_CALL, arg_count);
+}
+
+static void compiler_dot(Compiler* compiler, bool can_assign) {
+  compiler_consume(compiler, TOKEN_IDENTIFIER, "Expect property name after '.'.");
+  Token name = compiler->previous;
+
+  if (can_assign && compiler_match(compiler, TOKEN_EQUAL)) {
+    uint8_t constant = compiler_identifier_constant(compiler, &name);
+    compiler_expression(compiler);
+    compiler_emit_bytes_on_line(compiler, OP_SET_PROPERTY, constant, name.line);
+  } else if (compiler_match(compiler, TOKEN_LEFT_PAREN)) {
+    uint8_t constant = compiler_selector_constant(compiler, &name);
+    uint8_t arg_count = compiler_argument_list(compiler);
+    compiler_emit_bytes_on_line(compiler, OP_INVOKE, constant, name.line);
+    compiler_emit_byte_on_line(compiler, arg_count, name.line);
+  } else {
+    uint8_t constant = compiler_identifier_constant(compiler, &name);
+    compiler_emit_bytes(compiler, OP_GET_PROPERTY, constant);
+  }
+}
+
+static void compiler_grouping(Compiler* compiler, bool can_assign) {
+  compiler_expression(compiler);
+  compiler_consume(compiler, TOKEN_RIGHT_PAREN, "Expect ')' after expression.");
+}
+
+static void compiler_literal(Compiler* compiler, bool can_assign) {
+  switch (compiler->previous.type) {
+    case TOKEN_FALSE: compiler_emit_byte(compiler, OP_FALSE); break;
+    case TOKEN_NIL: compiler_emit_byte(compiler, OP_NIL); break;
+    case TOKEN_TRUE: compiler_emit_byte(compiler, OP_TRUE); break;
+    default: return; // Unreachable.
+  }
+}
+
+static void compiler_number(Compiler* compiler, bool can_assign) {
+  double value = strtod(compiler->previous.start, NULL);
+  uint8_t constant = compiler_check_constant(compiler, &compiler->previous, Chunk_add_number(compiler_current_chunk(compiler), value));
+  compiler_emit_bytes(compiler, OP_CONSTANT, constant);
+}
+
+static void compiler_or(Compiler* compiler, bool can_assign) {
+  int else_jump = compiler_emit_jump(compiler, OP_JUMP_IF_FALSE);
+  int end_jump = compiler_emit_jump(compiler, OP_JUMP);
+
+  compiler_patch_jump(compiler, else_jump);
+  compiler_emit_byte(compiler, OP_POP);
+
+  compiler_parse_precedence(compiler, PREC_OR + 1);
+  compiler_patch_jump(compiler, end_jump);
+}
+
+static void compiler_string(Compiler* compiler, bool can_assign) {
+  // Trim surrounding quotes
+  ObjString* string = Vm_copy_string(compiler->vm, (char*)compiler->previous.start + 1, compiler->previous.length - 2);
+  uint8_t constant = compiler_check_constant(compiler, &compiler->previous, Chunk_add_object(compiler_current_chunk(compiler), (Obj*)string));
+  compiler_emit_bytes(compiler, OP_CONSTANT, constant);
+}
+
+static void compiler_super(Compiler* compiler, bool can_assign) {
+  Token keyword = compiler->previous;
+  compiler_validate_super(compiler, &keyword);
+
+  compiler_consume(compiler, TOKEN_DOT, "Expect '.' after 'super'.");
+  compiler_consume(compiler, TOKEN_IDENTIFIER, "Expect superclass method name.");
+  Token name = compiler->previous;
+  uint8_t constant = compiler_selector_constant(compiler, &name);
+
+  compiler_get_named_variable(compiler, compiler_synthetic_token("this", name.line));
+  if (compiler_match(compiler, TOKEN_LEFT_PAREN)) {
+    uint8_t arg_count = compiler_argument_list(compiler);
+    compiler_get_named_variable(compiler, compiler_synthetic_token("super", name.line));
+    compiler_emit_bytes_on_line(compiler, OP_SUPER_INVOKE, constant, name.line);
+    compiler_emit_byte_on_line(compiler, arg_count, name.line);
+  } else {
+    compiler_get_named_variable(compiler, compiler_synthetic_token("super", name.line));
+    compiler_emit_bytes(compiler, OP_GET_SUPER, constant);
+  }
+}
+
+static void compiler_this(Compiler* compiler, bool can_assign) {
+  if (compiler->class_compiler == NULL) {
+    compiler_compile_error_at(compiler, &compiler->previous, "Can't use 'this' outside of a class.");
+    return;
+  }
+
+  compiler_get_named_variable(compiler, compiler->previous);
+}
+
+static void compiler_unary(Compiler* compiler, bool can_assign) {
+  TokenType operator_type = compiler->previous.type;
+  int line = compiler->previous.line;
+
+  compiler_parse_precedence(compiler, PREC_UNARY);
+
+  switch (operator_type) {
+    case TOKEN_BANG: compiler_emit_byte_on_line(compiler, OP_NOT, line); break;
+    case TOKEN_MINUS: compiler_emit_byte_on_line(compiler, OP_NEGATE, line); break;
+    default: return; // Unreachable.
+  }
+}
+
+static void compiler_variable(Compiler* compiler, bool can_assign) {
+  Token name = compiler->previous;
+  if (can_assign && compiler_match(compiler, TOKEN_EQUAL)) {
+    compiler_expression(compiler);
+    compiler_set_named_variable(compiler, name);
+  } else {
+    compiler_get_named_variable(compiler, name);
+  }
+}
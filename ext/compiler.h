@@ -0,0 +1,16 @@
+#ifndef clox_compiler_h
+#define clox_compiler_h
+
+#include "object.h"
+#include "vm.h"
+
+// Compiles Lox source straight to bytecode in a single pass, without going
+// through the Ruby parser. The bytecode and the error messages are meant to
+// be the same as the ones produced by Lox::Bytecode::Compiler, so any
+// difference between the two is a bug in one of them.
+//
+// Returns NULL if there were any errors, which have already been reported
+// on stderr by the time this returns.
+ObjFunction* Compiler_compile(Vm* vm, const char* source);
+
+#endif
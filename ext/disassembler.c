@@ -0,0 +1,208 @@
+#include <stdio.h>
+
+#include "common.h"
+#include "disassembler.h"
+#include "object.h"
+#include "value.h"
+
+static int disassembler_simple(FILE* stream, const char* name, int offset);
+static int disassembler_byte(FILE* stream, const char* name, Chunk* chunk, int offset);
+static int disassembler_constant(FILE* stream, const char* name, Chunk* chunk, int offset);
+static int disassembler_registers(FILE* stream, const char* name, Chunk* chunk, int offset);
+static int disassembler_register_constant(FILE* stream, const char* name, Chunk* chunk, int offset);
+static int disassembler_jump(FILE* stream, const char* name, int sign, Chunk* chunk, int offset);
+static int disassembler_invoke(FILE* stream, const char* name, Chunk* chunk, int offset);
+static int disassembler_closure(FILE* stream, Chunk* chunk, int offset);
+static void disassembler_quoted_string(FILE* stream, ObjString* string);
+
+void Disassembler_chunk(FILE* stream, Chunk* chunk, const char* name) {
+  fprintf(stream, "[DEBUG] == %s ==\n", name);
+  for (int offset = 0; offset < chunk->count;) {
+    offset = Disassembler_instruction(stream, chunk, offset);
+  }
+}
+
+void Disassembler_log_chunk(Chunk* chunk, const char* name) {
+  Disassembler_chunk(stdout, chunk, name);
+  fflush(stdout);
+}
+
+int Disassembler_instruction(FILE* stream, Chunk* chunk, int offset) {
+  fprintf(stream, "[DEBUG] %04d ", offset);
+  int line = Chunk_get_line(chunk, offset);
+  if (offset > 0 && line == Chunk_get_line(chunk, offset - 1)) {
+    fputs("   | ", stream);
+  } else {
+    fprintf(stream, "%4d ", line);
+  }
+
+  uint8_t instruction = chunk->code[offset];
+  switch (instruction) {
+    case OP_CONSTANT: return disassembler_constant(stream, "OP_CONSTANT", chunk, offset);
+    case OP_NIL: return disassembler_simple(stream, "OP_NIL", offset);
+    case OP_TRUE: return disassembler_simple(stream, "OP_TRUE", offset);
+    case OP_FALSE: return disassembler_simple(stream, "OP_FALSE", offset);
+    case OP_POP: return disassembler_simple(stream, "OP_POP", offset);
+    case OP_GET_LOCAL: return disassembler_byte(stream, "OP_GET_LOCAL", chunk, offset);
+    case OP_SET_LOCAL: return disassembler_byte(stream, "OP_SET_LOCAL", chunk, offset);
+    case OP_STORE_LOCAL: return disassembler_byte(stream, "OP_STORE_LOCAL", chunk, offset);
+    case OP_GET_GLOBAL: return disassembler_constant(stream, "OP_GET_GLOBAL", chunk, offset);
+    case OP_DEFINE_GLOBAL: return disassembler_constant(stream, "OP_DEFINE_GLOBAL", chunk, offset);
+    case OP_SET_GLOBAL: return disassembler_constant(stream, "OP_SET_GLOBAL", chunk, offset);
+    case OP_GET_UPVALUE: return disassembler_byte(stream, "OP_GET_UPVALUE", chunk, offset);
+    case OP_SET_UPVALUE: return disassembler_byte(stream, "OP_SET_UPVALUE", chunk, offset);
+    case OP_GET_CAPTURED: return disassembler_byte(stream, "OP_GET_CAPTURED", chunk, offset);
+    case OP_GET_PROPERTY: return disassembler_constant(stream, "OP_GET_PROPERTY", chunk, offset);
+    case OP_GET_METHOD: return disassembler_constant(stream, "OP_GET_METHOD", chunk, offset);
+    case OP_SET_PROPERTY: return disassembler_constant(stream, "OP_SET_PROPERTY", chunk, offset);
+    case OP_GET_SUPER: return disassembler_constant(stream, "OP_GET_SUPER", chunk, offset);
+    case OP_EQUAL: return disassembler_simple(stream, "OP_EQUAL", offset);
+    case OP_GREATER: return disassembler_simple(stream, "OP_GREATER", offset);
+    case OP_LESS: return disassembler_simple(stream, "OP_LESS", offset);
+    case OP_NOT_EQUAL: return disassembler_simple(stream, "OP_NOT_EQUAL", offset);
+    case OP_NOT_GREATER: return disassembler_simple(stream, "OP_NOT_GREATER", offset);
+    case OP_NOT_LESS: return disassembler_simple(stream, "OP_NOT_LESS", offset);
+    case OP_ADD: return disassembler_simple(stream, "OP_ADD", offset);
+    case OP_SUBTRACT: return disassembler_simple(stream, "OP_SUBTRACT", offset);
+    case OP_MULTIPLY: return disassembler_simple(stream, "OP_MULTIPLY", offset);
+    case OP_DIVIDE: return disassembler_simple(stream, "OP_DIVIDE", offset);
+    case OP_ADD_NUMBERS: return disassembler_simple(stream, "OP_ADD_NUMBERS", offset);
+    case OP_SUBTRACT_NUMBERS: return disassembler_simple(stream, "OP_SUBTRACT_NUMBERS", offset);
+    case OP_MULTIPLY_NUMBERS: return disassembler_simple(stream, "OP_MULTIPLY_NUMBERS", offset);
+    case OP_DIVIDE_NUMBERS: return disassembler_simple(stream, "OP_DIVIDE_NUMBERS", offset);
+    case OP_GREATER_NUMBERS: return disassembler_simple(stream, "OP_GREATER_NUMBERS", offset);
+    case OP_LESS_NUMBERS: return disassembler_simple(stream, "OP_LESS_NUMBERS", offset);
+    case OP_ADD_REGISTERS: return disassembler_registers(stream, "OP_ADD_REGISTERS", chunk, offset);
+    case OP_SUBTRACT_REGISTERS: return disassembler_registers(stream, "OP_SUBTRACT_REGISTERS", chunk, offset);
+    case OP_MULTIPLY_REGISTERS: return disassembler_registers(stream, "OP_MULTIPLY_REGISTERS", chunk, offset);
+    case OP_DIVIDE_REGISTERS: return disassembler_registers(stream, "OP_DIVIDE_REGISTERS", chunk, offset);
+    case OP_GREATER_REGISTERS: return disassembler_registers(stream, "OP_GREATER_REGISTERS", chunk, offset);
+    case OP_LESS_REGISTERS: return disassembler_registers(stream, "OP_LESS_REGISTERS", chunk, offset);
+    case OP_ADD_REGISTER_CONSTANT:
+      return disassembler_register_constant(stream, "OP_ADD_REGISTER_CONSTANT", chunk, offset);
+    case OP_SUBTRACT_REGISTER_CONSTANT:
+      return disassembler_register_constant(stream, "OP_SUBTRACT_REGISTER_CONSTANT", chunk, offset);
+    case OP_MULTIPLY_REGISTER_CONSTANT:
+      return disassembler_register_constant(stream, "OP_MULTIPLY_REGISTER_CONSTANT", chunk, offset);
+    case OP_DIVIDE_REGISTER_CONSTANT:
+      return disassembler_register_constant(stream, "OP_DIVIDE_REGISTER_CONSTANT", chunk, offset);
+    case OP_GREATER_REGISTER_CONSTANT:
+      return disassembler_register_constant(stream, "OP_GREATER_REGISTER_CONSTANT", chunk, offset);
+    case OP_LESS_REGISTER_CONSTANT:
+      return disassembler_register_constant(stream, "OP_LESS_REGISTER_CONSTANT", chunk, offset);
+    case OP_NOT: return disassembler_simple(stream, "OP_NOT", offset);
+    case OP_NEGATE: return disassembler_simple(stream, "OP_NEGATE", offset);
+    case OP_PRINT: return disassembler_simple(stream, "OP_PRINT", offset);
+    case OP_JUMP: return disassembler_jump(stream, "OP_JUMP", 1, chunk, offset);
+    case OP_JUMP_IF_FALSE: return disassembler_jump(stream, "OP_JUMP_IF_FALSE", 1, chunk, offset);
+    case OP_JUMP_IF_TRUE: return disassembler_jump(stream, "OP_JUMP_IF_TRUE", 1, chunk, offset);
+    case OP_LOOP: return disassembler_jump(stream, "OP_LOOP", -1, chunk, offset);
+    case OP_CALL: return disassembler_byte(stream, "OP_CALL", chunk, offset);
+    case OP_INVOKE: return disassembler_invoke(stream, "OP_INVOKE", chunk, offset);
+    case OP_SUPER_INVOKE: return disassembler_invoke(stream, "OP_SUPER_INVOKE", chunk, offset);
+    case OP_CALL_METHOD: return disassembler_invoke(stream, "OP_CALL_METHOD", chunk, offset);
+    case OP_CLOSURE: return disassembler_closure(stream, chunk, offset);
+    case OP_CLOSE_UPVALUE: return disassembler_simple(stream, "OP_CLOSE_UPVALUE", offset);
+    case OP_RETURN: return disassembler_simple(stream, "OP_RETURN", offset);
+    case OP_CLASS: return disassembler_constant(stream, "OP_CLASS", chunk, offset);
+    case OP_INHERIT: return disassembler_simple(stream, "OP_INHERIT", offset);
+    case OP_METHOD: return disassembler_constant(stream, "OP_METHOD", chunk, offset);
+    case OP_END_CLASS: return disassembler_simple(stream, "OP_END_CLASS", offset);
+    default:
+      fprintf(stream, "Unknown opcode %d\n", instruction);
+      return offset + 1;
+  }
+}
+
+static int disassembler_simple(FILE* stream, const char* name, int offset) {
+  fprintf(stream, "%s\n", name);
+  return offset + 1;
+}
+
+static int disassembler_byte(FILE* stream, const char* name, Chunk* chunk, int offset) {
+  fprintf(stream, "%-16s %4d\n", name, chunk->code[offset + 1]);
+  return offset + 2;
+}
+
+// Strings are quoted, so that names can be told apart from string literals
+static int disassembler_constant(FILE* stream, const char* name, Chunk* chunk, int offset) {
+  uint8_t constant_index = chunk->code[offset + 1];
+  Value constant = chunk->constants.values[constant_index];
+  fprintf(stream, "%-16s %4d '", name, constant_index);
+  if (Object_is_string(constant)) {
+    disassembler_quoted_string(stream, Object_as_string(constant));
+  } else {
+    Value_fprint(stream, constant);
+  }
+  fputs("'\n", stream);
+  return offset + 2;
+}
+
+static int disassembler_registers(FILE* stream, const char* name, Chunk* chunk, int offset) {
+  fprintf(stream, "%-16s r%d r%d\n", name, chunk->code[offset + 1], chunk->code[offset + 2]);
+  return offset + 3;
+}
+
+static int disassembler_register_constant(FILE* stream, const char* name, Chunk* chunk, int offset) {
+  uint8_t constant_index = chunk->code[offset + 2];
+  double number = Value_as_number(chunk->constants.values[constant_index]);
+  fprintf(stream, "%-16s r%d %4d '%g'\n", name, chunk->code[offset + 1], constant_index, number);
+  return offset + 3;
+}
+
+static int disassembler_jump(FILE* stream, const char* name, int sign, Chunk* chunk, int offset) {
+  int jump = (chunk->code[offset + 1] << 8) | chunk->code[offset + 2];
+  fprintf(stream, "%-16s %4d -> %d\n", name, offset, offset + 3 + sign * jump);
+  return offset + 3;
+}
+
+static int disassembler_invoke(FILE* stream, const char* name, Chunk* chunk, int offset) {
+  uint8_t constant_index = chunk->code[offset + 1];
+  uint8_t arg_count = chunk->code[offset + 2];
+  fprintf(stream, "%-16s (%d args) %4d '", name, arg_count, constant_index);
+  Value_fprint(stream, chunk->constants.values[constant_index]);
+  fputs("'\n", stream);
+  return offset + 3;
+}
+
+// Followed by a line for each upvalue the closure captures
+static int disassembler_closure(FILE* stream, Chunk* chunk, int offset) {
+  static const char* capture_names[] = { "upvalue", "local", "value" };
+
+  uint8_t constant_index = chunk->code[offset + 1];
+  Value constant = chunk->constants.values[constant_index];
+  fprintf(stream, "%-16s %4d '", "OP_CLOSURE", constant_index);
+  Value_fprint(stream, constant);
+  fputs("'\n", stream);
+  offset += 2;
+
+  ObjFunction* function = Object_as_function(constant);
+  for (int i = 0; i < function->upvalue_count; i++) {
+    uint8_t capture_type = chunk->code[offset];
+    const char* capture_name = capture_type <= CAPTURE_VALUE ? capture_names[capture_type] : "unknown";
+    fprintf(stream, "[DEBUG] %04d      |                     %s %d\n", offset, capture_name, chunk->code[offset + 1]);
+    offset += 2;
+  }
+  return offset;
+}
+
+static void disassembler_quoted_string(FILE* stream, ObjString* string) {
+  fputc('"', stream);
+  for (int i = 0; i < string->length; i++) {
+    unsigned char c = (unsigned char)string->chars[i];
+    switch (c) {
+      case '"': fputs("\\\"", stream); break;
+      case '\\': fputs("\\\\", stream); break;
+      case '\n': fputs("\\n", stream); break;
+      case '\t': fputs("\\t", stream); break;
+      case '\r': fputs("\\r", stream); break;
+      default:
+        if (c < 0x20 || c >= 0x7f) {
+          fprintf(stream, "\\x%02X", c);
+        } else {
+          fputc(c, stream);
+        }
+    }
+  }
+  fputc('"', stream);
+}
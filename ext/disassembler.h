@@ -0,0 +1,20 @@
+#ifndef clox_disassembler_h
+#define clox_disassembler_h
+
+#include <stdio.h>
+
+#include "common.h"
+#include "chunk.h"
+
+// Writes a readable listing of bytecode, one instruction per line, each
+// line starting with "[DEBUG]", its offset and its line in the source.
+// Compilers list the functions they compile with it, and traces list the
+// instructions that run (see trace.h).
+
+void Disassembler_chunk(FILE* stream, Chunk* chunk, const char* name);
+// Lists chunk on stdout, and flushes it
+void Disassembler_log_chunk(Chunk* chunk, const char* name);
+// Returns the offset of the next instruction
+int Disassembler_instruction(FILE* stream, Chunk* chunk, int offset);
+
+#endif
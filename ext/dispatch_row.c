@@ -0,0 +1,168 @@
+#include <string.h>
+
+#include "common.h"
+#include "dispatch_row.h"
+#include "memory_allocator.h"
+#include "object_types.h"
+#include "sealed_table.h"
+
+// Rows shorter than this are never sealed, since they're small anyway
+#define DISPATCH_ROW_MIN_SEALED_COUNT 16
+// Only rows with at most one method in this many slots are worth sealing
+#define DISPATCH_ROW_SEALED_SPARSENESS 4
+
+static bool dispatch_row_is_sealed(DispatchRow* row);
+static void dispatch_row_unseal(DispatchRow* row);
+static void dispatch_row_compact(DispatchRow* row);
+static void dispatch_row_resize(DispatchRow* row, int base, int count);
+
+void DispatchRow_init(DispatchRow* row, MemoryAllocator* memory_allocator) {
+  row->base = 0;
+  row->count = 0;
+  row->capacity = 0;
+  row->methods = NULL;
+  SealedTable_init(&row->sealed, memory_allocator);
+  row->memory_allocator = memory_allocator;
+}
+
+void DispatchRow_free(DispatchRow* row) {
+  MemoryAllocator_free_array(row->memory_allocator, row->methods, sizeof(ObjClosure*), row->capacity);
+  SealedTable_free(&row->sealed);
+  DispatchRow_init(row, row->memory_allocator);
+}
+
+void DispatchRow_set(DispatchRow* row, int selector, ObjClosure* method) {
+  if (dispatch_row_is_sealed(row)) {
+    dispatch_row_unseal(row);
+  }
+
+  if (row->count == 0) {
+    dispatch_row_resize(row, selector, 1);
+  } else if (selector < row->base) {
+    dispatch_row_resize(row, selector, row->base + row->count - selector);
+  } else if (selector >= row->base + row->count) {
+    dispatch_row_resize(row, row->base, selector - row->base + 1);
+  }
+  row->methods[selector - row->base] = method;
+}
+
+// This is how subclasses get the methods of their superclass, which
+// happens before any of their own methods are defined. In that case the
+// whole row can be copied over as-is.
+void DispatchRow_add_all(DispatchRow* from, DispatchRow* to) {
+  if (from->count == 0) {
+    return;
+  }
+
+  if (dispatch_row_is_sealed(from)) {
+    for (int i = 0; i < from->sealed.capacity; i++) {
+      SealedEntry* entry = &from->sealed.entries[i];
+      if (entry->selector != -1) {
+        DispatchRow_set(to, entry->selector, entry->method);
+      }
+    }
+    return;
+  }
+
+  if (to->count == 0) {
+    dispatch_row_resize(to, from->base, from->count);
+    memcpy(to->methods, from->methods, sizeof(ObjClosure*) * from->count);
+    return;
+  }
+
+  for (int i = 0; i < from->count; i++) {
+    if (from->methods[i] != NULL) {
+      DispatchRow_set(to, from->base + i, from->methods[i]);
+    }
+  }
+}
+
+void DispatchRow_seal(DispatchRow* row) {
+  if (dispatch_row_is_sealed(row)) {
+    return;
+  }
+  if (row->count < DISPATCH_ROW_MIN_SEALED_COUNT) {
+    dispatch_row_compact(row);
+    return;
+  }
+
+  int method_count = 0;
+  for (int i = 0; i < row->count; i++) {
+    if (row->methods[i] != NULL) {
+      method_count++;
+    }
+  }
+  if (method_count * DISPATCH_ROW_SEALED_SPARSENESS > row->count || !SealedTable_build(&row->sealed, row->base, row->methods, row->count)) {
+    dispatch_row_compact(row);
+    return;
+  }
+
+  // The table can still come out bigger than the row if the selectors
+  // needed a lot of slots to avoid colliding
+  if (SealedTable_size(&row->sealed) >= sizeof(ObjClosure*) * row->count) {
+    SealedTable_free(&row->sealed);
+    dispatch_row_compact(row);
+    return;
+  }
+  MemoryAllocator_free_array(row->memory_allocator, row->methods, sizeof(ObjClosure*), row->capacity);
+  row->methods = NULL;
+  row->capacity = 0;
+}
+
+static bool dispatch_row_is_sealed(DispatchRow* row) {
+  return row->methods == NULL && row->count > 0;
+}
+
+static void dispatch_row_unseal(DispatchRow* row) {
+  row->methods = (ObjClosure**)MemoryAllocator_allocate(row->memory_allocator, sizeof(ObjClosure*), row->count);
+  row->capacity = row->count;
+  for (int i = 0; i < row->count; i++) {
+    row->methods[i] = NULL;
+  }
+  for (int i = 0; i < row->sealed.capacity; i++) {
+    SealedEntry* entry = &row->sealed.entries[i];
+    if (entry->selector != -1) {
+      row->methods[entry->selector - row->base] = entry->method;
+    }
+  }
+  SealedTable_free(&row->sealed);
+}
+
+// Rows grow with slack while a class is being declared. Once the
+// declaration is finished the spare capacity is given back, since the row
+// is very unlikely to change again.
+static void dispatch_row_compact(DispatchRow* row) {
+  if (row->capacity == row->count) {
+    return;
+  }
+  row->methods = (ObjClosure**)MemoryAllocator_grow_array(row->memory_allocator, row->methods, sizeof(ObjClosure*), row->capacity, row->count);
+  row->capacity = row->count;
+}
+
+static void dispatch_row_resize(DispatchRow* row, int base, int count) {
+  int shift = row->base - base;
+  if (count > row->capacity) {
+    int old_capacity = row->capacity;
+    int capacity = MemoryAllocator_get_increased_capacity(row->memory_allocator, old_capacity);
+    if (capacity < count) {
+      capacity = count;
+    }
+    row->methods = (ObjClosure**)MemoryAllocator_grow_array(row->memory_allocator, row->methods, sizeof(ObjClosure*), old_capacity, capacity);
+    row->capacity = capacity;
+  }
+
+  // Growing downwards means moving the existing methods up to make room
+  if (row->count > 0 && shift > 0) {
+    memmove(row->methods + shift, row->methods, sizeof(ObjClosure*) * row->count);
+    for (int i = 0; i < shift; i++) {
+      row->methods[i] = NULL;
+    }
+  }
+  int first_new = row->count == 0 ? 0 : (shift > 0 ? shift + row->count : row->count);
+  for (int i = first_new; i < count; i++) {
+    row->methods[i] = NULL;
+  }
+
+  row->base = base;
+  row->count = count;
+}
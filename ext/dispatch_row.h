@@ -0,0 +1,53 @@
+#ifndef clox_dispatch_row_h
+#define clox_dispatch_row_h
+
+#include "common.h"
+#include "memory_allocator.h"
+#include "object_types.h"
+#include "sealed_table.h"
+
+// A DispatchRow maps selectors (the dense numbers the VM gives to method
+// names, see Vm_intern_selector) to the methods of a single class. Only the
+// range of selectors between the lowest and highest ones that are actually
+// defined is stored, so a lookup is one subtraction, one bounds check and
+// one load.
+//
+// A class whose methods are spread thinly over a wide range of selectors
+// (one declared after many others, with a few names of its own) would
+// waste most of its row on empty slots. Once the class has been declared,
+// such a row is sealed: its methods are moved into a SealedTable and the
+// array is freed, keeping only the range for the bounds check. Setting a
+// method on a sealed row turns it back into an array.
+
+typedef struct {
+  int base;
+  int count;
+  int capacity;
+  ObjClosure** methods; // NULL if the row is sealed
+  SealedTable sealed;
+  MemoryAllocator* memory_allocator;
+} DispatchRow;
+
+void DispatchRow_init(DispatchRow* row, MemoryAllocator* memory_allocator);
+void DispatchRow_free(DispatchRow* row);
+
+void DispatchRow_set(DispatchRow* row, int selector, ObjClosure* method);
+void DispatchRow_add_all(DispatchRow* from, DispatchRow* to);
+// Called once a class has been declared. Seals the row if that saves
+// memory, and otherwise gives back its spare capacity.
+void DispatchRow_seal(DispatchRow* row);
+
+inline ObjClosure* DispatchRow_get(DispatchRow* row, int selector) {
+  // Casting to unsigned folds the checks for selectors below the base
+  // (including the -1 of names that aren't selectors) into the upper bound
+  uint32_t index = (uint32_t)(selector - row->base);
+  if (index >= (uint32_t)row->count) {
+    return NULL;
+  }
+  if (row->methods == NULL) {
+    return SealedTable_get(&row->sealed, selector);
+  }
+  return row->methods[index];
+}
+
+#endif
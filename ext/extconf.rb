@@ -1,3 +1,16 @@
 require "mkmf"
 
+# main.c is the entry point of the standalone runner, so it's left out of
+# the shared library and linked into lox-native instead
+$srcs = Dir.glob("*.c", base: __dir__).sort - ["main.c"]
+$cleanfiles << "lox-native"
+
 create_makefile "vm"
+
+File.open("Makefile", "a") do |makefile|
+  makefile.puts <<~MAKE
+
+    lox-native: $(OBJS) main.o
+    \t$(CC) -o $@ $(OBJS) main.o $(LDFLAGS) $(LIBS)
+  MAKE
+end
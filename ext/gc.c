@@ -6,21 +6,25 @@
 #include "value.h"
 #include "object.h"
 #include "table.h"
+#include "dispatch_row.h"
+#include "trace.h"
 #include "vm.h"
 #include "gc.h"
 
 #define GC_HEAP_GROW_FACTOR 2
 
-static void gc_mark_protected_objects(Vm* vm);
+static void gc_mark_pushed_roots(Vm* vm);
 static void gc_mark_roots(Vm* vm);
 static void gc_mark_value(Vm* vm, Value value);
 static void gc_mark_object(Vm* vm, Obj* object);
 static void gc_mark_table(Vm* vm, Table* table);
+static void gc_mark_dispatch_row(Vm* vm, DispatchRow* row);
 static void gc_mark_array(Vm* vm, ValueArray* array);
 
 static void gc_trace_references(Vm* vm);
 static void gc_blacken_object(Vm* vm, Obj* object);
 
+static void gc_close_unreachable_fibers(Vm* vm);
 static void gc_remove_white_entries(Table* table);
 
 static void gc_sweep(Vm* vm);
@@ -49,9 +53,12 @@ void Gc_collect(Vm* vm) {
   MemoryAllocator* memory_allocator = &vm->memory_allocator;
   size_t before = memory_allocator->bytes_allocated;
 
-  gc_mark_protected_objects(vm);
+  gc_mark_pushed_roots(vm);
   gc_mark_roots(vm);
   gc_trace_references(vm);
+  if (vm->fiber_count > 0) {
+    gc_close_unreachable_fibers(vm);
+  }
   gc_remove_white_entries(&vm->strings);
   gc_sweep(vm);
 
@@ -69,8 +76,11 @@ void Gc_collect(Vm* vm) {
   }
 }
 
-static void gc_mark_protected_objects(Vm* vm) {
-  gc_mark_object(vm, vm->memory_allocator.protected_object);
+static void gc_mark_pushed_roots(Vm* vm) {
+  MemoryAllocator* memory_allocator = &vm->memory_allocator;
+  for (int i = 0; i < memory_allocator->root_count; i++) {
+    gc_mark_object(vm, memory_allocator->roots[i]);
+  }
 }
 
 static void gc_mark_roots(Vm* vm) {
@@ -86,9 +96,24 @@ static void gc_mark_roots(Vm* vm) {
     gc_mark_object(vm, (Obj*)upvalue);
   }
 
+  // The fibers that resumed the running one are reached through it
+  gc_mark_object(vm, (Obj*)vm->fiber);
+
   gc_mark_table(vm, &vm->globals);
 
+  // The functions a trace has introduced, see Trace
+  if (vm->trace != NULL) {
+    for (int i = 0; i < vm->trace->function_capacity; i++) {
+      gc_mark_object(vm, (Obj*)vm->trace->functions[i].function);
+    }
+  }
+
   gc_mark_object(vm, (Obj*)vm->init_string);
+  gc_mark_value(vm, vm->returned);
+
+  // Method names are kept alive forever, because if one were collected and
+  // interned again it would get a new selector
+  gc_mark_array(vm, &vm->selectors);
 }
 
 static void gc_mark_value(Vm* vm, Value value) {
@@ -98,7 +123,9 @@ static void gc_mark_value(Vm* vm, Value value) {
 }
 
 static void gc_mark_object(Vm* vm, Obj* object) {
-  if (object == NULL || object->is_marked) {
+  // Shared objects only refer to other shared objects, and other VMs may be
+  // looking at them, so they're neither marked nor traced
+  if (object == NULL || object->is_marked || object->is_shared) {
     return;
   }
 
@@ -135,6 +162,18 @@ static void gc_mark_table(Vm* vm, Table* table) {
   }
 }
 
+static void gc_mark_dispatch_row(Vm* vm, DispatchRow* row) {
+  if (row->methods == NULL) {
+    for (int i = 0; i < row->sealed.capacity; i++) {
+      gc_mark_object(vm, (Obj*)row->sealed.entries[i].method);
+    }
+    return;
+  }
+  for (int i = 0; i < row->count; i++) {
+    gc_mark_object(vm, (Obj*)row->methods[i]);
+  }
+}
+
 static void gc_mark_array(Vm* vm, ValueArray* array) {
   for (int i = 0; i < array->count; i++) {
     gc_mark_value(vm, array->values[i]);
@@ -174,14 +213,14 @@ static void gc_blacken_object(Vm* vm, Obj* object) {
       ObjClosure* closure = (ObjClosure*)object;
       gc_mark_object(vm, (Obj*)closure->function);
       for (int i = 0; i < closure->upvalue_count; i++) {
-        gc_mark_object(vm, (Obj*)closure->upvalues[i]);
+        gc_mark_value(vm, closure->upvalues[i]);
       }
       break;
     }
     case OBJ_CLASS: {
       ObjClass* klass = (ObjClass*)object;
       gc_mark_object(vm, (Obj*)klass->name);
-      gc_mark_table(vm, &klass->methods);
+      gc_mark_dispatch_row(vm, &klass->methods);
       break;
     }
     case OBJ_INSTANCE: {
@@ -196,7 +235,45 @@ static void gc_blacken_object(Vm* vm, Obj* object) {
       gc_mark_object(vm, (Obj*)bound_method->method);
       break;
     }
+    case OBJ_FIBER: {
+      // Whichever call stack the fiber holds, its own or its resumer's
+      ObjFiber* fiber = (ObjFiber*)object;
+      gc_mark_object(vm, (Obj*)fiber->closure);
+      gc_mark_object(vm, (Obj*)fiber->caller);
+      for (Value* slot = fiber->stack; slot < fiber->stack_top; slot++) {
+        gc_mark_value(vm, *slot);
+      }
+      for (int i = 0; i < fiber->frame_count; i++) {
+        gc_mark_object(vm, (Obj*)fiber->frames[i].closure);
+      }
+      for (ObjUpvalue* upvalue = fiber->open_upvalues; upvalue != NULL; upvalue = upvalue->next) {
+        gc_mark_object(vm, (Obj*)upvalue);
+      }
+      break;
+    }
+  }
+}
+
+// A suspended fiber that can't be reached can never be resumed, but
+// closures that it made can still be reached with upvalues pointing into
+// its stack. Those are closed before the stack is freed, and the values
+// they close over are kept alive along with them.
+static void gc_close_unreachable_fibers(Vm* vm) {
+  for (Obj* object = vm->objects; object != NULL; object = object->next) {
+    if (object->type != OBJ_FIBER || object->is_marked) {
+      continue;
+    }
+    ObjFiber* fiber = (ObjFiber*)object;
+    for (ObjUpvalue* upvalue = fiber->open_upvalues; upvalue != NULL; upvalue = upvalue->next) {
+      upvalue->closed = *upvalue->location;
+      upvalue->location = &upvalue->closed;
+      if (upvalue->obj.is_marked) {
+        gc_mark_value(vm, upvalue->closed);
+      }
+    }
+    fiber->open_upvalues = NULL;
   }
+  gc_trace_references(vm);
 }
 
 static void gc_remove_white_entries(Table* table) {
@@ -229,6 +306,9 @@ static void gc_sweep(Vm* vm) {
         vm->objects = object;
       }
 
+      if (unreached->type == OBJ_FIBER) {
+        vm->fiber_count--;
+      }
       Object_free(&vm->memory_allocator, unreached);
     }
   }
@@ -259,6 +339,9 @@ static void gc_log_value(Value value) {
     case OBJ_UPVALUE:
       printf("upvalue");
       break;
+    case OBJ_FIBER:
+      printf("fiber");
+      break;
   }
 }
 
@@ -0,0 +1,654 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "common.h"
+#include "binary_file.h"
+#include "bytecode_file.h"
+#include "chunk.h"
+#include "dispatch_row.h"
+#include "gc.h"
+#include "heap_snapshot.h"
+#include "object.h"
+#include "table.h"
+#include "value.h"
+#include "vm.h"
+
+// The payload of a snapshot (see binary_file.h) is
+//
+//   int32 object_count
+//   the shell of each object: its type, and whatever is needed to allocate it
+//   the contents of each object, in the same order
+//   int32 global_count, then each global as a name and a value
+//
+// Objects are referred to by their index, or -1 for NULL. Shells are
+// ordered by type so that a shell only ever refers to shells before it:
+// strings, then natives, functions, closures, classes, instances, upvalues
+// and bound methods. The contents can refer to any object, because all of
+// them have been allocated by the time they are read.
+
+#define HEAP_SNAPSHOT_MAGIC "LOXS"
+
+static const ObjType heap_snapshot_type_order[] = {
+  OBJ_STRING,
+  OBJ_NATIVE,
+  OBJ_FUNCTION,
+  OBJ_CLOSURE,
+  OBJ_CLASS,
+  OBJ_INSTANCE,
+  OBJ_UPVALUE,
+  OBJ_BOUND_METHOD,
+  OBJ_FIBER // Only so that heaps with fibers are turned down
+};
+#define HEAP_SNAPSHOT_TYPE_COUNT ((int)(sizeof(heap_snapshot_type_order) / sizeof(ObjType)))
+
+typedef struct {
+  Obj* object;
+  int index;
+} SnapshotEntry;
+
+typedef struct {
+  BinaryWriter binary;
+  int object_count;
+  Obj** objects;
+  SnapshotEntry* entries; // Sorted by address, for looking up indices
+} SnapshotWriter;
+
+typedef struct {
+  Vm* vm;
+  BinaryReader binary;
+  int object_count;
+  int allocated_count; // Objects whose shells have been read
+  Obj** objects;
+  int* selectors; // The selector of each string, -1 for other objects
+} SnapshotReader;
+
+static void heap_snapshot_collect_objects(SnapshotWriter* writer, Vm* vm);
+static int heap_snapshot_compare_entries(const void* a, const void* b);
+static void heap_snapshot_write_reference(SnapshotWriter* writer, Obj* object);
+static void heap_snapshot_write_value(SnapshotWriter* writer, Value value);
+static void heap_snapshot_write_table(SnapshotWriter* writer, Table* table);
+static bool heap_snapshot_write_shell(SnapshotWriter* writer, Obj* object);
+static void heap_snapshot_write_contents(SnapshotWriter* writer, Obj* object);
+static void heap_snapshot_write_function(SnapshotWriter* writer, ObjFunction* function);
+
+static bool heap_snapshot_load(Vm* vm, const uint8_t* bytes, size_t size);
+static Obj* heap_snapshot_read_reference(SnapshotReader* reader, int type, bool nullable);
+static Value heap_snapshot_read_value(SnapshotReader* reader);
+static bool heap_snapshot_read_table(SnapshotReader* reader, Table* table);
+static Obj* heap_snapshot_read_shell(SnapshotReader* reader, int index);
+static bool heap_snapshot_read_contents(SnapshotReader* reader, Obj* object);
+static bool heap_snapshot_read_function(SnapshotReader* reader, ObjFunction* function);
+static bool heap_snapshot_restore_selectors(SnapshotReader* reader);
+
+// Any type will do when reading a reference
+#define ANY_OBJ_TYPE -1
+
+bool HeapSnapshot_write(Vm* vm, const char* path) {
+  if (vm->frame_count != 0 || vm->open_upvalues != NULL || vm->code_heap != NULL) {
+    return false;
+  }
+
+  Gc_collect(vm);
+
+  SnapshotWriter writer;
+  BinaryWriter_init(&writer.binary, HEAP_SNAPSHOT_MAGIC, HEAP_SNAPSHOT_VERSION);
+  heap_snapshot_collect_objects(&writer, vm);
+
+  bool written = true;
+  BinaryWriter_write_int(&writer.binary, writer.object_count);
+  for (int i = 0; i < writer.object_count && written; i++) {
+    written = heap_snapshot_write_shell(&writer, writer.objects[i]);
+  }
+  for (int i = 0; i < writer.object_count && written; i++) {
+    heap_snapshot_write_contents(&writer, writer.objects[i]);
+  }
+  heap_snapshot_write_table(&writer, &vm->globals);
+
+  written = written && BinaryWriter_save(&writer.binary, path);
+  BinaryWriter_free(&writer.binary);
+  free(writer.objects);
+  free(writer.entries);
+  return written;
+}
+
+bool HeapSnapshot_read(Vm* vm, const char* path) {
+  if (vm->frame_count != 0 || vm->code_heap != NULL) {
+    return false;
+  }
+
+  FILE* file = fopen(path, "rb");
+  if (file == NULL) {
+    return false;
+  }
+
+  fseek(file, 0L, SEEK_END);
+  long file_size = ftell(file);
+  rewind(file);
+  if (file_size <= 0) {
+    fclose(file);
+    return false;
+  }
+
+  uint8_t* bytes = (uint8_t*)malloc(file_size);
+  size_t bytes_read = fread(bytes, 1, file_size, file);
+  fclose(file);
+
+  bool restored = bytes_read == (size_t)file_size && heap_snapshot_load(vm, bytes, bytes_read);
+  free(bytes);
+  return restored;
+}
+
+static void heap_snapshot_collect_objects(SnapshotWriter* writer, Vm* vm) {
+  int count = 0;
+  for (Obj* object = vm->objects; object != NULL; object = object->next) {
+    count++;
+  }
+
+  writer->object_count = count;
+  writer->objects = (Obj**)malloc(sizeof(Obj*) * (count + 1));
+  writer->entries = (SnapshotEntry*)malloc(sizeof(SnapshotEntry) * (count + 1));
+
+  int index = 0;
+  for (int i = 0; i < HEAP_SNAPSHOT_TYPE_COUNT; i++) {
+    for (Obj* object = vm->objects; object != NULL; object = object->next) {
+      if (object->type == heap_snapshot_type_order[i]) {
+        writer->objects[index] = object;
+        writer->entries[index].object = object;
+        writer->entries[index].index = index;
+        index++;
+      }
+    }
+  }
+
+  qsort(writer->entries, count, sizeof(SnapshotEntry), heap_snapshot_compare_entries);
+}
+
+static int heap_snapshot_compare_entries(const void* a, const void* b) {
+  uintptr_t first = (uintptr_t)((const SnapshotEntry*)a)->object;
+  uintptr_t second = (uintptr_t)((const SnapshotEntry*)b)->object;
+  return (first > second) - (first < second);
+}
+
+static void heap_snapshot_write_reference(SnapshotWriter* writer, Obj* object) {
+  if (object == NULL) {
+    BinaryWriter_write_int(&writer->binary, -1);
+    return;
+  }
+
+  SnapshotEntry key = { object, 0 };
+  SnapshotEntry* entry = (SnapshotEntry*)bsearch(&key, writer->entries, writer->object_count, sizeof(SnapshotEntry), heap_snapshot_compare_entries);
+  // Every object is in vm->objects, so this can't fail
+  BinaryWriter_write_int(&writer->binary, entry->index);
+}
+
+static void heap_snapshot_write_value(SnapshotWriter* writer, Value value) {
+  uint8_t type = (uint8_t)value.type;
+  BinaryWriter_write(&writer->binary, &type, sizeof(type));
+
+  switch (value.type) {
+    case VAL_BOOL: {
+      uint8_t boolean = Value_as_boolean(value);
+      BinaryWriter_write(&writer->binary, &boolean, sizeof(boolean));
+      break;
+    }
+    case VAL_NIL:
+      break;
+    case VAL_NUMBER: {
+      double number = Value_as_number(value);
+      BinaryWriter_write(&writer->binary, &number, sizeof(number));
+      break;
+    }
+    case VAL_OBJ:
+      heap_snapshot_write_reference(writer, Value_as_obj(value));
+      break;
+  }
+}
+
+static void heap_snapshot_write_table(SnapshotWriter* writer, Table* table) {
+  int count = 0;
+  for (int i = 0; i < table->capacity; i++) {
+    if (table->entries[i].key != NULL) {
+      count++;
+    }
+  }
+
+  BinaryWriter_write_int(&writer->binary, count);
+  for (int i = 0; i < table->capacity; i++) {
+    Entry* entry = &table->entries[i];
+    if (entry->key != NULL) {
+      heap_snapshot_write_reference(writer, (Obj*)entry->key);
+      heap_snapshot_write_value(writer, entry->value);
+    }
+  }
+}
+
+static bool heap_snapshot_write_shell(SnapshotWriter* writer, Obj* object) {
+  uint8_t type = (uint8_t)object->type;
+  BinaryWriter_write(&writer->binary, &type, sizeof(type));
+
+  switch (object->type) {
+    case OBJ_STRING: {
+      ObjString* string = (ObjString*)object;
+      BinaryWriter_write_int(&writer->binary, string->length);
+      BinaryWriter_write(&writer->binary, string->chars, string->length);
+      BinaryWriter_write_int(&writer->binary, string->selector);
+      return true;
+    }
+    case OBJ_NATIVE: {
+      int index = Vm_native_index(((ObjNative*)object)->function);
+      BinaryWriter_write_int(&writer->binary, index);
+      return index != -1;
+    }
+    case OBJ_FUNCTION: {
+      ObjFunction* function = (ObjFunction*)object;
+      BinaryWriter_write_int(&writer->binary, function->arity);
+      BinaryWriter_write_int(&writer->binary, function->upvalue_count);
+      return true;
+    }
+    case OBJ_CLOSURE:
+      heap_snapshot_write_reference(writer, (Obj*)((ObjClosure*)object)->function);
+      return true;
+    case OBJ_CLASS:
+      heap_snapshot_write_reference(writer, (Obj*)((ObjClass*)object)->name);
+      return true;
+    case OBJ_INSTANCE:
+      heap_snapshot_write_reference(writer, (Obj*)((ObjInstance*)object)->klass);
+      return true;
+    case OBJ_UPVALUE: {
+      // There are no open upvalues while the VM is idle, but make sure
+      ObjUpvalue* upvalue = (ObjUpvalue*)object;
+      return upvalue->location == &upvalue->closed;
+    }
+    case OBJ_BOUND_METHOD:
+      heap_snapshot_write_reference(writer, (Obj*)((ObjBoundMethod*)object)->method);
+      return true;
+    case OBJ_FIBER:
+      // A fiber's call stack points into itself and into code, which
+      // snapshots have no way to refer to
+      return false;
+  }
+
+  return false;
+}
+
+static void heap_snapshot_write_contents(SnapshotWriter* writer, Obj* object) {
+  switch (object->type) {
+    case OBJ_STRING:
+    case OBJ_NATIVE:
+      break;
+    case OBJ_FUNCTION:
+      heap_snapshot_write_function(writer, (ObjFunction*)object);
+      break;
+    case OBJ_CLOSURE: {
+      ObjClosure* closure = (ObjClosure*)object;
+      for (int i = 0; i < closure->upvalue_count; i++) {
+        heap_snapshot_write_value(writer, closure->upvalues[i]);
+      }
+      break;
+    }
+    case OBJ_CLASS: {
+      DispatchRow* methods = &((ObjClass*)object)->methods;
+      BinaryWriter_write_int(&writer->binary, methods->base);
+      BinaryWriter_write_int(&writer->binary, methods->count);
+      for (int i = 0; i < methods->count; i++) {
+        heap_snapshot_write_reference(writer, (Obj*)DispatchRow_get(methods, methods->base + i));
+      }
+      break;
+    }
+    case OBJ_INSTANCE:
+      heap_snapshot_write_table(writer, &((ObjInstance*)object)->fields);
+      break;
+    case OBJ_UPVALUE:
+      heap_snapshot_write_value(writer, ((ObjUpvalue*)object)->closed);
+      break;
+    case OBJ_BOUND_METHOD:
+      heap_snapshot_write_value(writer, ((ObjBoundMethod*)object)->receiver);
+      break;
+    case OBJ_FIBER:
+      break;
+  }
+}
+
+// The lines are written as a line and the number of bytes on it, the way
+// Chunk_write_bytes takes them
+static void heap_snapshot_write_function(SnapshotWriter* writer, ObjFunction* function) {
+  Chunk* chunk = &function->chunk;
+  heap_snapshot_write_reference(writer, (Obj*)function->name);
+
+  BinaryWriter_write_int(&writer->binary, chunk->constants.count);
+  for (int i = 0; i < chunk->constants.count; i++) {
+    heap_snapshot_write_value(writer, chunk->constants.values[i]);
+  }
+
+  BinaryWriter_write_int(&writer->binary, chunk->count);
+  BinaryWriter_write(&writer->binary, chunk->code, chunk->count);
+
+  BinaryWriter_write_int(&writer->binary, chunk->line_run_count);
+  for (int i = 0; i < chunk->line_run_count; i++) {
+    int end = i + 1 < chunk->line_run_count ? chunk->line_runs[i + 1].offset : chunk->count;
+    BinaryWriter_write_int(&writer->binary, chunk->line_runs[i].line);
+    BinaryWriter_write_int(&writer->binary, end - chunk->line_runs[i].offset);
+  }
+}
+
+static bool heap_snapshot_load(Vm* vm, const uint8_t* bytes, size_t size) {
+  SnapshotReader reader;
+  reader.vm = vm;
+  if (!BinaryReader_init(&reader.binary, bytes, size, HEAP_SNAPSHOT_MAGIC, HEAP_SNAPSHOT_VERSION)) {
+    return false;
+  }
+
+  // Every object needs at least a byte for its type
+  reader.object_count = BinaryReader_read_count(&reader.binary, sizeof(uint8_t));
+  reader.allocated_count = 0;
+  reader.objects = (Obj**)malloc(sizeof(Obj*) * (reader.object_count + 1));
+  reader.selectors = (int*)malloc(sizeof(int) * (reader.object_count + 1));
+
+  // None of the objects are reachable until the globals are restored
+  bool gc_enabled = vm->memory_allocator.gc_enabled;
+  vm->memory_allocator.gc_enabled = false;
+
+  bool valid = !reader.binary.had_error;
+  for (int i = 0; i < reader.object_count && valid; i++) {
+    reader.objects[i] = heap_snapshot_read_shell(&reader, i);
+    valid = reader.objects[i] != NULL;
+    reader.allocated_count++;
+  }
+  for (int i = 0; i < reader.object_count && valid; i++) {
+    valid = heap_snapshot_read_contents(&reader, reader.objects[i]);
+  }
+  // Functions can only be validated once the functions in their constants
+  // have been read as well
+  for (int i = 0; i < reader.object_count && valid; i++) {
+    if (reader.objects[i]->type == OBJ_FUNCTION) {
+      valid = BytecodeFile_validate_function((ObjFunction*)reader.objects[i]);
+      if (valid) {
+        Vm_finish_function((ObjFunction*)reader.objects[i]);
+      }
+    }
+  }
+
+  // The globals are read into a table of their own so that the VM's aren't
+  // touched until everything has been read
+  Table globals;
+  Table_init(&globals, &vm->memory_allocator);
+  valid = valid && heap_snapshot_read_table(&reader, &globals);
+  valid = valid && BinaryReader_is_at_end(&reader.binary);
+  valid = valid && heap_snapshot_restore_selectors(&reader);
+  if (valid) {
+    Table_add_all(&globals, &vm->globals);
+  }
+  Table_free(&globals);
+
+  vm->memory_allocator.gc_enabled = gc_enabled;
+  free(reader.objects);
+  free(reader.selectors);
+  return valid;
+}
+
+static Obj* heap_snapshot_read_reference(SnapshotReader* reader, int type, bool nullable) {
+  int32_t index = BinaryReader_read_int(&reader->binary);
+  if (reader->binary.had_error) {
+    return NULL;
+  }
+  if (index == -1 && nullable) {
+    return NULL;
+  }
+
+  if (index < 0 || index >= reader->allocated_count || (type != ANY_OBJ_TYPE && reader->objects[index]->type != (ObjType)type)) {
+    reader->binary.had_error = true;
+    return NULL;
+  }
+  return reader->objects[index];
+}
+
+static Value heap_snapshot_read_value(SnapshotReader* reader) {
+  const uint8_t* type = BinaryReader_read(&reader->binary, sizeof(uint8_t));
+  if (type == NULL) {
+    return Value_make_nil();
+  }
+
+  switch (*type) {
+    case VAL_BOOL: {
+      const uint8_t* boolean = BinaryReader_read(&reader->binary, sizeof(uint8_t));
+      return Value_make_boolean(boolean != NULL && *boolean != 0);
+    }
+    case VAL_NIL:
+      return Value_make_nil();
+    case VAL_NUMBER: {
+      const uint8_t* bytes = BinaryReader_read(&reader->binary, sizeof(double));
+      double number = 0;
+      if (bytes != NULL) {
+        memcpy(&number, bytes, sizeof(number));
+      }
+      return Value_make_number(number);
+    }
+    case VAL_OBJ: {
+      Obj* object = heap_snapshot_read_reference(reader, ANY_OBJ_TYPE, false);
+      return object == NULL ? Value_make_nil() : Value_make_obj(object);
+    }
+  }
+
+  reader->binary.had_error = true;
+  return Value_make_nil();
+}
+
+static bool heap_snapshot_read_table(SnapshotReader* reader, Table* table) {
+  int32_t count = BinaryReader_read_count(&reader->binary, sizeof(int32_t));
+  for (int i = 0; i < count && !reader->binary.had_error; i++) {
+    ObjString* key = (ObjString*)heap_snapshot_read_reference(reader, OBJ_STRING, false);
+    Value value = heap_snapshot_read_value(reader);
+    if (key != NULL) {
+      Table_set(table, key, value);
+    }
+  }
+  return !reader->binary.had_error;
+}
+
+static Obj* heap_snapshot_read_shell(SnapshotReader* reader, int index) {
+  MemoryAllocator* memory_allocator = &reader->vm->memory_allocator;
+  const uint8_t* type = BinaryReader_read(&reader->binary, sizeof(uint8_t));
+  if (type == NULL) {
+    return NULL;
+  }
+
+  reader->selectors[index] = -1;
+  switch (*type) {
+    case OBJ_STRING: {
+      int32_t length = BinaryReader_read_count(&reader->binary, sizeof(char));
+      const uint8_t* chars = BinaryReader_read(&reader->binary, length);
+      reader->selectors[index] = BinaryReader_read_int(&reader->binary);
+      if (reader->binary.had_error) {
+        return NULL;
+      }
+      return (Obj*)Vm_copy_string(reader->vm, (char*)chars, length);
+    }
+    case OBJ_NATIVE: {
+      NativeFn function = Vm_native_at(BinaryReader_read_int(&reader->binary));
+      if (function == NULL) {
+        return NULL;
+      }
+      return (Obj*)Object_allocate_new_native(memory_allocator, function);
+    }
+    case OBJ_FUNCTION: {
+      int32_t arity = BinaryReader_read_int(&reader->binary);
+      int32_t upvalue_count = BinaryReader_read_int(&reader->binary);
+      if (reader->binary.had_error || arity < 0 || arity > 255 || upvalue_count < 0 || upvalue_count > 256) {
+        return NULL;
+      }
+      ObjFunction* function = Vm_new_function(reader->vm);
+      function->arity = arity;
+      function->upvalue_count = upvalue_count;
+      return (Obj*)function;
+    }
+    case OBJ_CLOSURE: {
+      ObjFunction* function = (ObjFunction*)heap_snapshot_read_reference(reader, OBJ_FUNCTION, false);
+      if (function == NULL) {
+        return NULL;
+      }
+      return (Obj*)Object_allocate_new_closure(memory_allocator, function);
+    }
+    case OBJ_CLASS: {
+      ObjString* name = (ObjString*)heap_snapshot_read_reference(reader, OBJ_STRING, false);
+      if (name == NULL) {
+        return NULL;
+      }
+      return (Obj*)Object_allocate_new_class(memory_allocator, name);
+    }
+    case OBJ_INSTANCE: {
+      ObjClass* klass = (ObjClass*)heap_snapshot_read_reference(reader, OBJ_CLASS, false);
+      if (klass == NULL) {
+        return NULL;
+      }
+      return (Obj*)Object_allocate_new_instance(memory_allocator, klass);
+    }
+    case OBJ_UPVALUE: {
+      ObjUpvalue* upvalue = Object_allocate_new_upvalue(memory_allocator, NULL);
+      upvalue->location = &upvalue->closed;
+      return (Obj*)upvalue;
+    }
+    case OBJ_BOUND_METHOD: {
+      ObjClosure* method = (ObjClosure*)heap_snapshot_read_reference(reader, OBJ_CLOSURE, false);
+      if (method == NULL) {
+        return NULL;
+      }
+      return (Obj*)Object_allocate_new_bound_method(memory_allocator, Value_make_nil(), method);
+    }
+  }
+
+  return NULL;
+}
+
+static bool heap_snapshot_read_contents(SnapshotReader* reader, Obj* object) {
+  switch (object->type) {
+    case OBJ_STRING:
+    case OBJ_NATIVE:
+      break;
+    case OBJ_FUNCTION:
+      return heap_snapshot_read_function(reader, (ObjFunction*)object);
+    case OBJ_CLOSURE: {
+      ObjClosure* closure = (ObjClosure*)object;
+      for (int i = 0; i < closure->upvalue_count; i++) {
+        closure->upvalues[i] = heap_snapshot_read_value(reader);
+      }
+      break;
+    }
+    case OBJ_CLASS: {
+      DispatchRow* methods = &((ObjClass*)object)->methods;
+      int32_t base = BinaryReader_read_int(&reader->binary);
+      int32_t count = BinaryReader_read_count(&reader->binary, sizeof(int32_t));
+      if (base < 0 || base > reader->object_count) {
+        return false;
+      }
+      for (int i = 0; i < count && !reader->binary.had_error; i++) {
+        ObjClosure* method = (ObjClosure*)heap_snapshot_read_reference(reader, OBJ_CLOSURE, true);
+        if (method != NULL) {
+          DispatchRow_set(methods, base + i, method);
+        }
+      }
+      DispatchRow_seal(methods);
+      break;
+    }
+    case OBJ_INSTANCE:
+      return heap_snapshot_read_table(reader, &((ObjInstance*)object)->fields);
+    case OBJ_UPVALUE:
+      ((ObjUpvalue*)object)->closed = heap_snapshot_read_value(reader);
+      break;
+    case OBJ_BOUND_METHOD:
+      ((ObjBoundMethod*)object)->receiver = heap_snapshot_read_value(reader);
+      break;
+    case OBJ_FIBER:
+      break;
+  }
+
+  return !reader->binary.had_error;
+}
+
+static bool heap_snapshot_read_function(SnapshotReader* reader, ObjFunction* function) {
+  Chunk* chunk = &function->chunk;
+  function->name = (ObjString*)heap_snapshot_read_reference(reader, OBJ_STRING, true);
+
+  int32_t constant_count = BinaryReader_read_count(&reader->binary, sizeof(uint8_t));
+  for (int i = 0; i < constant_count && !reader->binary.had_error; i++) {
+    ValueArray_write(&chunk->constants, heap_snapshot_read_value(reader));
+  }
+
+  int32_t count = BinaryReader_read_count(&reader->binary, sizeof(uint8_t));
+  const uint8_t* code = BinaryReader_read(&reader->binary, count);
+  int32_t line_run_count = BinaryReader_read_count(&reader->binary, 2 * sizeof(int32_t));
+  if (reader->binary.had_error || count == 0 || line_run_count == 0) {
+    return false;
+  }
+
+  int* line_runs = (int*)malloc(sizeof(int) * 2 * line_run_count);
+  int total = 0;
+  for (int i = 0; i < line_run_count * 2; i += 2) {
+    line_runs[i] = BinaryReader_read_int(&reader->binary);
+    line_runs[i + 1] = BinaryReader_read_int(&reader->binary);
+    if (line_runs[i + 1] <= 0 || line_runs[i + 1] > count - total) {
+      reader->binary.had_error = true;
+      break;
+    }
+    total += line_runs[i + 1];
+  }
+
+  bool valid = !reader->binary.had_error && total == count;
+  if (valid) {
+    Chunk_write_bytes(chunk, (uint8_t*)code, count, line_runs, line_run_count);
+  }
+  free(line_runs);
+  return valid;
+}
+
+// Method names have to get the same selectors as they had before, since
+// the dispatch rows of the classes are indexed by them. Every selector has
+// to be taken by exactly one string.
+static bool heap_snapshot_restore_selectors(SnapshotReader* reader) {
+  Vm* vm = reader->vm;
+  int selector_count = 0;
+  for (int i = 0; i < reader->object_count; i++) {
+    if (reader->selectors[i] != -1) {
+      selector_count++;
+    }
+  }
+
+  ObjString** names = (ObjString**)calloc(selector_count + 1, sizeof(ObjString*));
+  bool valid = true;
+  for (int i = 0; i < reader->object_count && valid; i++) {
+    int selector = reader->selectors[i];
+    if (selector == -1) {
+      continue;
+    }
+    ObjString* name = (ObjString*)reader->objects[i];
+    // The same string can't appear twice, since strings are interned, but
+    // a corrupt snapshot could still try
+    valid = selector >= 0 && selector < selector_count && names[selector] == NULL && name->selector != -2;
+    if (valid) {
+      names[selector] = name;
+      name->selector = -2;
+    }
+  }
+
+  // Undoes the marking above, and gives the VM's method names that aren't
+  // in the snapshot their selectors back if the snapshot is rejected
+  for (int i = 0; i < selector_count; i++) {
+    if (names[i] != NULL) {
+      names[i]->selector = -1;
+    }
+  }
+  for (int i = 0; i < vm->selectors.count; i++) {
+    Object_as_string(vm->selectors.values[i])->selector = valid ? -1 : i;
+  }
+
+  if (valid) {
+    vm->selectors.count = 0;
+    for (int i = 0; i < selector_count; i++) {
+      names[i]->selector = i;
+      ValueArray_write(&vm->selectors, Value_make_obj((Obj*)names[i]));
+    }
+  }
+
+  free(names);
+  return valid;
+}
@@ -0,0 +1,37 @@
+#ifndef clox_heap_snapshot_h
+#define clox_heap_snapshot_h
+
+#include "common.h"
+#include "vm.h"
+
+// A heap snapshot saves everything that a VM has built up by running
+// scripts: every live object, the globals, and the selectors of method
+// names. A new VM can be restored from the snapshot and then go on to run
+// other scripts as if it had run the same ones, without compiling or
+// running anything. This is meant for initialization scripts that declare
+// classes and fill in tables, so that every process doesn't have to.
+//
+// Objects refer to each other by their index in the snapshot rather than
+// by their address, and natives by their index in the VM's list of natives
+// (see Vm_native_index). Like bytecode files, snapshots are meant to be
+// read on the machine that wrote them.
+//
+// Bump the version whenever the format, the objects or the opcodes change.
+#define HEAP_SNAPSHOT_VERSION 7
+
+// Snapshots can only be taken while the VM isn't running anything, since
+// call frames and the stack aren't saved. Garbage is collected first so
+// that it doesn't end up in the snapshot. VMs that share a code heap (see
+// Vm_init_shared) can't be snapshotted, since the objects they refer to
+// aren't theirs, and neither can heaps with fibers in them. Returns false
+// if the VM is busy, shares a code heap or has fibers, or the file couldn't
+// be written.
+bool HeapSnapshot_write(Vm* vm, const char* path);
+
+// Restores a snapshot into a VM that hasn't run anything yet and doesn't
+// share a code heap. Returns false if the file doesn't exist or isn't
+// valid, in which case the VM is left as it was, apart from some garbage.
+// Functions are validated the same way as the ones in bytecode files.
+bool HeapSnapshot_read(Vm* vm, const char* path);
+
+#endif
@@ -0,0 +1,640 @@
+#include <math.h>
+#include <pthread.h>
+#include <sched.h>
+#include <stdatomic.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "common.h"
+#include "dispatch_row.h"
+#include "isolate.h"
+#include "memory_allocator.h"
+#include "object.h"
+#include "table.h"
+#include "value.h"
+#include "vm.h"
+
+typedef enum {
+  MESSAGE_NIL,
+  MESSAGE_BOOLEAN,
+  MESSAGE_NUMBER,
+  MESSAGE_STRING,
+  MESSAGE_FUNCTION,
+  MESSAGE_CLASS
+} MessageType;
+
+// A value on its way from one heap to another. Strings are copied out of
+// the sender's heap, and functions are in the code heap both isolates share.
+// Classes are sent as their name and the functions of their methods, indexed
+// by selector from base like their dispatch row, since the names are in the
+// code heap too and so have the same selectors in every isolate.
+typedef struct Message {
+  _Atomic(struct Message*) next;
+  MessageType type;
+  union {
+    bool boolean;
+    double number;
+    struct {
+      char* chars;
+      int length;
+    } string;
+    ObjFunction* function;
+    struct {
+      ObjString* name;
+      int base;
+      int count;
+      ObjFunction** methods; // NULL where the class has no method
+    } klass;
+  } as;
+} Message;
+
+// Dmitry Vyukov's intrusive multiple-producer, single-consumer queue.
+// Senders swap their message in as the head and then link the previous head
+// to it, while the receiver takes messages from the tail. The stub keeps
+// the queue from ever being empty, so senders never touch the messages the
+// receiver is taking. A sender that has swapped itself in but not linked
+// its message yet makes the queue look empty for a moment, which receive()
+// copes with by waiting.
+typedef struct {
+  _Atomic(Message*) head;
+  Message* tail;
+  Message stub;
+  atomic_bool waiting; // Set while the receiver sleeps on arrived
+  bool closed; // Set once nothing should wait for messages anymore, under lock
+  pthread_mutex_t lock;
+  pthread_cond_t arrived;
+} Mailbox;
+
+struct Isolate {
+  IsolateGroup* group;
+  int number;
+  Vm* vm; // Freed as soon as the isolate finishes, apart from isolate 0's
+  ObjFunction* function;
+  pthread_t thread;
+  bool started; // False for isolate 0, and if the thread couldn't be created
+  Mailbox mailbox;
+  pthread_mutex_t lock;
+  pthread_cond_t finished_condition;
+  bool finished;
+  bool failed;
+  Message returned; // What the function returned, once the isolate has finished
+};
+
+struct IsolateGroup {
+  Vm* code_heap;
+  // Numbers are handed out by incrementing the count, and each isolate is
+  // stored under its number once it has been set up
+  atomic_int count;
+  _Atomic(Isolate*) isolates[ISOLATES_MAX];
+  // Set once the script has finished, so that isolates spawned after that
+  // close their mailboxes themselves
+  atomic_bool closed;
+};
+
+static Isolate* isolate_new(IsolateGroup* group, int number, Vm* vm);
+static Isolate* isolate_group_wait_for(IsolateGroup* group, int number);
+static void isolate_free(Isolate* isolate);
+static void* isolate_run(void* argument);
+static void isolate_define_natives(Vm* vm);
+static Isolate* isolate_current(Vm* vm);
+static Isolate* isolate_find(Vm* vm, Value number);
+static bool isolate_check_arity(Vm* vm, int expected, int arg_count);
+static bool isolate_pack(Vm* vm, Value value, Message* message);
+static bool isolate_pack_class(ObjClass* klass, Message* message);
+static Value isolate_unpack(Vm* vm, Message* message);
+static void isolate_free_message(Message* message);
+
+static void mailbox_init(Mailbox* mailbox);
+static void mailbox_free(Mailbox* mailbox);
+static void mailbox_push(Mailbox* mailbox, Message* message);
+static void mailbox_enqueue(Mailbox* mailbox, Message* message);
+static Message* mailbox_pop(Mailbox* mailbox);
+static Message* mailbox_wait(Mailbox* mailbox);
+static void mailbox_close(Mailbox* mailbox);
+
+IsolateGroup* IsolateGroup_new(Vm* vm) {
+  IsolateGroup* group = malloc(sizeof(IsolateGroup));
+  if (group == NULL) {
+    return NULL;
+  }
+  group->code_heap = vm->code_heap;
+  atomic_init(&group->count, 1);
+  atomic_init(&group->closed, false);
+  for (int i = 0; i < ISOLATES_MAX; i++) {
+    atomic_init(&group->isolates[i], NULL);
+  }
+
+  Isolate* isolate = isolate_new(group, 0, vm);
+  if (isolate == NULL) {
+    free(group);
+    return NULL;
+  }
+  atomic_store(&group->isolates[0], isolate);
+  vm->isolate = isolate;
+  isolate_define_natives(vm);
+  return group;
+}
+
+void IsolateGroup_free(IsolateGroup* group) {
+  // Isolates that are waiting for a message could otherwise wait forever,
+  // for instance when the script stopped at a runtime error before sending
+  // it, so every mailbox is closed before any isolate is waited for
+  atomic_store(&group->closed, true);
+  for (int i = 1; i < atomic_load(&group->count) && i < ISOLATES_MAX; i++) {
+    mailbox_close(&isolate_group_wait_for(group, i)->mailbox);
+  }
+
+  // Running isolates can still be spawning others, so the count is read
+  // again after each one has finished
+  for (int i = 1; i < atomic_load(&group->count) && i < ISOLATES_MAX; i++) {
+    Isolate* isolate = isolate_group_wait_for(group, i);
+    if (isolate->started) {
+      pthread_join(isolate->thread, NULL);
+    }
+    isolate_free(isolate);
+  }
+
+  Isolate* main_isolate = atomic_load(&group->isolates[0]);
+  main_isolate->vm->isolate = NULL;
+  isolate_free(main_isolate);
+  free(group);
+}
+
+// Isolates are stored under their number a moment after it's handed out
+static Isolate* isolate_group_wait_for(IsolateGroup* group, int number) {
+  Isolate* isolate;
+  while ((isolate = atomic_load(&group->isolates[number])) == NULL) {
+    sched_yield();
+  }
+  return isolate;
+}
+
+// Globals are looked up by name, so a function can only call the natives if
+// it has one of their names among its constants
+bool IsolateGroup_is_needed_by(ObjFunction* function) {
+  static const char* natives[] = {"spawn", "send", "receive", "join"};
+  ValueArray* constants = &function->chunk.constants;
+  for (int i = 0; i < constants->count; i++) {
+    Value constant = constants->values[i];
+    if (Object_is_function(constant) && IsolateGroup_is_needed_by(Object_as_function(constant))) {
+      return true;
+    }
+    if (!Object_is_string(constant)) {
+      continue;
+    }
+    for (size_t j = 0; j < sizeof(natives) / sizeof(natives[0]); j++) {
+      if (strcmp(Object_as_cstring(constant), natives[j]) == 0) {
+        return true;
+      }
+    }
+  }
+  return false;
+}
+
+static Isolate* isolate_new(IsolateGroup* group, int number, Vm* vm) {
+  Isolate* isolate = malloc(sizeof(Isolate));
+  if (isolate == NULL) {
+    return NULL;
+  }
+  isolate->group = group;
+  isolate->number = number;
+  isolate->vm = vm;
+  isolate->function = NULL;
+  isolate->started = false;
+  mailbox_init(&isolate->mailbox);
+  pthread_mutex_init(&isolate->lock, NULL);
+  pthread_cond_init(&isolate->finished_condition, NULL);
+  isolate->finished = false;
+  isolate->failed = false;
+  isolate->returned.type = MESSAGE_NIL;
+  return isolate;
+}
+
+static void isolate_free(Isolate* isolate) {
+  mailbox_free(&isolate->mailbox);
+  pthread_mutex_destroy(&isolate->lock);
+  pthread_cond_destroy(&isolate->finished_condition);
+  isolate_free_message(&isolate->returned);
+  free(isolate);
+}
+
+static void* isolate_run(void* argument) {
+  Isolate* isolate = (Isolate*)argument;
+  Vm* vm = isolate->vm;
+  bool failed = Vm_interpret(vm, isolate->function) != INTERPRET_OK ||
+                !isolate_pack(vm, vm->returned, &isolate->returned);
+  Vm_free(vm);
+  free(vm);
+  isolate->vm = NULL;
+
+  pthread_mutex_lock(&isolate->lock);
+  isolate->finished = true;
+  isolate->failed = failed;
+  pthread_cond_broadcast(&isolate->finished_condition);
+  pthread_mutex_unlock(&isolate->lock);
+  return NULL;
+}
+
+static bool isolate_spawn_native(Vm* vm, int arg_count, Value* args, Value* result) {
+  Isolate* parent = isolate_current(vm);
+  if (parent == NULL || !isolate_check_arity(vm, 1, arg_count)) {
+    return false;
+  }
+  ObjClosure* closure = Object_is_closure(args[0]) ? Object_as_closure(args[0]) : NULL;
+  if (closure == NULL || closure->upvalue_count != 0 || !closure->function->obj.is_shared) {
+    Vm_runtime_error(vm, "Can only spawn functions that don't capture variables.");
+    return false;
+  }
+  if (closure->function->arity != 0) {
+    Vm_runtime_error(vm, "Can only spawn functions that take no arguments.");
+    return false;
+  }
+
+  IsolateGroup* group = parent->group;
+  int number = atomic_fetch_add(&group->count, 1);
+  if (number >= ISOLATES_MAX) {
+    Vm_runtime_error(vm, "Can't have more than %d isolates.", ISOLATES_MAX);
+    return false;
+  }
+
+  Vm* child = malloc(sizeof(Vm));
+  Isolate* isolate = isolate_new(group, number, child);
+  if (child == NULL || isolate == NULL) {
+    fprintf(stderr, "Not enough memory to spawn an isolate.\n");
+    exit(74);
+  }
+  Vm_init_shared(child, group->code_heap);
+  child->memory_allocator.log_gc = vm->memory_allocator.log_gc;
+  child->memory_allocator.stress_gc = vm->memory_allocator.stress_gc;
+  child->memory_allocator.gc_enabled = vm->memory_allocator.gc_enabled;
+  child->output = vm->output;
+  child->errors = vm->errors;
+  child->isolate = isolate;
+  isolate_define_natives(child);
+
+  // The globals that can be sent are copied over, apart from the natives,
+  // which the child has already
+  Table* globals = &vm->globals;
+  for (int i = 0; i < globals->capacity; i++) {
+    Entry* entry = &globals->entries[i];
+    Message message;
+    if (entry->key == NULL || Object_is_native(entry->value) || !isolate_pack(NULL, entry->value, &message)) {
+      continue;
+    }
+    ObjString* name = Vm_copy_string(child, entry->key->chars, entry->key->length);
+    MemoryAllocator_push_root(&child->memory_allocator, (Obj*)name);
+    Value value = isolate_unpack(child, &message);
+    if (Value_is_obj(value)) {
+      MemoryAllocator_push_root(&child->memory_allocator, Value_as_obj(value));
+    }
+    Table_set(&child->globals, name, value);
+    if (Value_is_obj(value)) {
+      MemoryAllocator_pop_root(&child->memory_allocator);
+    }
+    MemoryAllocator_pop_root(&child->memory_allocator);
+    isolate_free_message(&message);
+  }
+
+  isolate->function = closure->function;
+  isolate->started = pthread_create(&isolate->thread, NULL, isolate_run, isolate) == 0;
+  if (!isolate->started) {
+    Vm_free(child);
+    free(child);
+    isolate->vm = NULL;
+    isolate->finished = true;
+    isolate->failed = true;
+  }
+  atomic_store(&group->isolates[number], isolate);
+  if (atomic_load(&group->closed)) {
+    mailbox_close(&isolate->mailbox);
+  }
+  if (!isolate->started) {
+    Vm_runtime_error(vm, "Could not start an isolate.");
+    return false;
+  }
+
+  *result = Value_make_number(number);
+  return true;
+}
+
+static bool isolate_send_native(Vm* vm, int arg_count, Value* args, Value* result) {
+  if (isolate_current(vm) == NULL || !isolate_check_arity(vm, 2, arg_count)) {
+    return false;
+  }
+  Isolate* isolate = isolate_find(vm, args[0]);
+  if (isolate == NULL) {
+    return false;
+  }
+
+  Message* message = malloc(sizeof(Message));
+  if (message == NULL) {
+    fprintf(stderr, "Not enough memory to send a message.\n");
+    exit(74);
+  }
+  if (!isolate_pack(vm, args[1], message)) {
+    free(message);
+    return false;
+  }
+  mailbox_push(&isolate->mailbox, message);
+  *result = Value_make_nil();
+  return true;
+}
+
+static bool isolate_receive_native(Vm* vm, int arg_count, Value* args, Value* result) {
+  Isolate* isolate = isolate_current(vm);
+  if (isolate == NULL || !isolate_check_arity(vm, 0, arg_count)) {
+    return false;
+  }
+
+  Message* message = mailbox_wait(&isolate->mailbox);
+  if (message == NULL) {
+    Vm_runtime_error(vm, "Isolate %d is waiting for a message, but the script has finished.", isolate->number);
+    return false;
+  }
+  *result = isolate_unpack(vm, message);
+  isolate_free_message(message);
+  free(message);
+  return true;
+}
+
+static bool isolate_join_native(Vm* vm, int arg_count, Value* args, Value* result) {
+  Isolate* current = isolate_current(vm);
+  if (current == NULL || !isolate_check_arity(vm, 1, arg_count)) {
+    return false;
+  }
+  Isolate* isolate = isolate_find(vm, args[0]);
+  if (isolate == NULL) {
+    return false;
+  }
+  // Isolate 0 is the script, which nothing waits for
+  if (isolate == current || isolate->number == 0) {
+    Vm_runtime_error(vm, "Can't join isolate %d from isolate %d.", isolate->number, current->number);
+    return false;
+  }
+
+  pthread_mutex_lock(&isolate->lock);
+  while (!isolate->finished) {
+    pthread_cond_wait(&isolate->finished_condition, &isolate->lock);
+  }
+  pthread_mutex_unlock(&isolate->lock);
+
+  if (isolate->failed) {
+    Vm_runtime_error(vm, "Isolate %d failed.", isolate->number);
+    return false;
+  }
+  *result = isolate_unpack(vm, &isolate->returned);
+  return true;
+}
+
+static void isolate_define_natives(Vm* vm) {
+  Vm_define_native(vm, "spawn", isolate_spawn_native);
+  Vm_define_native(vm, "send", isolate_send_native);
+  Vm_define_native(vm, "receive", isolate_receive_native);
+  Vm_define_native(vm, "join", isolate_join_native);
+}
+
+// The natives stay defined in isolate 0 once its group has been freed
+static Isolate* isolate_current(Vm* vm) {
+  if (vm->isolate == NULL) {
+    Vm_runtime_error(vm, "Isolates can't be used once the script has finished.");
+  }
+  return vm->isolate;
+}
+
+static Isolate* isolate_find(Vm* vm, Value number) {
+  IsolateGroup* group = vm->isolate->group;
+  if (Value_is_number(number)) {
+    double index = Value_as_number(number);
+    int count = atomic_load(&group->count);
+    if (index >= 0 && index < count && index < ISOLATES_MAX && index == floor(index)) {
+      Isolate* isolate = atomic_load(&group->isolates[(int)index]);
+      if (isolate != NULL) {
+        return isolate;
+      }
+    }
+  }
+  Vm_runtime_error(vm, "Unknown isolate.");
+  return NULL;
+}
+
+static bool isolate_check_arity(Vm* vm, int expected, int arg_count) {
+  if (arg_count != expected) {
+    Vm_runtime_error(vm, "Expected %d arguments but got %d.", expected, arg_count);
+    return false;
+  }
+  return true;
+}
+
+// Reports a runtime error in vm if value can't be sent, unless vm is NULL
+static bool isolate_pack(Vm* vm, Value value, Message* message) {
+  if (Value_is_nil(value)) {
+    message->type = MESSAGE_NIL;
+  } else if (Value_is_boolean(value)) {
+    message->type = MESSAGE_BOOLEAN;
+    message->as.boolean = Value_as_boolean(value);
+  } else if (Value_is_number(value)) {
+    message->type = MESSAGE_NUMBER;
+    message->as.number = Value_as_number(value);
+  } else if (Object_is_string(value)) {
+    ObjString* string = Object_as_string(value);
+    message->type = MESSAGE_STRING;
+    message->as.string.length = string->length;
+    message->as.string.chars = malloc(string->length + 1);
+    if (message->as.string.chars == NULL) {
+      fprintf(stderr, "Not enough memory to send a message.\n");
+      exit(74);
+    }
+    memcpy(message->as.string.chars, string->chars, string->length + 1);
+  } else if (Object_is_closure(value) && Object_as_closure(value)->upvalue_count == 0 &&
+             Object_as_closure(value)->function->obj.is_shared) {
+    message->type = MESSAGE_FUNCTION;
+    message->as.function = Object_as_closure(value)->function;
+  } else if (!Object_is_class(value) || !isolate_pack_class(Object_as_class(value), message)) {
+    if (vm != NULL) {
+      Vm_runtime_error(vm, "Can only send nil, booleans, numbers, strings, and functions and classes that don't capture variables.");
+    }
+    return false;
+  }
+  return true;
+}
+
+// A class can be sent if each of its methods could be sent as a function,
+// which rules out methods that call super methods, since they capture the
+// superclass
+static bool isolate_pack_class(ObjClass* klass, Message* message) {
+  DispatchRow* row = &klass->methods;
+  if (!klass->name->obj.is_shared) {
+    return false;
+  }
+  for (int i = 0; i < row->count; i++) {
+    ObjClosure* method = DispatchRow_get(row, row->base + i);
+    if (method != NULL && (method->upvalue_count != 0 || !method->function->obj.is_shared)) {
+      return false;
+    }
+  }
+
+  ObjFunction** methods = malloc(sizeof(ObjFunction*) * (row->count == 0 ? 1 : row->count));
+  if (methods == NULL) {
+    fprintf(stderr, "Not enough memory to send a message.\n");
+    exit(74);
+  }
+  for (int i = 0; i < row->count; i++) {
+    ObjClosure* method = DispatchRow_get(row, row->base + i);
+    methods[i] = method == NULL ? NULL : method->function;
+  }
+  message->type = MESSAGE_CLASS;
+  message->as.klass.name = klass->name;
+  message->as.klass.base = row->base;
+  message->as.klass.count = row->count;
+  message->as.klass.methods = methods;
+  return true;
+}
+
+// Creates the value in vm's heap. The message is left as it is.
+static Value isolate_unpack(Vm* vm, Message* message) {
+  switch (message->type) {
+    case MESSAGE_BOOLEAN:
+      return Value_make_boolean(message->as.boolean);
+    case MESSAGE_NUMBER:
+      return Value_make_number(message->as.number);
+    case MESSAGE_STRING:
+      return Value_make_obj((Obj*)Vm_copy_string(vm, message->as.string.chars, message->as.string.length));
+    case MESSAGE_FUNCTION:
+      return Value_make_obj((Obj*)Object_allocate_new_closure(&vm->memory_allocator, message->as.function));
+    case MESSAGE_CLASS: {
+      ObjClass* klass = Object_allocate_new_class(&vm->memory_allocator, message->as.klass.name);
+      MemoryAllocator_push_root(&vm->memory_allocator, (Obj*)klass);
+      for (int i = 0; i < message->as.klass.count; i++) {
+        ObjFunction* function = message->as.klass.methods[i];
+        if (function == NULL) {
+          continue;
+        }
+        ObjClosure* method = Object_allocate_new_closure(&vm->memory_allocator, function);
+        MemoryAllocator_push_root(&vm->memory_allocator, (Obj*)method);
+        DispatchRow_set(&klass->methods, message->as.klass.base + i, method);
+        MemoryAllocator_pop_root(&vm->memory_allocator);
+      }
+      DispatchRow_seal(&klass->methods);
+      MemoryAllocator_pop_root(&vm->memory_allocator);
+      return Value_make_obj((Obj*)klass);
+    }
+    case MESSAGE_NIL:
+    default:
+      return Value_make_nil();
+  }
+}
+
+static void isolate_free_message(Message* message) {
+  if (message->type == MESSAGE_STRING) {
+    free(message->as.string.chars);
+  } else if (message->type == MESSAGE_CLASS) {
+    free(message->as.klass.methods);
+  }
+  message->type = MESSAGE_NIL;
+}
+
+static void mailbox_init(Mailbox* mailbox) {
+  atomic_init(&mailbox->stub.next, NULL);
+  atomic_init(&mailbox->head, &mailbox->stub);
+  mailbox->tail = &mailbox->stub;
+  atomic_init(&mailbox->waiting, false);
+  mailbox->closed = false;
+  pthread_mutex_init(&mailbox->lock, NULL);
+  pthread_cond_init(&mailbox->arrived, NULL);
+}
+
+// Only once nobody can send to the mailbox anymore
+static void mailbox_free(Mailbox* mailbox) {
+  Message* message;
+  while ((message = mailbox_pop(mailbox)) != NULL) {
+    isolate_free_message(message);
+    free(message);
+  }
+  pthread_mutex_destroy(&mailbox->lock);
+  pthread_cond_destroy(&mailbox->arrived);
+}
+
+static void mailbox_push(Mailbox* mailbox, Message* message) {
+  mailbox_enqueue(mailbox, message);
+
+  // The receiver sets waiting before it checks for messages one last time,
+  // so either it sees this message or this sees it waiting
+  if (atomic_load(&mailbox->waiting)) {
+    pthread_mutex_lock(&mailbox->lock);
+    pthread_cond_signal(&mailbox->arrived);
+    pthread_mutex_unlock(&mailbox->lock);
+  }
+}
+
+static void mailbox_enqueue(Mailbox* mailbox, Message* message) {
+  atomic_store(&message->next, NULL);
+  Message* previous = atomic_exchange(&mailbox->head, message);
+  atomic_store(&previous->next, message);
+}
+
+// Returns NULL if the mailbox is empty, or a message is still being linked
+static Message* mailbox_pop(Mailbox* mailbox) {
+  Message* tail = mailbox->tail;
+  Message* next = atomic_load(&tail->next);
+  if (tail == &mailbox->stub) {
+    if (next == NULL) {
+      return NULL;
+    }
+    mailbox->tail = next;
+    tail = next;
+    next = atomic_load(&next->next);
+  }
+  if (next != NULL) {
+    mailbox->tail = next;
+    return tail;
+  }
+
+  // tail is the last message, which can only be taken once the stub has
+  // been put behind it
+  if (tail != atomic_load(&mailbox->head)) {
+    return NULL;
+  }
+  mailbox_enqueue(mailbox, &mailbox->stub);
+  next = atomic_load(&tail->next);
+  if (next != NULL) {
+    mailbox->tail = next;
+    return tail;
+  }
+  return NULL;
+}
+
+// Returns NULL once the mailbox has been closed and is empty
+static Message* mailbox_wait(Mailbox* mailbox) {
+  for (;;) {
+    Message* message = mailbox_pop(mailbox);
+    if (message != NULL) {
+      return message;
+    }
+
+    pthread_mutex_lock(&mailbox->lock);
+    atomic_store(&mailbox->waiting, true);
+    message = mailbox_pop(mailbox);
+    bool closed = mailbox->closed;
+    if (message == NULL && !closed) {
+      pthread_cond_wait(&mailbox->arrived, &mailbox->lock);
+    }
+    atomic_store(&mailbox->waiting, false);
+    pthread_mutex_unlock(&mailbox->lock);
+    if (message != NULL) {
+      return message;
+    }
+    if (closed) {
+      return NULL;
+    }
+  }
+}
+
+// Messages can still be sent to a closed mailbox, but the receiver stops
+// waiting for them once it's empty
+static void mailbox_close(Mailbox* mailbox) {
+  pthread_mutex_lock(&mailbox->lock);
+  mailbox->closed = true;
+  pthread_cond_broadcast(&mailbox->arrived);
+  pthread_mutex_unlock(&mailbox->lock);
+}
@@ -0,0 +1,56 @@
+#ifndef clox_isolate_h
+#define clox_isolate_h
+
+#include "common.h"
+#include "object.h"
+#include "vm.h"
+
+// Isolates let a Lox program use more than one thread. Each isolate runs a
+// function in a VM of its own, on a thread of its own, so isolates never
+// share a heap and the garbage collector doesn't need any locks. All of a
+// program's isolates share its code heap instead (see Vm_init_shared),
+// which is why only VMs that share one can spawn isolates.
+//
+// Isolates talk to each other by sending messages, which are copied into
+// the heap of the isolate that receives them. Nil, booleans, numbers,
+// strings, functions that don't capture any variables and classes whose
+// methods don't can be sent, and functions (including methods) are shared
+// rather than copied. A class arrives as a new class with the same methods,
+// so instances of the copy are separate from those of the original. A new
+// isolate starts out with a copy of every global of the isolate that
+// spawned it that could be sent, which gives it the script's classes.
+//
+// Programs use isolates through these natives:
+//
+// - spawn(function) runs function in a new isolate and returns its number.
+//   The script itself is isolate 0.
+// - send(isolate, message) puts message in the isolate's mailbox.
+// - receive() takes the oldest message out of the calling isolate's
+//   mailbox, waiting for one to arrive if it's empty. It's a runtime error
+//   to wait once the script has finished.
+// - join(isolate) waits for the isolate to finish, and returns what its
+//   function returned. It's a runtime error if the isolate had one.
+//
+// Mailboxes are lock-free queues that any number of isolates can send to at
+// once. A lock is only taken to wake up an isolate that's waiting in
+// receive().
+
+#define ISOLATES_MAX 256
+
+typedef struct Isolate Isolate;
+typedef struct IsolateGroup IsolateGroup;
+
+// Makes vm isolate 0 of a new group and defines the natives in it. vm has
+// to share a code heap, and outlive the group.
+IsolateGroup* IsolateGroup_new(Vm* vm);
+
+// Whether function, or any function declared in it, refers to one of the
+// natives above. Scripts that don't can run without a group.
+bool IsolateGroup_is_needed_by(ObjFunction* function);
+
+// Closes every isolate's mailbox, so that the ones waiting for a message
+// stop waiting, then waits for every isolate in the group to finish, and
+// frees them
+void IsolateGroup_free(IsolateGroup* group);
+
+#endif
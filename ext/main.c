@@ -0,0 +1,216 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+
+#include "common.h"
+#include "bytecode_file.h"
+#include "compiler.h"
+#include "heap_snapshot.h"
+#include "isolate.h"
+#include "trace.h"
+#include "vm.h"
+
+// The standalone runner for the bytecode virtual machine. It behaves like
+// exe/lox-bytecode, except that the source is compiled by the native
+// compiler and Ruby isn't involved at all. It isn't part of the shared
+// library (see extconf.rb).
+//
+// It can also run .loxc files, such as the ones in the cache directory of
+// exe/lox-bytecode, which are mapped into memory and run in place.
+//
+// With --load-snapshot, the VM starts out from a heap snapshot instead of
+// an empty heap. With --save-snapshot, a snapshot of the heap is saved once
+// the script has finished running without errors.
+//
+// Otherwise, scripts that refer to the natives of isolates are compiled
+// into a VM that's then frozen, and run in another VM that shares its code,
+// so that they can spawn isolates (see isolate.h). Other scripts don't pay
+// for the shared VM, and run in the VM they were compiled into.
+//
+// LOXRB_LOG_DISASSEMBLY lists every instruction of the script as it runs,
+// and LOXRB_TRACE writes them to a trace file instead (see trace.h).
+
+// Closed when the runner exits, however it exits
+static Trace* trace = NULL;
+
+static bool read_bool_env_var(const char* variable) {
+  const char* value = getenv(variable);
+  return value != NULL && value[0] != '\0' && strcmp(value, "0") != 0 && strcasecmp(value, "false") != 0;
+}
+
+static void close_trace(void) {
+  const char* path = getenv("LOXRB_TRACE");
+  if (trace != NULL && !Trace_close(trace)) {
+    fprintf(stderr, "Could not write trace file \"%s\".\n", path);
+  }
+  trace = NULL;
+}
+
+static void open_trace(bool log_disassembly) {
+  const char* path = getenv("LOXRB_TRACE");
+  if (path != NULL && path[0] != '\0') {
+    trace = Trace_open(path);
+    if (trace == NULL) {
+      fprintf(stderr, "Could not create trace file \"%s\".\n", path);
+      exit(74);
+    }
+  } else if (log_disassembly) {
+    trace = Trace_new_log();
+  }
+  atexit(close_trace);
+}
+
+static InterpretResult run(Vm* vm, const char* source) {
+  ObjFunction* function = Compiler_compile(vm, source);
+  if (function == NULL) {
+    return INTERPRET_COMPILE_ERROR;
+  }
+
+  return Vm_interpret(vm, function);
+}
+
+static void repl(Vm* vm) {
+  char line[1024];
+  for (;;) {
+    printf("> ");
+
+    if (!fgets(line, sizeof(line), stdin)) {
+      printf("\n");
+      break;
+    }
+
+    run(vm, line);
+  }
+}
+
+static char* read_file(const char* path) {
+  FILE* file = fopen(path, "rb");
+  if (file == NULL) {
+    fprintf(stderr, "Could not open file \"%s\".\n", path);
+    exit(74);
+  }
+
+  fseek(file, 0L, SEEK_END);
+  size_t file_size = ftell(file);
+  rewind(file);
+
+  char* buffer = (char*)malloc(file_size + 1);
+  if (buffer == NULL) {
+    fprintf(stderr, "Not enough memory to read \"%s\".\n", path);
+    exit(74);
+  }
+
+  size_t bytes_read = fread(buffer, sizeof(char), file_size, file);
+  if (bytes_read < file_size) {
+    fprintf(stderr, "Could not read file \"%s\".\n", path);
+    exit(74);
+  }
+
+  buffer[bytes_read] = '\0';
+
+  fclose(file);
+  return buffer;
+}
+
+static bool has_extension(const char* path, const char* extension) {
+  size_t path_length = strlen(path);
+  size_t extension_length = strlen(extension);
+  return path_length >= extension_length && strcmp(path + path_length - extension_length, extension) == 0;
+}
+
+static InterpretResult run_in_isolates(Vm* code_heap, ObjFunction* function) {
+  Vm_freeze(code_heap, function);
+
+  Vm vm;
+  Vm_init_shared(&vm, code_heap);
+  vm.memory_allocator.log_gc = code_heap->memory_allocator.log_gc;
+  vm.memory_allocator.stress_gc = code_heap->memory_allocator.stress_gc;
+  vm.memory_allocator.gc_enabled = true;
+  vm.trace = code_heap->trace;
+
+  IsolateGroup* group = IsolateGroup_new(&vm);
+  if (group == NULL) {
+    fprintf(stderr, "Not enough memory to run isolates.\n");
+    exit(74);
+  }
+  InterpretResult result = Vm_interpret(&vm, function);
+  IsolateGroup_free(group);
+  Vm_free(&vm);
+  return result;
+}
+
+static void run_file(Vm* vm, const char* path, bool isolates) {
+  ObjFunction* function;
+  if (has_extension(path, ".loxc")) {
+    function = BytecodeFile_map(vm, path);
+    if (function == NULL) {
+      fprintf(stderr, "Could not load bytecode file \"%s\".\n", path);
+      exit(74);
+    }
+  } else {
+    char* source = read_file(path);
+    function = Compiler_compile(vm, source);
+    free(source);
+    if (function == NULL) {
+      exit(65);
+    }
+  }
+
+  InterpretResult result = isolates && IsolateGroup_is_needed_by(function) ? run_in_isolates(vm, function) : Vm_interpret(vm, function);
+  if (result == INTERPRET_RUNTIME_ERROR) exit(70);
+}
+
+static void usage(void) {
+  fprintf(stderr, "Usage: lox-native [--load-snapshot path] [--save-snapshot path] [script]\n");
+  exit(64);
+}
+
+int main(int argc, const char* argv[]) {
+  bool debug_mode = read_bool_env_var("LOXRB_DEBUG_MODE");
+  const char* load_snapshot_path = NULL;
+  const char* save_snapshot_path = NULL;
+  const char* script_path = NULL;
+
+  for (int i = 1; i < argc; i++) {
+    if (strcmp(argv[i], "--load-snapshot") == 0 && i + 1 < argc) {
+      load_snapshot_path = argv[++i];
+    } else if (strcmp(argv[i], "--save-snapshot") == 0 && i + 1 < argc) {
+      save_snapshot_path = argv[++i];
+    } else if (argv[i][0] != '-' && script_path == NULL) {
+      script_path = argv[i];
+    } else {
+      usage();
+    }
+  }
+  if (save_snapshot_path != NULL && script_path == NULL) {
+    usage();
+  }
+
+  Vm vm;
+  Vm_init(&vm);
+  vm.memory_allocator.log_gc = read_bool_env_var("LOXRB_LOG_GC") || debug_mode;
+  vm.memory_allocator.stress_gc = read_bool_env_var("LOXRB_STRESS_GC") || debug_mode;
+  vm.memory_allocator.gc_enabled = true;
+  open_trace(read_bool_env_var("LOXRB_LOG_DISASSEMBLY") || debug_mode);
+  vm.trace = trace;
+
+  if (load_snapshot_path != NULL && !HeapSnapshot_read(&vm, load_snapshot_path)) {
+    fprintf(stderr, "Could not load heap snapshot \"%s\".\n", load_snapshot_path);
+    exit(74);
+  }
+
+  if (script_path == NULL) {
+    repl(&vm);
+  } else {
+    run_file(&vm, script_path, load_snapshot_path == NULL && save_snapshot_path == NULL);
+  }
+
+  if (save_snapshot_path != NULL && !HeapSnapshot_write(&vm, save_snapshot_path)) {
+    fprintf(stderr, "Could not save heap snapshot \"%s\".\n", save_snapshot_path);
+    exit(74);
+  }
+
+  Vm_free(&vm);
+  return 0;
+}
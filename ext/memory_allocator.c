@@ -14,6 +14,9 @@ void MemoryAllocator_init(MemoryAllocator* memory_allocator, void* callback_targ
   memory_allocator->stress_gc = false;
   memory_allocator->callback_target = callback_target;
   memory_allocator->callbacks = callbacks;
+  memory_allocator->roots = NULL;
+  memory_allocator->root_count = 0;
+  memory_allocator->root_capacity = 0;
 }
 
 void* MemoryAllocator_reallocate(MemoryAllocator* memory_allocator, void* array, size_t old_size, size_t new_size) {
@@ -65,3 +68,30 @@ char* MemoryAllocator_allocate_chars(MemoryAllocator* memory_allocator, size_t c
 void MemoryAllocator_collect_garbage(MemoryAllocator* memory_allocator) {
   (*memory_allocator->callbacks.collect_garbage)(memory_allocator->callback_target);
 }
+
+void MemoryAllocator_push_root(MemoryAllocator* memory_allocator, Obj* object) {
+  // Like the gray stack, this isn't counted as part of the heap, so that
+  // pushing a root can't set off a collection before the root is pushed
+  if (memory_allocator->root_count + 1 > memory_allocator->root_capacity) {
+    memory_allocator->root_capacity = MemoryAllocator_get_increased_capacity(
+      memory_allocator,
+      memory_allocator->root_capacity
+    );
+    memory_allocator->roots = (Obj**)realloc(memory_allocator->roots, sizeof(Obj*) * memory_allocator->root_capacity);
+    if (memory_allocator->roots == NULL) {
+      exit(1);
+    }
+  }
+  memory_allocator->roots[memory_allocator->root_count++] = object;
+}
+
+void MemoryAllocator_pop_root(MemoryAllocator* memory_allocator) {
+  memory_allocator->root_count--;
+}
+
+void MemoryAllocator_free_roots(MemoryAllocator* memory_allocator) {
+  free(memory_allocator->roots);
+  memory_allocator->roots = NULL;
+  memory_allocator->root_count = 0;
+  memory_allocator->root_capacity = 0;
+}
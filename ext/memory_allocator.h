@@ -21,7 +21,12 @@ typedef struct {
   bool stress_gc;
   void* callback_target;
   MemoryCallbacks callbacks;
-  Obj* protected_object;
+  // Objects that the garbage collector must keep alive even though nothing
+  // the VM can see refers to them yet, such as the functions that compilers
+  // are in the middle of compiling. Pushed and popped in LIFO order.
+  Obj** roots;
+  int root_count;
+  int root_capacity;
 } MemoryAllocator;
 
 void MemoryAllocator_init(MemoryAllocator* memory_allocator, void* callback_target, MemoryCallbacks memory_callbacks);
@@ -33,5 +38,8 @@ void MemoryAllocator_free_array(MemoryAllocator* memory_allocator, void* array,
 void* MemoryAllocator_allocate(MemoryAllocator* memory_allocator, size_t size, size_t count);
 char* MemoryAllocator_allocate_chars(MemoryAllocator* memory_allocator, size_t count);
 void MemoryAllocator_collect_garbage(MemoryAllocator* memory_allocator);
+void MemoryAllocator_push_root(MemoryAllocator* memory_allocator, Obj* object);
+void MemoryAllocator_pop_root(MemoryAllocator* memory_allocator);
+void MemoryAllocator_free_roots(MemoryAllocator* memory_allocator);
 
 #endif
@@ -5,35 +5,40 @@
 #include "object.h"
 #include "value.h"
 #include "table.h"
+#include "dispatch_row.h"
+#include "vm.h"
 
 Obj* object_allocate_new(MemoryAllocator* memory_allocator, size_t size, ObjType type);
-static void object_print_function(ObjFunction* function);
+static void object_print_function(FILE* stream, ObjFunction* function);
 
-void Object_print(Value value) {
+void Object_fprint(FILE* stream, Value value) {
   switch (Object_type(value)) {
     case OBJ_BOUND_METHOD:
-      object_print_function(Object_as_bound_method(value)->method->function);
+      object_print_function(stream, Object_as_bound_method(value)->method->function);
       break;
     case OBJ_CLASS:
-      printf("%s", Object_as_class(value)->name->chars);
+      fprintf(stream, "%s", Object_as_class(value)->name->chars);
       break;
     case OBJ_CLOSURE:
-      object_print_function(Object_as_closure(value)->function);
+      object_print_function(stream, Object_as_closure(value)->function);
       break;
     case OBJ_FUNCTION:
-      object_print_function(Object_as_function(value));
+      object_print_function(stream, Object_as_function(value));
       break;
     case OBJ_INSTANCE:
-      printf("%s instance", Object_as_instance(value)->klass->name->chars);
+      fprintf(stream, "%s instance", Object_as_instance(value)->klass->name->chars);
       break;
     case OBJ_NATIVE:
-      printf("<native fn>");
+      fputs("<native fn>", stream);
       break;
     case OBJ_STRING:
-      printf("%s", Object_as_cstring(value));
+      fprintf(stream, "%s", Object_as_cstring(value));
       break;
     case OBJ_UPVALUE:
-      printf("upvalue");
+      fputs("upvalue", stream);
+      break;
+    case OBJ_FIBER:
+      fputs("<fiber>", stream);
       break;
   }
 }
@@ -43,6 +48,7 @@ ObjString* Object_allocate_string(MemoryAllocator* memory_allocator, char* chars
   string->length = length;
   string->chars = chars;
   string->hash = hash;
+  string->selector = -1;
   return string;
 }
 
@@ -69,9 +75,9 @@ ObjNative* Object_allocate_new_native(MemoryAllocator* memory_allocator, NativeF
 }
 
 ObjClosure* Object_allocate_new_closure(MemoryAllocator* memory_allocator, ObjFunction* function) {
-  ObjUpvalue** upvalues = MemoryAllocator_allocate(memory_allocator, sizeof(ObjUpvalue*), function->upvalue_count);
+  Value* upvalues = MemoryAllocator_allocate(memory_allocator, sizeof(Value), function->upvalue_count);
   for (int i = 0; i < function->upvalue_count; i++) {
-    upvalues[i] = NULL;
+    upvalues[i] = Value_make_nil();
   }
   ObjClosure* closure = (ObjClosure*)object_allocate_new(memory_allocator, sizeof(ObjClosure), OBJ_CLOSURE);
   closure->function = function;
@@ -83,7 +89,7 @@ ObjClosure* Object_allocate_new_closure(MemoryAllocator* memory_allocator, ObjFu
 ObjClass* Object_allocate_new_class(MemoryAllocator* memory_allocator, ObjString* name) {
   ObjClass* klass = (ObjClass*)object_allocate_new(memory_allocator, sizeof(ObjClass), OBJ_CLASS);
   klass->name = name;
-  Table_init(&klass->methods, memory_allocator);
+  DispatchRow_init(&klass->methods, memory_allocator);
   return klass;
 }
 
@@ -101,6 +107,21 @@ ObjBoundMethod* Object_allocate_new_bound_method(MemoryAllocator* memory_allocat
   return bound_method;
 }
 
+ObjFiber* Object_allocate_new_fiber(MemoryAllocator* memory_allocator, ObjClosure* closure) {
+  ObjFiber* fiber = (ObjFiber*)object_allocate_new(memory_allocator, sizeof(ObjFiber), OBJ_FIBER);
+  fiber->closure = closure;
+  fiber->frames = NULL;
+  fiber->frame_count = 0;
+  fiber->frame_capacity = 0;
+  fiber->stack = NULL;
+  fiber->stack_top = NULL;
+  fiber->stack_capacity = 0;
+  fiber->open_upvalues = NULL;
+  fiber->caller = NULL;
+  fiber->state = FIBER_NEW;
+  return fiber;
+}
+
 void Object_free(MemoryAllocator* memory_allocator, Obj* object) {
   if (memory_allocator->log_gc) {
     Logger_debug("%p free type %d", (void*)object, object->type);
@@ -113,14 +134,14 @@ void Object_free(MemoryAllocator* memory_allocator, Obj* object) {
     }
     case OBJ_CLASS: {
       ObjClass* klass = (ObjClass*)object;
-      Table_free(&klass->methods);
+      DispatchRow_free(&klass->methods);
       MemoryAllocator_free(memory_allocator, object, sizeof(ObjClass));
       break;
     }
     case OBJ_CLOSURE: {
       ObjClosure* closure = (ObjClosure*)object;
       // Don't free the upvalues themselves, because the closure doesn't own them
-      MemoryAllocator_free_array(memory_allocator, closure->upvalues, sizeof(ObjUpvalue*), closure->upvalue_count);
+      MemoryAllocator_free_array(memory_allocator, closure->upvalues, sizeof(Value), closure->upvalue_count);
       // Don't free function, because the closure doesn't own this either
       MemoryAllocator_free(memory_allocator, object, sizeof(ObjClosure));
       break;
@@ -151,21 +172,31 @@ void Object_free(MemoryAllocator* memory_allocator, Obj* object) {
       MemoryAllocator_free(memory_allocator, object, sizeof(ObjUpvalue));
       break;
     }
+    case OBJ_FIBER: {
+      // Running fibers hold the call stack of whatever resumed them, but
+      // they're never freed while they run
+      ObjFiber* fiber = (ObjFiber*)object;
+      MemoryAllocator_free_array(memory_allocator, fiber->frames, sizeof(CallFrame), fiber->frame_capacity);
+      MemoryAllocator_free_array(memory_allocator, fiber->stack, sizeof(Value), fiber->stack_capacity);
+      MemoryAllocator_free(memory_allocator, object, sizeof(ObjFiber));
+      break;
+    }
   }
 }
 
-static void object_print_function(ObjFunction* function) {
+static void object_print_function(FILE* stream, ObjFunction* function) {
   if (function->name == NULL) {
-    printf("<script>");
+    fputs("<script>", stream);
     return;
   }
-  printf("<fn %s>", function->name->chars);
+  fprintf(stream, "<fn %s>", function->name->chars);
 }
 
 Obj* object_allocate_new(MemoryAllocator* memory_allocator, size_t size, ObjType type) {
   Obj* object = (Obj*)MemoryAllocator_reallocate(memory_allocator, NULL, 0, size);
   object->type = type;
   object->is_marked = false;
+  object->is_shared = false;
 
   (*memory_allocator->callbacks.handle_new_object)(memory_allocator->callback_target, object);
 
@@ -7,23 +7,41 @@
 #include "chunk.h"
 #include "value.h"
 #include "table.h"
+#include "dispatch_row.h"
 
 struct ObjString {
   Obj obj;
   int length;
   char* chars;
   uint32_t hash;
+  int selector; // -1 unless this string has been used as a method name
 };
 
+struct Vm;
+struct CallFrame;
+
+// The code a function was compiled to ahead of time, see aot.h. It runs the
+// function in the frame at the top of the VM's call stack and returns an
+// InterpretResult, which can't be named here.
+typedef int (*CompiledFn)(struct Vm* vm, struct CallFrame* frame);
+
 struct ObjFunction {
   Obj obj;
   int arity;
   int upvalue_count;
   Chunk chunk;
   ObjString* name;
+  CompiledFn compiled; // NULL unless the function was compiled to C
+  // The field a method returns if that's all it does, like
+  // `name() { return this.name; }`, so that it can be run without a call
+  // frame. NULL for any other function. See Vm_finish_function.
+  ObjString* getter;
 };
 
-typedef Value (*NativeFn)(int arg_count, Value* args);
+// Natives are given the VM that called them, so that they can allocate and
+// report runtime errors (see Vm_runtime_error). They put what they return
+// in result, and return false once they have reported an error.
+typedef bool (*NativeFn)(struct Vm* vm, int arg_count, Value* args, Value* result);
 
 struct ObjNative {
   Obj obj;
@@ -40,14 +58,20 @@ struct ObjUpvalue {
 struct ObjClosure {
   Obj obj;
   ObjFunction* function;
-  ObjUpvalue** upvalues;
+  // Either an ObjUpvalue or, for variables that are captured by value, the
+  // value itself. Upvalues are never Lox values, so they can be told apart.
+  Value* upvalues;
   int upvalue_count;
 };
 
+// Methods are looked up by the selector of their name rather than by
+// hashing the name itself. The row is filled in by OP_INHERIT and
+// OP_METHOD, and is sealed by OP_END_CLASS once the class declaration
+// has finished executing.
 struct ObjClass {
   Obj obj;
   ObjString* name;
-  Table methods;
+  DispatchRow methods;
 };
 
 struct ObjInstance {
@@ -62,6 +86,34 @@ struct ObjBoundMethod {
   ObjClosure* method;
 };
 
+typedef enum {
+  FIBER_NEW, // Its function hasn't been called yet
+  FIBER_SUSPENDED, // It has yielded
+  FIBER_RUNNING, // It's running, or waiting for a fiber it resumed
+  FIBER_DONE, // Its function has returned, or had a runtime error
+} FiberState;
+
+// A call stack that a Lox program can suspend and resume (see the fiber
+// natives in vm.c). The VM only ever runs on one call stack at a time, and
+// swaps that call stack with a fiber's to resume the fiber, so that while
+// the fiber runs it holds the call stack of whatever resumed it, until the
+// fiber yields or returns and the two are swapped back. The frames and the
+// stack are allocated the first time the fiber is resumed, and grow as it
+// calls deeper, so that fibers that don't do much don't cost much.
+struct ObjFiber {
+  Obj obj;
+  ObjClosure* closure; // The function the fiber runs
+  struct CallFrame* frames;
+  int frame_count;
+  int frame_capacity;
+  Value* stack;
+  Value* stack_top;
+  int stack_capacity;
+  ObjUpvalue* open_upvalues;
+  struct ObjFiber* caller; // The fiber that resumed this one while it runs, NULL for the script
+  FiberState state;
+};
+
 inline ObjType Object_type(Value value) {
   return Value_as_obj(value)->type;
 }
@@ -98,6 +150,10 @@ inline bool Object_is_bound_method(Value value) {
   return Object_is_type(value, OBJ_BOUND_METHOD);
 }
 
+inline bool Object_is_fiber(Value value) {
+  return Object_is_type(value, OBJ_FIBER);
+}
+
 inline ObjFunction* Object_as_function(Value value) {
   return (ObjFunction*)Value_as_obj(value);
 }
@@ -127,11 +183,19 @@ inline ObjInstance* Object_as_instance(Value value) {
   return (ObjInstance*)Value_as_obj(value);
 }
 
+inline ObjUpvalue* Object_as_upvalue(Value value) {
+  return (ObjUpvalue*)Value_as_obj(value);
+}
+
 inline ObjBoundMethod* Object_as_bound_method(Value value) {
   return (ObjBoundMethod*)Value_as_obj(value);
 }
 
-void Object_print(Value value);
+inline ObjFiber* Object_as_fiber(Value value) {
+  return (ObjFiber*)Value_as_obj(value);
+}
+
+void Object_fprint(FILE* stream, Value value);
 
 ObjString* Object_allocate_string(MemoryAllocator* memory_allocator, char* chars, int length, uint32_t hash);
 ObjString* Object_allocate_new_string(MemoryAllocator* memory_allocator);
@@ -142,6 +206,7 @@ ObjUpvalue* Object_allocate_new_upvalue(MemoryAllocator* memory_allocator, Value
 ObjClass* Object_allocate_new_class(MemoryAllocator* memory_allocator, ObjString* name);
 ObjInstance* Object_allocate_new_instance(MemoryAllocator* memory_allocator, ObjClass* klass);
 ObjBoundMethod* Object_allocate_new_bound_method(MemoryAllocator* memory_allocator, Value receiver, ObjClosure* method);
+ObjFiber* Object_allocate_new_fiber(MemoryAllocator* memory_allocator, ObjClosure* closure);
 
 void Object_free(MemoryAllocator* memory_allocator, Obj* object);
 
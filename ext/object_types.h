@@ -14,6 +14,7 @@ typedef enum {
   OBJ_NATIVE,
   OBJ_STRING,
   OBJ_UPVALUE,
+  OBJ_FIBER,
 } ObjType;
 
 // Obj is like a base class for all objects. Specializations must all
@@ -25,6 +26,7 @@ struct Obj {
   ObjType type;
   struct Obj* next;
   bool is_marked;
+  bool is_shared; // Owned by a frozen VM and never marked or freed, see Vm_freeze
 };
 typedef struct Obj Obj;
 
@@ -36,5 +38,6 @@ typedef struct ObjClosure ObjClosure;
 typedef struct ObjClass ObjClass;
 typedef struct ObjInstance ObjInstance;
 typedef struct ObjBoundMethod ObjBoundMethod;
+typedef struct ObjFiber ObjFiber;
 
 #endif
@@ -0,0 +1,356 @@
+#include <stdlib.h>
+#include <string.h>
+
+#include "common.h"
+#include "chunk.h"
+#include "object.h"
+#include "peephole.h"
+
+#define PEEPHOLE_MAX_JUMP 0xffff
+
+typedef struct {
+  int offset; // In the code before it was optimized
+  int length;
+  int line;
+  uint8_t opcode; // Can differ from the original one once instructions are merged
+  int target; // The index of the instruction that a jump goes to
+  bool is_target;
+  bool removed;
+} PeepholeInstruction;
+
+typedef struct {
+  PeepholeInstruction* instructions;
+  int count;
+} Peephole;
+
+static bool peephole_decode(Peephole* peephole, Chunk* chunk);
+static int peephole_instruction_length(Chunk* chunk, int offset);
+static bool peephole_is_jump(uint8_t opcode);
+static bool peephole_is_unconditional_jump(uint8_t opcode);
+static void peephole_mark_targets(Peephole* peephole);
+static void peephole_thread_jumps(Peephole* peephole);
+static void peephole_merge_instructions(Peephole* peephole, Chunk* chunk);
+static void peephole_remove_jumps_to_next(Peephole* peephole);
+static int peephole_next(Peephole* peephole, int index);
+static void peephole_encode(Peephole* peephole, Chunk* chunk);
+
+void Peephole_optimize(Chunk* chunk) {
+  // The count is never negative, but checking for that as well is what
+  // tells the compiler that copying the code in peephole_encode is in bounds
+  if (!chunk->owns_code || chunk->count <= 0) {
+    return;
+  }
+
+  Peephole peephole;
+  if (peephole_decode(&peephole, chunk)) {
+    peephole_thread_jumps(&peephole);
+    peephole_mark_targets(&peephole);
+    peephole_merge_instructions(&peephole, chunk);
+    peephole_remove_jumps_to_next(&peephole);
+    peephole_encode(&peephole, chunk);
+  }
+  free(peephole.instructions);
+}
+
+static bool peephole_decode(Peephole* peephole, Chunk* chunk) {
+  peephole->instructions = (PeepholeInstruction*)malloc(sizeof(PeepholeInstruction) * chunk->count);
+  peephole->count = 0;
+
+  // The index of the instruction that starts at each offset, or -1
+  int* indices = (int*)malloc(sizeof(int) * chunk->count);
+  for (int offset = 0; offset < chunk->count; offset++) {
+    indices[offset] = -1;
+  }
+
+  bool valid = true;
+  for (int offset = 0; offset < chunk->count && valid; ) {
+    int length = peephole_instruction_length(chunk, offset);
+    if (length < 0 || offset + length > chunk->count) {
+      valid = false;
+      break;
+    }
+
+    PeepholeInstruction* instruction = &peephole->instructions[peephole->count];
+    instruction->offset = offset;
+    instruction->length = length;
+    instruction->line = Chunk_get_line(chunk, offset);
+    instruction->opcode = chunk->code[offset];
+    instruction->target = -1;
+    instruction->is_target = false;
+    instruction->removed = false;
+    indices[offset] = peephole->count++;
+    offset += length;
+  }
+
+  for (int i = 0; i < peephole->count && valid; i++) {
+    PeepholeInstruction* instruction = &peephole->instructions[i];
+    if (peephole_is_jump(instruction->opcode)) {
+      int jump = (chunk->code[instruction->offset + 1] << 8) | chunk->code[instruction->offset + 2];
+      int next = instruction->offset + instruction->length;
+      int target = instruction->opcode == OP_LOOP ? next - jump : next + jump;
+      valid = target >= 0 && target < chunk->count && indices[target] != -1;
+      instruction->target = valid ? indices[target] : -1;
+    }
+  }
+
+  free(indices);
+  return valid;
+}
+
+// Returns -1 for opcodes that it doesn't know
+static int peephole_instruction_length(Chunk* chunk, int offset) {
+  switch (chunk->code[offset]) {
+    case OP_NIL:
+    case OP_TRUE:
+    case OP_FALSE:
+    case OP_POP:
+    case OP_EQUAL:
+    case OP_GREATER:
+    case OP_LESS:
+    case OP_NOT_EQUAL:
+    case OP_NOT_GREATER:
+    case OP_NOT_LESS:
+    case OP_ADD:
+    case OP_SUBTRACT:
+    case OP_MULTIPLY:
+    case OP_DIVIDE:
+    case OP_ADD_NUMBERS:
+    case OP_SUBTRACT_NUMBERS:
+    case OP_MULTIPLY_NUMBERS:
+    case OP_DIVIDE_NUMBERS:
+    case OP_GREATER_NUMBERS:
+    case OP_LESS_NUMBERS:
+    case OP_NOT:
+    case OP_NEGATE:
+    case OP_PRINT:
+    case OP_CLOSE_UPVALUE:
+    case OP_RETURN:
+    case OP_INHERIT:
+    case OP_END_CLASS:
+      return 1;
+    case OP_CONSTANT:
+    case OP_GET_LOCAL:
+    case OP_SET_LOCAL:
+    case OP_STORE_LOCAL:
+    case OP_GET_GLOBAL:
+    case OP_DEFINE_GLOBAL:
+    case OP_SET_GLOBAL:
+    case OP_GET_UPVALUE:
+    case OP_SET_UPVALUE:
+    case OP_GET_CAPTURED:
+    case OP_GET_PROPERTY:
+    case OP_GET_METHOD:
+    case OP_SET_PROPERTY:
+    case OP_GET_SUPER:
+    case OP_CALL:
+    case OP_CLASS:
+    case OP_METHOD:
+      return 2;
+    case OP_JUMP:
+    case OP_JUMP_IF_FALSE:
+    case OP_JUMP_IF_TRUE:
+    case OP_LOOP:
+    case OP_INVOKE:
+    case OP_SUPER_INVOKE:
+    case OP_CALL_METHOD:
+    case OP_ADD_REGISTERS:
+    case OP_SUBTRACT_REGISTERS:
+    case OP_MULTIPLY_REGISTERS:
+    case OP_DIVIDE_REGISTERS:
+    case OP_GREATER_REGISTERS:
+    case OP_LESS_REGISTERS:
+    case OP_ADD_REGISTER_CONSTANT:
+    case OP_SUBTRACT_REGISTER_CONSTANT:
+    case OP_MULTIPLY_REGISTER_CONSTANT:
+    case OP_DIVIDE_REGISTER_CONSTANT:
+    case OP_GREATER_REGISTER_CONSTANT:
+    case OP_LESS_REGISTER_CONSTANT:
+      return 3;
+    case OP_CLOSURE: {
+      if (offset + 1 >= chunk->count || chunk->code[offset + 1] >= chunk->constants.count) {
+        return -1;
+      }
+      Value constant = chunk->constants.values[chunk->code[offset + 1]];
+      if (!Object_is_type(constant, OBJ_FUNCTION)) {
+        return -1;
+      }
+      return 2 + Object_as_function(constant)->upvalue_count * 2;
+    }
+    default:
+      return -1;
+  }
+}
+
+static bool peephole_is_jump(uint8_t opcode) {
+  return opcode == OP_JUMP || opcode == OP_JUMP_IF_FALSE || opcode == OP_JUMP_IF_TRUE || opcode == OP_LOOP;
+}
+
+static bool peephole_is_unconditional_jump(uint8_t opcode) {
+  return opcode == OP_JUMP || opcode == OP_LOOP;
+}
+
+static void peephole_mark_targets(Peephole* peephole) {
+  for (int i = 0; i < peephole->count; i++) {
+    peephole->instructions[i].is_target = false;
+  }
+  for (int i = 0; i < peephole->count; i++) {
+    PeepholeInstruction* instruction = &peephole->instructions[i];
+    if (!instruction->removed && peephole_is_jump(instruction->opcode)) {
+      peephole->instructions[instruction->target].is_target = true;
+    }
+  }
+}
+
+// Compacting the code only ever brings instructions closer together, so a
+// jump that fits before it does fits afterwards too. Conditional jumps can
+// only go forwards, while unconditional ones are turned into loops and back
+// again as needed when they're encoded.
+static void peephole_thread_jumps(Peephole* peephole) {
+  for (int i = 0; i < peephole->count; i++) {
+    PeepholeInstruction* instruction = &peephole->instructions[i];
+    if (!peephole_is_jump(instruction->opcode)) {
+      continue;
+    }
+
+    int target = instruction->target;
+    // Bounded, in case the jumps go around in a circle
+    for (int hops = 0; hops < peephole->count && peephole_is_unconditional_jump(peephole->instructions[target].opcode); hops++) {
+      int next_target = peephole->instructions[target].target;
+      int distance = abs(peephole->instructions[next_target].offset - (instruction->offset + instruction->length));
+      bool reachable = peephole_is_unconditional_jump(instruction->opcode) || next_target > i;
+      if (next_target == target || !reachable || distance > PEEPHOLE_MAX_JUMP) {
+        break;
+      }
+      target = next_target;
+    }
+    instruction->target = target;
+  }
+}
+
+static void peephole_merge_instructions(Peephole* peephole, Chunk* chunk) {
+  for (int i = 0; i < peephole->count; i++) {
+    PeepholeInstruction* instruction = &peephole->instructions[i];
+    if (instruction->removed) {
+      continue;
+    }
+
+    int next_index = peephole_next(peephole, i);
+    if (next_index == -1) {
+      break;
+    }
+    PeepholeInstruction* next = &peephole->instructions[next_index];
+
+    switch (instruction->opcode) {
+      case OP_EQUAL:
+      case OP_GREATER:
+      case OP_LESS:
+        if (next->opcode == OP_NOT && !next->is_target) {
+          instruction->opcode = instruction->opcode == OP_EQUAL ? OP_NOT_EQUAL
+                              : instruction->opcode == OP_GREATER ? OP_NOT_GREATER
+                              : OP_NOT_LESS;
+          next->removed = true;
+        }
+        break;
+      case OP_NOT: {
+        // Whatever jumps to the OP_NOT ends up at the jump instead, which
+        // makes the same decision about the value the OP_NOT would have
+        // negated. The value itself doesn't matter, since it's popped.
+        int after_jump = peephole_next(peephole, next_index);
+        if (next->opcode == OP_JUMP_IF_FALSE && !next->is_target &&
+            after_jump != -1 && peephole->instructions[after_jump].opcode == OP_POP &&
+            peephole->instructions[next->target].opcode == OP_POP) {
+          instruction->removed = true;
+          next->opcode = OP_JUMP_IF_TRUE;
+        }
+        break;
+      }
+      case OP_SET_LOCAL:
+      case OP_SET_UPVALUE:
+      case OP_SET_GLOBAL: {
+        uint8_t get = instruction->opcode == OP_SET_LOCAL ? OP_GET_LOCAL
+                    : instruction->opcode == OP_SET_UPVALUE ? OP_GET_UPVALUE
+                    : OP_GET_GLOBAL;
+        int get_index = peephole_next(peephole, next_index);
+        if (next->opcode == OP_POP && !next->is_target && get_index != -1) {
+          PeepholeInstruction* get_instruction = &peephole->instructions[get_index];
+          if (get_instruction->opcode == get && !get_instruction->is_target &&
+              chunk->code[get_instruction->offset + 1] == chunk->code[instruction->offset + 1]) {
+            next->removed = true;
+            get_instruction->removed = true;
+          }
+        }
+        break;
+      }
+      default:
+        break;
+    }
+  }
+}
+
+static void peephole_remove_jumps_to_next(Peephole* peephole) {
+  for (int i = 0; i < peephole->count; i++) {
+    PeepholeInstruction* instruction = &peephole->instructions[i];
+    if (!instruction->removed && instruction->opcode == OP_JUMP && instruction->target == peephole_next(peephole, i)) {
+      instruction->removed = true;
+    }
+  }
+}
+
+static int peephole_next(Peephole* peephole, int index) {
+  for (int i = index + 1; i < peephole->count; i++) {
+    if (!peephole->instructions[i].removed) {
+      return i;
+    }
+  }
+  return -1;
+}
+
+static void peephole_encode(Peephole* peephole, Chunk* chunk) {
+  // Instructions that were removed move to wherever the next one that's
+  // left ends up, so that jumps to them land there. The last instruction
+  // is always a return, which is never removed.
+  int* new_offsets = (int*)malloc(sizeof(int) * peephole->count);
+  int new_offset = 0;
+  for (int i = 0; i < peephole->count; i++) {
+    new_offsets[i] = new_offset;
+    if (!peephole->instructions[i].removed) {
+      new_offset += peephole->instructions[i].length;
+    }
+  }
+
+  uint8_t* code = (uint8_t*)malloc(chunk->count);
+  memcpy(code, chunk->code, chunk->count);
+  chunk->count = 0;
+  chunk->line_run_count = 0;
+
+  // The code only shrinks, so writing it back never grows the chunk
+  for (int i = 0; i < peephole->count; i++) {
+    PeepholeInstruction* instruction = &peephole->instructions[i];
+    if (instruction->removed) {
+      continue;
+    }
+
+    uint8_t opcode = instruction->opcode;
+    const uint8_t* operands = code + instruction->offset + 1;
+    uint8_t jump_operands[2];
+    if (peephole_is_jump(opcode)) {
+      int next = new_offsets[i] + instruction->length;
+      int target = new_offsets[instruction->target];
+      if (peephole_is_unconditional_jump(opcode)) {
+        opcode = target >= next ? OP_JUMP : OP_LOOP;
+      }
+      int jump = opcode == OP_LOOP ? next - target : target - next;
+      jump_operands[0] = (jump >> 8) & 0xff;
+      jump_operands[1] = jump & 0xff;
+      operands = jump_operands;
+    }
+
+    Chunk_write(chunk, opcode, instruction->line);
+    for (int j = 0; j < instruction->length - 1; j++) {
+      Chunk_write(chunk, operands[j], instruction->line);
+    }
+  }
+
+  free(code);
+  free(new_offsets);
+}
@@ -0,0 +1,25 @@
+#ifndef clox_peephole_h
+#define clox_peephole_h
+
+#include "common.h"
+#include "chunk.h"
+
+// Rewrites the code of a function once it has been compiled, so that fewer
+// instructions are dispatched when it runs:
+//
+// - Jumps to unconditional jumps go straight to where the chain ends.
+// - OP_EQUAL, OP_GREATER or OP_LESS followed by OP_NOT become a single
+//   OP_NOT_EQUAL, OP_NOT_GREATER or OP_NOT_LESS.
+// - OP_NOT followed by an OP_JUMP_IF_FALSE whose condition is popped either
+//   way becomes an OP_JUMP_IF_TRUE.
+// - Setting a variable, popping the value and getting the same variable
+//   again only sets the variable, leaving the value on the stack.
+// - Jumps to the next instruction are removed.
+//
+// The code is then compacted, with the jump offsets and the lines moved
+// along with it. Instructions that are jumped to are never merged into the
+// one before them. Code that doesn't decode cleanly, which compilers can
+// leave behind after reporting an error, is left alone.
+void Peephole_optimize(Chunk* chunk);
+
+#endif
@@ -0,0 +1,239 @@
+#include <string.h>
+
+#include "common.h"
+#include "scanner.h"
+
+static bool scanner_is_at_end(Scanner* scanner);
+static char scanner_advance(Scanner* scanner);
+static char scanner_peek(Scanner* scanner);
+static char scanner_peek_next(Scanner* scanner);
+static bool scanner_match(Scanner* scanner, char expected);
+static Token scanner_make_token(Scanner* scanner, TokenType type);
+static Token scanner_error_token(Scanner* scanner, const char* message);
+static void scanner_skip_whitespace(Scanner* scanner);
+static Token scanner_string(Scanner* scanner);
+static Token scanner_number(Scanner* scanner);
+static Token scanner_identifier(Scanner* scanner);
+static TokenType scanner_identifier_type(Scanner* scanner);
+static TokenType scanner_check_keyword(Scanner* scanner, int start, int length, const char* rest, TokenType type);
+static bool scanner_is_digit(char c);
+static bool scanner_is_alpha(char c);
+
+void Scanner_init(Scanner* scanner, const char* source) {
+  scanner->start = source;
+  scanner->current = source;
+  scanner->line = 1;
+}
+
+Token Scanner_scan_token(Scanner* scanner) {
+  scanner_skip_whitespace(scanner);
+  scanner->start = scanner->current;
+
+  if (scanner_is_at_end(scanner)) {
+    return scanner_make_token(scanner, TOKEN_EOF);
+  }
+
+  char c = scanner_advance(scanner);
+  if (scanner_is_alpha(c)) {
+    return scanner_identifier(scanner);
+  }
+  if (scanner_is_digit(c)) {
+    return scanner_number(scanner);
+  }
+
+  switch (c) {
+    case '(': return scanner_make_token(scanner, TOKEN_LEFT_PAREN);
+    case ')': return scanner_make_token(scanner, TOKEN_RIGHT_PAREN);
+    case '{': return scanner_make_token(scanner, TOKEN_LEFT_BRACE);
+    case '}': return scanner_make_token(scanner, TOKEN_RIGHT_BRACE);
+    case ';': return scanner_make_token(scanner, TOKEN_SEMICOLON);
+    case ',': return scanner_make_token(scanner, TOKEN_COMMA);
+    case '.': return scanner_make_token(scanner, TOKEN_DOT);
+    case '-': return scanner_make_token(scanner, TOKEN_MINUS);
+    case '+': return scanner_make_token(scanner, TOKEN_PLUS);
+    case '/': return scanner_make_token(scanner, TOKEN_SLASH);
+    case '*': return scanner_make_token(scanner, TOKEN_STAR);
+    case '!':
+      return scanner_make_token(scanner, scanner_match(scanner, '=') ? TOKEN_BANG_EQUAL : TOKEN_BANG);
+    case '=':
+      return scanner_make_token(scanner, scanner_match(scanner, '=') ? TOKEN_EQUAL_EQUAL : TOKEN_EQUAL);
+    case '<':
+      return scanner_make_token(scanner, scanner_match(scanner, '=') ? TOKEN_LESS_EQUAL : TOKEN_LESS);
+    case '>':
+      return scanner_make_token(scanner, scanner_match(scanner, '=') ? TOKEN_GREATER_EQUAL : TOKEN_GREATER);
+    case '"': return scanner_string(scanner);
+  }
+
+  return scanner_error_token(scanner, "Unexpected character.");
+}
+
+static bool scanner_is_at_end(Scanner* scanner) {
+  return *scanner->current == '\0';
+}
+
+static char scanner_advance(Scanner* scanner) {
+  scanner->current++;
+  return scanner->current[-1];
+}
+
+static char scanner_peek(Scanner* scanner) {
+  return *scanner->current;
+}
+
+// NOTE: Unlike the Ruby scanner, this relies on the source being
+// NUL-terminated rather than checking the length
+static char scanner_peek_next(Scanner* scanner) {
+  if (scanner_is_at_end(scanner)) {
+    return '\0';
+  }
+  return scanner->current[1];
+}
+
+static bool scanner_match(Scanner* scanner, char expected) {
+  if (scanner_is_at_end(scanner)) {
+    return false;
+  }
+  if (*scanner->current != expected) {
+    return false;
+  }
+  scanner->current++;
+  return true;
+}
+
+static Token scanner_make_token(Scanner* scanner, TokenType type) {
+  Token token;
+  token.type = type;
+  token.start = scanner->start;
+  token.length = (int)(scanner->current - scanner->start);
+  token.line = scanner->line;
+  return token;
+}
+
+static Token scanner_error_token(Scanner* scanner, const char* message) {
+  Token token;
+  token.type = TOKEN_ERROR;
+  token.start = message;
+  token.length = (int)strlen(message);
+  token.line = scanner->line;
+  return token;
+}
+
+static void scanner_skip_whitespace(Scanner* scanner) {
+  for (;;) {
+    char c = scanner_peek(scanner);
+    switch (c) {
+      case ' ':
+      case '\r':
+      case '\t':
+        scanner_advance(scanner);
+        break;
+      case '\n':
+        scanner->line++;
+        scanner_advance(scanner);
+        break;
+      case '/':
+        if (scanner_peek_next(scanner) == '/') {
+          while (scanner_peek(scanner) != '\n' && !scanner_is_at_end(scanner)) {
+            scanner_advance(scanner);
+          }
+        } else {
+          return;
+        }
+        break;
+      default:
+        return;
+    }
+  }
+}
+
+static Token scanner_string(Scanner* scanner) {
+  while (scanner_peek(scanner) != '"' && !scanner_is_at_end(scanner)) {
+    if (scanner_peek(scanner) == '\n') {
+      scanner->line++;
+    }
+    scanner_advance(scanner);
+  }
+
+  if (scanner_is_at_end(scanner)) {
+    return scanner_error_token(scanner, "Unterminated string.");
+  }
+
+  // The closing "
+  scanner_advance(scanner);
+  return scanner_make_token(scanner, TOKEN_STRING);
+}
+
+static Token scanner_number(Scanner* scanner) {
+  while (scanner_is_digit(scanner_peek(scanner))) {
+    scanner_advance(scanner);
+  }
+
+  // Look for a fractional part
+  if (scanner_peek(scanner) == '.' && scanner_is_digit(scanner_peek_next(scanner))) {
+    // Consume the .
+    scanner_advance(scanner);
+
+    while (scanner_is_digit(scanner_peek(scanner))) {
+      scanner_advance(scanner);
+    }
+  }
+
+  return scanner_make_token(scanner, TOKEN_NUMBER);
+}
+
+static Token scanner_identifier(Scanner* scanner) {
+  while (scanner_is_alpha(scanner_peek(scanner)) || scanner_is_digit(scanner_peek(scanner))) {
+    scanner_advance(scanner);
+  }
+  return scanner_make_token(scanner, scanner_identifier_type(scanner));
+}
+
+static TokenType scanner_identifier_type(Scanner* scanner) {
+  switch (scanner->start[0]) {
+    case 'a': return scanner_check_keyword(scanner, 1, 2, "nd", TOKEN_AND);
+    case 'c': return scanner_check_keyword(scanner, 1, 4, "lass", TOKEN_CLASS);
+    case 'e': return scanner_check_keyword(scanner, 1, 3, "lse", TOKEN_ELSE);
+    case 'f':
+      if (scanner->current - scanner->start > 1) {
+        switch (scanner->start[1]) {
+          case 'a': return scanner_check_keyword(scanner, 2, 3, "lse", TOKEN_FALSE);
+          case 'o': return scanner_check_keyword(scanner, 2, 1, "r", TOKEN_FOR);
+          case 'u': return scanner_check_keyword(scanner, 2, 1, "n", TOKEN_FUN);
+        }
+      }
+      break;
+    case 'i': return scanner_check_keyword(scanner, 1, 1, "f", TOKEN_IF);
+    case 'n': return scanner_check_keyword(scanner, 1, 2, "il", TOKEN_NIL);
+    case 'o': return scanner_check_keyword(scanner, 1, 1, "r", TOKEN_OR);
+    case 'p': return scanner_check_keyword(scanner, 1, 4, "rint", TOKEN_PRINT);
+    case 'r': return scanner_check_keyword(scanner, 1, 5, "eturn", TOKEN_RETURN);
+    case 's': return scanner_check_keyword(scanner, 1, 4, "uper", TOKEN_SUPER);
+    case 't':
+      if (scanner->current - scanner->start > 1) {
+        switch (scanner->start[1]) {
+          case 'h': return scanner_check_keyword(scanner, 2, 2, "is", TOKEN_THIS);
+          case 'r': return scanner_check_keyword(scanner, 2, 2, "ue", TOKEN_TRUE);
+        }
+      }
+      break;
+    case 'v': return scanner_check_keyword(scanner, 1, 2, "ar", TOKEN_VAR);
+    case 'w': return scanner_check_keyword(scanner, 1, 4, "hile", TOKEN_WHILE);
+  }
+
+  return TOKEN_IDENTIFIER;
+}
+
+static TokenType scanner_check_keyword(Scanner* scanner, int start, int length, const char* rest, TokenType type) {
+  if (scanner->current - scanner->start == start + length && memcmp(scanner->start + start, rest, length) == 0) {
+    return type;
+  }
+  return TOKEN_IDENTIFIER;
+}
+
+static bool scanner_is_digit(char c) {
+  return c >= '0' && c <= '9';
+}
+
+static bool scanner_is_alpha(char c) {
+  return (c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z') || c == '_';
+}
@@ -0,0 +1,73 @@
+#ifndef clox_scanner_h
+#define clox_scanner_h
+
+#include "common.h"
+
+typedef enum {
+  // Single-character tokens.
+  TOKEN_LEFT_PAREN,
+  TOKEN_RIGHT_PAREN,
+  TOKEN_LEFT_BRACE,
+  TOKEN_RIGHT_BRACE,
+  TOKEN_COMMA,
+  TOKEN_DOT,
+  TOKEN_MINUS,
+  TOKEN_PLUS,
+  TOKEN_SEMICOLON,
+  TOKEN_SLASH,
+  TOKEN_STAR,
+  // One or two character tokens.
+  TOKEN_BANG,
+  TOKEN_BANG_EQUAL,
+  TOKEN_EQUAL,
+  TOKEN_EQUAL_EQUAL,
+  TOKEN_GREATER,
+  TOKEN_GREATER_EQUAL,
+  TOKEN_LESS,
+  TOKEN_LESS_EQUAL,
+  // Literals.
+  TOKEN_IDENTIFIER,
+  TOKEN_STRING,
+  TOKEN_NUMBER,
+  // Keywords.
+  TOKEN_AND,
+  TOKEN_CLASS,
+  TOKEN_ELSE,
+  TOKEN_FALSE,
+  TOKEN_FOR,
+  TOKEN_FUN,
+  TOKEN_IF,
+  TOKEN_NIL,
+  TOKEN_OR,
+  TOKEN_PRINT,
+  TOKEN_RETURN,
+  TOKEN_SUPER,
+  TOKEN_THIS,
+  TOKEN_TRUE,
+  TOKEN_VAR,
+  TOKEN_WHILE,
+
+  TOKEN_ERROR,
+  TOKEN_EOF
+} TokenType;
+
+// Tokens point back into the source they were scanned from rather than
+// owning a copy of their lexemes. Error tokens point at a static message
+// instead.
+typedef struct {
+  TokenType type;
+  const char* start;
+  int length;
+  int line;
+} Token;
+
+typedef struct {
+  const char* start;
+  const char* current;
+  int line;
+} Scanner;
+
+void Scanner_init(Scanner* scanner, const char* source);
+Token Scanner_scan_token(Scanner* scanner);
+
+#endif
@@ -0,0 +1,190 @@
+#include "common.h"
+#include "memory_allocator.h"
+#include "object_types.h"
+#include "sealed_table.h"
+
+// How many displacements are tried for a single bucket before giving up
+// and retrying the whole build with twice as many slots
+#define SEALED_TABLE_MAX_DISPLACEMENT 1024
+// Sealing is abandoned (and the row stays as it is) rather than letting the
+// table grow beyond this many slots per selector
+#define SEALED_TABLE_MAX_SLOTS_PER_KEY 8
+
+static bool sealed_table_try_build(SealedTable* table, SealedEntry* keys, int count, int capacity);
+static bool sealed_table_place_bucket(SealedTable* table, SealedEntry* bucket, int bucket_size, uint32_t* slots);
+static uint32_t sealed_table_slot(SealedTable* table, int selector, uint32_t displacement);
+static int sealed_table_bucket(int bucket_count, int selector);
+static int sealed_table_power_of_two_at_least(int count);
+
+void SealedTable_init(SealedTable* table, MemoryAllocator* memory_allocator) {
+  table->count = 0;
+  table->capacity = 0;
+  table->bucket_count = 0;
+  table->displacements = NULL;
+  table->entries = NULL;
+  table->memory_allocator = memory_allocator;
+}
+
+void SealedTable_free(SealedTable* table) {
+  MemoryAllocator_free_array(table->memory_allocator, table->displacements, sizeof(uint32_t), table->bucket_count);
+  MemoryAllocator_free_array(table->memory_allocator, table->entries, sizeof(SealedEntry), table->capacity);
+  SealedTable_init(table, table->memory_allocator);
+}
+
+bool SealedTable_build(SealedTable* table, int base, ObjClosure** methods, int count) {
+  int key_count = 0;
+  for (int i = 0; i < count; i++) {
+    if (methods[i] != NULL) {
+      key_count++;
+    }
+  }
+
+  SealedEntry* keys = MemoryAllocator_allocate(table->memory_allocator, sizeof(SealedEntry), key_count);
+  int key_index = 0;
+  for (int i = 0; i < count; i++) {
+    if (methods[i] != NULL) {
+      keys[key_index].selector = base + i;
+      keys[key_index].method = methods[i];
+      key_index++;
+    }
+  }
+
+  bool is_built = false;
+  int max_capacity = sealed_table_power_of_two_at_least(key_count * SEALED_TABLE_MAX_SLOTS_PER_KEY);
+  for (int capacity = sealed_table_power_of_two_at_least(key_count); capacity <= max_capacity; capacity *= 2) {
+    if (sealed_table_try_build(table, keys, key_count, capacity)) {
+      is_built = true;
+      break;
+    }
+  }
+
+  MemoryAllocator_free_array(table->memory_allocator, keys, sizeof(SealedEntry), key_count);
+  return is_built;
+}
+
+size_t SealedTable_size(SealedTable* table) {
+  return sizeof(uint32_t) * table->bucket_count + sizeof(SealedEntry) * table->capacity;
+}
+
+ObjClosure* SealedTable_get(SealedTable* table, int selector) {
+  uint32_t displacement = table->displacements[sealed_table_bucket(table->bucket_count, selector)];
+  SealedEntry* entry = &table->entries[sealed_table_slot(table, selector, displacement)];
+  return entry->selector == selector ? entry->method : NULL;
+}
+
+static bool sealed_table_try_build(SealedTable* table, SealedEntry* keys, int count, int capacity) {
+  SealedTable_free(table);
+
+  // Two selectors per bucket on average keeps the search for displacements
+  // short
+  int bucket_count = sealed_table_power_of_two_at_least(count / 2);
+  table->capacity = capacity;
+  table->bucket_count = bucket_count;
+  table->count = count;
+  table->displacements = MemoryAllocator_allocate(table->memory_allocator, sizeof(uint32_t), bucket_count);
+  table->entries = MemoryAllocator_allocate(table->memory_allocator, sizeof(SealedEntry), capacity);
+  for (int i = 0; i < bucket_count; i++) {
+    table->displacements[i] = 0;
+  }
+  for (int i = 0; i < capacity; i++) {
+    table->entries[i].selector = -1;
+    table->entries[i].method = NULL;
+  }
+
+  // Counting sort the selectors by bucket, so that every bucket is
+  // contiguous
+  int* bucket_sizes = MemoryAllocator_allocate(table->memory_allocator, sizeof(int), bucket_count);
+  int* bucket_starts = MemoryAllocator_allocate(table->memory_allocator, sizeof(int), bucket_count);
+  SealedEntry* sorted_keys = MemoryAllocator_allocate(table->memory_allocator, sizeof(SealedEntry), count);
+  uint32_t* slots = MemoryAllocator_allocate(table->memory_allocator, sizeof(uint32_t), count);
+  for (int i = 0; i < bucket_count; i++) {
+    bucket_sizes[i] = 0;
+  }
+  for (int i = 0; i < count; i++) {
+    bucket_sizes[sealed_table_bucket(bucket_count, keys[i].selector)]++;
+  }
+  int largest_bucket_size = 0;
+  int next_start = 0;
+  for (int i = 0; i < bucket_count; i++) {
+    bucket_starts[i] = next_start;
+    next_start += bucket_sizes[i];
+    if (bucket_sizes[i] > largest_bucket_size) {
+      largest_bucket_size = bucket_sizes[i];
+    }
+    bucket_sizes[i] = 0;
+  }
+  for (int i = 0; i < count; i++) {
+    int bucket = sealed_table_bucket(bucket_count, keys[i].selector);
+    sorted_keys[bucket_starts[bucket] + bucket_sizes[bucket]++] = keys[i];
+  }
+
+  // Placing the largest buckets first, while the table is still mostly
+  // empty, makes it much more likely that every bucket finds a home
+  bool is_placed = true;
+  for (int size = largest_bucket_size; size > 0 && is_placed; size--) {
+    for (int bucket = 0; bucket < bucket_count; bucket++) {
+      if (bucket_sizes[bucket] != size) {
+        continue;
+      }
+      if (!sealed_table_place_bucket(table, &sorted_keys[bucket_starts[bucket]], size, slots)) {
+        is_placed = false;
+        break;
+      }
+    }
+  }
+
+  MemoryAllocator_free_array(table->memory_allocator, bucket_sizes, sizeof(int), bucket_count);
+  MemoryAllocator_free_array(table->memory_allocator, bucket_starts, sizeof(int), bucket_count);
+  MemoryAllocator_free_array(table->memory_allocator, sorted_keys, sizeof(SealedEntry), count);
+  MemoryAllocator_free_array(table->memory_allocator, slots, sizeof(uint32_t), count);
+
+  if (!is_placed) {
+    SealedTable_free(table);
+  }
+  return is_placed;
+}
+
+static bool sealed_table_place_bucket(SealedTable* table, SealedEntry* bucket, int bucket_size, uint32_t* slots) {
+  for (uint32_t displacement = 0; displacement < SEALED_TABLE_MAX_DISPLACEMENT; displacement++) {
+    bool fits = true;
+    for (int i = 0; i < bucket_size && fits; i++) {
+      slots[i] = sealed_table_slot(table, bucket[i].selector, displacement);
+      if (table->entries[slots[i]].selector != -1) {
+        fits = false;
+      }
+      for (int j = 0; j < i && fits; j++) {
+        if (slots[j] == slots[i]) {
+          fits = false;
+        }
+      }
+    }
+
+    if (fits) {
+      table->displacements[sealed_table_bucket(table->bucket_count, bucket[0].selector)] = displacement;
+      for (int i = 0; i < bucket_size; i++) {
+        table->entries[slots[i]] = bucket[i];
+      }
+      return true;
+    }
+  }
+
+  return false;
+}
+
+static uint32_t sealed_table_slot(SealedTable* table, int selector, uint32_t displacement) {
+  uint32_t mixed = ((uint32_t)selector ^ (displacement * 0x9e3779b9u)) * 0x85ebca6bu;
+  mixed ^= mixed >> 16;
+  return mixed & (uint32_t)(table->capacity - 1);
+}
+
+static int sealed_table_bucket(int bucket_count, int selector) {
+  return (int)((uint32_t)selector & (uint32_t)(bucket_count - 1));
+}
+
+static int sealed_table_power_of_two_at_least(int count) {
+  int result = 1;
+  while (result < count) {
+    result *= 2;
+  }
+  return result;
+}
@@ -0,0 +1,43 @@
+#ifndef clox_sealed_table_h
+#define clox_sealed_table_h
+
+#include "common.h"
+#include "memory_allocator.h"
+#include "object_types.h"
+
+// A SealedTable is a frozen, collision-free map from selectors to methods,
+// which a DispatchRow that's mostly empty is sealed into once its class has
+// been declared (see DispatchRow_seal). It is built once using a
+// hash-and-displace scheme: selectors are first grouped into buckets, and
+// then every bucket is given a displacement that moves all of its
+// selectors into distinct slots. A lookup is therefore always exactly one
+// displacement read, one entry read and one selector comparison, with no
+// probing. SealedTables can't be modified after they are built.
+
+typedef struct {
+  int selector; // -1 if the slot is empty
+  ObjClosure* method;
+} SealedEntry;
+
+typedef struct {
+  int count;
+  int capacity;
+  int bucket_count;
+  uint32_t* displacements;
+  SealedEntry* entries;
+  MemoryAllocator* memory_allocator;
+} SealedTable;
+
+void SealedTable_init(SealedTable* table, MemoryAllocator* memory_allocator);
+void SealedTable_free(SealedTable* table);
+
+// Builds the table from the count methods of a row that starts at
+// selector base, skipping the NULL ones. Returns false, leaving the table
+// empty, if no collision-free layout was found.
+bool SealedTable_build(SealedTable* table, int base, ObjClosure** methods, int count);
+// How much memory the table takes up, in bytes
+size_t SealedTable_size(SealedTable* table);
+// Returns NULL if there is no method for the selector
+ObjClosure* SealedTable_get(SealedTable* table, int selector);
+
+#endif
@@ -0,0 +1,70 @@
+#include <stdlib.h>
+
+#include "common.h"
+#include "scanner.h"
+#include "token_buffer.h"
+
+static void token_buffer_write_token(TokenBuffer* buffer, const char* source, Token* token);
+static void token_buffer_write_error(TokenBuffer* buffer, Token* token);
+
+void TokenBuffer_init(TokenBuffer* buffer) {
+  buffer->count = 0;
+  buffer->capacity = 0;
+  buffer->tokens = NULL;
+  buffer->error_count = 0;
+  buffer->error_capacity = 0;
+  buffer->errors = NULL;
+}
+
+// Scans all of source, including the final EOF token
+void TokenBuffer_scan(TokenBuffer* buffer, const char* source) {
+  Scanner scanner;
+  Scanner_init(&scanner, source);
+
+  for (;;) {
+    Token token = Scanner_scan_token(&scanner);
+    if (token.type == TOKEN_ERROR) {
+      token_buffer_write_error(buffer, &token);
+      continue;
+    }
+
+    token_buffer_write_token(buffer, source, &token);
+    if (token.type == TOKEN_EOF) {
+      break;
+    }
+  }
+}
+
+void TokenBuffer_free(TokenBuffer* buffer) {
+  free(buffer->tokens);
+  free(buffer->errors);
+  TokenBuffer_init(buffer);
+}
+
+// These buffers live outside of any VM, so they don't go through a
+// MemoryAllocator
+static void token_buffer_write_token(TokenBuffer* buffer, const char* source, Token* token) {
+  if (buffer->capacity < buffer->count + 1) {
+    buffer->capacity = buffer->capacity < 256 ? 256 : buffer->capacity * 2;
+    buffer->tokens = realloc(buffer->tokens, sizeof(PackedToken) * buffer->capacity);
+    if (buffer->tokens == NULL) exit(1);
+  }
+
+  PackedToken* packed = &buffer->tokens[buffer->count++];
+  packed->type = token->type;
+  packed->start = (int32_t)(token->start - source);
+  packed->length = token->length;
+  packed->line = token->line;
+}
+
+static void token_buffer_write_error(TokenBuffer* buffer, Token* token) {
+  if (buffer->error_capacity < buffer->error_count + 1) {
+    buffer->error_capacity = buffer->error_capacity < 8 ? 8 : buffer->error_capacity * 2;
+    buffer->errors = realloc(buffer->errors, sizeof(ScanError) * buffer->error_capacity);
+    if (buffer->errors == NULL) exit(1);
+  }
+
+  ScanError* error = &buffer->errors[buffer->error_count++];
+  error->line = token->line;
+  error->message = token->start;
+}
@@ -0,0 +1,40 @@
+#ifndef clox_token_buffer_h
+#define clox_token_buffer_h
+
+#include "common.h"
+#include "scanner.h"
+
+// A TokenBuffer holds all of the tokens of a source file, for the Ruby
+// parser to read in one go. Tokens are stored as byte offsets into the
+// source instead of pointers, so that Ruby can slice lexemes out of its
+// own copy of the source.
+//
+// Like the Ruby scanner, scanning errors don't produce tokens. They are
+// collected separately instead, in the order they were found.
+
+typedef struct {
+  int32_t type; // TokenType
+  int32_t start;
+  int32_t length;
+  int32_t line;
+} PackedToken;
+
+typedef struct {
+  int32_t line;
+  const char* message;
+} ScanError;
+
+typedef struct {
+  int count;
+  int capacity;
+  PackedToken* tokens;
+  int error_count;
+  int error_capacity;
+  ScanError* errors;
+} TokenBuffer;
+
+void TokenBuffer_init(TokenBuffer* buffer);
+void TokenBuffer_scan(TokenBuffer* buffer, const char* source);
+void TokenBuffer_free(TokenBuffer* buffer);
+
+#endif
@@ -0,0 +1,248 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "common.h"
+#include "disassembler.h"
+#include "trace.h"
+#include "value.h"
+#include "vm.h"
+
+#define TRACE_BUFFER_SIZE (64 * 1024)
+
+static Trace* trace_new(FILE* file);
+static void trace_log(Trace* trace, Vm* vm, ObjFunction* function, int offset);
+static int32_t trace_function_id(Trace* trace, ObjFunction* function);
+static void trace_write_function(Trace* trace, ObjFunction* function, int32_t id);
+static void trace_write(Trace* trace, const void* bytes, size_t count);
+static void trace_write_int(Trace* trace, int32_t value);
+static void trace_flush(Trace* trace);
+
+int Trace_version(void) {
+  return TRACE_VERSION;
+}
+
+Trace* Trace_new_log(void) {
+  return trace_new(NULL);
+}
+
+Trace* Trace_open(const char* path) {
+  FILE* file = fopen(path, "wb");
+  if (file == NULL) {
+    return NULL;
+  }
+  Trace* trace = trace_new(file);
+  if (trace == NULL) {
+    fclose(file);
+    return NULL;
+  }
+
+  TraceFileHeader header;
+  memset(&header, 0, sizeof(header));
+  memcpy(header.magic, TRACE_MAGIC, sizeof(header.magic));
+  header.version = TRACE_VERSION;
+  trace_write(trace, &header, sizeof(header));
+  return trace;
+}
+
+bool Trace_close(Trace* trace) {
+  bool written = true;
+  if (trace->file == NULL) {
+    fflush(stdout);
+  } else {
+    trace_flush(trace);
+    written = fclose(trace->file) == 0 && !trace->had_error;
+  }
+  free(trace->buffer);
+  free(trace->functions);
+  free(trace);
+  return written;
+}
+
+void Trace_instruction(Trace* trace, Vm* vm) {
+  CallFrame* frame = &vm->frames[vm->frame_count - 1];
+  ObjFunction* function = frame->closure->function;
+  int offset = (int)(frame->ip - function->chunk.code);
+  if (trace->file == NULL) {
+    trace_log(trace, vm, function, offset);
+    return;
+  }
+
+  TraceInstruction record;
+  memset(&record, 0, sizeof(record));
+  record.function = function == trace->last_function ? trace->last_id : trace_function_id(trace, function);
+  record.offset = offset;
+  record.frame_count = (uint16_t)vm->frame_count;
+  record.stack_depth = (uint16_t)(vm->stack_top - vm->stack);
+  if (vm->stack_top == vm->stack) {
+    record.top_type = TRACE_VALUE_NONE;
+  } else {
+    Value top = vm->stack_top[-1];
+    switch (top.type) {
+      case VAL_NIL:
+        record.top_type = TRACE_VALUE_NIL;
+        break;
+      case VAL_BOOL:
+        record.top_type = TRACE_VALUE_BOOL;
+        record.top_number = Value_as_boolean(top) ? 1 : 0;
+        break;
+      case VAL_NUMBER:
+        record.top_type = TRACE_VALUE_NUMBER;
+        record.top_number = Value_as_number(top);
+        break;
+      case VAL_OBJ:
+        record.top_type = TRACE_VALUE_OBJ;
+        record.top_object_type = (uint8_t)Object_type(top);
+        break;
+    }
+  }
+
+  uint8_t type = TRACE_RECORD_INSTRUCTION;
+  trace_write(trace, &type, sizeof(type));
+  trace_write(trace, &record, sizeof(record));
+}
+
+static Trace* trace_new(FILE* file) {
+  Trace* trace = (Trace*)malloc(sizeof(Trace));
+  uint8_t* buffer = file == NULL ? NULL : (uint8_t*)malloc(TRACE_BUFFER_SIZE);
+  if (trace == NULL || (file != NULL && buffer == NULL)) {
+    free(trace);
+    free(buffer);
+    return NULL;
+  }
+  trace->file = file;
+  trace->buffer = buffer;
+  trace->buffer_count = 0;
+  trace->functions = NULL;
+  trace->function_count = 0;
+  trace->function_capacity = 0;
+  trace->last_function = NULL;
+  trace->last_id = -1;
+  trace->had_error = false;
+  return trace;
+}
+
+// Lists the stack and then the instruction, with a header whenever another
+// function starts or picks up running
+static void trace_log(Trace* trace, Vm* vm, ObjFunction* function, int offset) {
+  if (function != trace->last_function) {
+    fprintf(stdout, "[DEBUG] == %s ==\n", function->name == NULL ? "<script>" : function->name->chars);
+    trace->last_function = function;
+  }
+  fputs("[DEBUG]           ", stdout);
+  for (Value* slot = vm->stack; slot < vm->stack_top; slot++) {
+    fputs("[ ", stdout);
+    Value_fprint(stdout, *slot);
+    fputs(" ]", stdout);
+  }
+  fputc('\n', stdout);
+  Disassembler_instruction(stdout, &function->chunk, offset);
+}
+
+// Functions are introduced to the trace the first time they run, and looked
+// up by their address in an open-addressed table after that
+static int32_t trace_function_id(Trace* trace, ObjFunction* function) {
+  if (trace->function_count + 1 > trace->function_capacity * 3 / 4) {
+    int old_capacity = trace->function_capacity;
+    TraceFunctionEntry* old_functions = trace->functions;
+    int capacity = old_capacity < 16 ? 16 : old_capacity * 2;
+    TraceFunctionEntry* functions = (TraceFunctionEntry*)calloc(capacity, sizeof(TraceFunctionEntry));
+    if (functions == NULL) {
+      exit(1);
+    }
+    for (int i = 0; i < old_capacity; i++) {
+      if (old_functions[i].function != NULL) {
+        size_t index = ((uintptr_t)old_functions[i].function >> 4) & (capacity - 1);
+        while (functions[index].function != NULL) {
+          index = (index + 1) & (capacity - 1);
+        }
+        functions[index] = old_functions[i];
+      }
+    }
+    free(old_functions);
+    trace->functions = functions;
+    trace->function_capacity = capacity;
+  }
+
+  size_t index = ((uintptr_t)function >> 4) & (trace->function_capacity - 1);
+  while (trace->functions[index].function != NULL && trace->functions[index].function != function) {
+    index = (index + 1) & (trace->function_capacity - 1);
+  }
+  TraceFunctionEntry* entry = &trace->functions[index];
+  if (entry->function == NULL) {
+    entry->function = function;
+    entry->id = trace->function_count++;
+    trace_write_function(trace, function, entry->id);
+  }
+
+  trace->last_function = function;
+  trace->last_id = entry->id;
+  return entry->id;
+}
+
+static void trace_write_function(Trace* trace, ObjFunction* function, int32_t id) {
+  uint8_t type = TRACE_RECORD_FUNCTION;
+  trace_write(trace, &type, sizeof(type));
+  trace_write_int(trace, id);
+  if (function->name == NULL) {
+    trace_write_int(trace, -1);
+  } else {
+    trace_write_int(trace, function->name->length);
+    trace_write(trace, function->name->chars, function->name->length);
+  }
+
+  // Each instruction is written with its offset and the length of its
+  // text, which can span more than one line
+  Chunk* chunk = &function->chunk;
+  int* offsets = (int*)malloc(sizeof(int) * (chunk->count + 1));
+  long* ends = (long*)malloc(sizeof(long) * (chunk->count + 1));
+  char* listing = NULL;
+  size_t listing_length = 0;
+  FILE* stream = open_memstream(&listing, &listing_length);
+  if (offsets == NULL || ends == NULL || stream == NULL) {
+    exit(1);
+  }
+  int32_t instruction_count = 0;
+  for (int offset = 0; offset < chunk->count; instruction_count++) {
+    offsets[instruction_count] = offset;
+    offset = Disassembler_instruction(stream, chunk, offset);
+    fflush(stream);
+    ends[instruction_count] = (long)listing_length;
+  }
+  fclose(stream);
+
+  trace_write_int(trace, instruction_count);
+  long start = 0;
+  for (int i = 0; i < instruction_count; i++) {
+    trace_write_int(trace, offsets[i]);
+    trace_write_int(trace, (int32_t)(ends[i] - start));
+    trace_write(trace, listing + start, ends[i] - start);
+    start = ends[i];
+  }
+  free(offsets);
+  free(ends);
+  free(listing);
+}
+
+static void trace_write(Trace* trace, const void* bytes, size_t count) {
+  if (trace->buffer_count + count > TRACE_BUFFER_SIZE) {
+    trace_flush(trace);
+  }
+  if (count > TRACE_BUFFER_SIZE) {
+    trace->had_error |= fwrite(bytes, 1, count, trace->file) != count;
+    return;
+  }
+  memcpy(trace->buffer + trace->buffer_count, bytes, count);
+  trace->buffer_count += count;
+}
+
+static void trace_write_int(Trace* trace, int32_t value) {
+  trace_write(trace, &value, sizeof(value));
+}
+
+static void trace_flush(Trace* trace) {
+  if (trace->buffer_count > 0) {
+    trace->had_error |= fwrite(trace->buffer, 1, trace->buffer_count, trace->file) != trace->buffer_count;
+    trace->buffer_count = 0;
+  }
+}
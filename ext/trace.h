@@ -0,0 +1,104 @@
+#ifndef clox_trace_h
+#define clox_trace_h
+
+#include <stdio.h>
+
+#include "common.h"
+#include "object.h"
+
+struct Vm;
+
+// Traces every instruction a VM interprets, from inside the VM, so that
+// tracing a program only costs a fraction of what running it costs. A VM
+// traces while its trace is set, see Vm.trace, and code that's been
+// compiled into native code isn't traced.
+//
+// A trace either logs what runs as it runs, one disassembled instruction at
+// a time after the values on the stack, or writes it to a file in a compact
+// binary format, for programs that run for too long for that to be read.
+// Trace files are read by Lox::Bytecode::TraceDecoder. They start with a
+// TraceFileHeader, which is followed by records that each start with their
+// TraceRecordType:
+//
+// - TRACE_RECORD_FUNCTION introduces a function the first time it runs: its
+//   id (int32_t), the length of its name and the name (NULL for the script,
+//   with a length of -1), and its disassembled instructions (a count,
+//   followed by the offset, length and text of each one).
+// - TRACE_RECORD_INSTRUCTION is a TraceInstruction, for an instruction that
+//   is about to run.
+//
+// Numbers are stored in native byte order, like in the VM's other binary
+// files (see binary_file.h).
+
+#define TRACE_MAGIC "LOXT"
+// Bump the version whenever the format or the opcodes change
+#define TRACE_VERSION 1
+
+typedef struct {
+  char magic[4];
+  uint32_t version;
+} TraceFileHeader;
+
+typedef enum {
+  TRACE_RECORD_FUNCTION,
+  TRACE_RECORD_INSTRUCTION
+} TraceRecordType;
+
+// What's on top of the stack, since a record can't hold the whole stack.
+// Objects only keep their ObjType.
+typedef enum {
+  TRACE_VALUE_NONE, // The stack is empty
+  TRACE_VALUE_NIL,
+  TRACE_VALUE_BOOL,
+  TRACE_VALUE_NUMBER,
+  TRACE_VALUE_OBJ
+} TraceValueType;
+
+typedef struct {
+  int32_t function;
+  int32_t offset;
+  uint16_t frame_count;
+  uint16_t stack_depth;
+  uint8_t top_type; // A TraceValueType
+  uint8_t top_object_type; // The ObjType, if the top is an object
+  uint8_t unused[2];
+  double top_number; // The number, or 1 or 0 for a boolean
+} TraceInstruction;
+
+typedef struct {
+  ObjFunction* function;
+  int32_t id;
+} TraceFunctionEntry;
+
+typedef struct Trace {
+  FILE* file; // NULL if the trace is logged
+  // Records are collected here and written out when it fills up
+  uint8_t* buffer;
+  size_t buffer_count;
+  // The functions that have been introduced, by their address. They're
+  // marked by the GC, since another function could take the address of one
+  // that's been freed.
+  TraceFunctionEntry* functions;
+  int function_count;
+  int function_capacity;
+  // The function of the last instruction, which is what the next one is
+  // usually in
+  ObjFunction* last_function;
+  int32_t last_id;
+  bool had_error;
+} Trace;
+
+int Trace_version(void);
+
+// Returns a trace that logs to stdout
+Trace* Trace_new_log(void);
+// Returns NULL if the file couldn't be created
+Trace* Trace_open(const char* path);
+// Writes whatever hasn't been written yet, and closes the file. Returns
+// false if any of the trace couldn't be written.
+bool Trace_close(Trace* trace);
+
+// Called before each instruction the VM interprets
+void Trace_instruction(Trace* trace, struct Vm* vm);
+
+#endif
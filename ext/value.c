@@ -24,18 +24,22 @@ bool Value_equals(Value a, Value b) {
 }
 
 void Value_print(Value value) {
+  Value_fprint(stdout, value);
+}
+
+void Value_fprint(FILE* stream, Value value) {
   switch (value.type) {
     case VAL_BOOL:
-      printf(Value_as_boolean(value) ? "true" : "false");
+      fputs(Value_as_boolean(value) ? "true" : "false", stream);
       break;
     case VAL_NIL:
-      printf("nil");
+      fputs("nil", stream);
       break;
     case VAL_NUMBER:
-      printf("%g", Value_as_number(value));
+      fprintf(stream, "%g", Value_as_number(value));
       break;
     case VAL_OBJ:
-      Object_print(value);
+      Object_fprint(stream, value);
       break;
   }
 }
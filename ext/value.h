@@ -1,6 +1,8 @@
 #ifndef clox_value_h
 #define clox_value_h
 
+#include <stdio.h>
+
 #include "common.h"
 #include "object_types.h"
 
@@ -22,6 +24,7 @@ typedef struct {
 
 bool Value_equals(Value a, Value b);
 void Value_print(Value value);
+void Value_fprint(FILE* stream, Value value);
 
 inline Value Value_make_boolean(bool value) {
   return (Value){VAL_BOOL, {.boolean = value}};
@@ -5,34 +5,52 @@
 #include <time.h>
 
 #include "common.h"
+#include "bytecode_file.h"
 #include "memory_allocator.h"
 #include "object.h"
 #include "table.h"
+#include "trace.h"
+#include "dispatch_row.h"
 #include "value.h"
 #include "vm.h"
 #include "gc.h"
 
+// What STACK_MAX sets aside for each frame, which a fiber's stack makes
+// room for with each call
+#define FIBER_FRAME_SLOTS 256
+#define FIBER_FRAMES_MIN 4
+
+static void vm_init(Vm* vm, Vm* code_heap);
 static uint32_t vm_hash_string(char* chars, int length);
+static ObjString* vm_find_interned_string(Vm* vm, char* chars, int length, uint32_t hash);
 static CallFrame* vm_current_frame(Vm* vm);
 static void vm_reset_stack(Vm* vm);
 static void vm_stack_push(Vm* vm, Value value);
 static Value vm_stack_pop(Vm* vm);
 static Value vm_stack_peek(Vm* vm, int distance);
 static InterpretResult vm_run(Vm* vm);
+static InterpretResult vm_run_traced(Vm* vm);
+static InterpretResult vm_run_compiled(Vm* vm);
 static inline InterpretResult vm_run_instruction(Vm* vm);
 static bool vm_is_falsey(Value value);
-static void vm_runtime_error(Vm* vm, const char* format, ...);
+static void vm_report_runtime_error(Vm* vm, const char* format, va_list args);
 static void vm_concatenate(Vm* vm);
+static inline bool vm_register_binary(Vm* vm, OpCode operation, Value a, Value b);
 static bool vm_call(Vm* vm, ObjClosure* closure, int arg_count);
 static bool vm_call_value(Vm* vm, Value callee, int arg_count);
 static bool vm_invoke(Vm* vm, ObjString* name, int arg_count);
 static bool vm_invoke_from_class(Vm* vm, ObjClass* klass, ObjString* name, int arg_count);
-static void vm_define_native(Vm* vm, char* name, NativeFn function);
-static void vm_define_method(Vm* vm, ObjString* name);
+static bool vm_inline_getter(Vm* vm, ObjClosure* method, int arg_count);
+static bool vm_define_method(Vm* vm, ObjString* name);
 static bool vm_bind_method(Vm* vm, ObjClass* klass, ObjString* name);
 static ObjUpvalue* vm_capture_upvalue(Vm* vm, Value* local);
+static Value* vm_upvalue_location(ObjClosure* closure, int slot);
 static void vm_close_upvalues(Vm* vm, Value* last);
 static ObjString* vm_allocate_string(Vm* vm, char* chars, int length, uint32_t hash);
+static void vm_swap_stacks(Vm* vm, ObjFiber* fiber);
+static void vm_grow_fiber_frames(Vm* vm);
+static void vm_reserve_fiber_stack(Vm* vm, int slot_count);
+static void vm_leave_fiber(Vm* vm);
 
 void vm_handle_new_object(void* callback_target, Obj* object) {
   Vm* vm = (Vm*) callback_target;
@@ -45,16 +63,186 @@ void vm_collect_garbage(void* callback_target) {
   Gc_collect(vm);
 }
 
-static Value vm_clock_native(int arg_count, Value* args) {
-  return Value_make_number((double)clock() / CLOCKS_PER_SEC);
+static bool vm_clock_native(Vm* vm, int arg_count, Value* args, Value* result) {
+  *result = Value_make_number((double)clock() / CLOCKS_PER_SEC);
+  return true;
+}
+
+// Fibers let a program suspend a function part of the way through and
+// pick it up again later, with these natives:
+//
+// - fiber(function) makes a fiber that will call function, which can take
+//   no arguments or one, when it's first resumed.
+// - resume(fiber) or resume(fiber, value) runs the fiber until it yields
+//   or returns, and returns the value it yielded or returned. The value
+//   is passed to the function the first time the fiber is resumed, and is
+//   what yield returns after that.
+// - yield() or yield(value) suspends the fiber that's running, and hands
+//   value back to whatever resumed it.
+// - done(fiber) is true once the fiber's function has returned.
+//
+// Natives that switch call stacks push the value the other call stack was
+// waiting for themselves, and vm_call_value leaves the stack alone when
+// the VM has switched fibers.
+
+static bool vm_fiber_native(Vm* vm, int arg_count, Value* args, Value* result) {
+  if (arg_count != 1) {
+    Vm_runtime_error(vm, "Expected 1 arguments but got %d.", arg_count);
+    return false;
+  }
+  if (!Object_is_closure(args[0]) || Object_as_closure(args[0])->function->arity > 1) {
+    Vm_runtime_error(vm, "Can only make fibers from functions that take at most one argument.");
+    return false;
+  }
+  *result = Value_make_obj((Obj*)Object_allocate_new_fiber(&vm->memory_allocator, Object_as_closure(args[0])));
+  vm->fiber_count++;
+  return true;
+}
+
+static bool vm_resume_native(Vm* vm, int arg_count, Value* args, Value* result) {
+  if (arg_count != 1 && arg_count != 2) {
+    Vm_runtime_error(vm, "Expected 1 or 2 arguments but got %d.", arg_count);
+    return false;
+  }
+  if (!Object_is_fiber(args[0])) {
+    Vm_runtime_error(vm, "Can only resume fibers.");
+    return false;
+  }
+  ObjFiber* fiber = Object_as_fiber(args[0]);
+  if (fiber->state == FIBER_RUNNING) {
+    Vm_runtime_error(vm, "Can't resume a fiber that's already running.");
+    return false;
+  }
+  if (fiber->state == FIBER_DONE) {
+    Vm_runtime_error(vm, "Can't resume a fiber that has finished.");
+    return false;
+  }
+
+  Value value = arg_count == 2 ? args[1] : Value_make_nil();
+  FiberState state = fiber->state;
+  vm_swap_stacks(vm, fiber);
+  fiber->caller = vm->fiber;
+  fiber->state = FIBER_RUNNING;
+  vm->fiber = fiber;
+  // The resumer gets its result when the fiber yields or returns. Until the
+  // value has been pushed, the call stays on the resumer's stack, where the
+  // garbage collector can see it.
+  if (state == FIBER_SUSPENDED) {
+    vm_stack_push(vm, value); // What yield returns
+    fiber->stack_top -= arg_count + 1;
+    return true;
+  }
+
+  ObjClosure* closure = fiber->closure;
+  vm_reserve_fiber_stack(vm, FIBER_FRAME_SLOTS);
+  vm_stack_push(vm, Value_make_obj((Obj*)closure));
+  if (closure->function->arity == 1) {
+    vm_stack_push(vm, value);
+  }
+  fiber->stack_top -= arg_count + 1;
+  return vm_call(vm, closure, closure->function->arity);
+}
+
+static bool vm_yield_native(Vm* vm, int arg_count, Value* args, Value* result) {
+  if (arg_count > 1) {
+    Vm_runtime_error(vm, "Expected 0 or 1 arguments but got %d.", arg_count);
+    return false;
+  }
+  if (vm->fiber == NULL) {
+    Vm_runtime_error(vm, "Can only yield from inside a fiber.");
+    return false;
+  }
+
+  Value value = arg_count == 1 ? args[0] : Value_make_nil();
+  vm->stack_top -= arg_count + 1;
+  ObjFiber* fiber = vm->fiber;
+  vm_swap_stacks(vm, fiber);
+  vm->fiber = fiber->caller;
+  fiber->caller = NULL;
+  fiber->state = FIBER_SUSPENDED;
+  vm_stack_push(vm, value); // What resume returns
+  return true;
+}
+
+static bool vm_done_native(Vm* vm, int arg_count, Value* args, Value* result) {
+  if (arg_count != 1) {
+    Vm_runtime_error(vm, "Expected 1 arguments but got %d.", arg_count);
+    return false;
+  }
+  if (!Object_is_fiber(args[0])) {
+    Vm_runtime_error(vm, "Can only check whether fibers are done.");
+    return false;
+  }
+  *result = Value_make_boolean(Object_as_fiber(args[0])->state == FIBER_DONE);
+  return true;
+}
+
+// Heap snapshots refer to natives by their index in here, because their
+// addresses change from one process to the next
+static NativeFn vm_natives[] = { vm_clock_native, vm_fiber_native, vm_resume_native, vm_yield_native, vm_done_native };
+#define VM_NATIVE_COUNT ((int)(sizeof(vm_natives) / sizeof(NativeFn)))
+
+int Vm_native_index(NativeFn function) {
+  for (int i = 0; i < VM_NATIVE_COUNT; i++) {
+    if (vm_natives[i] == function) {
+      return i;
+    }
+  }
+  return -1;
+}
+
+NativeFn Vm_native_at(int index) {
+  if (index < 0 || index >= VM_NATIVE_COUNT) {
+    return NULL;
+  }
+  return vm_natives[index];
 }
 
 void Vm_init(Vm* vm) {
+  vm_init(vm, NULL);
+}
+
+void Vm_init_shared(Vm* vm, Vm* code_heap) {
+  vm_init(vm, code_heap);
+}
+
+void Vm_freeze(Vm* vm, ObjFunction* function) {
+  MemoryAllocator_push_root(&vm->memory_allocator, (Obj*)function);
+  Gc_collect(vm);
+  MemoryAllocator_pop_root(&vm->memory_allocator);
+  // Nothing is collected from here on, so the objects can be walked while
+  // the selectors are handed out
+  vm->memory_allocator.gc_enabled = false;
+
+  for (Obj* object = vm->objects; object != NULL; object = object->next) {
+    if (object->type == OBJ_STRING) {
+      Vm_intern_selector(vm, (ObjString*)object);
+    }
+    object->is_shared = true;
+  }
+}
+
+static void vm_init(Vm* vm, Vm* code_heap) {
+  vm->frames = vm->root_frames;
+  vm->frame_capacity = FRAMES_MAX;
+  vm->stack = vm->root_stack;
+  vm->stack_capacity = STACK_MAX;
+  vm->fiber = NULL;
+  vm->fiber_count = 0;
   vm_reset_stack(vm);
   vm->objects = NULL;
   vm->gray_count = 0;
   vm->gray_capacity = 0;
   vm->gray_stack = NULL;
+  vm->images = NULL;
+  vm->compile_function = NULL;
+  vm->output = stdout;
+  vm->errors = stderr;
+  vm->code_heap = code_heap;
+  vm->returned = Value_make_nil();
+  vm->isolate = NULL;
+  vm->budget = BUDGET_UNLIMITED;
+  vm->trace = NULL;
   MemoryCallbacks memory_callbacks = {
     .handle_new_object = vm_handle_new_object,
     .collect_garbage = vm_collect_garbage
@@ -62,11 +250,17 @@ void Vm_init(Vm* vm) {
   MemoryAllocator_init(&vm->memory_allocator, vm, memory_callbacks);
   Table_init(&vm->globals, &vm->memory_allocator);
   Table_init(&vm->strings, &vm->memory_allocator);
+  ValueArray_init(&vm->selectors, &vm->memory_allocator);
 
   vm->init_string = NULL; // Protect GC if it runs while allocating this
   vm->init_string = Vm_copy_string(vm, "init", 4);
+  Vm_intern_selector(vm, vm->init_string);
 
-  vm_define_native(vm, "clock", vm_clock_native);
+  Vm_define_native(vm, "clock", vm_clock_native);
+  Vm_define_native(vm, "fiber", vm_fiber_native);
+  Vm_define_native(vm, "resume", vm_resume_native);
+  Vm_define_native(vm, "yield", vm_yield_native);
+  Vm_define_native(vm, "done", vm_done_native);
 }
 
 void Vm_init_function(Vm* vm, ObjFunction* function) {
@@ -79,13 +273,22 @@ void Vm_init_function(Vm* vm, ObjFunction* function) {
 
 InterpretResult Vm_interpret(Vm* vm, ObjFunction* function) {
   Vm_init_function(vm, function);
-  return vm_run(vm);
+  return vm->trace != NULL ? vm_run_traced(vm) : vm_run(vm);
+}
+
+InterpretResult Vm_resume(Vm* vm) {
+  return vm->trace != NULL ? vm_run_traced(vm) : vm_run(vm);
 }
 
 InterpretResult Vm_interpret_next_instruction(Vm* vm) {
   return vm_run_instruction(vm);
 }
 
+InterpretResult Vm_interpret_compiled(Vm* vm, ObjFunction* function) {
+  Vm_init_function(vm, function);
+  return vm_run_compiled(vm);
+}
+
 static void vm_stack_push(Vm* vm, Value value) {
   *vm->stack_top = value;
   *vm->stack_top++;
@@ -101,13 +304,25 @@ ObjFunction* Vm_new_function(Vm* vm) {
   function->arity = 0;
   function->upvalue_count = 0;
   function->name = NULL;
+  function->compiled = NULL;
+  function->getter = NULL;
   Chunk_init(&function->chunk, &vm->memory_allocator);
   return function;
 }
 
+void Vm_finish_function(ObjFunction* function) {
+  Chunk* chunk = &function->chunk;
+  function->getter = NULL;
+  if (function->arity == 0 && chunk->count >= 5 &&
+      chunk->code[0] == OP_GET_LOCAL && chunk->code[1] == 0 &&
+      chunk->code[2] == OP_GET_PROPERTY && chunk->code[4] == OP_RETURN) {
+    function->getter = Object_as_string(chunk->constants.values[chunk->code[3]]);
+  }
+}
+
 ObjString* Vm_copy_string(Vm* vm, char* chars, int length) {
   uint32_t hash = vm_hash_string(chars, length);
-  ObjString* interned = Table_find_string(&vm->strings, chars, length, hash);
+  ObjString* interned = vm_find_interned_string(vm, chars, length, hash);
   if (interned != NULL) {
     return interned;
   }
@@ -120,7 +335,7 @@ ObjString* Vm_copy_string(Vm* vm, char* chars, int length) {
 
 ObjString* Vm_take_string(Vm* vm, char* chars, int length) {
   uint32_t hash = vm_hash_string(chars, length);
-  ObjString* interned = Table_find_string(&vm->strings, chars, length, hash);
+  ObjString* interned = vm_find_interned_string(vm, chars, length, hash);
   if (interned != NULL) {
     MemoryAllocator_free_array(&vm->memory_allocator, chars, sizeof(char), length + 1);
     return interned;
@@ -130,6 +345,9 @@ ObjString* Vm_take_string(Vm* vm, char* chars, int length) {
 }
 
 void Vm_free(Vm* vm) {
+  // Fibers that are running hold on to other call stacks, which mustn't be
+  // freed along with them
+  vm_reset_stack(vm);
   Table_free(&vm->globals);
   Obj* object = vm->objects;
   while (object != NULL) {
@@ -139,10 +357,42 @@ void Vm_free(Vm* vm) {
   }
 
   Table_free(&vm->strings);
+  ValueArray_free(&vm->selectors);
 
-  Object_free(&vm->memory_allocator, (Obj*)vm->init_string);
+  // The init string was freed along with every other object
+  vm->init_string = NULL;
 
   free(vm->gray_stack);
+  MemoryAllocator_free_roots(&vm->memory_allocator);
+
+  // Only once nothing can be running the code in them anymore
+  BytecodeFile_unmap_images(vm);
+}
+
+// Selectors are handed out in the order method names are first seen, so
+// the methods declared together in one class usually get neighbouring
+// selectors, which keeps the dispatch rows of classes short.
+int Vm_intern_selector(Vm* vm, ObjString* name) {
+  if (name->selector == -1) {
+    MemoryAllocator_push_root(&vm->memory_allocator, (Obj*)name);
+    ValueArray_write(&vm->selectors, Value_make_obj((Obj*)name));
+    MemoryAllocator_pop_root(&vm->memory_allocator);
+    // The selectors of a VM that shares a code heap follow on from the
+    // heap's own
+    int first_selector = vm->code_heap == NULL ? 0 : vm->code_heap->selectors.count;
+    name->selector = first_selector + vm->selectors.count - 1;
+  }
+  return name->selector;
+}
+
+static ObjString* vm_find_interned_string(Vm* vm, char* chars, int length, uint32_t hash) {
+  if (vm->code_heap != NULL) {
+    ObjString* shared = Table_find_string(&vm->code_heap->strings, chars, length, hash);
+    if (shared != NULL) {
+      return shared;
+    }
+  }
+  return Table_find_string(&vm->strings, chars, length, hash);
 }
 
 static uint32_t vm_hash_string(char* key, int length) {
@@ -159,7 +409,13 @@ static CallFrame* vm_current_frame(Vm* vm) {
   return &vm->frames[vm->frame_count - 1];
 }
 
+// Also abandons the fibers that are running, which happens when one of them
+// has a runtime error
 static void vm_reset_stack(Vm* vm) {
+  while (vm->fiber != NULL) {
+    vm_close_upvalues(vm, vm->stack);
+    vm_leave_fiber(vm);
+  }
   vm->stack_top = vm->stack;
   vm->frame_count = 0;
   vm->open_upvalues = NULL;
@@ -182,6 +438,18 @@ static inline ObjString* vm_read_string(CallFrame* call_frame) {
   return Object_as_string(vm_read_constant(call_frame));
 }
 
+// The superinstructions that fuse loading their operands with the
+// operation: the first operand is read straight out of a local's slot, and
+// the second out of another slot or the constants, instead of both being
+// pushed by instructions of their own first
+#define REGISTER_BINARY_OP(operation, b) \
+  do { \
+    Value a = call_frame->slots[vm_read_byte(call_frame)]; \
+    if (!vm_register_binary(vm, operation, a, b)) { \
+      return INTERPRET_RUNTIME_ERROR; \
+    } \
+  } while (false)
+
 static inline InterpretResult vm_run_instruction(Vm* vm) {
   CallFrame* call_frame = vm_current_frame(vm);
   uint8_t instruction;
@@ -213,11 +481,16 @@ static inline InterpretResult vm_run_instruction(Vm* vm) {
       call_frame->slots[slot] = vm_stack_peek(vm, 0);
       break;
     }
+    case OP_STORE_LOCAL: {
+      uint8_t slot = vm_read_byte(call_frame);
+      call_frame->slots[slot] = vm_stack_pop(vm);
+      break;
+    }
     case OP_GET_GLOBAL: {
       ObjString* name = vm_read_string(call_frame);
       Value value;
       if (!Table_get(&vm->globals, name, &value)) {
-        vm_runtime_error(vm, "Undefined variable '%s'.", name->chars);
+        Vm_runtime_error(vm, "Undefined variable '%s'.", name->chars);
         return INTERPRET_RUNTIME_ERROR;
       }
       vm_stack_push(vm, value);
@@ -233,24 +506,29 @@ static inline InterpretResult vm_run_instruction(Vm* vm) {
       ObjString* name = vm_read_string(call_frame);
       if (Table_set(&vm->globals, name, vm_stack_peek(vm, 0))) {
         Table_delete(&vm->globals, name);
-        vm_runtime_error(vm, "Undefined variable '%s'.", name->chars);
+        Vm_runtime_error(vm, "Undefined variable '%s'.", name->chars);
         return INTERPRET_RUNTIME_ERROR;
       }
       break;
     }
     case OP_GET_UPVALUE: {
       uint8_t slot = vm_read_byte(call_frame);
-      vm_stack_push(vm, *call_frame->closure->upvalues[slot]->location);
+      vm_stack_push(vm, *vm_upvalue_location(call_frame->closure, slot));
       break;
     }
     case OP_SET_UPVALUE: {
       uint8_t slot = vm_read_byte(call_frame);
-      *call_frame->closure->upvalues[slot]->location = vm_stack_peek(vm, 0);
+      *vm_upvalue_location(call_frame->closure, slot) = vm_stack_peek(vm, 0);
+      break;
+    }
+    case OP_GET_CAPTURED: {
+      uint8_t slot = vm_read_byte(call_frame);
+      vm_stack_push(vm, call_frame->closure->upvalues[slot]);
       break;
     }
     case OP_GET_PROPERTY: {
       if (!Object_is_instance(vm_stack_peek(vm, 0))) {
-        vm_runtime_error(vm, "Only instances have properties.");
+        Vm_runtime_error(vm, "Only instances have properties.");
         return INTERPRET_RUNTIME_ERROR;
       }
       ObjInstance* instance = Object_as_instance(vm_stack_peek(vm, 0));
@@ -268,9 +546,37 @@ static inline InterpretResult vm_run_instruction(Vm* vm) {
       }
       break;
     }
+    // Gets a property that's about to be called, like OP_GET_PROPERTY, except
+    // that a method is left unbound: the receiver stays where it is and
+    // OP_CALL_METHOD finds the method again once the arguments have been
+    // pushed, so no bound method has to be allocated
+    case OP_GET_METHOD: {
+      if (!Object_is_instance(vm_stack_peek(vm, 0))) {
+        Vm_runtime_error(vm, "Only instances have properties.");
+        return INTERPRET_RUNTIME_ERROR;
+      }
+      ObjInstance* instance = Object_as_instance(vm_stack_peek(vm, 0));
+      ObjString* name = vm_read_string(call_frame);
+
+      Value value;
+      if (Table_get(&instance->fields, name, &value)) {
+        // Instances can't be called, and leaving one here would make it look
+        // like a receiver, so it's swapped for another value that can't be
+        // called either, which fails with the same error
+        vm_stack_pop(vm); // Pop off the instance
+        vm_stack_push(vm, Object_is_instance(value) ? Value_make_nil() : value);
+        break;
+      }
+
+      if (DispatchRow_get(&instance->klass->methods, name->selector) == NULL) {
+        Vm_runtime_error(vm, "Undefined property '%s'.", name->chars);
+        return INTERPRET_RUNTIME_ERROR;
+      }
+      break;
+    }
     case OP_SET_PROPERTY: {
       if (!Object_is_instance(vm_stack_peek(vm, 1))) {
-        vm_runtime_error(vm, "Only instances have fields.");
+        Vm_runtime_error(vm, "Only instances have fields.");
         return INTERPRET_RUNTIME_ERROR;
       }
       ObjInstance* instance = Object_as_instance(vm_stack_peek(vm, 1));
@@ -282,6 +588,10 @@ static inline InterpretResult vm_run_instruction(Vm* vm) {
     }
     case OP_GET_SUPER: {
       ObjString* name = vm_read_string(call_frame);
+      if (!Object_is_class(vm_stack_peek(vm, 0))) {
+        Vm_runtime_error(vm, "Superclass must be a class.");
+        return INTERPRET_RUNTIME_ERROR;
+      }
       ObjClass* superclass = Object_as_class(vm_stack_pop(vm));
 
       if (!vm_bind_method(vm, superclass, name)) {
@@ -297,7 +607,7 @@ static inline InterpretResult vm_run_instruction(Vm* vm) {
     }
     case OP_GREATER: {
       if (!Value_is_number(vm_stack_peek(vm, 0)) || !Value_is_number(vm_stack_peek(vm, 1))) {
-        vm_runtime_error(vm, "Operands must be numbers.");
+        Vm_runtime_error(vm, "Operands must be numbers.");
         return INTERPRET_RUNTIME_ERROR;
       }
       double b = Value_as_number(vm_stack_pop(vm));
@@ -307,7 +617,7 @@ static inline InterpretResult vm_run_instruction(Vm* vm) {
     }
     case OP_LESS: {
       if (!Value_is_number(vm_stack_peek(vm, 0)) || !Value_is_number(vm_stack_peek(vm, 1))) {
-        vm_runtime_error(vm, "Operands must be numbers.");
+        Vm_runtime_error(vm, "Operands must be numbers.");
         return INTERPRET_RUNTIME_ERROR;
       }
       double b = Value_as_number(vm_stack_pop(vm));
@@ -315,6 +625,34 @@ static inline InterpretResult vm_run_instruction(Vm* vm) {
       vm_stack_push(vm, Value_make_boolean(a < b));
       break;
     }
+    case OP_NOT_EQUAL: {
+      Value b = vm_stack_pop(vm);
+      Value a = vm_stack_pop(vm);
+      vm_stack_push(vm, Value_make_boolean(!Value_equals(a, b)));
+      break;
+    }
+    // These negate the comparison rather than doing the opposite one, which
+    // is what a >= b and a <= b compile to, and which differs for NaN
+    case OP_NOT_GREATER: {
+      if (!Value_is_number(vm_stack_peek(vm, 0)) || !Value_is_number(vm_stack_peek(vm, 1))) {
+        Vm_runtime_error(vm, "Operands must be numbers.");
+        return INTERPRET_RUNTIME_ERROR;
+      }
+      double b = Value_as_number(vm_stack_pop(vm));
+      double a = Value_as_number(vm_stack_pop(vm));
+      vm_stack_push(vm, Value_make_boolean(!(a > b)));
+      break;
+    }
+    case OP_NOT_LESS: {
+      if (!Value_is_number(vm_stack_peek(vm, 0)) || !Value_is_number(vm_stack_peek(vm, 1))) {
+        Vm_runtime_error(vm, "Operands must be numbers.");
+        return INTERPRET_RUNTIME_ERROR;
+      }
+      double b = Value_as_number(vm_stack_pop(vm));
+      double a = Value_as_number(vm_stack_pop(vm));
+      vm_stack_push(vm, Value_make_boolean(!(a < b)));
+      break;
+    }
     case OP_ADD: {
       if (Object_is_string(vm_stack_peek(vm, 0)) && Object_is_string(vm_stack_peek(vm, 1))) {
         vm_concatenate(vm);
@@ -323,14 +661,14 @@ static inline InterpretResult vm_run_instruction(Vm* vm) {
         double a = Value_as_number(vm_stack_pop(vm));
         vm_stack_push(vm, Value_make_number(a + b));
       } else {
-        vm_runtime_error(vm, "Operands must be two numbers or two strings.");
+        Vm_runtime_error(vm, "Operands must be two numbers or two strings.");
         return INTERPRET_RUNTIME_ERROR;
       }
       break;
     }
     case OP_SUBTRACT: {
       if (!Value_is_number(vm_stack_peek(vm, 0)) || !Value_is_number(vm_stack_peek(vm, 1))) {
-        vm_runtime_error(vm, "Operands must be numbers.");
+        Vm_runtime_error(vm, "Operands must be numbers.");
         return INTERPRET_RUNTIME_ERROR;
       }
       double b = Value_as_number(vm_stack_pop(vm));
@@ -340,7 +678,7 @@ static inline InterpretResult vm_run_instruction(Vm* vm) {
     }
     case OP_MULTIPLY: {
       if (!Value_is_number(vm_stack_peek(vm, 0)) || !Value_is_number(vm_stack_peek(vm, 1))) {
-        vm_runtime_error(vm, "Operands must be numbers.");
+        Vm_runtime_error(vm, "Operands must be numbers.");
         return INTERPRET_RUNTIME_ERROR;
       }
       double b = Value_as_number(vm_stack_pop(vm));
@@ -350,7 +688,7 @@ static inline InterpretResult vm_run_instruction(Vm* vm) {
     }
     case OP_DIVIDE: {
       if (!Value_is_number(vm_stack_peek(vm, 0)) || !Value_is_number(vm_stack_peek(vm, 1))) {
-        vm_runtime_error(vm, "Operands must be numbers.");
+        Vm_runtime_error(vm, "Operands must be numbers.");
         return INTERPRET_RUNTIME_ERROR;
       }
       double b = Value_as_number(vm_stack_pop(vm));
@@ -358,19 +696,94 @@ static inline InterpretResult vm_run_instruction(Vm* vm) {
       vm_stack_push(vm, Value_make_number(a / b));
       break;
     }
+    // The compiler only uses these when it has proven that both operands are
+    // numbers (see TypeInference)
+    case OP_ADD_NUMBERS: {
+      double b = Value_as_number(vm_stack_pop(vm));
+      double a = Value_as_number(vm_stack_pop(vm));
+      vm_stack_push(vm, Value_make_number(a + b));
+      break;
+    }
+    case OP_SUBTRACT_NUMBERS: {
+      double b = Value_as_number(vm_stack_pop(vm));
+      double a = Value_as_number(vm_stack_pop(vm));
+      vm_stack_push(vm, Value_make_number(a - b));
+      break;
+    }
+    case OP_MULTIPLY_NUMBERS: {
+      double b = Value_as_number(vm_stack_pop(vm));
+      double a = Value_as_number(vm_stack_pop(vm));
+      vm_stack_push(vm, Value_make_number(a * b));
+      break;
+    }
+    case OP_DIVIDE_NUMBERS: {
+      double b = Value_as_number(vm_stack_pop(vm));
+      double a = Value_as_number(vm_stack_pop(vm));
+      vm_stack_push(vm, Value_make_number(a / b));
+      break;
+    }
+    case OP_GREATER_NUMBERS: {
+      double b = Value_as_number(vm_stack_pop(vm));
+      double a = Value_as_number(vm_stack_pop(vm));
+      vm_stack_push(vm, Value_make_boolean(a > b));
+      break;
+    }
+    case OP_LESS_NUMBERS: {
+      double b = Value_as_number(vm_stack_pop(vm));
+      double a = Value_as_number(vm_stack_pop(vm));
+      vm_stack_push(vm, Value_make_boolean(a < b));
+      break;
+    }
+    // Superinstructions, see REGISTER_BINARY_OP
+    case OP_ADD_REGISTERS:
+      REGISTER_BINARY_OP(OP_ADD, call_frame->slots[vm_read_byte(call_frame)]);
+      break;
+    case OP_SUBTRACT_REGISTERS:
+      REGISTER_BINARY_OP(OP_SUBTRACT, call_frame->slots[vm_read_byte(call_frame)]);
+      break;
+    case OP_MULTIPLY_REGISTERS:
+      REGISTER_BINARY_OP(OP_MULTIPLY, call_frame->slots[vm_read_byte(call_frame)]);
+      break;
+    case OP_DIVIDE_REGISTERS:
+      REGISTER_BINARY_OP(OP_DIVIDE, call_frame->slots[vm_read_byte(call_frame)]);
+      break;
+    case OP_GREATER_REGISTERS:
+      REGISTER_BINARY_OP(OP_GREATER, call_frame->slots[vm_read_byte(call_frame)]);
+      break;
+    case OP_LESS_REGISTERS:
+      REGISTER_BINARY_OP(OP_LESS, call_frame->slots[vm_read_byte(call_frame)]);
+      break;
+    case OP_ADD_REGISTER_CONSTANT:
+      REGISTER_BINARY_OP(OP_ADD, vm_read_constant(call_frame));
+      break;
+    case OP_SUBTRACT_REGISTER_CONSTANT:
+      REGISTER_BINARY_OP(OP_SUBTRACT, vm_read_constant(call_frame));
+      break;
+    case OP_MULTIPLY_REGISTER_CONSTANT:
+      REGISTER_BINARY_OP(OP_MULTIPLY, vm_read_constant(call_frame));
+      break;
+    case OP_DIVIDE_REGISTER_CONSTANT:
+      REGISTER_BINARY_OP(OP_DIVIDE, vm_read_constant(call_frame));
+      break;
+    case OP_GREATER_REGISTER_CONSTANT:
+      REGISTER_BINARY_OP(OP_GREATER, vm_read_constant(call_frame));
+      break;
+    case OP_LESS_REGISTER_CONSTANT:
+      REGISTER_BINARY_OP(OP_LESS, vm_read_constant(call_frame));
+      break;
     case OP_NOT:
       vm_stack_push(vm, Value_make_boolean(vm_is_falsey(vm_stack_pop(vm))));
       break;
     case OP_NEGATE:
       if (!Value_is_number(vm_stack_peek(vm, 0))) {
-        vm_runtime_error(vm, "Operand must be a number.");
+        Vm_runtime_error(vm, "Operand must be a number.");
         return INTERPRET_RUNTIME_ERROR;
       }
       vm_stack_push(vm, Value_make_number(-Value_as_number(vm_stack_pop(vm))));
       break;
     case OP_PRINT: {
-      Value_print(vm_stack_pop(vm));
-      printf("\n");
+      Value_fprint(vm->output, vm_stack_pop(vm));
+      fputc('\n', vm->output);
       break;
     }
     case OP_JUMP: {
@@ -385,9 +798,19 @@ static inline InterpretResult vm_run_instruction(Vm* vm) {
       }
       break;
     }
+    case OP_JUMP_IF_TRUE: {
+      uint16_t offset = vm_read_short(call_frame);
+      if (!vm_is_falsey(vm_stack_peek(vm, 0))) {
+        call_frame->ip += offset;
+      }
+      break;
+    }
     case OP_LOOP: {
       uint16_t offset = vm_read_short(call_frame);
       call_frame->ip -= offset;
+      if (--vm->budget <= 0) {
+        return INTERPRET_YIELDED;
+      }
       break;
     }
     case OP_CALL: {
@@ -395,6 +818,9 @@ static inline InterpretResult vm_run_instruction(Vm* vm) {
       if (!vm_call_value(vm, vm_stack_peek(vm, arg_count), arg_count)) {
         return INTERPRET_RUNTIME_ERROR;
       }
+      if (vm->budget <= 0) {
+        return INTERPRET_YIELDED;
+      }
       break;
     }
     case OP_INVOKE: {
@@ -403,15 +829,42 @@ static inline InterpretResult vm_run_instruction(Vm* vm) {
       if (!vm_invoke(vm, method, arg_count)) {
         return INTERPRET_RUNTIME_ERROR;
       }
+      if (vm->budget <= 0) {
+        return INTERPRET_YIELDED;
+      }
       break;
     }
     case OP_SUPER_INVOKE: {
       ObjString* method = vm_read_string(call_frame);
       int arg_count = vm_read_byte(call_frame);
+      if (!Object_is_class(vm_stack_peek(vm, 0))) {
+        Vm_runtime_error(vm, "Superclass must be a class.");
+        return INTERPRET_RUNTIME_ERROR;
+      }
       ObjClass* superclass = Object_as_class(vm_stack_pop(vm));
       if (!vm_invoke_from_class(vm, superclass, method, arg_count)) {
         return INTERPRET_RUNTIME_ERROR;
       }
+      if (vm->budget <= 0) {
+        return INTERPRET_YIELDED;
+      }
+      break;
+    }
+    case OP_CALL_METHOD: {
+      ObjString* method = vm_read_string(call_frame);
+      int arg_count = vm_read_byte(call_frame);
+      Value callee = vm_stack_peek(vm, arg_count);
+      // Classes can't be changed once they've been declared, so the method
+      // that OP_GET_METHOD found is still there
+      bool called = Object_is_instance(callee)
+        ? vm_invoke_from_class(vm, Object_as_instance(callee)->klass, method, arg_count)
+        : vm_call_value(vm, callee, arg_count);
+      if (!called) {
+        return INTERPRET_RUNTIME_ERROR;
+      }
+      if (vm->budget <= 0) {
+        return INTERPRET_YIELDED;
+      }
       break;
     }
     case OP_CLOSURE: {
@@ -419,10 +872,14 @@ static inline InterpretResult vm_run_instruction(Vm* vm) {
       ObjClosure* closure = Object_allocate_new_closure(&vm->memory_allocator, function);
       vm_stack_push(vm, Value_make_obj((Obj*)closure));
       for (int i = 0; i < closure->upvalue_count; i++) {
-        uint8_t is_local = vm_read_byte(call_frame);
+        uint8_t capture_type = vm_read_byte(call_frame);
         uint8_t index = vm_read_byte(call_frame);
-        if (is_local) {
-          closure->upvalues[i] = vm_capture_upvalue(vm, call_frame->slots + index);
+        // A local function that refers to itself finds itself here, since
+        // the closure was just pushed into its slot
+        if (capture_type == CAPTURE_VALUE) {
+          closure->upvalues[i] = call_frame->slots[index];
+        } else if (capture_type == CAPTURE_LOCAL) {
+          closure->upvalues[i] = Value_make_obj((Obj*)vm_capture_upvalue(vm, call_frame->slots + index));
         } else {
           closure->upvalues[i] = call_frame->closure->upvalues[index];
         }
@@ -440,6 +897,12 @@ static inline InterpretResult vm_run_instruction(Vm* vm) {
       vm->frame_count--;
       if (vm->frame_count == 0) {
         vm_stack_pop(vm);
+        if (vm->fiber != NULL) {
+          vm_leave_fiber(vm);
+          vm_stack_push(vm, result); // What resume returns
+          break;
+        }
+        vm->returned = result;
         return INTERPRET_OK;
       }
 
@@ -455,17 +918,32 @@ static inline InterpretResult vm_run_instruction(Vm* vm) {
     case OP_INHERIT: {
       Value superclass = vm_stack_peek(vm, 1);
       if (!Object_is_class(superclass)) {
-        vm_runtime_error(vm, "Superclass must be a class.");
+        Vm_runtime_error(vm, "Superclass must be a class.");
+        return INTERPRET_RUNTIME_ERROR;
+      }
+      if (!Object_is_class(vm_stack_peek(vm, 0))) {
+        Vm_runtime_error(vm, "Only classes can inherit.");
         return INTERPRET_RUNTIME_ERROR;
       }
       ObjClass* subclass = Object_as_class(vm_stack_peek(vm, 0));
-      Table_add_all(&Object_as_class(superclass)->methods, &subclass->methods);
+      DispatchRow_add_all(&Object_as_class(superclass)->methods, &subclass->methods);
       vm_stack_pop(vm); // subclass
       // Note: Intentionally leaving the superclass on the stack
       break;
     }
     case OP_METHOD: {
-      vm_define_method(vm, vm_read_string(call_frame));
+      if (!vm_define_method(vm, vm_read_string(call_frame))) {
+        return INTERPRET_RUNTIME_ERROR;
+      }
+      break;
+    }
+    case OP_END_CLASS: {
+      if (!Object_is_class(vm_stack_peek(vm, 0))) {
+        Vm_runtime_error(vm, "Only classes have methods.");
+        return INTERPRET_RUNTIME_ERROR;
+      }
+      DispatchRow_seal(&Object_as_class(vm_stack_peek(vm, 0))->methods);
+      vm_stack_pop(vm);
       break;
     }
     default:
@@ -474,6 +952,8 @@ static inline InterpretResult vm_run_instruction(Vm* vm) {
   return INTERPRET_INCOMPLETE;
 }
 
+#undef REGISTER_BINARY_OP
+
 static InterpretResult vm_run(Vm* vm) {
   for (;;) {
     InterpretResult result = vm_run_instruction(vm);
@@ -483,25 +963,115 @@ static InterpretResult vm_run(Vm* vm) {
   }
 }
 
+// Traces each instruction before running it. Kept apart from vm_run so
+// that running without a trace doesn't pay for checking for one.
+static InterpretResult vm_run_traced(Vm* vm) {
+  for (;;) {
+    Trace_instruction(vm->trace, vm);
+    InterpretResult result = vm_run_instruction(vm);
+    if (result != INTERPRET_INCOMPLETE) {
+      return result;
+    }
+  }
+}
+
+// Compiled code runs until its frame calls or returns, so that it never
+// has to call back into the VM recursively. The frame's ip tells it where
+// to pick up again afterwards. Kept apart from vm_run so that interpreting
+// doesn't pay for checking each frame for compiled code.
+static InterpretResult vm_run_compiled(Vm* vm) {
+  for (;;) {
+    CallFrame* call_frame = vm_current_frame(vm);
+    CompiledFn compiled = call_frame->closure->function->compiled;
+    InterpretResult result = compiled != NULL ? (InterpretResult)compiled(vm, call_frame) : vm_run_instruction(vm);
+    if (result != INTERPRET_INCOMPLETE) {
+      return result;
+    }
+  }
+}
+
 static Value vm_stack_peek(Vm* vm, int distance) {
   return vm->stack_top[-1 - distance];
 }
 
+// Pushes the result of one of the binary operations that the register
+// superinstructions do, with the same checks and errors as the instruction for
+// the operation itself. The operation is always a constant, so each case
+// of the dispatch switch ends up with only its own operation inlined.
+static inline bool vm_register_binary(Vm* vm, OpCode operation, Value a, Value b) {
+  if (Value_is_number(a) && Value_is_number(b)) {
+    double x = Value_as_number(a);
+    double y = Value_as_number(b);
+    switch (operation) {
+      case OP_ADD:
+        vm_stack_push(vm, Value_make_number(x + y));
+        break;
+      case OP_SUBTRACT:
+        vm_stack_push(vm, Value_make_number(x - y));
+        break;
+      case OP_MULTIPLY:
+        vm_stack_push(vm, Value_make_number(x * y));
+        break;
+      case OP_DIVIDE:
+        vm_stack_push(vm, Value_make_number(x / y));
+        break;
+      case OP_GREATER:
+        vm_stack_push(vm, Value_make_boolean(x > y));
+        break;
+      default:
+        vm_stack_push(vm, Value_make_boolean(x < y));
+        break;
+    }
+    return true;
+  }
+
+  if (operation != OP_ADD) {
+    Vm_runtime_error(vm, "Operands must be numbers.");
+    return false;
+  }
+  if (!Object_is_string(a) || !Object_is_string(b)) {
+    Vm_runtime_error(vm, "Operands must be two numbers or two strings.");
+    return false;
+  }
+  vm_stack_push(vm, a);
+  vm_stack_push(vm, b);
+  vm_concatenate(vm);
+  return true;
+}
+
 static bool vm_is_falsey(Value value) {
   return Value_is_nil(value) || (Value_is_boolean(value) && !Value_as_boolean(value));
 }
 
 static bool vm_call(Vm* vm, ObjClosure* closure, int arg_count) {
   if (arg_count != closure->function->arity) {
-    vm_runtime_error(vm, "Expected %d arguments but got %d.", closure->function->arity, arg_count);
+    Vm_runtime_error(vm, "Expected %d arguments but got %d.", closure->function->arity, arg_count);
     return false;
   }
 
-  if (vm->frame_count == FRAMES_MAX) {
-    vm_runtime_error(vm, "Stack overflow.");
+  if (vm->frame_count == vm->frame_capacity) {
+    if (vm->frame_capacity == FRAMES_MAX) {
+      Vm_runtime_error(vm, "Stack overflow.");
+      return false;
+    }
+    vm_grow_fiber_frames(vm);
+  }
+
+  // Every compiled function ends with a return, so a function without any
+  // code is one whose body is compiled the first time it's called
+  ObjFunction* function = closure->function;
+  if (function->chunk.count == 0 &&
+      (vm->compile_function == NULL || !vm->compile_function(function))) {
+    Vm_runtime_error(vm, "Could not compile %s.", function->name->chars);
     return false;
   }
 
+  // The script's stack always has room for another frame, see STACK_MAX
+  if (vm->fiber != NULL) {
+    vm_reserve_fiber_stack(vm, (int)(vm->stack_top - vm->stack) - arg_count - 1 + FIBER_FRAME_SLOTS);
+  }
+
+  vm->budget--; // Checked once the instruction that made the call is done
   CallFrame* frame = &vm->frames[vm->frame_count++];
   frame->closure = closure;
   frame->ip = closure->function->chunk.code;
@@ -520,11 +1090,11 @@ static bool vm_call_value(Vm* vm, Value callee, int arg_count) {
       case OBJ_CLASS: {
         ObjClass* klass = Object_as_class(callee);
         vm->stack_top[-arg_count - 1] = Value_make_obj((Obj*)Object_allocate_new_instance(&vm->memory_allocator, klass));
-        Value initializer;
-        if (Table_get(&klass->methods, vm->init_string, &initializer)) {
-          return vm_call(vm, Object_as_closure(initializer), arg_count);
+        ObjClosure* initializer = DispatchRow_get(&klass->methods, vm->init_string->selector);
+        if (initializer != NULL) {
+          return vm_call(vm, initializer, arg_count);
         } else if (arg_count != 0) {
-          vm_runtime_error(vm, "Expected 0 arguments but got %d.", arg_count);
+          Vm_runtime_error(vm, "Expected 0 arguments but got %d.", arg_count);
           return false;
         }
         return true;
@@ -533,7 +1103,14 @@ static bool vm_call_value(Vm* vm, Value callee, int arg_count) {
         return vm_call(vm, Object_as_closure(callee), arg_count);
       case OBJ_NATIVE: {
         NativeFn native = Object_as_native(callee);
-        Value result = native(arg_count, vm->stack_top - arg_count);
+        ObjFiber* fiber = vm->fiber;
+        Value result;
+        if (!native(vm, arg_count, vm->stack_top - arg_count, &result)) {
+          return false;
+        }
+        if (vm->fiber != fiber) {
+          return true;
+        }
         vm->stack_top -= arg_count + 1;
         vm_stack_push(vm, result);
         return true;
@@ -542,12 +1119,16 @@ static bool vm_call_value(Vm* vm, Value callee, int arg_count) {
         break;
     }
   }
-  vm_runtime_error(vm, "Can only call functions and classes.");
+  Vm_runtime_error(vm, "Can only call functions and classes.");
   return false;
 }
 
 static bool vm_invoke(Vm* vm, ObjString* name, int arg_count) {
   Value receiver = vm_stack_peek(vm, arg_count);
+  if (!Object_is_instance(receiver)) {
+    Vm_runtime_error(vm, "Only instances have methods.");
+    return false;
+  }
   ObjInstance* instance = Object_as_instance(receiver);
 
   Value value;
@@ -560,38 +1141,82 @@ static bool vm_invoke(Vm* vm, ObjString* name, int arg_count) {
 }
 
 static bool vm_invoke_from_class(Vm* vm, ObjClass* klass, ObjString* name, int arg_count) {
-  Value method;
-  if (!Table_get(&klass->methods, name, &method)) {
-    vm_runtime_error(vm, "Undefined property '%s'.", name->chars);
+  ObjClosure* method = DispatchRow_get(&klass->methods, name->selector);
+  if (method == NULL) {
+    Vm_runtime_error(vm, "Undefined property '%s'.", name->chars);
     return false;
   }
-  return vm_call(vm, Object_as_closure(method), arg_count);
+  if (vm_inline_getter(vm, method, arg_count)) {
+    return true;
+  }
+  return vm_call(vm, method, arg_count);
 }
 
-static void vm_runtime_error(Vm* vm, const char* format, ...) {
+// Methods that only return one of the receiver's fields (see
+// ObjFunction.getter) are run without pushing a call frame. When anything is
+// off, such as the field not being set, the method is called as usual so
+// that it behaves exactly as it would have.
+static bool vm_inline_getter(Vm* vm, ObjClosure* method, int arg_count) {
+  ObjString* name = method->function->getter;
+  if (name == NULL || arg_count != 0 || vm->frame_count == FRAMES_MAX) {
+    return false;
+  }
+
+  Value receiver = vm_stack_peek(vm, 0);
+  if (!Object_is_instance(receiver)) {
+    return false;
+  }
+
+  Value value;
+  if (!Table_get(&Object_as_instance(receiver)->fields, name, &value)) {
+    return false;
+  }
+
+  vm->stack_top[-1] = value;
+  return true;
+}
+
+void Vm_runtime_error(Vm* vm, const char* format, ...) {
   va_list args;
   va_start(args, format);
-  vfprintf(stderr, format, args);
+  vm_report_runtime_error(vm, format, args);
   va_end(args);
-  fputs("\n", stderr);
+}
+
+static void vm_report_runtime_error(Vm* vm, const char* format, va_list args) {
+  vfprintf(vm->errors, format, args);
+  fputs("\n", vm->errors);
 
   // CallFrame* call_frame = vm_current_frame(vm);
   // Chunk chunk = call_frame->function->chunk;
 
   // size_t instruction = call_frame->ip - chunk.code - 1;
-  // int line = chunk.lines[instruction];
+  // int line = Chunk_get_line(&chunk, instruction);
   // fprintf(stderr, "[line %d] in script\n", line);
 
-  for (int i = vm->frame_count - 1; i >= 0; i--) {
-    CallFrame* frame = &vm->frames[i];
-    ObjFunction* function = frame->closure->function;
-    size_t instruction = frame->ip - function->chunk.code - 1;
-    fprintf(stderr, "[line %d] in ", function->chunk.lines[instruction]);
-    if (function->name == NULL) {
-      fprintf(stderr, "script\n");
-    } else {
-      fprintf(stderr, "%s()\n", function->name->chars);
+  // The call stacks of the fibers that resumed the one that's running are
+  // held by the fibers they resumed
+  CallFrame* frames = vm->frames;
+  int frame_count = vm->frame_count;
+  ObjFiber* fiber = vm->fiber;
+  for (;;) {
+    for (int i = frame_count - 1; i >= 0; i--) {
+      CallFrame* frame = &frames[i];
+      ObjFunction* function = frame->closure->function;
+      size_t instruction = frame->ip - function->chunk.code - 1;
+      fprintf(vm->errors, "[line %d] in ", Chunk_get_line(&function->chunk, instruction));
+      if (function->name == NULL) {
+        fprintf(vm->errors, "script\n");
+      } else {
+        fprintf(vm->errors, "%s()\n", function->name->chars);
+      }
+    }
+    if (fiber == NULL) {
+      break;
     }
+    frames = fiber->frames;
+    frame_count = fiber->frame_count;
+    fiber = fiber->caller;
   }
 
   vm_reset_stack(vm);
@@ -613,32 +1238,39 @@ static void vm_concatenate(Vm* vm) {
   vm_stack_push(vm, Value_make_obj((Obj*)result));
 }
 
-static void vm_define_native(Vm* vm, char* name, NativeFn function) {
-  vm_stack_push(vm, Value_make_obj((Obj*)Vm_copy_string(vm, name, (int)strlen(name))));
+void Vm_define_native(Vm* vm, const char* name, NativeFn function) {
+  vm_stack_push(vm, Value_make_obj((Obj*)Vm_copy_string(vm, (char*)name, (int)strlen(name))));
   vm_stack_push(vm, Value_make_obj((Obj*)Object_allocate_new_native(&vm->memory_allocator, function)));
   Table_set(&vm->globals, Object_as_string(vm_stack_peek(vm, 1)), vm_stack_peek(vm, 0));
   vm_stack_pop(vm);
   vm_stack_pop(vm);
 }
 
-static void vm_define_method(Vm* vm, ObjString* name) {
+// The compiler only ever defines closures as methods of the class it's
+// declaring, but bytecode files could have anything on the stack
+static bool vm_define_method(Vm* vm, ObjString* name) {
   Value method = vm_stack_peek(vm, 0);
+  if (!Object_is_class(vm_stack_peek(vm, 1)) || !Object_is_closure(method)) {
+    Vm_runtime_error(vm, "Only classes have methods.");
+    return false;
+  }
   ObjClass* klass = Object_as_class(vm_stack_peek(vm, 1));
-  Table_set(&klass->methods, name, method);
+  DispatchRow_set(&klass->methods, Vm_intern_selector(vm, name), Object_as_closure(method));
   vm_stack_pop(vm);
+  return true;
 }
 
 static bool vm_bind_method(Vm* vm, ObjClass* klass, ObjString* name) {
-  Value method;
-  if (!Table_get(&klass->methods, name, &method)) {
-    vm_runtime_error(vm, "Undefined property '%s'.", name->chars);
+  ObjClosure* method = DispatchRow_get(&klass->methods, name->selector);
+  if (method == NULL) {
+    Vm_runtime_error(vm, "Undefined property '%s'.", name->chars);
     return false;
   }
 
   ObjBoundMethod* bound_method = Object_allocate_new_bound_method(
     &vm->memory_allocator,
     vm_stack_peek(vm, 0),
-    Object_as_closure(method)
+    method
   );
   vm_stack_pop(vm);
   vm_stack_push(vm, Value_make_obj((Obj*)bound_method));
@@ -668,6 +1300,13 @@ static ObjUpvalue* vm_capture_upvalue(Vm* vm, Value* local) {
   return created_upvalue;
 }
 
+// Compilers only use OP_GET_UPVALUE and OP_SET_UPVALUE for variables that
+// are shared through an ObjUpvalue, but bytecode files aren't trusted to
+static Value* vm_upvalue_location(ObjClosure* closure, int slot) {
+  Value* upvalue = &closure->upvalues[slot];
+  return Object_is_type(*upvalue, OBJ_UPVALUE) ? Object_as_upvalue(*upvalue)->location : upvalue;
+}
+
 static void vm_close_upvalues(Vm* vm, Value* last) {
   while (vm->open_upvalues != NULL && vm->open_upvalues->location >= last) {
     ObjUpvalue* upvalue = vm->open_upvalues;
@@ -679,8 +1318,90 @@ static void vm_close_upvalues(Vm* vm, Value* last) {
 
 static ObjString* vm_allocate_string(Vm* vm, char* chars, int length, uint32_t hash) {
   ObjString* string = Object_allocate_string(&vm->memory_allocator, chars, length, hash);
-  vm->memory_allocator.protected_object = (Obj*)string;
+  MemoryAllocator_push_root(&vm->memory_allocator, (Obj*)string);
   Table_set(&vm->strings, string, Value_make_nil());
-  vm->memory_allocator.protected_object = NULL;
+  MemoryAllocator_pop_root(&vm->memory_allocator);
   return string;
 }
+
+static void vm_swap_stacks(Vm* vm, ObjFiber* fiber) {
+  CallFrame* frames = vm->frames;
+  int frame_count = vm->frame_count;
+  int frame_capacity = vm->frame_capacity;
+  Value* stack = vm->stack;
+  Value* stack_top = vm->stack_top;
+  int stack_capacity = vm->stack_capacity;
+  ObjUpvalue* open_upvalues = vm->open_upvalues;
+
+  vm->frames = fiber->frames;
+  vm->frame_count = fiber->frame_count;
+  vm->frame_capacity = fiber->frame_capacity;
+  vm->stack = fiber->stack;
+  vm->stack_top = fiber->stack_top;
+  vm->stack_capacity = fiber->stack_capacity;
+  vm->open_upvalues = fiber->open_upvalues;
+
+  fiber->frames = frames;
+  fiber->frame_count = frame_count;
+  fiber->frame_capacity = frame_capacity;
+  fiber->stack = stack;
+  fiber->stack_top = stack_top;
+  fiber->stack_capacity = stack_capacity;
+  fiber->open_upvalues = open_upvalues;
+}
+
+// Fibers start out with room for a few frames, and double it up to
+// FRAMES_MAX. Anything holding a CallFrame of the fiber has to fetch it
+// again after a call.
+static void vm_grow_fiber_frames(Vm* vm) {
+  int capacity = vm->frame_capacity < FIBER_FRAMES_MIN ? FIBER_FRAMES_MIN : vm->frame_capacity * 2;
+  if (capacity > FRAMES_MAX) {
+    capacity = FRAMES_MAX;
+  }
+  vm->frames = MemoryAllocator_grow_array(&vm->memory_allocator, vm->frames, sizeof(CallFrame), vm->frame_capacity, capacity);
+  vm->frame_capacity = capacity;
+}
+
+// Makes sure the running fiber's stack has room for slot_count values.
+// Moving the stack moves everything that points into it along with it.
+static void vm_reserve_fiber_stack(Vm* vm, int slot_count) {
+  if (slot_count <= vm->stack_capacity) {
+    return;
+  }
+
+  int capacity = vm->stack_capacity < FIBER_FRAME_SLOTS ? FIBER_FRAME_SLOTS : vm->stack_capacity;
+  while (capacity < slot_count) {
+    capacity *= 2;
+  }
+  Value* old_stack = vm->stack;
+  Value* stack = MemoryAllocator_grow_array(&vm->memory_allocator, old_stack, sizeof(Value), vm->stack_capacity, capacity);
+  vm->stack = stack;
+  vm->stack_top = stack + (vm->stack_top - old_stack);
+  vm->stack_capacity = capacity;
+  for (int i = 0; i < vm->frame_count; i++) {
+    vm->frames[i].slots = stack + (vm->frames[i].slots - old_stack);
+  }
+  for (ObjUpvalue* upvalue = vm->open_upvalues; upvalue != NULL; upvalue = upvalue->next) {
+    upvalue->location = stack + (upvalue->location - old_stack);
+  }
+}
+
+// Switches back to the call stack that resumed the running fiber, once the
+// fiber is done. Nothing points into the fiber's own call stack anymore,
+// since its upvalues have all been closed, so that's freed.
+static void vm_leave_fiber(Vm* vm) {
+  ObjFiber* fiber = vm->fiber;
+  vm_swap_stacks(vm, fiber);
+  vm->fiber = fiber->caller;
+  fiber->caller = NULL;
+  fiber->state = FIBER_DONE;
+
+  MemoryAllocator_free_array(&vm->memory_allocator, fiber->frames, sizeof(CallFrame), fiber->frame_capacity);
+  MemoryAllocator_free_array(&vm->memory_allocator, fiber->stack, sizeof(Value), fiber->stack_capacity);
+  fiber->frames = NULL;
+  fiber->frame_count = 0;
+  fiber->frame_capacity = 0;
+  fiber->stack = NULL;
+  fiber->stack_top = NULL;
+  fiber->stack_capacity = 0;
+}
@@ -9,44 +9,110 @@
 
 #define FRAMES_MAX 64
 #define STACK_MAX (FRAMES_MAX * 256)
+#define BUDGET_UNLIMITED INT64_MAX
 
-typedef struct {
+typedef struct CallFrame {
   ObjClosure* closure;
   uint8_t* ip;
   Value* slots; // Points into the VM's stack to the first slot this function can use
 } CallFrame;
 
-typedef struct {
-  CallFrame frames[FRAMES_MAX];
+// Compiles a function that was declared without being compiled, see vm_call.
+// Returns false if the function had compile errors.
+typedef bool (*CompileFn)(ObjFunction* function);
+
+typedef struct Vm {
+  // The call stack that's running, which is the script's own (root_frames
+  // and root_stack) unless a fiber is running, see ObjFiber
+  CallFrame* frames;
   int frame_count;
-  Value stack[STACK_MAX];
+  int frame_capacity;
+  Value* stack;
   Value* stack_top;
-  Table globals;
+  int stack_capacity;
   ObjUpvalue* open_upvalues;
+  ObjFiber* fiber; // The fiber that's running, NULL while the script's own code is
+  int fiber_count; // Fibers that haven't been collected, so the GC can skip looking for them
+  Table globals;
   Obj* objects;
   Table strings;
   ObjString* init_string;
+  ValueArray selectors; // Method names, indexed by their selector
   MemoryAllocator memory_allocator;
   int gray_count;
   int gray_capacity;
   Obj** gray_stack;
+  struct BytecodeImage* images; // Mapped bytecode files, see bytecode_file.h
+  CompileFn compile_function; // Only set by compilers that compile function bodies lazily
+  // Where printed values and runtime errors go, stdout and stderr unless
+  // they're being captured, see batch.h
+  FILE* output;
+  FILE* errors;
+  struct Vm* code_heap; // The frozen VM whose objects this one shares, see Vm_init_shared
+  Value returned; // What the outermost function returned, once it has
+  struct Isolate* isolate; // NULL unless the VM runs an isolate, see isolate.h
+  // How many more loop iterations and calls the VM runs before it yields,
+  // see Vm_resume. BUDGET_UNLIMITED unless something has set it.
+  int64_t budget;
+  struct Trace* trace; // Traces every instruction interpreted while it's set, see trace.h
+  CallFrame root_frames[FRAMES_MAX];
+  Value root_stack[STACK_MAX];
 } Vm;
 
 typedef enum {
   INTERPRET_INCOMPLETE,
   INTERPRET_OK,
-  INTERPRET_RUNTIME_ERROR
+  INTERPRET_RUNTIME_ERROR,
+  INTERPRET_COMPILE_ERROR, // Only returned by callers of Compiler_compile
+  INTERPRET_YIELDED // The VM has run out of budget, see Vm_resume
 } InterpretResult;
 
 void Vm_init(Vm* vm);
+// Initializes vm to run code compiled in code_heap, a frozen VM (see
+// Vm_freeze), without copying any of it. The objects of code_heap are used
+// in place and are never marked or freed by vm, so any number of VMs, on
+// any number of threads, can share one heap of compiled code while each
+// has a heap of its own for the objects its program creates. Strings are
+// looked up in code_heap before they're interned in vm, and vm hands out
+// selectors after the ones code_heap has handed out, so code from code_heap
+// runs in vm as it is. code_heap has to outlive vm.
+void Vm_init_shared(Vm* vm, Vm* code_heap);
+// Collects everything in vm that function can't reach, and freezes the
+// rest so that it can be shared by other VMs. Every string is given a
+// selector, since that can't be done once other VMs are reading them. A
+// frozen VM must not run code or allocate again, and is only ever freed.
+void Vm_freeze(Vm* vm, ObjFunction* function);
 void Vm_init_function(Vm* vm, ObjFunction* function);
 InterpretResult Vm_interpret(Vm* vm, ObjFunction* function);
+// Picks up exactly where the VM left off after it returned
+// INTERPRET_YIELDED, which it does once it has used up its budget. The
+// budget only counts down at the end of each loop iteration and with each
+// call, so that a program can't run for long without it being checked,
+// and the check stays out of the way of everything else. Set a new budget
+// before resuming, or the VM yields again at the next check.
+InterpretResult Vm_resume(Vm* vm);
 InterpretResult Vm_interpret_next_instruction(Vm* vm);
+// Like Vm_interpret, except that functions with compiled code run that code
+// rather than being interpreted
+InterpretResult Vm_interpret_compiled(Vm* vm, ObjFunction* function);
 
 ObjFunction* Vm_new_function(Vm* vm);
+// Works out what the VM needs to know about a function's code once it's
+// final, whether it was compiled or loaded. A function whose code is
+// checked (see BytecodeFile_validate_function) can be finished as well.
+void Vm_finish_function(ObjFunction* function);
 
 ObjString* Vm_copy_string(Vm* vm, char* chars, int length);
 ObjString* Vm_take_string(Vm* vm, char* chars, int length);
+int Vm_intern_selector(Vm* vm, ObjString* name);
+
+// Defines a global holding a native function
+void Vm_define_native(Vm* vm, const char* name, NativeFn function);
+// For natives to report errors with, after which they return false
+void Vm_runtime_error(Vm* vm, const char* format, ...);
+
+int Vm_native_index(NativeFn function);
+NativeFn Vm_native_at(int index);
 
 void Vm_free(Vm* vm);
 
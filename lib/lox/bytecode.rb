@@ -3,10 +3,19 @@
 require "ffi"
 
 require_relative "bytecode/compiler"
+require_relative "bytecode/superinstruction_compiler"
 require_relative "bytecode/interpreter"
 require_relative "bytecode/main"
 require_relative "bytecode/repl"
 require_relative "bytecode/disassembler"
+require_relative "bytecode/trace_decoder"
+require_relative "bytecode/native_scanner"
+require_relative "bytecode/bytecode_cache"
+require_relative "bytecode/lazy_functions"
+require_relative "bytecode/optimizer"
+require_relative "bytecode/type_inference"
+require_relative "bytecode/aot_compiler"
+require_relative "bytecode/batch"
 
 module Lox
   module Bytecode
@@ -32,17 +41,22 @@ module Lox
         :stress_gc, :bool,
         :callback_target, :pointer,
         :memory_callbacks, MemoryCallbacks,
-        :protected_object, :pointer
+        :roots, :pointer,
+        :root_count, :int,
+        :root_capacity, :int
     end
 
+    attach_function :memory_allocator_push_root, :MemoryAllocator_push_root, [MemoryAllocator.ptr, :pointer], :void
+    attach_function :memory_allocator_pop_root, :MemoryAllocator_pop_root, [MemoryAllocator.ptr], :void
+
     ### VALUES ###
 
     ValueType = enum :value_type, [:bool, :nil, :number, :obj]
 
-    ObjType = enum :obj_type, [:bound_method, :class, :closure, :function, :instance, :native, :string, :upvalue]
+    ObjType = enum :obj_type, [:bound_method, :class, :closure, :function, :instance, :native, :string, :upvalue, :fiber]
 
     class Obj < FFI::Struct
-      layout :type, ObjType, :next, Obj.ptr, :is_marked, :bool
+      layout :type, ObjType, :next, Obj.ptr, :is_marked, :bool, :is_shared, :bool
 
       def as_closure
         ObjClosure.new(to_ptr)
@@ -94,6 +108,8 @@ module Lox
           as_instance[:klass][:name][:chars]
         when :bound_method
           as_bound_method[:method].to_s
+        when :fiber
+          "<fiber>"
         else
           raise "Unsupported object type #{self[:type]}"
         end
@@ -134,7 +150,7 @@ module Lox
     end
 
     class ObjString < FFI::Struct
-      layout :obj, Obj, :length, :int, :chars, :string, :hash, :uint32
+      layout :obj, Obj, :length, :int, :chars, :string, :hash, :uint32, :selector, :int
     end
 
     ### TABLE ###
@@ -159,43 +175,80 @@ module Lox
       :pop,
       :get_local,
       :set_local,
+      :store_local,
       :get_global,
       :define_global,
       :set_global,
       :get_upvalue,
       :set_upvalue,
+      :get_captured,
       :get_property,
+      :get_method,
       :set_property,
       :get_super,
       :equal,
       :greater,
       :less,
+      :not_equal,
+      :not_greater,
+      :not_less,
       :add,
       :subtract,
       :multiply,
       :divide,
+      :add_numbers,
+      :subtract_numbers,
+      :multiply_numbers,
+      :divide_numbers,
+      :greater_numbers,
+      :less_numbers,
+      :add_registers,
+      :subtract_registers,
+      :multiply_registers,
+      :divide_registers,
+      :greater_registers,
+      :less_registers,
+      :add_register_constant,
+      :subtract_register_constant,
+      :multiply_register_constant,
+      :divide_register_constant,
+      :greater_register_constant,
+      :less_register_constant,
       :not,
       :negate,
       :print,
       :jump,
       :jump_if_false,
+      :jump_if_true,
       :loop,
       :call,
       :invoke,
       :super_invoke,
+      :call_method,
       :closure,
       :close_upvalue,
       :return,
       :class,
       :inherit,
-      :method
+      :method,
+      :end_class
     ]
 
+    CaptureType = enum :capture_type, [:capture_upvalue, :capture_local, :capture_value]
+
     class Chunk < FFI::Struct
-      layout :capacity, :int, :count, :int, :code, :pointer, :lines, :pointer, :constants, ValueArray, :memory_allocator, MemoryAllocator.ptr
+      layout :capacity, :int,
+        :count, :int,
+        :code, :pointer,
+        :line_run_capacity, :int,
+        :line_run_count, :int,
+        :line_runs, :pointer,
+        :constants, ValueArray,
+        :memory_allocator, MemoryAllocator.ptr,
+        :owns_code, :bool
 
       def line_at(offset)
-        (self[:lines] + (offset * FFI.type_size(FFI::TYPE_INT32))).read(:int)
+        Lox::Bytecode.chunk_get_line(self, offset)
       end
 
       def contents_at(offset)
@@ -212,14 +265,18 @@ module Lox
     end
 
     attach_function :chunk_write, :Chunk_write, [Chunk.ptr, :uint8, :int], :void
+    attach_function :chunk_get_line, :Chunk_get_line, [Chunk.ptr, :int], :int
+    attach_function :chunk_write_bytes, :Chunk_write_bytes, [Chunk.ptr, :pointer, :int, :pointer, :int], :void
 
     attach_function :chunk_add_number, :Chunk_add_number, [Chunk.ptr, :double], :int
     attach_function :chunk_add_object, :Chunk_add_object, [Chunk.ptr, :pointer], :int
 
+    attach_function :peephole_optimize, :Peephole_optimize, [Chunk.ptr], :void
+
     ### FUNCTIONS ###
 
     class ObjFunction < FFI::Struct
-      layout :obj, Obj, :arity, :int, :upvalue_count, :int, :chunk, Chunk, :name, ObjString.ptr
+      layout :obj, Obj, :arity, :int, :upvalue_count, :int, :chunk, Chunk, :name, ObjString.ptr, :compiled, :pointer, :getter, ObjString.ptr
     end
 
     class ObjClosure < FFI::Struct
@@ -232,8 +289,21 @@ module Lox
 
     ### OOP ###
 
+    class SealedTable < FFI::Struct
+      layout :count, :int,
+        :capacity, :int,
+        :bucket_count, :int,
+        :displacements, :pointer,
+        :entries, :pointer,
+        :memory_allocator, MemoryAllocator.ptr
+    end
+
+    class DispatchRow < FFI::Struct
+      layout :base, :int, :count, :int, :capacity, :int, :methods, :pointer, :sealed, SealedTable, :memory_allocator, MemoryAllocator.ptr
+    end
+
     class ObjClass < FFI::Struct
-      layout :obj, Obj, :name, ObjString.ptr, :methods, Table
+      layout :obj, Obj, :name, ObjString.ptr, :methods, DispatchRow
     end
 
     class ObjInstance < FFI::Struct
@@ -244,58 +314,155 @@ module Lox
       layout :obj, Obj, :receiver, Value, :method, ObjClosure
     end
 
+    ### SCANNER ###
+
+    class ScanError < FFI::Struct
+      layout :line, :int32, :message, :string
+    end
+
+    class TokenBuffer < FFI::Struct
+      layout :count, :int,
+        :capacity, :int,
+        :tokens, :pointer,
+        :error_count, :int,
+        :error_capacity, :int,
+        :errors, ScanError.ptr
+
+      def error_at(index)
+        ScanError.new(self[:errors].to_ptr + (index * ScanError.size))
+      end
+    end
+
+    attach_function :token_buffer_init, :TokenBuffer_init, [TokenBuffer.ptr], :void
+    attach_function :token_buffer_scan, :TokenBuffer_scan, [TokenBuffer.ptr, :string], :void
+    attach_function :token_buffer_free, :TokenBuffer_free, [TokenBuffer.ptr], :void
+
     ### VM ###
 
     class CallFrame < FFI::Struct
       layout :closure, ObjClosure.ptr, :ip, :pointer, :slots, Value.ptr
     end
 
-    InterpretResult = enum :interpret_result, [:incomplete, :ok, :runtime_error]
+    InterpretResult = enum :interpret_result, [:incomplete, :ok, :runtime_error, :compile_error, :yielded]
 
     class VM < FFI::Struct
-      layout :frames, [CallFrame, 64],
+      layout :frames, CallFrame.ptr,
         :frame_count, :int,
-        :stack, [Value, 64 * 256],
+        :frame_capacity, :int,
+        :stack, Value.ptr,
         :stack_top, Value.ptr,
-        :globals, Table,
+        :stack_capacity, :int,
         :open_upvalues, ObjUpvalue.ptr,
+        :fiber, :pointer,
+        :fiber_count, :int,
+        :globals, Table,
         :objects, Obj.ptr,
         :strings, Table,
+        :init_string, ObjString.ptr,
+        :selectors, ValueArray,
         :memory_allocator, MemoryAllocator,
         :gray_count, :int,
         :gray_capacity, :int,
-        :gray_stack, :pointer
+        :gray_stack, :pointer,
+        :images, :pointer,
+        :compile_function, :pointer,
+        :output, :pointer,
+        :errors, :pointer,
+        :code_heap, :pointer,
+        :returned, Value,
+        :isolate, :pointer,
+        :budget, :int64,
+        :trace, :pointer,
+        :root_frames, [CallFrame, 64],
+        :root_stack, [Value, 64 * 256]
+
+      # A VM that runs the code frozen in code_heap, see Vm_init_shared
+      def self.new_shared(code_heap)
+        vm = new(FFI::MemoryPointer.new(self, 1)[0])
+        Lox::Bytecode.vm_init_shared(vm, code_heap)
+        vm[:memory_allocator][:log_gc] = code_heap[:memory_allocator][:log_gc]
+        vm[:memory_allocator][:stress_gc] = code_heap[:memory_allocator][:stress_gc]
+        vm[:memory_allocator][:gc_enabled] = true
+        vm
+      end
 
       def with_new_function
         yield Lox::Bytecode.vm_new_function(self)
       end
 
-      def current_frame
-        self[:frames][self[:frame_count] - 1]
-      end
-
-      def current_function
-        current_frame[:closure][:function]
-      end
-
-      def current_offset
-        current_frame[:ip].to_i - current_function[:chunk][:code].to_i
-      end
-
-      def stack_contents
-        num_elements = (self[:stack_top].to_ptr.address - self[:stack].to_ptr.address) / Value.size
-        contents = []
-        (0...num_elements).each { |i| contents << self[:stack][i].to_s }
-        contents
+      # Keeps object alive while the block runs, for objects that Ruby holds
+      # on to but that the VM can't reach yet
+      def with_root(object)
+        Lox::Bytecode.memory_allocator_push_root(self[:memory_allocator], object)
+        yield
+      ensure
+        Lox::Bytecode.memory_allocator_pop_root(self[:memory_allocator])
       end
     end
 
     attach_function :vm_init, :Vm_init, [VM.ptr], :void
-    attach_function :vm_init_function, :Vm_init_function, [VM.ptr, ObjFunction.ptr], :void
+    attach_function :vm_init_shared, :Vm_init_shared, [VM.ptr, VM.ptr], :void
+    attach_function :vm_freeze, :Vm_freeze, [VM.ptr, ObjFunction.ptr], :void
     attach_function :vm_interpret, :Vm_interpret, [VM.ptr, ObjFunction.ptr], InterpretResult
-    attach_function :vm_interpret_next_instruction, :Vm_interpret_next_instruction, [VM.ptr], InterpretResult
     attach_function :vm_new_function, :Vm_new_function, [VM.ptr], ObjFunction.ptr
+    attach_function :vm_finish_function, :Vm_finish_function, [ObjFunction.ptr], :void
     attach_function :vm_copy_string, :Vm_copy_string, [VM.ptr, :pointer, :int], ObjString.ptr
+    attach_function :vm_intern_selector, :Vm_intern_selector, [VM.ptr, ObjString.ptr], :int
     attach_function :vm_free, :Vm_free, [VM.ptr], :void
+
+    ### TRACES ###
+
+    attach_function :disassembler_log_chunk, :Disassembler_log_chunk, [Chunk.ptr, :string], :void
+    attach_function :trace_version, :Trace_version, [], :int
+    attach_function :trace_new_log, :Trace_new_log, [], :pointer
+    attach_function :trace_open, :Trace_open, [:string], :pointer
+    attach_function :trace_close, :Trace_close, [:pointer], :bool
+
+    ### BYTECODE FILES ###
+
+    attach_function :bytecode_file_version, :BytecodeFile_version, [], :int
+    attach_function :bytecode_file_write, :BytecodeFile_write, [ObjFunction.ptr, :string], :bool
+    attach_function :bytecode_file_map, :BytecodeFile_map, [VM.ptr, :string], :pointer
+
+    ### HEAP SNAPSHOTS ###
+
+    attach_function :heap_snapshot_write, :HeapSnapshot_write, [VM.ptr, :string], :bool
+    attach_function :heap_snapshot_read, :HeapSnapshot_read, [VM.ptr, :string], :bool
+
+    ### ISOLATES ###
+
+    attach_function :isolate_group_new, :IsolateGroup_new, [VM.ptr], :pointer
+    attach_function :isolate_group_is_needed_by, :IsolateGroup_is_needed_by, [ObjFunction.ptr], :bool
+    # Waits for the isolates that are still running
+    attach_function :isolate_group_free, :IsolateGroup_free, [:pointer], :void, blocking: true
+
+    ### BATCHES ###
+
+    class BatchJob < FFI::Struct
+      layout :vm, VM.ptr,
+        :function, ObjFunction.ptr,
+        :result, InterpretResult,
+        :output, :pointer,
+        :output_length, :size_t,
+        :errors, :pointer,
+        :errors_length, :size_t,
+        :slices, :int,
+        :run_time, :double,
+        :longest_wait, :double,
+        :finish_time, :double
+
+      def output
+        self[:output].null? ? "" : self[:output].read_bytes(self[:output_length])
+      end
+
+      def errors
+        self[:errors].null? ? "" : self[:errors].read_bytes(self[:errors_length])
+      end
+    end
+
+    # Doesn't hold the GVL while the jobs run, so that they can run in
+    # parallel with each other and with Ruby code
+    attach_function :batch_run, :Batch_run, [:pointer, :int, :int, :int64], :void, blocking: true
+    attach_function :batch_job_free, :BatchJob_free, [BatchJob.ptr], :void
   end
 end
@@ -0,0 +1,237 @@
+require "tmpdir"
+
+module Lox
+  module Bytecode
+    # Compiles a script ahead of time into a native executable, by way of C.
+    # The script is compiled to bytecode as usual first, and each function's
+    # bytecode is then translated into a C function, with jumps becoming
+    # gotos and the values that instructions read out of the code becoming
+    # constants. The executable carries the bytecode file for the script too,
+    # and links against the VM in ext/, which compiled code hands everything
+    # but the common cases of the simpler instructions to (see aot.h).
+    class AotCompiler
+      EXT_DIRECTORY = File.expand_path("../../../ext", __dir__)
+
+      # Instructions that are always run by the interpreter don't need to be
+      # listed, apart from their length
+      INSTRUCTION_LENGTHS = Hash.new(1).merge(
+        constant: 2, get_local: 2, set_local: 2, store_local: 2, get_global: 2, define_global: 2, set_global: 2,
+        get_upvalue: 2, set_upvalue: 2, get_captured: 2, get_property: 2, get_method: 2,
+        set_property: 2, get_super: 2, call: 2, class: 2, method: 2,
+        jump: 3, jump_if_false: 3, jump_if_true: 3, loop: 3, invoke: 3, super_invoke: 3, call_method: 3,
+        add_registers: 3, subtract_registers: 3, multiply_registers: 3, divide_registers: 3,
+        greater_registers: 3, less_registers: 3,
+        add_register_constant: 3, subtract_register_constant: 3, multiply_register_constant: 3,
+        divide_register_constant: 3, greater_register_constant: 3, less_register_constant: 3
+      ).freeze
+
+      CHECKED_ARITHMETIC = {add: "a + b", subtract: "a - b", multiply: "a * b", divide: "a / b"}.freeze
+      CHECKED_COMPARISONS = {greater: "a > b", less: "a < b", not_greater: "!(a > b)", not_less: "!(a < b)"}.freeze
+      UNCHECKED_ARITHMETIC = {
+        add_numbers: "a + b", subtract_numbers: "a - b", multiply_numbers: "a * b", divide_numbers: "a / b"
+      }.freeze
+      UNCHECKED_COMPARISONS = {greater_numbers: "a > b", less_numbers: "a < b"}.freeze
+      REGISTER_OPERATIONS = {
+        "add" => ["Value_make_number", "+"], "subtract" => ["Value_make_number", "-"],
+        "multiply" => ["Value_make_number", "*"], "divide" => ["Value_make_number", "/"],
+        "greater" => ["Value_make_boolean", ">"], "less" => ["Value_make_boolean", "<"]
+      }.freeze
+
+      def initialize(function)
+        @function = function
+      end
+
+      # Returns false if the executable couldn't be built
+      def build(output_path, cc: ENV.fetch("CC", "cc"))
+        Dir.mktmpdir do |directory|
+          source_path = File.join(directory, "script.c")
+          File.write(source_path, generate_c(directory))
+          runtime = (Dir.glob("*.c", base: EXT_DIRECTORY).sort - ["main.c"]).map { |file| File.join(EXT_DIRECTORY, file) }
+          system(cc, "-O3", "-pthread", "-I", EXT_DIRECTORY, "-o", output_path, source_path, *runtime, "-lm")
+        end
+      end
+
+      # The directory is somewhere to write the bytecode file to on the way
+      def generate_c(directory)
+        bytecode_path = File.join(directory, "script.loxc")
+        raise "Could not write #{bytecode_path}" unless Lox::Bytecode.bytecode_file_write(@function, bytecode_path)
+        bytecode = File.binread(bytecode_path)
+
+        functions = all_functions(@function)
+        c = +"// Generated by lox-compile\n\n#include \"aot.h\"\n\n"
+        c << "static const uint8_t bytecode[] = {\n"
+        bytecode.bytes.each_slice(16) { |bytes| c << "  #{bytes.map { |byte| "0x%02x," % byte }.join(" ")}\n" }
+        c << "};\n\n"
+        functions.each_index { |index| c << "static int lox_function_#{index}(Vm* vm, CallFrame* frame);\n" }
+        c << "\nstatic const AotFunction functions[] = {\n"
+        functions.each_with_index { |function, index| c << "  { lox_function_#{index}, #{function[:chunk][:count]} },\n" }
+        c << "};\n"
+        functions.each_with_index { |function, index| c << "\n" << function_c(function, index) }
+        c << "\nint main(void) {\n  return Aot_main(bytecode, sizeof(bytecode), functions, #{functions.length});\n}\n"
+        c
+      end
+
+      private
+
+      # In the same order as aot_attach in aot.c
+      def all_functions(function, functions = [])
+        functions << function
+        constants = function[:chunk][:constants]
+        (0...constants[:count]).each do |index|
+          constant = constants.constant_at(index)
+          if constant[:type] == :obj && constant[:as][:obj][:type] == :function
+            all_functions(constant[:as][:obj].as_function, functions)
+          end
+        end
+        functions
+      end
+
+      def function_c(function, index)
+        chunk = function[:chunk]
+        instructions = decode(chunk)
+        starts = instructions.to_h { |offset, _, _| [offset, true] }
+
+        body = +""
+        instructions.each do |offset, opcode, length|
+          body << "offset_#{offset}: // #{opcode.to_s.upcase} (line #{chunk.line_at(offset)})\n"
+          body << instruction_c(chunk, offset, opcode, length, starts)
+        end
+
+        c = +"// #{function[:name][:chars] || "<script>"}\n"
+        c << "static int lox_function_#{index}(Vm* vm, CallFrame* frame) {\n"
+        c << "  Value* slots = frame->slots;\n" if body.include?("slots[")
+        c << "  Value* constants = frame->closure->function->chunk.constants.values;\n" if body.include?("constants[")
+        c << "  InterpretResult result;\n"
+        c << "  switch (frame->ip - frame->closure->function->chunk.code) {\n"
+        instructions.each { |offset, _, _| c << "    case #{offset}: goto offset_#{offset};\n" }
+        c << "    default: return INTERPRET_RUNTIME_ERROR;\n"
+        c << "  }\n\n"
+        c << body
+        # Every function ends with OP_RETURN, which always leaves
+        c << "  return INTERPRET_RUNTIME_ERROR;\n"
+        c << "}\n"
+      end
+
+      # Returns the offset, opcode and length of each instruction
+      def decode(chunk)
+        instructions = []
+        offset = 0
+        while offset < chunk[:count]
+          opcode = Opcode[chunk.contents_at(offset)]
+          raise "Unknown opcode #{chunk.contents_at(offset)} at #{offset}" if opcode.nil?
+
+          length = if opcode == :closure
+            2 + chunk.constant_at(chunk.contents_at(offset + 1))[:as][:obj].as_function[:upvalue_count] * 2
+          else
+            INSTRUCTION_LENGTHS[opcode]
+          end
+          instructions << [offset, opcode, length]
+          offset += length
+        end
+        instructions
+      end
+
+      def instruction_c(chunk, offset, opcode, length, starts)
+        operand = chunk.contents_at(offset + 1) if length > 1
+        step = "!Aot_step(vm, frame, #{offset}, &result)"
+
+        case opcode
+        when :constant
+          "  *vm->stack_top++ = constants[#{operand}];\n"
+        when :nil
+          "  *vm->stack_top++ = Value_make_nil();\n"
+        when :true # standard:disable Lint/BooleanSymbol
+          "  *vm->stack_top++ = Value_make_boolean(true);\n"
+        when :false # standard:disable Lint/BooleanSymbol
+          "  *vm->stack_top++ = Value_make_boolean(false);\n"
+        when :pop
+          "  vm->stack_top--;\n"
+        when :get_local
+          "  *vm->stack_top++ = slots[#{operand}];\n"
+        when :set_local
+          "  slots[#{operand}] = vm->stack_top[-1];\n"
+        when :store_local
+          "  slots[#{operand}] = *--vm->stack_top;\n"
+        when :get_captured
+          "  *vm->stack_top++ = frame->closure->upvalues[#{operand}];\n"
+        when :get_upvalue, :set_upvalue
+          upvalue = "frame->closure->upvalues[#{operand}]"
+          access = if opcode == :get_upvalue
+            "*vm->stack_top++ = *Object_as_upvalue(#{upvalue})->location;"
+          else
+            "*Object_as_upvalue(#{upvalue})->location = vm->stack_top[-1];"
+          end
+          with_fallback("Object_is_type(#{upvalue}, OBJ_UPVALUE)", access, step)
+        when :get_global
+          "  {\n    Value value;\n" +
+            indent(with_fallback("Table_get(&vm->globals, Object_as_string(constants[#{operand}]), &value)",
+              "*vm->stack_top++ = value;", step)) +
+            "  }\n"
+        when :get_property
+          condition = "Object_is_instance(vm->stack_top[-1]) &&\n" \
+            "      Table_get(&Object_as_instance(vm->stack_top[-1])->fields, Object_as_string(constants[#{operand}]), &value)"
+          "  {\n    Value value;\n" + indent(with_fallback(condition, "vm->stack_top[-1] = value;", step)) + "  }\n"
+        when :equal, :not_equal
+          negation = (opcode == :not_equal) ? "!" : ""
+          "  vm->stack_top--;\n" \
+            "  vm->stack_top[-1] = Value_make_boolean(#{negation}Value_equals(vm->stack_top[-1], vm->stack_top[0]));\n"
+        when *CHECKED_ARITHMETIC.keys
+          with_fallback(numbers_condition, binary_number_c("Value_make_number", CHECKED_ARITHMETIC[opcode]), step)
+        when *CHECKED_COMPARISONS.keys
+          with_fallback(numbers_condition, binary_number_c("Value_make_boolean", CHECKED_COMPARISONS[opcode]), step)
+        when *UNCHECKED_ARITHMETIC.keys
+          "  {\n#{indent(binary_number_c("Value_make_number", UNCHECKED_ARITHMETIC[opcode]), 2)}  }\n"
+        when *UNCHECKED_COMPARISONS.keys
+          "  {\n#{indent(binary_number_c("Value_make_boolean", UNCHECKED_COMPARISONS[opcode]), 2)}  }\n"
+        when /_registers?(_constant)?\z/
+          make, operator = REGISTER_OPERATIONS[opcode.to_s[/\A[a-z]+/]]
+          right = opcode.end_with?("constant") ? "constants[#{chunk.contents_at(offset + 2)}]" : "slots[#{chunk.contents_at(offset + 2)}]"
+          with_fallback("Value_is_number(slots[#{operand}]) && Value_is_number(#{right})",
+            "*vm->stack_top++ = #{make}(Value_as_number(slots[#{operand}]) #{operator} Value_as_number(#{right}));", step)
+        when :not
+          "  vm->stack_top[-1] = Value_make_boolean(Aot_is_falsey(vm->stack_top[-1]));\n"
+        when :negate
+          with_fallback("Value_is_number(vm->stack_top[-1])",
+            "vm->stack_top[-1] = Value_make_number(-Value_as_number(vm->stack_top[-1]));", step)
+        when :jump, :loop, :jump_if_false, :jump_if_true
+          jump = (operand << 8) | chunk.contents_at(offset + 2)
+          target = (opcode == :loop) ? offset + length - jump : offset + length + jump
+          raise "Jump to #{target} at #{offset} doesn't land on an instruction" unless starts[target]
+
+          case opcode
+          when :jump_if_false
+            "  if (Aot_is_falsey(vm->stack_top[-1])) {\n    goto offset_#{target};\n  }\n"
+          when :jump_if_true
+            "  if (!Aot_is_falsey(vm->stack_top[-1])) {\n    goto offset_#{target};\n  }\n"
+          else
+            "  goto offset_#{target};\n"
+          end
+        else
+          "  if (#{step}) {\n    return result;\n  }\n"
+        end
+      end
+
+      def numbers_condition
+        "Value_is_number(vm->stack_top[-1]) && Value_is_number(vm->stack_top[-2])"
+      end
+
+      # The lines of a block that pops two numbers and pushes the result
+      def binary_number_c(make, expression)
+        "double b = Value_as_number(vm->stack_top[-1]);\n" \
+          "double a = Value_as_number(vm->stack_top[-2]);\n" \
+          "vm->stack_top--;\n" \
+          "vm->stack_top[-1] = #{make}(#{expression});"
+      end
+
+      # Runs code if condition holds, or the instruction in the interpreter
+      # otherwise
+      def with_fallback(condition, code, step)
+        "  if (#{condition}) {\n#{indent(code, 2)}  } else if (#{step}) {\n    return result;\n  }\n"
+      end
+
+      def indent(code, levels = 1)
+        code.each_line.map { |line| "#{"  " * levels}#{line.chomp}\n" }.join
+      end
+    end
+  end
+end
@@ -0,0 +1,99 @@
+require "etc"
+require "stringio"
+
+module Lox
+  module Bytecode
+    # Runs many scripts from one process, each in a VM of its own, on a pool
+    # of native threads that run without holding the GVL (see batch.h). The
+    # scripts are compiled one after another first, since compiling happens
+    # in Ruby. Everything a script prints is captured, so that the output of
+    # scripts running at the same time isn't interleaved.
+    #
+    # Each distinct source is only compiled once, into a VM that's then
+    # frozen, and the VMs that run it share that VM's code rather than
+    # holding copies of their own (see Vm_init_shared). Running the same
+    # script many times over only costs a heap for what each run creates.
+    #
+    # With a budget, scripts take turns on the threads, running for that many
+    # loop iterations and calls at a time (see Vm_resume), so that a few
+    # scripts that run for a long time, or forever, can't keep the others
+    # waiting.
+    class Batch
+      # The status is what lox-bytecode would exit with had it run the
+      # script on its own. The rest is how the script was scheduled, with
+      # times in seconds (see BatchJob), and is zero for scripts that didn't
+      # compile.
+      Result = Struct.new(
+        :status, :output, :errors, :slices, :run_time, :longest_wait, :finish_time,
+        keyword_init: true
+      )
+
+      def initialize(vm_options = nil, thread_count: Etc.nprocessors, budget: nil)
+        @vm_options = (vm_options || Main::VmOptions.default).dup
+        # Traces of scripts running at the same time would be interleaved,
+        # and compiling lazily runs Ruby code while the script runs
+        @vm_options.log_disassembly = false
+        @vm_options.trace_path = nil
+        @vm_options.lazy_compile = false
+        @thread_count = thread_count
+        @budget = budget || 0
+      end
+
+      # Returns a Result for each source, in the same order
+      def run(sources)
+        code_heaps = []
+        vms = []
+        compiled = sources.uniq.to_h do |source|
+          error_output = StringIO.new
+          main = Main.new(@vm_options, error_output: error_output)
+          code_heaps << main.vm
+          function = main.compile(source)
+          Lox::Bytecode.vm_freeze(main.vm, function) unless function.nil?
+          [source, [main.vm, function, error_output.string]]
+        end
+
+        runnable = sources.each_index.reject { |index| compiled[sources[index]][1].nil? }
+        jobs = FFI::MemoryPointer.new(BatchJob, runnable.length)
+        runnable.each_with_index do |index, job_index|
+          code_heap, function, _ = compiled[sources[index]]
+          vms << (vm = VM.new_shared(code_heap))
+          job = batch_job(jobs, job_index)
+          job[:vm] = vm
+          job[:function] = function
+        end
+        Lox::Bytecode.batch_run(jobs, runnable.length, @thread_count, @budget)
+
+        results = sources.map do |source|
+          Result.new(
+            status: 65, output: "", errors: compiled[source][2],
+            slices: 0, run_time: 0.0, longest_wait: 0.0, finish_time: 0.0
+          )
+        end
+        runnable.each_with_index do |index, job_index|
+          job = batch_job(jobs, job_index)
+          results[index] = Result.new(
+            status: (job[:result] == :ok) ? 0 : 70,
+            output: job.output,
+            errors: results[index].errors + job.errors,
+            slices: job[:slices],
+            run_time: job[:run_time],
+            longest_wait: job[:longest_wait],
+            finish_time: job[:finish_time]
+          )
+          Lox::Bytecode.batch_job_free(job)
+        end
+        results
+      ensure
+        # The code heaps have to outlive the VMs that share them
+        vms&.each { |vm| Lox::Bytecode.vm_free(vm) }
+        code_heaps&.each { |vm| Lox::Bytecode.vm_free(vm) }
+      end
+
+      private
+
+      def batch_job(jobs, index)
+        BatchJob.new(jobs + (index * BatchJob.size))
+      end
+    end
+  end
+end
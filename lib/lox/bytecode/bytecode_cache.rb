@@ -0,0 +1,39 @@
+require "digest"
+require "fileutils"
+
+module Lox
+  module Bytecode
+    # Keeps compiled scripts in a directory as .loxc files, so that a script
+    # that hasn't changed since it was last run doesn't need to be scanned,
+    # parsed or compiled again. Files are named after a hash of the source
+    # and the version of the file format, so there's never any need to
+    # invalidate them. Files that can't be loaded are simply replaced.
+    class BytecodeCache
+      def initialize(vm, directory)
+        @vm = vm
+        @directory = directory
+        FileUtils.mkdir_p(@directory)
+      end
+
+      # Returns the cached function for source if there is one. Otherwise,
+      # compiles it with the block, which should return nil if there were
+      # errors, and caches the result.
+      def fetch(source)
+        path = path_for(source)
+        pointer = Lox::Bytecode.bytecode_file_map(@vm, path)
+        return ObjFunction.new(pointer) unless pointer.null?
+
+        function = yield
+        # Not being able to write the file only means it will be compiled
+        # again next time
+        Lox::Bytecode.bytecode_file_write(function, path) unless function.nil?
+        function
+      end
+
+      def path_for(source)
+        hash = Digest::SHA256.hexdigest(source)
+        File.join(@directory, "#{hash}-v#{Lox::Bytecode.bytecode_file_version}.loxc")
+      end
+    end
+  end
+end
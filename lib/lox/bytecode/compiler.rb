@@ -1,14 +1,30 @@
+require_relative "../parser"
+
 module Lox
   module Bytecode
     class Compiler
-      Local = Struct.new(:name, :depth, :is_captured)
+      # Closures copy the values of final locals instead of sharing them.
+      # Locals that are declared with a method that's only ever called hold
+      # its receiver instead of a bound method, and method_property is the
+      # property they were declared with (see TypeInference#unbound_method).
+      Local = Struct.new(:name, :depth, :is_captured, :is_final, :method_property)
 
-      Upvalue = Struct.new(:index, :is_local)
+      Upvalue = Struct.new(:index, :is_local, :name, :by_value)
 
       ClassDeclaration = Struct.new(:enclosing, :has_superclass)
 
       SyntheticToken = Struct.new(:lexeme, :line)
 
+      # The opcodes for operators whose operands are known to be numbers
+      NUMBER_OPCODES = {
+        Lox::Parser::TokenType::PLUS => :add_numbers,
+        Lox::Parser::TokenType::MINUS => :subtract_numbers,
+        Lox::Parser::TokenType::STAR => :multiply_numbers,
+        Lox::Parser::TokenType::SLASH => :divide_numbers,
+        Lox::Parser::TokenType::GREATER => :greater_numbers,
+        Lox::Parser::TokenType::LESS => :less_numbers
+      }.freeze
+
       module FunctionType
         FUNCTION = :FUNCTION
         INITIALIZER = :INITIALIZER
@@ -16,7 +32,7 @@ module Lox
         SCRIPT = :SCRIPT
       end
 
-      def initialize(vm:, function:, function_type:, error_handler:, enclosing: nil, scope_depth: 0, current_class: nil, disassembler: nil)
+      def initialize(vm:, function:, function_type:, error_handler:, enclosing: nil, scope_depth: 0, current_class: nil, disassembler: nil, lazy_functions: nil, optimize: false, types: nil)
         @vm = vm
         @function = function
         @function_type = function_type
@@ -25,15 +41,30 @@ module Lox
         @scope_depth = scope_depth
         @current_class = current_class
         @disassembler = disassembler
+        @lazy_functions = lazy_functions
+        # Deduplicates string constants and runs the peephole optimizer over
+        # the code once it's compiled
+        @optimize = optimize
+        # A TypeInference for the whole script, if numeric operations whose
+        # operands are known to be numbers should skip checking them
+        @types = types
+        # The constant indices of strings, by their contents
+        @string_constants = {}
 
         @locals = []
         @locals << if [FunctionType::INITIALIZER, FunctionType::METHOD].include?(function_type)
-          Local.new("this", scope_depth, false)
+          Local.new("this", scope_depth, false, !@types.nil?)
         else
-          Local.new("", scope_depth, false)
+          Local.new("", scope_depth, false, false)
         end
 
         @upvalues = []
+
+        # The function's code is built up here and handed over to its chunk
+        # all at once by flush_code, rather than one FFI call per byte. Lines
+        # are kept as a flat array of [line, number of bytes] runs.
+        @code = []
+        @line_runs = []
       end
 
       def compile(statements)
@@ -44,7 +75,16 @@ module Lox
         # Since this is synthetic, we make it appear as if it comes from the previous line
         emit_return(nil, statements.last&.bounding_lines&.last || 0)
 
-        @disassembler&.disassemble_function(@function)
+        flush_code
+
+        if @optimize
+          @disassembler&.disassemble_function(@function, "before peephole")
+          Lox::Bytecode.peephole_optimize(current_chunk)
+          @disassembler&.disassemble_function(@function, "after peephole")
+        else
+          @disassembler&.disassemble_function(@function)
+        end
+        Lox::Bytecode.vm_finish_function(@function)
 
         @function
       end
@@ -79,7 +119,7 @@ module Lox
 
           get_named_variable(stmt.superclass.name)
           begin_scope
-          @locals << Local.new("super", -1, false)
+          @locals << Local.new("super", -1, false, !@types.nil?)
           if global_scope?
             define_global(0, stmt.superclass.name.line)
           else
@@ -95,13 +135,15 @@ module Lox
         get_named_variable(stmt.name)
 
         stmt.methods.each do |method|
-          constant = make_identifier_constant(method.name, method.name.lexeme)
+          constant = make_selector_constant(method.name, method.name.lexeme)
           function_type = method.name.lexeme == "init" ? FunctionType::INITIALIZER : FunctionType::METHOD
           compile_function(method, function_type)
           emit_bytes(:method, constant, method.bounding_lines.first)
         end
 
-        emit_byte(:pop, stmt.bounding_lines.last)
+        # Compacts the dispatch row of the class now that all of its methods are
+        # defined, and pops it
+        emit_byte(:end_class, stmt.bounding_lines.last)
 
         end_scope(stmt.bounding_lines.last) if @current_class.has_superclass
 
@@ -164,13 +206,21 @@ module Lox
           define_global(global, stmt.bounding_lines.last)
         else
           declare_local(stmt.name)
-          emit_var_initializer(stmt)
+          if (get = @locals[-1].method_property)
+            # The method is looked up now, so that the same errors are
+            # reported at the same time, and again when it's called
+            get.object.accept(self)
+            constant = make_selector_constant(get.name, get.name.lexeme)
+            emit_bytes(:get_method, constant, get.name.line)
+          else
+            emit_var_initializer(stmt)
+          end
           mark_new_local_initialized
         end
       end
 
       def visit_while_stmt(stmt)
-        loop_start = current_chunk[:count]
+        loop_start = @code.length
         stmt.condition.accept(self)
         exit_jump = emit_jump(:jump_if_false, stmt.condition.bounding_lines.last)
         emit_byte(:pop, stmt.condition.bounding_lines.last)
@@ -179,6 +229,18 @@ module Lox
         emit_byte(:pop, stmt.bounding_lines.last)
       end
 
+      def visit_dead_code(node)
+        code_length = @code.length
+        line_run_count = @line_runs.length
+        last_line_run_length = @line_runs[-1]
+        node.dead.accept(self)
+        @code.slice!(code_length..)
+        @line_runs.slice!(line_run_count..)
+        @line_runs[-1] = last_line_run_length unless line_run_count == 0
+
+        node.live&.accept(self)
+      end
+
       def visit_assign_expr(expr)
         expr.value.accept(self)
         line = expr.name.bounding_lines.first
@@ -200,6 +262,13 @@ module Lox
         add_expression_to_chunk(expr.left)
         add_expression_to_chunk(expr.right)
 
+        # <= and >= are left checked, since the peephole pass fuses them into
+        # a single instruction, which beats skipping the checks
+        if @types&.number?(expr.left) && @types.number?(expr.right)
+          opcode = NUMBER_OPCODES[expr.operator.type]
+          return emit_byte(opcode, expr.operator.line) if opcode
+        end
+
         case expr.operator.type
         when Lox::Parser::TokenType::BANG_EQUAL
           emit_bytes(:equal, :not, expr.operator.line)
@@ -227,7 +296,7 @@ module Lox
       def visit_call_expr(expr)
         if expr.callee.is_a?(Lox::Parser::Expr::Get)
           expr.callee.object.accept(self)
-          constant = make_identifier_constant(expr.callee.name, expr.callee.name.lexeme)
+          constant = make_selector_constant(expr.callee.name, expr.callee.name.lexeme)
           arg_count = argument_list(expr.arguments)
           emit_bytes(:invoke, constant, expr.callee.name.line)
           emit_byte(arg_count, expr.callee.name.line)
@@ -235,11 +304,28 @@ module Lox
           validate_super_call(expr.callee.keyword)
 
           get_named_variable(SyntheticToken.new("this", expr.callee.method.line))
-          constant = make_identifier_constant(expr.callee.method, expr.callee.method.lexeme)
+          constant = make_selector_constant(expr.callee.method, expr.callee.method.lexeme)
           arg_count = argument_list(expr.arguments)
           get_named_variable(SyntheticToken.new("super", expr.callee.method.line))
           emit_bytes(:super_invoke, constant, expr.callee.method.line)
           emit_byte(arg_count, expr.callee.method.line)
+        elsif (get = parenthesized_get(expr.callee))
+          # Like a call to a method, except that the property is looked up
+          # before the arguments are evaluated. The method isn't bound, since
+          # the bound method could never be used again anyway.
+          get.object.accept(self)
+          constant = make_selector_constant(get.name, get.name.lexeme)
+          emit_bytes(:get_method, constant, get.name.line)
+          arg_count = argument_list(expr.arguments)
+          emit_bytes(:call_method, constant, expr.bounding_lines.first)
+          emit_byte(arg_count, expr.bounding_lines.first)
+        elsif expr.callee.is_a?(Lox::Parser::Expr::Variable) && (get = local_method(expr.callee.name))
+          # The local holds the receiver, see visit_var_stmt
+          get_named_variable(expr.callee.name)
+          constant = make_selector_constant(get.name, get.name.lexeme)
+          arg_count = argument_list(expr.arguments)
+          emit_bytes(:call_method, constant, expr.bounding_lines.first)
+          emit_byte(arg_count, expr.bounding_lines.first)
         else
           expr.callee.accept(self)
           arg_count = argument_list(expr.arguments)
@@ -301,7 +387,7 @@ module Lox
       def visit_super_expr(expr)
         validate_super_call(expr.keyword)
 
-        constant = make_identifier_constant(expr.method, expr.method.lexeme)
+        constant = make_selector_constant(expr.method, expr.method.lexeme)
 
         get_named_variable(SyntheticToken.new("this", expr.method.line))
         get_named_variable(SyntheticToken.new("super", expr.method.line))
@@ -347,7 +433,13 @@ module Lox
           end
         end
 
-        @locals << Local.new(name.lexeme, -1, false)
+        @locals << Local.new(name.lexeme, -1, false, !!@types&.final?(name), @types&.unbound_method(name))
+      end
+
+      # The property that a local holds the receiver of, if the name refers
+      # to one
+      def local_method(token)
+        @locals.reverse_each.find { |local| local.name == token.lexeme }&.method_property
       end
 
       def mark_new_local_initialized
@@ -370,28 +462,50 @@ module Lox
       end
 
       def resolve_upvalue(token, name)
-        return -1 if @enclosing.nil?
+        # Functions that are compiled lazily are cut off from the compilers
+        # that enclosed them, so they can only see what was captured up front
+        if @enclosing.nil?
+          return @upvalues.index { |upvalue| upvalue.name == name } || -1
+        end
 
         local = @enclosing.resolve_local(token, name)
         if local != -1
-          @enclosing.capture_local(local)
-          return add_upvalue(token, local, true)
+          by_value = @enclosing.capture_local(local)
+          return add_upvalue(token, local, true, by_value)
         end
 
         upvalue = @enclosing.resolve_upvalue(token, name)
-        return add_upvalue(token, upvalue, false) if upvalue != -1
+        return add_upvalue(token, upvalue, false, @enclosing.upvalue_by_value?(upvalue)) if upvalue != -1
 
         -1
       end
 
+      # Returns true if the local is captured by value, in which case it
+      # doesn't have to be closed when it goes out of scope
       def capture_local(index)
-        @locals[index].is_captured = true
+        local = @locals[index]
+        local.is_captured = true unless local.is_final
+        local.is_final
+      end
+
+      def upvalue_by_value?(index)
+        @upvalues[index].by_value
       end
 
       def upvalues
         @upvalues.dup
       end
 
+      # Captures every variable the body could refer to while the enclosing
+      # compilers can still resolve it, so that the body can be compiled
+      # later on its own
+      def capture_referenced_variables(body)
+        LazyFunctions.referenced_names(body).each do |name|
+          resolve_upvalue(SyntheticToken.new(name, body.first&.bounding_lines&.first || 0), name)
+        end
+        @enclosing = nil
+      end
+
       private
 
       def current_chunk
@@ -435,7 +549,7 @@ module Lox
         else
           upvalue = resolve_upvalue(token, token.lexeme)
           if upvalue != -1
-            emit_bytes(:get_upvalue, upvalue, line)
+            emit_bytes(@upvalues[upvalue].by_value ? :get_captured : :get_upvalue, upvalue, line)
           else
             constant = make_identifier_constant(token, token.lexeme)
             emit_bytes(:get_global, constant, line)
@@ -451,7 +565,7 @@ module Lox
         emit_bytes(:define_global, global, line)
       end
 
-      def add_upvalue(token, index, is_local)
+      def add_upvalue(token, index, is_local, by_value)
         upvalue = @function[:upvalue_count]
         @upvalues.each.with_index do |upvalue, i|
           if upvalue.index == index && upvalue.is_local == is_local
@@ -463,7 +577,7 @@ module Lox
           @error_handler.compile_error(token, "Too many closure variables in function.")
           return 0
         end
-        @upvalues << Upvalue.new(index, is_local)
+        @upvalues << Upvalue.new(index, is_local, token.lexeme, by_value)
         @function[:upvalue_count] += 1
         upvalue
       end
@@ -498,33 +612,63 @@ module Lox
 
       def compile_function(stmt, function_type)
         function = Lox::Bytecode.vm_new_function(@vm)
-        function[:name] = Lox::Bytecode.vm_copy_string(@vm, stmt.name.lexeme, stmt.name.lexeme.bytesize)
-        compiler = Compiler.new(
-          vm: @vm,
-          function: function,
-          function_type: function_type,
-          error_handler: @error_handler,
-          enclosing: self,
-          scope_depth: @scope_depth + 1,
-          current_class: @current_class,
-          disassembler: @disassembler
-        )
-        stmt.params.each do |param|
-          function[:arity] += 1
-          if function[:arity] > 255
-            @error_handler.compile_error(param, "Can't have more than 255 parameters.")
+        # The function is only reachable from the enclosing function once it's
+        # been added to its constants
+        compiler = @vm.with_root(function) do
+          function[:name] = Lox::Bytecode.vm_copy_string(@vm, stmt.name.lexeme, stmt.name.lexeme.bytesize)
+          compiler = self.class.new(
+            vm: @vm,
+            function: function,
+            function_type: function_type,
+            error_handler: @error_handler,
+            enclosing: self,
+            scope_depth: @scope_depth + 1,
+            current_class: @current_class,
+            disassembler: @disassembler,
+            lazy_functions: @lazy_functions,
+            optimize: @optimize,
+            types: @types
+          )
+          stmt.params.each do |param|
+            function[:arity] += 1
+            if function[:arity] > 255
+              @error_handler.compile_error(param, "Can't have more than 255 parameters.")
+            end
+            compiler.declare_local(param)
+            compiler.mark_new_local_initialized
           end
-          compiler.declare_local(param)
-          compiler.mark_new_local_initialized
+          if @lazy_functions
+            compiler.capture_referenced_variables(stmt.body)
+            @lazy_functions.add(function, compiler, stmt.body)
+          else
+            compiler.compile(stmt.body)
+          end
+          compiler
         end
-        compiler.compile(stmt.body)
         emit_bytes(:closure, make_constant(:object, stmt.name, function), stmt.name.line)
         (0...function[:upvalue_count]).each do |i|
-          emit_byte(compiler.upvalues[i].is_local ? 1 : 0, stmt.name.line)
+          upvalue = compiler.upvalues[i]
+          capture_type = if !upvalue.is_local
+            :capture_upvalue
+          elsif upvalue.by_value
+            :capture_value
+          else
+            :capture_local
+          end
+          emit_byte(CaptureType[capture_type], stmt.name.line)
           emit_byte(compiler.upvalues[i].index, stmt.name.line)
         end
       end
 
+      # Returns the property access inside of any number of parentheses, as
+      # in (object.method)(), or nil if there's something else in there
+      def parenthesized_get(expr)
+        return nil unless expr.is_a?(Lox::Parser::Expr::Grouping)
+
+        expr = expr.expression while expr.is_a?(Lox::Parser::Expr::Grouping)
+        expr if expr.is_a?(Lox::Parser::Expr::Get)
+      end
+
       def validate_super_call(keyword)
         if @current_class.nil?
           @error_handler.compile_error(keyword, "Can't use 'super' outside of a class.")
@@ -534,7 +678,16 @@ module Lox
       end
 
       def emit_byte(byte, line)
-        Lox::Bytecode.chunk_write(current_chunk, byte, line)
+        @code << (byte.is_a?(Symbol) ? Opcode[byte] : byte)
+        if @line_runs[-2] == line
+          @line_runs[-1] += 1
+        else
+          @line_runs << line << 1
+        end
+      end
+
+      def flush_code
+        Lox::Bytecode.chunk_write_bytes(current_chunk, @code.pack("C*"), @code.length, @line_runs.pack("l*"), @line_runs.length / 2)
       end
 
       def emit_bytes(byte1, byte2, line)
@@ -552,33 +705,55 @@ module Lox
 
       def make_identifier_constant(token, value)
         obj_string = Lox::Bytecode.vm_copy_string(@vm, value, value.bytesize)
-        make_constant(:object, token, obj_string)
+        make_string_constant(token, value, obj_string)
+      end
+
+      # Method names are given selectors as they are compiled, so that the
+      # selectors of methods that are declared together end up close together
+      def make_selector_constant(token, value)
+        obj_string = Lox::Bytecode.vm_copy_string(@vm, value, value.bytesize)
+        Lox::Bytecode.vm_intern_selector(@vm, obj_string)
+        make_string_constant(token, value, obj_string)
+      end
+
+      # Numbers aren't deduplicated, to keep within the limits clox has on
+      # constants, which the tests check
+      def make_string_constant(token, value, obj_string)
+        return make_constant(:object, token, obj_string) unless @optimize
+
+        return @string_constants[value] if @string_constants.key?(value)
+
+        # A constant that didn't fit has been reported, and has to be
+        # reported again wherever the string is used
+        constant = make_constant(:object, token, obj_string)
+        @string_constants[value] = constant if constant <= 255
+        constant
       end
 
       def emit_jump(instruction, line)
         emit_byte(instruction, line)
         emit_byte(0xff, line)
         emit_byte(0xff, line)
-        current_chunk[:count] - 2
+        @code.length - 2
       end
 
       def patch_jump(offset, line)
         # -2 to adjust for the bytecode for the jump offset itself.
-        jump = current_chunk[:count] - offset - 2
+        jump = @code.length - offset - 2
 
         if jump > 0xffff
           @error_handler.tokenless_compile_error(line, "Too much code to jump over.")
         end
 
-        current_chunk.patch_contents_at(offset, (jump >> 8) & 0xff)
-        current_chunk.patch_contents_at(offset + 1, jump & 0xff)
+        @code[offset] = (jump >> 8) & 0xff
+        @code[offset + 1] = jump & 0xff
       end
 
       def emit_loop(loop_start, stmt, exit_jump)
         loop_line = stmt.condition.bounding_lines.first
         emit_byte(:loop, loop_line)
 
-        offset = current_chunk[:count] - loop_start + 2
+        offset = @code.length - loop_start + 2
 
         if offset > 0xffff
           @error_handler.tokenless_compile_error(stmt.body.bounding_lines.last, "Loop body too large.")
@@ -1,33 +1,38 @@
 module Lox
   module Bytecode
     class Interpreter
-      def initialize(vm, disassembler: nil)
+      # With log_disassembly, every instruction is listed on stdout as it
+      # runs. With a trace_path, they're written to a trace file instead,
+      # which TraceDecoder reads. Both are done by the VM (see trace.h).
+      def initialize(vm, log_disassembly: false, trace_path: nil)
         @vm = vm
-        @disassembler = disassembler
+        @log_disassembly = log_disassembly
+        @trace_path = trace_path
       end
 
       def interpret(function)
-        interpret_result = nil
-
-        if log_disassembly?
-          Lox::Bytecode.vm_init_function(@vm, function)
-          loop do
-            @disassembler.disassemble_instruction(@vm.current_function[:chunk], @vm.current_offset)
-            interpret_result = Lox::Bytecode.vm_interpret_next_instruction(@vm)
-            puts "[DEBUG] Stack contents: #{@vm.stack_contents}"
-            break if interpret_result != :incomplete
-          end
-        else
-          interpret_result = Lox::Bytecode.vm_interpret(@vm, function)
+        trace = open_trace
+        @vm[:trace] = trace unless trace.nil?
+        Lox::Bytecode.vm_interpret(@vm, function)
+      ensure
+        unless trace.nil?
+          @vm[:trace] = nil
+          warn "Could not write trace file \"#{@trace_path}\"." unless Lox::Bytecode.trace_close(trace)
         end
-
-        interpret_result
       end
 
       private
 
-      def log_disassembly?
-        !!@disassembler
+      def open_trace
+        if @trace_path
+          trace = Lox::Bytecode.trace_open(@trace_path)
+          return trace unless trace.null?
+
+          warn "Could not create trace file \"#{@trace_path}\"."
+          nil
+        elsif @log_disassembly
+          Lox::Bytecode.trace_new_log
+        end
       end
     end
   end
@@ -0,0 +1,73 @@
+module Lox
+  module Bytecode
+    # Holds on to the functions whose bodies haven't been compiled yet, along
+    # with the compilers that will compile them. A function declared in lazy
+    # mode is created without any code, and the VM calls back into here the
+    # first time it's called (see vm_call). Compile errors in a function body
+    # are only reported then.
+    class LazyFunctions
+      def initialize(vm, error_handler)
+        @vm = vm
+        @error_handler = error_handler
+        @pending = {}
+        # The VM only has a pointer to the callback, so it has to be kept
+        # alive for as long as the VM is
+        @callback = FFI::Function.new(:bool, [:pointer]) { |function| compile(function) }
+        @vm[:compile_function] = @callback
+      end
+
+      def add(function, compiler, body)
+        @pending[function.to_ptr.address] = [compiler, body]
+      end
+
+      # Returns the names of all the variables that the statements refer to,
+      # including "this" and "super", in the order they first appear. Names
+      # that are declared by the statements themselves are included too,
+      # which only means that a function may capture a few more variables
+      # than it needs to.
+      def self.referenced_names(nodes)
+        names = {}
+        add_referenced_names(nodes, names)
+        names.keys
+      end
+
+      def self.add_referenced_names(nodes, names)
+        nodes.each do |node|
+          case node
+          when Lox::Parser::Expr::Variable, Lox::Parser::Expr::Assign
+            names[node.name.lexeme] = true
+          when Lox::Parser::Expr::This
+            names["this"] = true
+          when Lox::Parser::Expr::Super
+            names["this"] = true
+            names["super"] = true
+          when Lox::Parser::Stmt::Class
+            names[node.name.lexeme] = true
+          when Lox::Parser::Token
+            next
+          end
+
+          node.each do |child|
+            if child.is_a?(Array)
+              add_referenced_names(child, names)
+            elsif child.is_a?(Struct)
+              add_referenced_names([child], names)
+            end
+          end
+        end
+      end
+      private_class_method :add_referenced_names
+
+      private
+
+      def compile(pointer)
+        compiler, body = @pending.delete(pointer.address)
+        return false if compiler.nil?
+
+        @vm.with_root(pointer) { compiler.compile(body) }
+
+        !@error_handler.had_error?
+      end
+    end
+  end
+end
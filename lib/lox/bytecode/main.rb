@@ -3,57 +3,68 @@ require_relative "../parser"
 module Lox
   module Bytecode
     class Main
-      VmOptions = Struct.new(:log_disassembly, :log_gc, :stress_gc, keyword_init: true) do
+      VmOptions = Struct.new(:log_disassembly, :log_gc, :stress_gc, :cache_directory, :lazy_compile, :optimize, :superinstructions, :isolates, :trace_path, keyword_init: true) do
         def self.default
-          new(log_disassembly: false, log_gc: false, stress_gc: false)
+          new(log_disassembly: false, log_gc: false, stress_gc: false, cache_directory: nil, lazy_compile: false, optimize: true, superinstructions: false, isolates: false, trace_path: nil)
         end
       end
 
-      def initialize(vm_options = nil)
+      attr_reader :vm
+
+      # Errors are written to error_output if it's given, or warned about
+      # otherwise
+      def initialize(vm_options = nil, error_output: nil)
         @vm_options = vm_options || VmOptions.default
+        @error_output = error_output
         @vm = Lox::Bytecode::VM.new(FFI::MemoryPointer.new(Lox::Bytecode::VM, 1)[0])
         Lox::Bytecode.vm_init(@vm)
         @vm[:memory_allocator][:log_gc] = @vm_options.log_gc
         @vm[:memory_allocator][:stress_gc] = @vm_options.stress_gc
+        @vm[:memory_allocator][:gc_enabled] = true
         if @vm_options.log_disassembly
-          @disassembler = Lox::Bytecode::Disassembler.new($stdout)
+          @disassembler = Lox::Bytecode::Disassembler.new
+        end
+        if @vm_options.cache_directory
+          @bytecode_cache = BytecodeCache.new(@vm, @vm_options.cache_directory)
+        elsif @vm_options.lazy_compile
+          # Bytecode files can only hold compiled functions, and a script that
+          # is cached doesn't get compiled at all anyway
+          @lazy_functions = LazyFunctions.new(@vm, self)
         end
       end
 
       def run(source)
-        # Because the compiler is creating objects on behalf of the native
-        # extension without the native extension maintaining references to
-        # all of these objects, doing garbage collection during compilation
-        # is rather unsafe. So we don't!
-        @vm[:memory_allocator][:gc_enabled] = false
-        scanner = Lox::Parser::Scanner.new(source, self)
-        tokens = scanner.scan_tokens
-
-        parser = Lox::Parser::RecursiveDescentParser.new(tokens, self)
-        statements = parser.parse!
-
-        return if had_error?
-
-        function = Lox::Bytecode.vm_new_function(@vm)
-        compiler = Compiler.new(
-          vm: @vm,
-          function: function,
-          function_type: Compiler::FunctionType::SCRIPT,
-          error_handler: self,
-          disassembler: @disassembler
-        )
-        compiler.compile(statements)
+        function = if @bytecode_cache
+          @bytecode_cache.fetch(source) { compile(source) }
+        else
+          compile(source)
+        end
 
-        return if had_error?
+        return if function.nil?
 
-        @vm[:memory_allocator][:gc_enabled] = true
-        interpreter = Interpreter.new(@vm, disassembler: @disassembler)
-        interpret_result = interpreter.interpret(function)
+        # Lazily compiled functions are compiled on whichever thread calls
+        # them first, which can't be done in code that isolates share.
+        # Scripts that never refer to the natives of isolates don't need
+        # the VM frozen and a second VM to run in.
+        interpret_result = if @vm_options.isolates && @lazy_functions.nil? && Lox::Bytecode.isolate_group_is_needed_by(function)
+          run_in_isolates(function)
+        else
+          interpreter(@vm).interpret(function)
+        end
         if interpret_result != :ok
           @had_runtime_error = true
         end
       end
 
+      # Compiles source into a native executable at output_path instead of
+      # running it, see AotCompiler. Returns false if it couldn't be built.
+      def build_executable(source, output_path)
+        function = compile(source)
+        return false if function.nil?
+
+        AotCompiler.new(function).build(output_path)
+      end
+
       def scan_error(line, message)
         report(line, "", message)
         @had_error = true
@@ -78,7 +89,7 @@ module Lox
       end
 
       def tokenless_compile_error(line, message)
-        warn("[line #{line}] Error: #{message}")
+        report_error("[line #{line}] Error: #{message}")
         @had_error = true
       end
 
@@ -94,10 +105,69 @@ module Lox
         @had_error = false
       end
 
+      # Returns nil if there were any errors
+      def compile(source)
+        scanner = NativeScanner.new(source, self)
+        tokens = scanner.scan_tokens
+
+        parser = Lox::Parser::RecursiveDescentParser.new(tokens, self)
+        statements = parser.parse!
+
+        return if had_error?
+
+        statements = Optimizer.new.optimize(statements) if @vm_options.optimize
+
+        function = Lox::Bytecode.vm_new_function(@vm)
+        compiler_class = @vm_options.superinstructions ? SuperinstructionCompiler : Compiler
+        compiler = compiler_class.new(
+          vm: @vm,
+          function: function,
+          function_type: Compiler::FunctionType::SCRIPT,
+          error_handler: self,
+          disassembler: @disassembler,
+          lazy_functions: @lazy_functions,
+          optimize: !!@vm_options.optimize,
+          types: (TypeInference.new(statements) if @vm_options.optimize)
+        )
+        # The garbage collector can run while compiling, and nothing refers
+        # to the script's function until it starts running
+        @vm.with_root(function) { compiler.compile(statements) }
+
+        return if had_error?
+
+        function
+      end
+
       private
 
+      # Freezes the VM the script was compiled in, and runs the script in
+      # another VM that shares its code, so that it can spawn isolates (see
+      # isolate.h). Nothing can be compiled in a frozen VM, so this can only
+      # be done once.
+      def run_in_isolates(function)
+        Lox::Bytecode.vm_freeze(@vm, function)
+        vm = VM.new_shared(@vm)
+        group = Lox::Bytecode.isolate_group_new(vm)
+        interpreter(vm).interpret(function)
+      ensure
+        Lox::Bytecode.isolate_group_free(group) if group
+        Lox::Bytecode.vm_free(vm) if vm
+      end
+
+      def interpreter(vm)
+        Interpreter.new(vm, log_disassembly: @vm_options.log_disassembly, trace_path: @vm_options.trace_path)
+      end
+
       def report(line, where, message)
-        warn("[line #{line}] Error#{where}: #{message}")
+        report_error("[line #{line}] Error#{where}: #{message}")
+      end
+
+      def report_error(message)
+        if @error_output
+          @error_output.puts(message)
+        else
+          warn(message)
+        end
       end
     end
   end
@@ -0,0 +1,100 @@
+module Lox
+  module Bytecode
+    # A stand-in for Lox::Parser::Scanner that scans in the native extension.
+    # All of the tokens come back from one FFI call as a packed buffer of
+    # (type, start, length, line) entries, and Token objects are only built
+    # when the parser asks for them.
+    class NativeScanner
+      # The token types from ext/scanner.h, in the order they are defined
+      TOKEN_TYPES = [
+        Lox::Parser::TokenType::LEFT_PAREN, Lox::Parser::TokenType::RIGHT_PAREN,
+        Lox::Parser::TokenType::LEFT_BRACE, Lox::Parser::TokenType::RIGHT_BRACE,
+        Lox::Parser::TokenType::COMMA, Lox::Parser::TokenType::DOT,
+        Lox::Parser::TokenType::MINUS, Lox::Parser::TokenType::PLUS,
+        Lox::Parser::TokenType::SEMICOLON, Lox::Parser::TokenType::SLASH,
+        Lox::Parser::TokenType::STAR,
+        Lox::Parser::TokenType::BANG, Lox::Parser::TokenType::BANG_EQUAL,
+        Lox::Parser::TokenType::EQUAL, Lox::Parser::TokenType::EQUAL_EQUAL,
+        Lox::Parser::TokenType::GREATER, Lox::Parser::TokenType::GREATER_EQUAL,
+        Lox::Parser::TokenType::LESS, Lox::Parser::TokenType::LESS_EQUAL,
+        Lox::Parser::TokenType::IDENTIFIER, Lox::Parser::TokenType::STRING,
+        Lox::Parser::TokenType::NUMBER,
+        Lox::Parser::TokenType::AND, Lox::Parser::TokenType::CLASS,
+        Lox::Parser::TokenType::ELSE, Lox::Parser::TokenType::FALSE,
+        Lox::Parser::TokenType::FOR, Lox::Parser::TokenType::FUN,
+        Lox::Parser::TokenType::IF, Lox::Parser::TokenType::NIL,
+        Lox::Parser::TokenType::OR, Lox::Parser::TokenType::PRINT,
+        Lox::Parser::TokenType::RETURN, Lox::Parser::TokenType::SUPER,
+        Lox::Parser::TokenType::THIS, Lox::Parser::TokenType::TRUE,
+        Lox::Parser::TokenType::VAR, Lox::Parser::TokenType::WHILE,
+        nil, # TOKEN_ERROR, which never makes it into the buffer
+        Lox::Parser::TokenType::EOF
+      ].freeze
+
+      FIELDS_PER_TOKEN = 4
+
+      def initialize(source, error_handler)
+        @source = source
+        @error_handler = error_handler
+      end
+
+      def scan_tokens
+        buffer = TokenBuffer.new(FFI::MemoryPointer.new(TokenBuffer, 1)[0])
+        Lox::Bytecode.token_buffer_init(buffer)
+        begin
+          Lox::Bytecode.token_buffer_scan(buffer, @source)
+          (0...buffer[:error_count]).each do |i|
+            error = buffer.error_at(i)
+            @error_handler.scan_error(error[:line], error[:message])
+          end
+          TokenList.new(@source, buffer[:tokens].read_array_of_int32(buffer[:count] * FIELDS_PER_TOKEN))
+        ensure
+          Lox::Bytecode.token_buffer_free(buffer)
+        end
+      end
+
+      # Only implements the parts of Array that RecursiveDescentParser uses
+      class TokenList
+        def initialize(source, fields)
+          @source = source
+          @fields = fields
+          @tokens = Array.new(fields.length / FIELDS_PER_TOKEN)
+        end
+
+        def length
+          @tokens.length
+        end
+
+        def [](index)
+          index += length if index < 0
+          return if index < 0 || index >= length
+
+          @tokens[index] ||= build_token(index)
+        end
+
+        def to_a
+          (0...length).map { |i| self[i] }
+        end
+
+        private
+
+        def build_token(index)
+          offset = index * FIELDS_PER_TOKEN
+          type = TOKEN_TYPES[@fields[offset]]
+          # Offsets are in bytes, not characters
+          lexeme = @source.byteslice(@fields[offset + 1], @fields[offset + 2]).force_encoding(@source.encoding)
+          line = @fields[offset + 3]
+
+          literal = case type
+          when Lox::Parser::TokenType::NUMBER
+            Float(lexeme)
+          when Lox::Parser::TokenType::STRING
+            lexeme[1...-1]
+          end
+
+          Lox::Parser::Token.new(type, lexeme, literal, line)
+        end
+      end
+    end
+  end
+end
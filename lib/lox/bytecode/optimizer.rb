@@ -0,0 +1,255 @@
+module Lox
+  module Bytecode
+    # Rewrites the AST between parsing and compiling. Arithmetic, comparisons
+    # and string concatenation on literals are folded into a single literal,
+    # branches and loops whose conditions are literals are pruned, and logical
+    # operators with a literal on the left are reduced to whichever operand
+    # they would evaluate to. Nodes that aren't changed are reused as they
+    # are, and the ones that are copied keep the lines of the originals, so
+    # runtime errors are reported on the same lines either way.
+    class Optimizer
+      # Code that can never run. It's still compiled, so that the same compile
+      # errors are reported with and without the optimizer, but its code is
+      # thrown away and the live code, if there is any, is compiled instead.
+      DeadCode = Struct.new(:dead, :live) do
+        def bounding_lines
+          (live || dead).bounding_lines
+        end
+
+        def accept(visitor)
+          visitor.visit_dead_code(self)
+        end
+      end
+
+      TokenType = Lox::Parser::TokenType
+
+      NOT_CONSTANT = Object.new.freeze
+
+      def optimize(statements)
+        optimize_all(statements)
+      end
+
+      def visit_block_stmt(stmt)
+        rebuild(stmt, statements: optimize_all(stmt.statements))
+      end
+
+      def visit_class_stmt(stmt)
+        rebuild(stmt, methods: optimize_all(stmt.methods))
+      end
+
+      def visit_expression_stmt(stmt)
+        rebuild(stmt, expression: stmt.expression.accept(self))
+      end
+
+      def visit_function_stmt(stmt)
+        rebuild(stmt, body: optimize_all(stmt.body))
+      end
+
+      def visit_if_stmt(stmt)
+        condition = stmt.condition.accept(self)
+        then_branch = stmt.then_branch.accept(self)
+        else_branch = stmt.else_branch&.accept(self)
+        if literal?(condition)
+          live, dead = truthy?(value_of(condition)) ? [then_branch, else_branch] : [else_branch, then_branch]
+          return dead_code(dead, live)
+        end
+
+        rebuild(stmt, condition: condition, then_branch: then_branch, else_branch: else_branch)
+      end
+
+      def visit_print_stmt(stmt)
+        rebuild(stmt, expression: stmt.expression.accept(self))
+      end
+
+      def visit_return_stmt(stmt)
+        rebuild(stmt, value: stmt.value&.accept(self))
+      end
+
+      def visit_var_stmt(stmt)
+        rebuild(stmt, initializer: stmt.initializer&.accept(self))
+      end
+
+      def visit_while_stmt(stmt)
+        optimized = rebuild(stmt, condition: stmt.condition.accept(self), body: stmt.body.accept(self))
+        if literal?(optimized.condition) && !truthy?(value_of(optimized.condition))
+          return dead_code(optimized, nil)
+        end
+
+        optimized
+      end
+
+      def visit_assign_expr(expr)
+        rebuild(expr, value: expr.value.accept(self))
+      end
+
+      def visit_binary_expr(expr)
+        left = expr.left.accept(self)
+        right = expr.right.accept(self)
+        if literal?(left) && literal?(right)
+          value = fold_binary(expr.operator.type, value_of(left), value_of(right))
+          return make_literal(value, expr.operator.line) unless value.equal?(NOT_CONSTANT)
+        end
+
+        rebuild(expr, left: left, right: right)
+      end
+
+      def visit_call_expr(expr)
+        rebuild(expr, callee: expr.callee.accept(self), arguments: optimize_all(expr.arguments))
+      end
+
+      def visit_get_expr(expr)
+        rebuild(expr, object: expr.object.accept(self))
+      end
+
+      def visit_grouping_expr(expr)
+        expression = expr.expression.accept(self)
+        return expression if literal?(expression)
+
+        rebuild(expr, expression: expression)
+      end
+
+      def visit_literal_expr(expr)
+        expr
+      end
+
+      def visit_logical_expr(expr)
+        left = expr.left.accept(self)
+        right = expr.right.accept(self)
+        if literal?(left)
+          short_circuits = truthy?(value_of(left)) == (expr.operator.type == TokenType::OR)
+          return short_circuits ? dead_code(right, left) : right
+        end
+
+        rebuild(expr, left: left, right: right)
+      end
+
+      def visit_set_expr(expr)
+        rebuild(expr, object: expr.object.accept(self), value: expr.value.accept(self))
+      end
+
+      def visit_super_expr(expr)
+        expr
+      end
+
+      def visit_this_expr(expr)
+        expr
+      end
+
+      def visit_unary_expr(expr)
+        right = expr.right.accept(self)
+        if literal?(right)
+          value = fold_unary(expr.operator.type, value_of(right))
+          return make_literal(value, expr.operator.line) unless value.equal?(NOT_CONSTANT)
+        end
+
+        rebuild(expr, right: right)
+      end
+
+      def visit_variable_expr(expr)
+        expr
+      end
+
+      private
+
+      # Returns nodes itself if none of them changed
+      def optimize_all(nodes)
+        optimized = nodes.map { |node| node.accept(self) }
+        optimized.zip(nodes).all? { |new_node, node| new_node.equal?(node) } ? nodes : optimized
+      end
+
+      # Copies node with some of its members replaced, unless they're all the
+      # same as before. The copy keeps the bounding lines of node.
+      def rebuild(node, **members)
+        return node if members.all? { |name, value| node[name].equal?(value) }
+
+        copy = node.dup
+        members.each { |name, value| copy[name] = value }
+        copy
+      end
+
+      # Literals and missing else branches can't have compile errors in them,
+      # so there's no need to compile them just to throw them away
+      def dead_code(dead, live)
+        return live if dead.nil? || literal?(dead)
+
+        DeadCode.new(dead, live)
+      end
+
+      def literal?(expr)
+        expr.is_a?(Lox::Parser::Expr::Literal)
+      end
+
+      def value_of(literal)
+        token = literal.value
+        case token.type
+        when TokenType::TRUE then true
+        when TokenType::FALSE then false
+        when TokenType::NIL then nil
+        else token.literal
+        end
+      end
+
+      def make_literal(value, line)
+        token = case value
+        when Float
+          Lox::Parser::Token.new(TokenType::NUMBER, value.to_s.delete_suffix(".0"), value, line)
+        when String
+          Lox::Parser::Token.new(TokenType::STRING, "\"#{value}\"", value, line)
+        when true
+          Lox::Parser::Token.new(TokenType::TRUE, "true", nil, line)
+        when false
+          Lox::Parser::Token.new(TokenType::FALSE, "false", nil, line)
+        else
+          Lox::Parser::Token.new(TokenType::NIL, "nil", nil, line)
+        end
+        Lox::Parser::Expr::Literal.new(token)
+      end
+
+      def truthy?(value)
+        !(value.nil? || value == false)
+      end
+
+      # Operations that would be runtime errors are left for the VM to report
+      def fold_binary(type, left, right)
+        numbers = left.is_a?(Float) && right.is_a?(Float)
+        case type
+        when TokenType::PLUS
+          return left + right if numbers || (left.is_a?(String) && right.is_a?(String))
+        when TokenType::MINUS
+          return left - right if numbers
+        when TokenType::STAR
+          return left * right if numbers
+        when TokenType::SLASH
+          return left / right if numbers
+        when TokenType::GREATER
+          return left > right if numbers
+        when TokenType::LESS
+          return left < right if numbers
+        # These are compiled as the negation of the opposite comparison, which
+        # makes a difference for NaN
+        when TokenType::GREATER_EQUAL
+          return !(left < right) if numbers
+        when TokenType::LESS_EQUAL
+          return !(left > right) if numbers
+        # Strings are interned, so comparing them by value is the same as
+        # comparing them by identity
+        when TokenType::EQUAL_EQUAL
+          return left == right
+        when TokenType::BANG_EQUAL
+          return left != right
+        end
+        NOT_CONSTANT
+      end
+
+      def fold_unary(type, right)
+        case type
+        when TokenType::MINUS
+          return -right if right.is_a?(Float)
+        when TokenType::BANG
+          return !truthy?(right)
+        end
+        NOT_CONSTANT
+      end
+    end
+  end
+end
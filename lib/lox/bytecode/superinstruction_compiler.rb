@@ -0,0 +1,88 @@
+module Lox
+  module Bytecode
+    # Compiles the same way as Compiler except for the places where the
+    # stack machine spends the most instructions moving values around. Arithmetic and comparisons whose operands are
+    # both locals, or a local and a number, compile to a single
+    # superinstruction that reads them straight out of the frame's slots
+    # instead of pushing them first. Assignments to locals whose value isn't
+    # used pop the value straight into the local's slot.
+    #
+    # The VM is still a stack machine, and the results of these instructions
+    # are pushed like any others. They're run by the same dispatch loop as
+    # every other instruction, so functions compiled by either compiler can
+    # call each other freely.
+    class SuperinstructionCompiler < Compiler
+      TokenType = Lox::Parser::TokenType
+
+      REGISTER_OPERATIONS = {
+        TokenType::PLUS => "add",
+        TokenType::MINUS => "subtract",
+        TokenType::STAR => "multiply",
+        TokenType::SLASH => "divide",
+        TokenType::GREATER => "greater",
+        TokenType::LESS => "less"
+      }.freeze
+
+      # The operators whose operands can be swapped, so that a number on the
+      # left can still be read out of the constants, and what they become
+      SWAPPED_OPERATORS = {
+        TokenType::PLUS => TokenType::PLUS,
+        TokenType::STAR => TokenType::STAR,
+        TokenType::GREATER => TokenType::LESS,
+        TokenType::LESS => TokenType::GREATER
+      }.freeze
+
+      def visit_expression_stmt(stmt)
+        assign = stmt.expression
+        register = register_of(assign.name.lexeme) if assign.is_a?(Lox::Parser::Expr::Assign)
+        return super if register.nil?
+
+        add_expression_to_chunk(assign.value)
+        emit_bytes(:store_local, register, assign.name.bounding_lines.first)
+      end
+
+      def visit_binary_expr(expr)
+        operator = expr.operator.type
+        left, right = expr.left, expr.right
+        if number?(left) && register_operand(right) && SWAPPED_OPERATORS.key?(operator)
+          left, right = right, left
+          operator = SWAPPED_OPERATORS[operator]
+        end
+
+        operation = REGISTER_OPERATIONS[operator]
+        left_register = register_operand(left)
+        return super if operation.nil? || left_register.nil?
+
+        line = expr.operator.line
+        if (right_register = register_operand(right))
+          emit_bytes(:"#{operation}_registers", left_register, line)
+          emit_byte(right_register, line)
+        elsif number?(right)
+          constant = make_constant(:number, right.value, right.value.literal)
+          emit_bytes(:"#{operation}_register_constant", left_register, line)
+          emit_byte(constant, line)
+        else
+          super
+        end
+      end
+
+      private
+
+      # The slot of the local that expr reads, if it's a local of this
+      # function that can be read. Reading one that can't is a compile error,
+      # which the stack instructions are left to report.
+      def register_operand(expr)
+        register_of(expr.name.lexeme) if expr.is_a?(Lox::Parser::Expr::Variable)
+      end
+
+      def register_of(name)
+        index = @locals.rindex { |local| local.name == name }
+        index if index && @locals[index].depth != -1
+      end
+
+      def number?(expr)
+        expr.is_a?(Lox::Parser::Expr::Literal) && expr.value.literal.is_a?(Float)
+      end
+    end
+  end
+end
@@ -0,0 +1,105 @@
+module Lox
+  module Bytecode
+    # Reads the trace files that the VM writes with LOXRB_TRACE (see
+    # trace.h), and lists them the way LOXRB_LOG_DISASSEMBLY lists programs
+    # as they run, except that only the value on top of the stack is known.
+    # Traces are read a record at a time, so they can be longer than would
+    # fit in memory.
+    class TraceDecoder
+      class Error < StandardError; end
+
+      Function = Struct.new(:name, :instructions, keyword_init: true)
+      # top is a string, or nil if the stack was empty
+      Instruction = Struct.new(:function, :offset, :frame_count, :stack_depth, :top, keyword_init: true)
+
+      # The layout of TraceFileHeader and TraceInstruction
+      HEADER_FORMAT = "a4L"
+      HEADER_SIZE = 8
+      INSTRUCTION_FORMAT = "llSSCCx2d"
+      INSTRUCTION_SIZE = 24
+
+      RECORD_FUNCTION = 0
+      RECORD_INSTRUCTION = 1
+
+      VALUE_NONE, VALUE_NIL, VALUE_BOOL, VALUE_NUMBER, VALUE_OBJ = (0..4).to_a
+
+      def initialize(io)
+        @io = io
+        @functions = []
+      end
+
+      # Yields each Instruction in the order they ran
+      def each_instruction
+        return enum_for(:each_instruction) unless block_given?
+
+        magic, version = read(HEADER_SIZE).unpack(HEADER_FORMAT)
+        raise Error, "Not a trace file." unless magic == "LOXT"
+        raise Error, "Trace file version #{version} isn't supported." unless version == Lox::Bytecode.trace_version
+
+        until (type = @io.read(1)).nil?
+          case type.unpack1("C")
+          when RECORD_FUNCTION
+            read_function
+          when RECORD_INSTRUCTION
+            yield read_instruction
+          else
+            raise Error, "Trace file is corrupt."
+          end
+        end
+      end
+
+      def decode(output)
+        last_function = nil
+        each_instruction do |instruction|
+          function = instruction.function
+          output.puts("[DEBUG] == #{function.name} ==") unless function.equal?(last_function)
+          last_function = function
+          top = instruction.top.nil? ? "" : " [ #{instruction.top} ]"
+          output.puts("[DEBUG]           (#{instruction.stack_depth} on the stack)#{top}")
+          output.write(function.instructions.fetch(instruction.offset) { "[DEBUG] %04d ?\n" % instruction.offset })
+        end
+      end
+
+      private
+
+      def read(count)
+        bytes = @io.read(count)
+        raise Error, "Trace file ends in the middle of a record." if bytes.nil? || bytes.bytesize < count
+
+        bytes
+      end
+
+      def read_int
+        read(4).unpack1("l")
+      end
+
+      def read_function
+        id = read_int
+        name_length = read_int
+        name = (name_length == -1) ? "<script>" : read(name_length)
+        instructions = {}
+        read_int.times do
+          offset = read_int
+          instructions[offset] = read(read_int)
+        end
+        @functions[id] = Function.new(name: name, instructions: instructions)
+      end
+
+      def read_instruction
+        id, offset, frame_count, stack_depth, top_type, top_object_type, top_number =
+          read(INSTRUCTION_SIZE).unpack(INSTRUCTION_FORMAT)
+        function = @functions[id]
+        raise Error, "Trace file is corrupt." if function.nil?
+
+        top = case top_type
+        when VALUE_NONE then nil
+        when VALUE_NIL then "nil"
+        when VALUE_BOOL then (top_number != 0).to_s
+        when VALUE_NUMBER then format("%g", top_number)
+        when VALUE_OBJ then "<#{ObjType[top_object_type]}>"
+        end
+        Instruction.new(function: function, offset: offset, frame_count: frame_count, stack_depth: stack_depth, top: top)
+      end
+    end
+  end
+end
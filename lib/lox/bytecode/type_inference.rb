@@ -0,0 +1,249 @@
+module Lox
+  module Bytecode
+    # Works out which expressions in a script always evaluate to numbers, so
+    # that the compiler can use the opcodes that don't check their operands.
+    #
+    # Subtraction, multiplication, division and negation can only ever result
+    # in numbers, since they're runtime errors otherwise. Addition results in
+    # a number when both of its operands do. A local variable holds a number
+    # when every value it's ever given does, which is worked out by assuming
+    # that they all do and ruling out the ones that are given anything that
+    # might not be a number until nothing changes. Globals, parameters and
+    # locals that closures refer to are never assumed to hold numbers.
+    #
+    # It also tells which locals are never assigned once they're declared,
+    # which closures can capture by value, and which locals hold a method
+    # that's only ever called, which don't need a bound method.
+    class TypeInference
+      Declaration = Struct.new(:values, :captured, :number, :escapes)
+
+      def initialize(statements)
+        # Each variable expression and assignment, mapped to the local it
+        # refers to. Globals aren't in here.
+        @declarations = {}.compare_by_identity
+        # Each local by the token of the name it's declared with
+        @declarations_by_name = {}.compare_by_identity
+        @all_declarations = []
+        @scopes = []
+        @function_depth = 0
+
+        resolve_all(statements)
+        infer_numbers
+      end
+
+      def number?(expr)
+        case expr
+        when Lox::Parser::Expr::Literal
+          expr.value.type == Lox::Parser::TokenType::NUMBER
+        when Lox::Parser::Expr::Grouping
+          number?(expr.expression)
+        when Lox::Parser::Expr::Unary
+          expr.operator.type == Lox::Parser::TokenType::MINUS
+        when Lox::Parser::Expr::Binary
+          case expr.operator.type
+          when Lox::Parser::TokenType::MINUS, Lox::Parser::TokenType::STAR, Lox::Parser::TokenType::SLASH
+            true
+          when Lox::Parser::TokenType::PLUS
+            number?(expr.left) && number?(expr.right)
+          else
+            false
+          end
+        when Lox::Parser::Expr::Assign
+          number?(expr.value)
+        when Lox::Parser::Expr::Variable
+          !!@declarations[expr]&.number
+        else
+          false
+        end
+      end
+
+      # Takes the name token of a local variable, function, class or
+      # parameter, and returns true if the local is never assigned
+      def final?(name)
+        declaration = @declarations_by_name[name]
+        !declaration.nil? && declaration.values.length == 1
+      end
+
+      # Takes the name token of a local variable, and returns the property
+      # it's declared with, as in `var m = object.method;`, if the local is
+      # never assigned, captured or used as anything but the callee of a
+      # call. Returns nil otherwise.
+      def unbound_method(name)
+        declaration = @declarations_by_name[name]
+        return if declaration.nil? || declaration.values.length != 1 || declaration.captured || declaration.escapes
+
+        value = declaration.values.first
+        value if value.is_a?(Lox::Parser::Expr::Get)
+      end
+
+      def visit_block_stmt(stmt)
+        in_scope { resolve_all(stmt.statements) }
+      end
+
+      def visit_class_stmt(stmt)
+        declare(stmt.name, nil)
+        stmt.superclass&.accept(self)
+        stmt.methods.each { |method| resolve_function(method) }
+      end
+
+      def visit_expression_stmt(stmt)
+        stmt.expression.accept(self)
+      end
+
+      def visit_function_stmt(stmt)
+        declare(stmt.name, nil)
+        resolve_function(stmt)
+      end
+
+      def visit_if_stmt(stmt)
+        stmt.condition.accept(self)
+        stmt.then_branch.accept(self)
+        stmt.else_branch&.accept(self)
+      end
+
+      def visit_print_stmt(stmt)
+        stmt.expression.accept(self)
+      end
+
+      def visit_return_stmt(stmt)
+        stmt.value&.accept(self)
+      end
+
+      def visit_var_stmt(stmt)
+        stmt.initializer&.accept(self)
+        declare(stmt.name, stmt.initializer)
+      end
+
+      def visit_while_stmt(stmt)
+        stmt.condition.accept(self)
+        stmt.body.accept(self)
+      end
+
+      # Dead code is still compiled, so the expressions in it have to be
+      # resolved too
+      def visit_dead_code(node)
+        node.dead.accept(self)
+        node.live&.accept(self)
+      end
+
+      def visit_assign_expr(expr)
+        expr.value.accept(self)
+        declaration = resolve(expr, expr.name.lexeme)
+        declaration&.values&.push(expr.value)
+      end
+
+      def visit_binary_expr(expr)
+        expr.left.accept(self)
+        expr.right.accept(self)
+      end
+
+      def visit_call_expr(expr)
+        # Calling a local is the one use of it that doesn't need its value
+        # to be a bound method
+        if expr.callee.is_a?(Lox::Parser::Expr::Variable)
+          resolve(expr.callee, expr.callee.name.lexeme)
+        else
+          expr.callee.accept(self)
+        end
+        resolve_all(expr.arguments)
+      end
+
+      def visit_get_expr(expr)
+        expr.object.accept(self)
+      end
+
+      def visit_grouping_expr(expr)
+        expr.expression.accept(self)
+      end
+
+      def visit_literal_expr(expr)
+      end
+
+      def visit_logical_expr(expr)
+        expr.left.accept(self)
+        expr.right.accept(self)
+      end
+
+      def visit_set_expr(expr)
+        expr.object.accept(self)
+        expr.value.accept(self)
+      end
+
+      def visit_super_expr(expr)
+      end
+
+      def visit_this_expr(expr)
+      end
+
+      def visit_unary_expr(expr)
+        expr.right.accept(self)
+      end
+
+      def visit_variable_expr(expr)
+        declaration = resolve(expr, expr.name.lexeme)
+        declaration.escapes = true unless declaration.nil?
+      end
+
+      private
+
+      def resolve_all(nodes)
+        nodes.each { |node| node.accept(self) }
+      end
+
+      def resolve_function(stmt)
+        @function_depth += 1
+        in_scope do
+          stmt.params.each { |param| declare(param, nil) }
+          resolve_all(stmt.body)
+        end
+        @function_depth -= 1
+      end
+
+      def in_scope
+        @scopes << {}
+        yield
+        @scopes.pop
+      end
+
+      # Declarations without a value, like parameters, can hold anything.
+      # Outside of any scope, variables are globals and aren't tracked.
+      def declare(name, value)
+        return if @scopes.empty?
+
+        declaration = Declaration.new([value], false, true, false)
+        @all_declarations << declaration
+        @declarations_by_name[name] = declaration
+        @scopes.last[name.lexeme] = [declaration, @function_depth]
+      end
+
+      def resolve(expr, name)
+        @scopes.reverse_each do |scope|
+          declaration, function_depth = scope[name]
+          next if declaration.nil?
+
+          declaration.captured = true if function_depth != @function_depth
+          @declarations[expr] = declaration
+          return declaration
+        end
+        nil
+      end
+
+      def infer_numbers
+        @all_declarations.each do |declaration|
+          declaration.number = !declaration.captured
+        end
+
+        loop do
+          changed = false
+          @all_declarations.each do |declaration|
+            next if !declaration.number || declaration.values.all? { |value| value && number?(value) }
+
+            declaration.number = false
+            changed = true
+          end
+          break unless changed
+        end
+      end
+    end
+  end
+end
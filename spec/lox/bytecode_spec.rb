@@ -1,6 +1,9 @@
 # frozen_string_literal: true
 
+require "open3"
 require "stringio"
+require "tempfile"
+require "tmpdir"
 
 RSpec.describe Lox::Bytecode do
   subject { Lox::Bytecode::Main }
@@ -21,6 +24,19 @@ RSpec.describe Lox::Bytecode do
     )
   end
 
+  # The opcodes of the named function as the compiler leaves them, from the
+  # listing that lox-bytecode prints once the peephole optimizer has run
+  def compiled_opcodes(source, function_name, env = {})
+    Tempfile.create(["script", ".lox"]) do |file|
+      file.write(source)
+      file.flush
+      executable = File.expand_path("../../exe/lox-bytecode", __dir__)
+      stdout, = Open3.capture3({"LOXRB_LOG_DISASSEMBLY" => "1", **env}, executable, file.path)
+      listing = stdout.split(/^\[DEBUG\] == /).find { |section| section.start_with?("#{function_name} (after peephole) ==") }
+      listing.lines.drop(1).filter_map { |line| line[/OP_\w+/] }
+    end
+  end
+
   it "executes simple arithmetic with Main in debug mode" do
     ["1 + 1;", "2 - 3;", "5 * 5;", "6 / 2;"].each do |expr|
       puts "evaluating '#{expr}' (debug mode)"
@@ -51,6 +67,571 @@ RSpec.describe Lox::Bytecode do
     subject.new(default_options).run("!(5 - 4 > 3 * 2 == !nil);")
   end
 
+  it "scans the same lexemes as the Ruby scanner" do
+    source = <<~EOF
+      class Foo {
+        inFoo() {
+          print "in foo";
+        }
+      }
+
+      class Bar < Foo {
+        inBar(a, b) {
+          var a = 12.3;
+          var b = .23;
+          print nil;
+        }
+      }
+
+      class Baz < Bar {
+        inBaz() {
+          print 1+2 / 3;
+        }
+      }
+
+      var baz = Baz();
+    EOF
+    error_handler = Class.new do
+      def self.scan_error(line, message)
+        raise "found unexpected error on line #{line}: #{message}"
+      end
+    end
+    tokens = Lox::Bytecode::NativeScanner.new(source, error_handler).scan_tokens
+    expect(tokens.to_a.map(&:to_h)).to match_snapshot("scans_lexemes")
+  end
+
+  it "reports the line of a runtime error that follows a run of instructions on another line" do
+    source = <<~EOF
+      fun check(a) {
+        var b = a + 1; var c = b * 2;
+        return c
+          -
+          "x";
+      }
+      var total = 1 + 2 + 3;
+      check(total);
+    EOF
+    expect { subject.new(default_options).run(source) }
+      .to output("Operands must be numbers.\n[line 4] in check()\n[line 8] in script\n").to_stderr_from_any_process
+  end
+
+  it "runs scripts from the bytecode cache" do
+    source = <<~EOF
+      class Greeter {
+        init(name) { this.name = name; }
+        greet() { print "hello " + this.name; }
+      }
+
+      fun twice(f) {
+        fun run() { f(); f(); }
+        return run;
+      }
+
+      twice(Greeter("cache").greet)();
+    EOF
+    Dir.mktmpdir do |directory|
+      options = default_options.dup
+      options.cache_directory = directory
+      2.times do
+        expect { subject.new(options).run(source) }
+          .to output("hello cache\nhello cache\n").to_stdout_from_any_process
+      end
+      expect(Dir.children(directory).grep(/\.loxc\z/).length).to eq(1)
+    end
+  end
+
+  it "reports a runtime error instead of crashing on a corrupted bytecode cache file" do
+    source = <<~EOF
+      class A { m() {} }
+      print "ran";
+    EOF
+    Dir.mktmpdir do |directory|
+      options = default_options.dup
+      options.cache_directory = directory
+      expect { subject.new(options).run(source) }.to output("ran\n").to_stdout_from_any_process
+
+      # Turn the GET_GLOBAL that puts the class back on the stack for its
+      # methods into a CONSTANT that pushes its name, and fix the checksum so
+      # that the file is still loaded
+      path = File.join(directory, Dir.children(directory).grep(/\.loxc\z/).first)
+      bytes = File.binread(path)
+      opcodes = Lox::Bytecode::Opcode
+      class_code = [opcodes[:class], 0, opcodes[:define_global], 0, opcodes[:get_global]].pack("C*")
+      at = bytes.index(class_code)
+      bytes.setbyte(at + 4, opcodes[:constant])
+      checksum = bytes.byteslice(32..).each_byte.reduce(0xcbf29ce484222325) do |hash, byte|
+        ((hash ^ byte) * 0x100000001b3) & 0xffffffffffffffff
+      end
+      bytes[24, 8] = [checksum].pack("Q")
+      File.binwrite(path, bytes)
+
+      expect { subject.new(options).run(source) }
+        .to output("Only classes have methods.\n[line 1] in script\n").to_stderr_from_any_process
+    end
+  end
+
+  it "compiles function bodies when they are first called" do
+    source = <<~EOF
+      fun counter() {
+        var count = 0;
+        fun increment() {
+          fun add() { count = count + 1; return count; }
+          return add();
+        }
+        return increment;
+      }
+
+      fun never() { return this; }
+
+      var next = counter();
+      next();
+      print next();
+    EOF
+    options = default_options.dup
+    options.lazy_compile = true
+    expect { subject.new(options).run(source) }.to output("2\n").to_stdout_from_any_process
+  end
+
+  it "produces the same output with and without the optimizer" do
+    executable = File.expand_path("../../exe/lox-bytecode", __dir__)
+    cases = Dir[File.expand_path("../../cases/**/*.lox", __dir__)].reject { |path| path.include?("/benchmark/") }
+    cases.each do |path|
+      optimized = Open3.capture3(executable, path)
+      unoptimized = Open3.capture3({"LOXRB_NO_OPTIMIZE" => "1"}, executable, path)
+      expect([path, *optimized[0..1], optimized[2].exitstatus])
+        .to eq([path, *unoptimized[0..1], unoptimized[2].exitstatus])
+    end
+  end
+
+  it "reports every use of a name that no longer fits in the constants of its function" do
+    source = "fun f() {\n" + 256.times.map { |i| "  print #{i};\n" }.join + "  print a;\n  print a;\n}\n"
+    Tempfile.create(["constants", ".lox"]) do |file|
+      file.write(source)
+      file.close
+      stdout, stderr, status = Open3.capture3(File.expand_path("../../exe/lox-bytecode", __dir__), file.path)
+      expect(stdout).to eq("")
+      expect(stderr).to eq(
+        "[line 258] Error at 'a': Too many constants in one chunk.\n" \
+        "[line 259] Error at 'a': Too many constants in one chunk.\n"
+      )
+      expect(status.exitstatus).to eq(65)
+    end
+  end
+
+  it "rewrites compiled code with the peephole optimizer" do
+    source = <<~EOF
+      fun f(a, b) {
+        var x = a;
+        x = x + b;
+        print x;
+        if (!(a < b)) print "not less";
+        if (!a) print "falsey";
+        return x;
+      }
+      f(3, 2);
+    EOF
+    opcodes = compiled_opcodes(source, "f")
+    # The assignment's value is kept for print instead of being popped and
+    # read again
+    expect(opcodes.each_cons(2).to_a).to include(["OP_SET_LOCAL", "OP_PRINT"])
+    # !(a < b) is a single comparison
+    expect(opcodes.each_cons(4).to_a).to include(["OP_GET_LOCAL", "OP_GET_LOCAL", "OP_NOT_LESS", "OP_JUMP_IF_FALSE"])
+    # if (!a) jumps over the body when a is truthy instead of negating it
+    expect(opcodes.each_cons(2).to_a).to include(["OP_GET_LOCAL", "OP_JUMP_IF_TRUE"])
+    expect(opcodes).not_to include("OP_NOT")
+  end
+
+  it "skips checking the operands of arithmetic on locals that only hold numbers" do
+    source = <<~EOF
+      fun f(n) {
+        var total = 0;
+        var i = 0;
+        while (i < n) {
+          total = total + i;
+          i = i + 1;
+        }
+        var label = 1;
+        label = "x";
+        print label + label;
+        return total;
+      }
+      print f(4);
+    EOF
+    expect { subject.new(Lox::Bytecode::Main::VmOptions.default).run(source) }.to output("xx\n6\n").to_stdout_from_any_process
+    # total + i and i + 1, but not label + label, since label is given a
+    # string as well
+    opcodes = compiled_opcodes(source, "f")
+    expect(opcodes.count("OP_ADD_NUMBERS")).to eq(2)
+    expect(opcodes.count("OP_ADD")).to eq(1)
+  end
+
+  it "doesn't bind methods that are kept in locals only to be called" do
+    source = <<~EOF
+      class Counter {
+        init() { this.count = 0; }
+        add(n) { this.count = this.count + n; return this.count; }
+      }
+      fun f() {
+        var counter = Counter();
+        var add = counter.add;
+        add(1);
+        print add(2);
+        var escaped = counter.add;
+        print escaped;
+        counter.add = Counter;
+        var field = counter.add;
+        print field();
+      }
+      f();
+    EOF
+    expected = "3\n<fn add>\nCounter instance\n"
+    expect { subject.new(Lox::Bytecode::Main::VmOptions.default).run(source) }.to output(expected).to_stdout_from_any_process
+    expect { subject.new(default_options).run(source) }.to output(expected).to_stdout_from_any_process
+    # add and field are only called, while escaped is printed and has to be
+    # a bound method
+    opcodes = compiled_opcodes(source, "f")
+    expect(opcodes.count("OP_GET_METHOD")).to eq(2)
+    expect(opcodes.count("OP_CALL_METHOD")).to eq(3)
+    expect(opcodes.count("OP_GET_PROPERTY")).to eq(1)
+  end
+
+  it "captures locals that are never reassigned by value" do
+    source = <<~EOF
+      fun outer() {
+        var fixed = 1;
+        var counter = 0;
+        fun inner() {
+          counter = counter + fixed;
+          return counter;
+        }
+        return inner;
+      }
+      var f = outer();
+      f();
+      print f();
+    EOF
+    expect { subject.new(Lox::Bytecode::Main::VmOptions.default).run(source) }.to output("2\n").to_stdout_from_any_process
+    # counter is shared with outer through an upvalue, while fixed is a copy
+    expect(compiled_opcodes(source, "inner")).to eq(
+      ["OP_GET_UPVALUE", "OP_GET_CAPTURED", "OP_ADD", "OP_SET_UPVALUE", "OP_RETURN", "OP_NIL", "OP_RETURN"]
+    )
+  end
+
+  it "compiles arithmetic on locals to superinstructions" do
+    source = <<~EOF
+      fun f(a, b) {
+        var sum = a + b;
+        var scaled =
+          sum * 2;
+        return scaled;
+      }
+      print f(1, 2);
+      print f("x", "y");
+    EOF
+    options = Lox::Bytecode::Main::VmOptions.default
+    options.superinstructions = true
+    expect { subject.new(options).run(source) }.to output("6\n").to_stdout_from_any_process
+    expect { subject.new(options).run(source) }
+      .to output("Operands must be numbers.\n[line 4] in f()\n[line 8] in script\n").to_stderr_from_any_process
+    expect(compiled_opcodes(source, "f", {"LOXRB_SUPERINSTRUCTIONS" => "1"}).take(3))
+      .to eq(["OP_ADD_REGISTERS", "OP_MULTIPLY_REGISTER_CONSTANT", "OP_GET_LOCAL"])
+  end
+
+  it "runs getters without a call frame only while they return a field" do
+    source = <<~EOF
+      class Box {
+        init(v) { this.v = v; }
+        value() { return this.v; }
+      }
+      class Doubled < Box {
+        value() { return this.v * 2; }
+      }
+      fun seven() { return 7; }
+
+      var box = Box(1);
+      print box.value();
+      print Doubled(2).value();
+      box.value = seven;
+      print box.value();
+      print Box(3).value();
+    EOF
+    unset_field = <<~EOF
+      class Empty {
+        value() { return this.v; }
+      }
+      Empty().value();
+    EOF
+    # Both with and without the optimizer, which compile getters the same way
+    [default_options, Lox::Bytecode::Main::VmOptions.default].each do |options|
+      expect { subject.new(options).run(source) }.to output("1\n4\n7\n3\n").to_stdout_from_any_process
+      expect { subject.new(options).run(unset_field) }
+        .to output("Undefined property 'v'.\n[line 2] in value()\n[line 4] in script\n").to_stderr_from_any_process
+    end
+  end
+
+  it "compiles scripts into native executables" do
+    source = <<~EOF
+      class Counter {
+        init() { this.count = 0; }
+        increment() { this.count = this.count + 1; return this.count; }
+      }
+
+      fun fib(n) { if (n < 2) return n; return fib(n - 1) + fib(n - 2); }
+
+      var counter = Counter();
+      for (var i = 0; i < 3; i = i + 1) counter.increment();
+      print counter.count;
+      print fib(15);
+      print "a" + "b";
+      print -"c";
+    EOF
+    Dir.mktmpdir do |directory|
+      executable = File.join(directory, "script")
+      expect(subject.new.build_executable(source, executable)).to be(true)
+      stdout, stderr, status = Open3.capture3(executable)
+      expect(stdout).to eq("3\n610\nab\n")
+      expect(stderr).to eq("Operand must be a number.\n[line 13] in script\n")
+      expect(status.exitstatus).to eq(70)
+    end
+  end
+
+  it "restores globals, classes and closures from a heap snapshot" do
+    setup = <<~EOF
+      var greeting = "hello";
+      class Counter {
+        init() { this.count = 0; }
+        increment() { this.count = this.count + 1; return this.count; }
+      }
+      class Loud < Counter {
+        increment() { return super.increment() * 10; }
+      }
+      fun make_adder(n) {
+        fun add(x) { return x + n; }
+        return add;
+      }
+      var add2 = make_adder(2);
+      var counter = Loud();
+      counter.increment();
+    EOF
+    main = <<~EOF
+      print greeting;
+      print add2(40);
+      print counter.increment();
+      print Counter().increment();
+      print Loud().increment();
+    EOF
+    executable = File.expand_path("../../ext/lox-native", __dir__)
+    Dir.mktmpdir do |directory|
+      snapshot = File.join(directory, "heap.snapshot")
+      File.write(File.join(directory, "setup.lox"), setup)
+      File.write(File.join(directory, "main.lox"), main)
+      _, stderr, status = Open3.capture3(executable, "--save-snapshot", snapshot, File.join(directory, "setup.lox"))
+      expect([stderr, status.exitstatus]).to eq(["", 0])
+
+      stdout, stderr, status = Open3.capture3(executable, "--load-snapshot", snapshot, File.join(directory, "main.lox"))
+      expect([stdout, stderr, status.exitstatus]).to eq(["hello\n42\n20\n1\n10\n", "", 0])
+    end
+  end
+
+  it "traces programs into a file that can be listed afterwards" do
+    source = <<~EOF
+      fun add(a, b) { return a + b; }
+      print add(1, 2);
+    EOF
+    Dir.mktmpdir do |directory|
+      options = default_options.dup
+      options.trace_path = File.join(directory, "trace.loxt")
+      expect { subject.new(options).run(source) }.to output("3\n").to_stdout_from_any_process
+      instructions = File.open(options.trace_path, "rb") do |file|
+        Lox::Bytecode::TraceDecoder.new(file).each_instruction.to_a
+      end
+      listings = instructions.map { |instruction| instruction.function.instructions[instruction.offset] }
+      expect(instructions.map { |instruction| instruction.function.name }.uniq).to eq(["<script>", "add"])
+      add = listings.index { |listing| listing.include?("OP_ADD") }
+      expect([instructions[add].stack_depth, instructions[add].frame_count, instructions[add].top]).to eq([6, 2, "2"])
+      expect(listings.last).to include("OP_RETURN")
+    end
+  end
+
+  it "runs a batch of scripts in parallel and captures what each one prints" do
+    sources = [
+      "var sum = 0; for (var i = 0; i < 1000; i = i + 1) sum = sum + i; print sum;",
+      "print \"a\" + \"b\";\nprint -\"c\";",
+      "print ;",
+      "print nil;"
+    ]
+    results = Lox::Bytecode::Batch.new(thread_count: 2).run(sources)
+    expect(results.map(&:status)).to eq([0, 70, 65, 0])
+    expect(results.map(&:output)).to eq(["499500\n", "ab\n", "", "nil\n"])
+    expect(results[1].errors).to eq("Operand must be a number.\n[line 2] in script\n")
+    expect(results[2].errors).to eq("[line 1] Error at ';': Expect expression.\n")
+  end
+
+  it "runs a script many times over from one copy of its code" do
+    source = <<~EOF
+      class Pair {
+        init(a, b) { this.a = a; this.b = b; }
+        join() { return this.a + this.b; }
+      }
+      print Pair("a", "b").join() == "ab";
+    EOF
+    results = Lox::Bytecode::Batch.new(thread_count: 4).run([source] * 8)
+    expect(results.map(&:output)).to all(eq("true\n"))
+    expect(results.map(&:status)).to all(eq(0))
+  end
+
+  it "takes turns running the scripts in a batch that has a budget" do
+    sources = [
+      "var i = 0; while (i < 100000) i = i + 1; print i;",
+      "fun fib(n) { if (n < 2) return n; return fib(n - 1) + fib(n - 2); } print fib(15);",
+      "print \"quick\";"
+    ]
+    results = Lox::Bytecode::Batch.new(thread_count: 1, budget: 1000).run(sources)
+    expect(results.map(&:output)).to eq(["100000\n", "610\n", "quick\n"])
+    expect(results.map(&:status)).to all(eq(0))
+    expect(results[0].slices).to be > 100
+    expect(results[1].slices).to be > 1
+    expect(results[2].finish_time).to be < results[0].finish_time
+  end
+
+  it "runs isolates that pass messages to each other" do
+    source = <<~EOF
+      fun square(n) { return n * n; }
+      fun worker() {
+        var total = 0;
+        var message = receive();
+        while (message != nil) {
+          total = total + square(message);
+          message = receive();
+        }
+        send(0, "done");
+        return total;
+      }
+      var a = spawn(worker);
+      var b = spawn(worker);
+      for (var i = 1; i <= 10; i = i + 1) { send(a, i); send(b, -i); }
+      send(a, nil);
+      send(b, nil);
+      print receive() + receive();
+      print join(a) + join(b);
+      fun broken() { return nil + 1; }
+      join(spawn(broken));
+    EOF
+    Tempfile.create(["isolates", ".lox"]) do |file|
+      file.write(source)
+      file.close
+      stdout, stderr, status = Open3.capture3(File.expand_path("../../exe/lox-bytecode", __dir__), file.path)
+      expect(stdout).to eq("donedone\n770\n")
+      expect(stderr).to eq("Operands must be two numbers or two strings.\n[line 19] in broken()\nIsolate 3 failed.\n[line 20] in script\n")
+      expect(status.exitstatus).to eq(70)
+    end
+  end
+
+  it "only freezes the VM for scripts that use isolates" do
+    options = Lox::Bytecode::Main::VmOptions.default
+    options.isolates = true
+    main = subject.new(options)
+    main.run("var answer = 42;")
+    # The first script ran in the VM it was compiled in, which can still
+    # compile the next one and has its globals
+    expect { main.run("print answer;") }.to output("42\n").to_stdout_from_any_process
+    expect { main.run("fun worker() { return 1; } print join(spawn(worker));") }.to output("1\n").to_stdout_from_any_process
+  end
+
+  it "lets isolates make instances of the classes the script declared" do
+    source = <<~EOF
+      class Point {
+        init(x, y) { this.x = x; this.y = y; }
+        length2() { return this.x * this.x + this.y * this.y; }
+      }
+      class Named < Point {
+        name() { return "point"; }
+      }
+      fun worker() {
+        var n = receive();
+        var point = Named(n, n + 1);
+        send(0, point.name());
+        return point.length2();
+      }
+      var isolate = spawn(worker);
+      send(isolate, 3);
+      print receive();
+      print join(isolate);
+    EOF
+    Tempfile.create(["isolates", ".lox"]) do |file|
+      file.write(source)
+      file.close
+      ["../../exe/lox-bytecode", "../../ext/lox-native"].each do |executable|
+        stdout, stderr, status = Open3.capture3(File.expand_path(executable, __dir__), file.path)
+        expect([stdout, stderr, status.exitstatus]).to eq(["point\n25\n", "", 0])
+      end
+    end
+  end
+
+  it "stops isolates that wait for a message once the script has finished" do
+    source = <<~EOF
+      fun worker() {
+        return receive();
+      }
+      spawn(worker);
+      print nil + 1;
+    EOF
+    Tempfile.create(["isolates", ".lox"]) do |file|
+      file.write(source)
+      file.close
+      ["../../exe/lox-bytecode", "../../ext/lox-native"].each do |executable|
+        Open3.popen3(File.expand_path(executable, __dir__), file.path) do |stdin, stdout, stderr, wait_thread|
+          stdin.close
+          unless wait_thread.join(30)
+            Process.kill("KILL", wait_thread.pid)
+            raise "#{executable} didn't exit"
+          end
+          expect(stdout.read).to eq("")
+          expect(stderr.read).to eq("Operands must be two numbers or two strings.\n[line 5] in script\nIsolate 1 is waiting for a message, but the script has finished.\n[line 2] in worker()\n")
+          expect(wait_thread.value.exitstatus).to eq(70)
+        end
+      end
+    end
+  end
+
+  it "suspends and resumes functions in fibers" do
+    source = <<~EOF
+      fun numbers(limit) {
+        for (var i = 0; i < limit; i = i + 1) {
+          var doubled = i * 2;
+          fun get() { return doubled; }
+          yield(get);
+        }
+        return "done";
+      }
+
+      fun sum(first) {
+        var total = first;
+        var next = yield(total);
+        while (next != nil) {
+          total = total + next;
+          next = yield(total);
+        }
+        return total;
+      }
+
+      var generator = fiber(numbers);
+      var getters = fiber(sum);
+      resume(getters, 0);
+      var get = resume(generator, 1000);
+      while (!done(generator)) {
+        resume(getters, get());
+        get = resume(generator);
+      }
+      print get;
+      print resume(getters, nil);
+      print done(getters);
+    EOF
+    options = default_options.dup
+    options.stress_gc = true
+    expect { subject.new(options).run(source) }.to output("done\n999000\ntrue\n").to_stdout_from_any_process
+  end
+
   it "repeatedly runs no-ops" do
     10.times do
       expect { subject.new.run("") }.not_to raise_error